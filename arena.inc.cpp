@@ -0,0 +1,100 @@
+// Arena allocator
+//
+// Bump-pointer allocation out of a linked list of chunks. Individual
+// allocations are never freed; instead the whole arena is either reset
+// (rewound to its first chunk, keeping every chunk for reuse: O(1)) or
+// freed outright.
+//
+// Build with -DRT_NO_ARENA to route every allocation through malloc
+// instead; this exists only so benchmarks can compare the two.
+
+typedef struct rt_arena_chunk {
+	struct rt_arena_chunk *next;
+	size_t size;
+	char data[0];
+} rt_arena_chunk_t;
+
+typedef struct {
+	rt_arena_chunk_t *first;
+	rt_arena_chunk_t *curr;
+	size_t pos;
+	size_t chunk_sz;
+	long nallocs;
+	size_t nbytes;
+} rt_arena_t;
+
+const size_t rt_arena_align = 8;
+
+void rt_arena_init(rt_arena_t *arena, size_t chunk_sz) {
+	arena->first = NULL;
+	arena->curr = NULL;
+	arena->pos = 0;
+	arena->chunk_sz = chunk_sz;
+	arena->nallocs = 0;
+	arena->nbytes = 0;
+}
+
+rt_arena_chunk_t *arena_alloc_chunk(size_t size) {
+	rt_arena_chunk_t *chunk = (rt_arena_chunk_t*)malloc(sizeof(rt_arena_chunk_t) + size);
+	if (!chunk) {
+		fprintf(stderr, "failed to allocate arena chunk\n");
+		exit(1);
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+void *rt_arena_alloc(rt_arena_t *arena, size_t len) {
+	arena->nallocs++;
+	arena->nbytes += len;
+#ifdef RT_NO_ARENA
+	void *mem = malloc(len);
+	if (!mem) {
+		fprintf(stderr, "failed to allocate %zu bytes\n", len);
+		exit(1);
+	}
+	return mem;
+#else
+	len = (len + rt_arena_align - 1) & ~(rt_arena_align - 1);
+	if (!arena->curr || arena->pos + len > arena->curr->size) {
+		// Advance to the next retained chunk if it's big enough, otherwise
+		// splice in a new one (oversized requests get a chunk of their own).
+		rt_arena_chunk_t *next = arena->curr ? arena->curr->next : arena->first;
+		if (!next || next->size < len) {
+			rt_arena_chunk_t *chunk = arena_alloc_chunk(len > arena->chunk_sz ? len : arena->chunk_sz);
+			chunk->next = next;
+			if (arena->curr) {
+				arena->curr->next = chunk;
+			} else {
+				arena->first = chunk;
+			}
+			next = chunk;
+		}
+		arena->curr = next;
+		arena->pos = 0;
+	}
+	void *mem = arena->curr->data + arena->pos;
+	arena->pos += len;
+	return mem;
+#endif
+}
+
+// Discard everything allocated from `arena` but keep its chunks.
+void rt_arena_reset(rt_arena_t *arena) {
+	arena->curr = NULL;
+	arena->pos = 0;
+	arena->nallocs = 0;
+	arena->nbytes = 0;
+}
+
+// Discard everything allocated from `arena` and return its memory.
+void rt_arena_free(rt_arena_t *arena) {
+	rt_arena_chunk_t *chunk = arena->first;
+	while (chunk) {
+		rt_arena_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	rt_arena_init(arena, arena->chunk_sz);
+}
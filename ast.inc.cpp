@@ -28,6 +28,11 @@ typedef struct ast_fn_def {
     val_t body;
 } ast_fn_def_t;
 
+typedef struct ast_return {
+    ast_node_t base;
+    val_t exp;
+} ast_return_t;
+
 typedef struct ast_if {
     ast_node_t base;
     val_t cond;
@@ -52,12 +57,19 @@ typedef struct ast_binop {
     operator_t op;
     val_t l;
     val_t r;
+    int need;   // Sethi-Ullman label, -1 until computed
 } ast_binop_t;
 
+// AST nodes are allocated from the arena of the calling thread's current
+// parse/compile session and are released all at once when the session
+// ends; nothing that must outlive compile() may point into the tree.
+const size_t ast_arena_chunk_sz = 64 * 1024;
+thread_local rt_arena_t *ast_arena = NULL;
+
 #define ALLOC_AST(struct_type, tag) \
-    struct_type *node = (struct_type*)malloc(sizeof(struct_type)); \
+    struct_type *node = (struct_type*)rt_arena_alloc(ast_arena, sizeof(struct_type)); \
     ((ast_node_t*)node)->type = tag; \
-    val_t val = { .type = T_AST, .ast = (ast_node_t*) node }
+    val_t val = mk_ast((ast_node_t*) node)
 
 val_t mk_ast_list(val_t stmt, val_t next) {
     ALLOC_AST(ast_list_t, AST_LIST);
@@ -79,6 +91,12 @@ val_t mk_ast_print(val_t exp) {
     return val;
 }
 
+val_t mk_ast_return(val_t exp) {
+    ALLOC_AST(ast_return_t, AST_RETURN);
+    node->exp = exp;
+    return val;
+}
+
 val_t mk_ast_unop(operator_t op, val_t exp) {
     ALLOC_AST(ast_unop_t, AST_UN_OP);
     node->op = op;
@@ -91,6 +109,7 @@ val_t mk_ast_binop(operator_t op, val_t l, val_t r) {
     node->op = op;
     node->l = l;
     node->r = r;
+    node->need = -1;
     return val;
 }
 
@@ -138,14 +157,14 @@ val_t ast_if_cons(val_t tail, val_t cond, val_t body) {
 }
 
 int ast_type(val_t v) {
-    return v.ast->type;
+    return ast_val(v)->type;
 }
 
 int ast_list_len(val_t v) {
     int len = 0;
     while (!nil_p(v)) {
         len++;
-        v = ((ast_list_t*)v.ast)->next;
+        v = ((ast_list_t*)ast_val(v))->next;
     }
     return len;
 }
\ No newline at end of file
@@ -0,0 +1,374 @@
+// Persistent collection benchmark: times updates and lookups on the
+// persistent maps and lists (map.inc.cpp, list.inc.cpp) against
+// copy-on-write baselines, i.e. a flat hash table and a flat array that
+// are copied whole for every update, which is what keeping the old
+// version of a mutable collection would otherwise take. Each operation is
+// run at several sizes, and reports the best time per operation over a
+// number of iterations.
+//
+// Usage: bench/coll [-n iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PDEBUG(msg)
+
+typedef struct ast_node ast_node_t;
+typedef struct code code_t;
+
+#include "../util.inc.cpp"
+#include "../arena.inc.cpp"
+#include "../types.inc.cpp"
+#include "../val.inc.cpp"
+#include "../ast.inc.cpp"
+#include "../lexer.inc.cpp"
+#include "../intern.inc.cpp"
+#include "../parser.inc.cpp"
+#include "../fold.inc.cpp"
+#include "../gc.inc.cpp"
+#include "../string.inc.cpp"
+#include "../bigint.inc.cpp"
+#include "../vector.inc.cpp"
+#include "../map.inc.cpp"
+#include "../list.inc.cpp"
+#include "../natives.inc.cpp"
+#include "../regalloc.inc.cpp"
+#include "../code.inc.cpp"
+#include "../compiler.inc.cpp"
+#include "../peephole.inc.cpp"
+#include "../cache.inc.cpp"
+#include "../profile.inc.cpp"
+#include "../vm.inc.cpp"
+#include "../sched.inc.cpp"
+#include "../chan.inc.cpp"
+
+const int SIZES[] = { 1000, 4000, 16000 };
+
+// Collections held across allocations; a GC root.
+val_t bench_slots[4];
+
+void bench_visit(void *ctx) {
+	for (int i = 0; i < 4; ++i) {
+		rt_gc_visit(&bench_slots[i]);
+	}
+}
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+//
+// Copy-on-write baselines
+
+typedef struct {
+	int count;
+	int cap;            // a power of 2, at least twice count
+	val_t *slots;       // key, value pairs; nil keys are empty
+} cow_map_t;
+
+val_t *cow_map_find(cow_map_t *map, val_t key) {
+	uint32_t mask = map->cap - 1, i = map_mix(key.bits) & mask;
+	while (!nil_p(map->slots[2 * i]) && map->slots[2 * i].bits != key.bits) {
+		i = (i + 1) & mask;
+	}
+	return &map->slots[2 * i];
+}
+
+// Returns a copy of `map` with `key` mapped to `value`.
+cow_map_t cow_map_assoc(cow_map_t *map, val_t key, val_t value) {
+	cow_map_t out;
+	out.count = map->count;
+	out.cap = map->cap;
+	if (2 * (map->count + 1) > map->cap) {
+		out.cap = map->cap ? map->cap * 2 : 16;
+		out.slots = (val_t*)malloc(sizeof(val_t) * 2 * out.cap);
+		for (int i = 0; i < 2 * out.cap; ++i) {
+			out.slots[i] = mk_nil();
+		}
+		for (int i = 0; i < map->cap; ++i) {
+			if (!nil_p(map->slots[2 * i])) {
+				val_t *slot = cow_map_find(&out, map->slots[2 * i]);
+				slot[0] = map->slots[2 * i];
+				slot[1] = map->slots[2 * i + 1];
+			}
+		}
+	} else {
+		out.slots = (val_t*)malloc(sizeof(val_t) * 2 * out.cap);
+		memcpy(out.slots, map->slots, sizeof(val_t) * 2 * out.cap);
+	}
+	val_t *slot = cow_map_find(&out, key);
+	out.count += nil_p(slot[0]);
+	slot[0] = key;
+	slot[1] = value;
+	return out;
+}
+
+typedef struct {
+	int count;
+	val_t *items;
+} cow_list_t;
+
+cow_list_t cow_list_copy(cow_list_t *list, int extra) {
+	cow_list_t out;
+	out.count = list->count;
+	out.items = (val_t*)malloc(sizeof(val_t) * (list->count + extra + 1));
+	memcpy(out.items, list->items, sizeof(val_t) * list->count);
+	return out;
+}
+
+//
+// Operations on `n` elements, returning a checksum. Each sets `*start`
+// once it has built what it works on, so that only the operation itself
+// is timed.
+
+int *keys;
+
+long map_assoc_persistent(int n, double *start) {
+	*start = now_ms();
+	bench_slots[0] = rt_builtin_map(NULL, 0);
+	for (int i = 0; i < n; ++i) {
+		bench_slots[1] = mk_int(keys[i]);
+		bench_slots[2] = mk_int(i);
+		bench_slots[0] = rt_map_assoc(&bench_slots[0], &bench_slots[1], &bench_slots[2]);
+	}
+	return rt_map_count(bench_slots[0]);
+}
+
+long map_assoc_transient(int n, double *start) {
+	*start = now_ms();
+	rt_gc_reserve((size_t)n * 48 + 1024);
+	rt_gc_hold();
+	rt_map_t *map = map_transient(map_new(0, 0, mk_nil(), 0));
+	for (int i = 0; i < n; ++i) {
+		map_transient_assoc(map, mk_int(keys[i]), mk_int(i));
+	}
+	bench_slots[0] = map_persistent(map);
+	rt_gc_release();
+	return rt_map_count(bench_slots[0]);
+}
+
+long map_assoc_cow(int n, double *start) {
+	*start = now_ms();
+	cow_map_t map = { 0, 0, NULL };
+	for (int i = 0; i < n; ++i) {
+		cow_map_t next = cow_map_assoc(&map, mk_int(keys[i]), mk_int(i));
+		free(map.slots);
+		map = next;
+	}
+	free(map.slots);
+	return map.count;
+}
+
+long map_get_persistent(int n, double *start) {
+	map_assoc_transient(n, start);
+	*start = now_ms();
+	long sum = 0;
+	for (int i = 0; i < n; ++i) {
+		bench_slots[1] = mk_int(keys[i]);
+		sum += int_val(rt_map_get(&bench_slots[0], &bench_slots[1]));
+	}
+	return sum;
+}
+
+// The table is built in place, as the transient map is.
+long map_get_cow(int n, double *start) {
+	cow_map_t map = { 0, 16, NULL };
+	while (map.cap < 2 * n) {
+		map.cap *= 2;
+	}
+	map.slots = (val_t*)malloc(sizeof(val_t) * 2 * map.cap);
+	for (int i = 0; i < 2 * map.cap; ++i) {
+		map.slots[i] = mk_nil();
+	}
+	for (int i = 0; i < n; ++i) {
+		val_t *slot = cow_map_find(&map, mk_int(keys[i]));
+		slot[0] = mk_int(keys[i]);
+		slot[1] = mk_int(i);
+	}
+	*start = now_ms();
+	long sum = 0;
+	for (int i = 0; i < n; ++i) {
+		sum += int_val(cow_map_find(&map, mk_int(keys[i]))[1]);
+	}
+	free(map.slots);
+	return sum;
+}
+
+long list_conj_persistent(int n, double *start) {
+	*start = now_ms();
+	bench_slots[0] = rt_builtin_list(NULL, 0);
+	for (int i = 0; i < n; ++i) {
+		bench_slots[1] = mk_int(i);
+		bench_slots[0] = rt_list_conj(&bench_slots[0], &bench_slots[1]);
+	}
+	return rt_list_count(bench_slots[0]);
+}
+
+long list_conj_cow(int n, double *start) {
+	*start = now_ms();
+	cow_list_t list = { 0, NULL };
+	for (int i = 0; i < n; ++i) {
+		cow_list_t next = cow_list_copy(&list, 1);
+		next.items[next.count++] = mk_int(i);
+		free(list.items);
+		list = next;
+	}
+	free(list.items);
+	return list.count;
+}
+
+long list_assoc_persistent(int n, double *start) {
+	list_conj_persistent(n, start);
+	*start = now_ms();
+	for (int i = 0; i < n; ++i) {
+		bench_slots[1] = mk_int(keys[i]);
+		bench_slots[2] = mk_int(-i);
+		bench_slots[0] = rt_list_assoc(&bench_slots[0], &bench_slots[1], &bench_slots[2]);
+	}
+	return int_val(*list_slot(list_val(bench_slots[0]), keys[0]));
+}
+
+long list_assoc_cow(int n, double *start) {
+	cow_list_t list = { n, (val_t*)malloc(sizeof(val_t) * n) };
+	for (int i = 0; i < n; ++i) {
+		list.items[i] = mk_int(i);
+	}
+	*start = now_ms();
+	for (int i = 0; i < n; ++i) {
+		cow_list_t next = cow_list_copy(&list, 0);
+		next.items[keys[i]] = mk_int(-i);
+		free(list.items);
+		list = next;
+	}
+	long check = int_val(list.items[keys[0]]);
+	free(list.items);
+	return check;
+}
+
+// Joins and splits n / 32 times: a list of n elements is cut in two at
+// varying points and put back together.
+long list_concat_persistent(int n, double *start) {
+	list_conj_persistent(n, start);
+	*start = now_ms();
+	for (int i = 0; i < n / 32; ++i) {
+		int at = keys[i];
+		bench_slots[1] = rt_list_slice(&bench_slots[0], 0, at);
+		bench_slots[2] = rt_list_slice(&bench_slots[0], at, n);
+		bench_slots[0] = rt_list_concat(&bench_slots[2], &bench_slots[1]);
+	}
+	return int_val(*list_slot(list_val(bench_slots[0]), 0));
+}
+
+long list_concat_cow(int n, double *start) {
+	cow_list_t list = { n, (val_t*)malloc(sizeof(val_t) * n) };
+	for (int i = 0; i < n; ++i) {
+		list.items[i] = mk_int(i);
+	}
+	*start = now_ms();
+	for (int i = 0; i < n / 32; ++i) {
+		int at = keys[i];
+		cow_list_t left = { at, (val_t*)malloc(sizeof(val_t) * (at + 1)) };
+		cow_list_t right = { n - at, (val_t*)malloc(sizeof(val_t) * (n - at + 1)) };
+		memcpy(left.items, list.items, sizeof(val_t) * at);
+		memcpy(right.items, list.items + at, sizeof(val_t) * (n - at));
+		free(list.items);
+		list = cow_list_copy(&right, left.count);
+		memcpy(list.items + right.count, left.items, sizeof(val_t) * left.count);
+		list.count = n;
+		free(left.items);
+		free(right.items);
+	}
+	long check = int_val(list.items[0]);
+	free(list.items);
+	return check;
+}
+
+typedef struct {
+	const char *name;
+	long (*persistent)(int n, double *start);
+	long (*baseline)(int n, double *start);
+	int divisor;            // the op count is n / divisor
+} bench_op_t;
+
+const bench_op_t OPS[] = {
+	{ "map assoc",              map_assoc_persistent,   map_assoc_cow,      1 },
+	{ "map assoc (transient)",  map_assoc_transient,    map_assoc_cow,      1 },
+	{ "map get",                map_get_persistent,     map_get_cow,        1 },
+	{ "list conj",              list_conj_persistent,   list_conj_cow,      1 },
+	{ "list assoc",             list_assoc_persistent,  list_assoc_cow,     1 },
+	{ "list split + join",      list_concat_persistent, list_concat_cow,    32 }
+};
+
+double best_ms(long (*fn)(int n, double *start), int n, int iterations, long *check) {
+	double best = -1;
+	for (int it = 0; it < iterations; ++it) {
+		double start;
+		*check = fn(n, &start);
+		double elapsed = now_ms() - start;
+		if (best < 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 3;
+	if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+		iterations = atoi(argv[2]);
+	}
+	if ((argc != 1 && argc != 3) || iterations < 1) {
+		fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+		return 1;
+	}
+
+	rt_intern_init();
+	rt_gc_enter();
+	for (int i = 0; i < 4; ++i) {
+		bench_slots[i] = mk_nil();
+	}
+	rt_gc_add_root(bench_visit, NULL);
+
+	int max = SIZES[sizeof(SIZES) / sizeof(SIZES[0]) - 1];
+	keys = (int*)malloc(sizeof(int) * max);
+
+	printf("%-24s %6s %14s %14s %8s\n", "operation", "n", "persistent", "copy-on-write", "speedup");
+	for (size_t o = 0; o < sizeof(OPS) / sizeof(OPS[0]); ++o) {
+		for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); ++s) {
+			int n = SIZES[s];
+			// a shuffle of 0..n-1: keys, indices and split points
+			for (int i = 0; i < n; ++i) {
+				keys[i] = i;
+			}
+			srand(n);
+			for (int i = n - 1; i > 0; --i) {
+				int j = rand() % (i + 1), t = keys[i];
+				keys[i] = keys[j];
+				keys[j] = t;
+			}
+			long check, baseline_check;
+			double ms = best_ms(OPS[o].persistent, n, iterations, &check);
+			double baseline_ms = best_ms(OPS[o].baseline, n, iterations, &baseline_check);
+			if (check != baseline_check) {
+				fprintf(stderr, "%s: results differ (%ld, %ld)\n", OPS[o].name, check, baseline_check);
+				return 1;
+			}
+			long ops = n / OPS[o].divisor;
+			printf("%-24s %6d %8.1f ns/op %8.1f ns/op %7.1fx\n", OPS[o].name, n,
+				ms * 1e6 / ops, baseline_ms * 1e6 / ops, baseline_ms / ms);
+		}
+	}
+
+	rt_gc_remove_root(bench_visit, NULL);
+	rt_gc_leave();
+	return 0;
+}
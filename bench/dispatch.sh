@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Compare switch-based and threaded interpreter dispatch.
+#
+# Usage: bench/dispatch.sh <switch-binary> <threaded-binary> <script.rt> [runs]
+#
+# Each binary is run `runs` times (default 5) and the best wall-clock time
+# is reported.
+
+set -e
+
+SWITCH_BIN=$1
+THREADED_BIN=$2
+SCRIPT=$3
+RUNS=${4:-5}
+
+best_time() {
+	local best=""
+	for ((i = 0; i < RUNS; i++)); do
+		local start=$(date +%s%N)
+		"$1" "$SCRIPT" > /dev/null 2>&1
+		local end=$(date +%s%N)
+		local ms=$(( (end - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+	done
+	echo $best
+}
+
+switch_ms=$(best_time "$SWITCH_BIN")
+threaded_ms=$(best_time "$THREADED_BIN")
+
+printf "%-10s %8d ms\n" "switch" "$switch_ms"
+printf "%-10s %8d ms\n" "threaded" "$threaded_ms"
+if [ "$threaded_ms" -gt 0 ]; then
+	awk -v s="$switch_ms" -v t="$threaded_ms" 'BEGIN { printf "speedup    %8.2f x\n", s / t }'
+fi
@@ -0,0 +1,12 @@
+#!/bin/bash
+#
+# Generate an identifier-dense module on stdout: every statement introduces
+# and references long, distinct identifiers.
+#
+# Usage: bench/gen_idents.sh [statements]
+
+NSTMTS=${1:-5000}
+
+for ((i = 0; i < NSTMTS; i++)); do
+	echo "local_variable_number_$i := input_value_$((i / 2)) + another_input_$((i / 3)) * scale_factor_$((i % 97))"
+done
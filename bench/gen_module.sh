@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# Generate a large synthetic module on stdout.
+#
+# Usage: bench/gen_module.sh [groups]
+#
+# Each group is a handful of statements exercising assignment, arithmetic,
+# calls, string literals, while, if/else and function definitions.
+
+NGROUPS=${1:-10000}
+
+for ((i = 0; i < NGROUPS; i++)); do
+	cat <<RT
+v$i := ($i + 1) * 3 - $i / 2
+while v$i < $((i + 10)) {
+	p1(v$i, "str $i")
+	v$i := v$i + 1
+}
+if v$i = $i {
+	p2(v$i)
+} else {
+	print(v$i)
+}
+def f$i(a, b) {
+	a := a + b * $i
+}
+RT
+done
@@ -0,0 +1,321 @@
+// Benchmark harness: runs each phase of the pipeline (lexer, parser,
+// compiler, bytecode cache loader, VM) over a workload in isolation and
+// reports, per phase, the best wall time over a number of iterations,
+// throughput in that phase's natural unit, and allocation counts, plus
+// garbage collector statistics for the run phase of the last iteration
+// and the number of messages it passed over channels (with a rate based
+// on the best run time). Results are written as JSON.
+//
+// Usage: bench/harness [-n iterations] [-o results.json] <workload.rt>...
+//
+// Allocation counts come from interposing malloc/calloc/realloc, which
+// relies on glibc's __libc_* entry points. Script output is discarded.
+// Cache images are written to a temporary directory, removed on exit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PDEBUG(msg)
+
+long bench_mallocs = 0;
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void*, size_t);
+
+extern "C" void *malloc(size_t n) {
+	__atomic_add_fetch(&bench_mallocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t sz) {
+	__atomic_add_fetch(&bench_mallocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, sz);
+}
+
+extern "C" void *realloc(void *p, size_t n) {
+	__atomic_add_fetch(&bench_mallocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, n);
+}
+
+typedef struct ast_node ast_node_t;
+typedef struct code code_t;
+
+#include "../util.inc.cpp"
+#include "../arena.inc.cpp"
+#include "../types.inc.cpp"
+#include "../val.inc.cpp"
+#include "../ast.inc.cpp"
+#include "../lexer.inc.cpp"
+#include "../intern.inc.cpp"
+#include "../parser.inc.cpp"
+#include "../fold.inc.cpp"
+#include "../gc.inc.cpp"
+#include "../string.inc.cpp"
+#include "../bigint.inc.cpp"
+#include "../vector.inc.cpp"
+#include "../map.inc.cpp"
+#include "../list.inc.cpp"
+#include "../natives.inc.cpp"
+#include "../regalloc.inc.cpp"
+#include "../code.inc.cpp"
+#include "../compiler.inc.cpp"
+#include "../peephole.inc.cpp"
+#include "../cache.inc.cpp"
+#include "../profile.inc.cpp"
+#include "../vm.inc.cpp"
+#include "../sched.inc.cpp"
+#include "../chan.inc.cpp"
+
+val_t bench_print(val_t *args, int nargs) {
+	printf("print: %lld\n", (long long)int_val(args[0]));
+	return mk_nil();
+}
+
+val_t bench_id(val_t *args, int nargs) {
+	return args[0];
+}
+
+val_t bench_add(val_t *args, int nargs) {
+	return rt_arith(OP_ADD, &args[0], &args[1]);
+}
+
+val_t bench_pick(val_t *args, int nargs) {
+	return args[int_val(args[nargs - 1]) % nargs];
+}
+
+// print is left to the builtin, so that its intrinsic is measured.
+rt_native_t bench_natives[] = {
+	{ "p1",     bench_print,    NATIVE_VARIADIC,    0,              0 },
+	{ "p2",     bench_print,    NATIVE_VARIADIC,    0,              0 },
+	{ "id",     bench_id,       1,                  NATIVE_PURE,    0 },
+	{ "add",    bench_add,      2,                  NATIVE_PURE,    0 },
+	{ "pick",   bench_pick,     NATIVE_VARIADIC,    NATIVE_PURE,    0 },
+	{ NULL,     NULL,           0,                  0,              0 }
+};
+
+rt_natives_t bench_registry;
+
+typedef struct {
+	const char *name;
+	const char *unit;
+	double wall_ms;
+	long count;
+	long mallocs;
+	long arena_allocs;
+} phase_t;
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Script and compiler diagnostics go to stdout; keep them out of the
+// measurements' way.
+int saved_stdout = -1;
+
+void mute_stdout() {
+	fflush(stdout);
+	saved_stdout = dup(1);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 1);
+	close(devnull);
+}
+
+void unmute_stdout() {
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+}
+
+void phase_record(phase_t *phase, double elapsed, long count, long mallocs, long arena_allocs) {
+	if (phase->wall_ms < 0 || elapsed < phase->wall_ms) {
+		phase->wall_ms = elapsed;
+	}
+	phase->count = count;
+	phase->mallocs = mallocs;
+	phase->arena_allocs = arena_allocs;
+}
+
+int bench_workload(const char *path, int iterations, FILE *out, int first) {
+	// phases are repeated, so the workload must be mapped, not streamed
+	rt_source_t src;
+	if (!rt_source_open(&src, path) || !src.text) {
+		fprintf(stderr, "unable to read source file: %s\n", path);
+		return 0;
+	}
+	const char *source = src.text;
+	size_t source_len = src.len;
+
+	phase_t phases[] = {
+		{ "lex",        "tokens",       -1, 0, 0, 0 },
+		{ "parse",      "nodes",        -1, 0, 0, 0 },
+		{ "compile",    "instructions", -1, 0, 0, 0 },
+		{ "load",       "instructions", -1, 0, 0, 0 },
+		{ "run",        "instructions", -1, 0, 0, 0 }
+	};
+
+	int folded = 0;
+	rt_gc_stats_t gc;
+	long messages = 0;
+
+	rt_arena_t session;
+	rt_arena_init(&session, ast_arena_chunk_sz);
+	ast_arena = &session;
+
+	rt_tokens_t tokens;
+	rt_tokens_init(&tokens);
+
+	mute_stdout();
+	for (int i = 0; i < iterations; ++i) {
+		// lex (into a token buffer, as main does for a mapped source)
+		long mallocs = bench_mallocs;
+		double start = now_ms();
+		rt_tokenize(&tokens, source, source_len);
+		phase_record(&phases[0], now_ms() - start, tokens.ntokens - 1, bench_mallocs - mallocs, 0);
+
+		// parse (walks the lex phase's tokens)
+		rt_arena_reset(&session);
+		mallocs = bench_mallocs;
+		start = now_ms();
+		rt_parser_t parser;
+		rt_parser_init_tokens(&parser, &tokens);
+		val_t mod = rt_parse_module(&parser);
+		phase_record(&phases[1], now_ms() - start, session.nallocs, bench_mallocs - mallocs, session.nallocs);
+		if (parser.error) {
+			unmute_stdout();
+			fprintf(stderr, "%s: parse error: %s\n", path, parser.error);
+			return 0;
+		}
+
+		// compile
+		mallocs = bench_mallocs;
+		start = now_ms();
+		code_t *code = compile(mod, &bench_registry);
+		peephole(code);
+		phase_record(&phases[2], now_ms() - start, code->pi, bench_mallocs - mallocs, 0);
+
+		// load (from the image of the module just compiled)
+		rt_cache_save(code, source, source_len);
+		mallocs = bench_mallocs;
+		start = now_ms();
+		code_t *cached = rt_cache_load(source, source_len, &bench_registry);
+		phase_record(&phases[3], now_ms() - start, cached ? cached->pi : 0, bench_mallocs - mallocs, 0);
+		if (cached) {
+			code_free(cached);
+		}
+
+		// run
+		mallocs = bench_mallocs;
+		rt_vm_instructions = 0;
+		rt_chan_messages = 0;
+		rt_gc_reset_stats();
+		start = now_ms();
+		run(code);
+		phase_record(&phases[4], now_ms() - start, rt_vm_instructions, bench_mallocs - mallocs, 0);
+		gc = rt_gc_stats;
+		messages = rt_chan_messages;
+
+		folded = code->folded;
+		code_free(code);
+	}
+	unmute_stdout();
+
+	rt_tokens_free(&tokens);
+	rt_arena_free(&session);
+	ast_arena = NULL;
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	fprintf(out, "%s  {\n", first ? "" : ",\n");
+	fprintf(out, "    \"workload\": \"%s\",\n", name);
+	fprintf(out, "    \"source_bytes\": %zu,\n", source_len);
+	fprintf(out, "    \"iterations\": %d,\n", iterations);
+	fprintf(out, "    \"folded_nodes\": %d,\n", folded);
+	fprintf(out, "    \"phases\": {\n");
+	for (int i = 0; i < 5; ++i) {
+		phase_t *p = &phases[i];
+		fprintf(out, "      \"%s\": { \"wall_ms\": %.3f, \"%s\": %ld, \"%s_per_sec\": %.0f, \"mallocs\": %ld, \"arena_allocs\": %ld }%s\n",
+			p->name, p->wall_ms, p->unit, p->count, p->unit,
+			p->wall_ms > 0 ? p->count / (p->wall_ms / 1000.0) : 0.0,
+			p->mallocs, p->arena_allocs,
+			i < 4 ? "," : "");
+	}
+	fprintf(out, "    },\n");
+	fprintf(out, "    \"channels\": { \"messages\": %ld, \"messages_per_sec\": %.0f },\n",
+		messages, phases[4].wall_ms > 0 ? messages / (phases[4].wall_ms / 1000.0) : 0.0);
+	fprintf(out, "    \"gc\": { \"minor\": %d, \"major\": %d, \"pause_ms\": %.3f, \"max_pause_ms\": %.3f, \"allocated_bytes\": %ld, \"promoted_bytes\": %ld, \"old_peak_bytes\": %ld }\n",
+		gc.minor_collections, gc.major_collections, gc.pause_ms, gc.max_pause_ms,
+		gc.allocated_bytes, gc.promoted_bytes, gc.old_peak_bytes);
+	fprintf(out, "  }");
+
+	char *image = cache_path(source, source_len);
+	if (image) {
+		unlink(image);
+		free(image);
+	}
+	rt_source_close(&src);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 3;
+	const char *out_path = NULL;
+	int argi = 1;
+	while (argi < argc && argv[argi][0] == '-') {
+		if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc) {
+			iterations = atoi(argv[argi + 1]);
+			argi += 2;
+		} else if (strcmp(argv[argi], "-o") == 0 && argi + 1 < argc) {
+			out_path = argv[argi + 1];
+			argi += 2;
+		} else {
+			break;
+		}
+	}
+	if (argi == argc || iterations < 1) {
+		fprintf(stderr, "Usage: %s [-n iterations] [-o results.json] <workload.rt>...\n", argv[0]);
+		return 1;
+	}
+
+	FILE *out = out_path ? fopen(out_path, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "unable to open output file: %s\n", out_path);
+		return 1;
+	}
+
+	char cache_dir[] = "/tmp/rt-bench-XXXXXX";
+	if (!mkdtemp(cache_dir)) {
+		fprintf(stderr, "unable to create cache directory\n");
+		return 1;
+	}
+	setenv("RT_CACHE_DIR", cache_dir, 1);
+
+	rt_intern_init();
+	rt_natives_init(&bench_registry);
+	rt_natives_add_all(&bench_registry, bench_natives);
+
+	fprintf(out, "[\n");
+	for (int i = argi; i < argc; ++i) {
+		if (!bench_workload(argv[i], iterations, out, i == argi)) {
+			rmdir(cache_dir);
+			return 1;
+		}
+	}
+	fprintf(out, "\n]\n");
+	rmdir(cache_dir);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+// Symbol interning microbenchmark: interns 1M distinct symbols, then looks
+// each of them up again, first on one thread and then split across
+// BENCH_THREADS threads, each of which also interns as many new symbols.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "../util.inc.cpp"
+#include "../arena.inc.cpp"
+#include "../intern.inc.cpp"
+
+const int NSYMS = 1000000;
+const int BENCH_THREADS = 4;
+
+char *names;
+int *lens;
+
+typedef struct {
+	int from;
+	int to;
+	long check;
+} bench_slice_t;
+
+// Looks up symbols [from, to), and interns a new symbol for each.
+void *bench_thread(void *arg) {
+	bench_slice_t *slice = (bench_slice_t*)arg;
+	char fresh[24];
+	for (int i = slice->from; i < slice->to; ++i) {
+		slice->check += rt_intern(names + i * 16, lens[i]);
+		int len = snprintf(fresh, sizeof(fresh), "new_%d", i);
+		if (rt_intern(fresh, len) <= NSYMS) {
+			slice->check = -1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+	rt_intern_init();
+
+	names = (char*)malloc(NSYMS * 16);
+	lens = (int*)malloc(NSYMS * sizeof(int));
+	for (int i = 0; i < NSYMS; ++i) {
+		lens[i] = snprintf(names + i * 16, 16, "sym_%d", i);
+	}
+
+	double start = now_ms();
+	for (int i = 0; i < NSYMS; ++i) {
+		rt_intern(names + i * 16, lens[i]);
+	}
+	double inserted = now_ms();
+	long check = 0;
+	for (int i = 0; i < NSYMS; ++i) {
+		check += rt_intern(names + i * 16, lens[i]);
+	}
+	double looked_up = now_ms();
+
+	pthread_t threads[BENCH_THREADS];
+	bench_slice_t slices[BENCH_THREADS];
+	for (int t = 0; t < BENCH_THREADS; ++t) {
+		slices[t].from = (long)NSYMS * t / BENCH_THREADS;
+		slices[t].to = (long)NSYMS * (t + 1) / BENCH_THREADS;
+		slices[t].check = 0;
+		pthread_create(&threads[t], NULL, bench_thread, &slices[t]);
+	}
+	long parallel_check = 0;
+	for (int t = 0; t < BENCH_THREADS; ++t) {
+		pthread_join(threads[t], NULL);
+		parallel_check += slices[t].check;
+	}
+	double parallel = now_ms();
+
+	if (check != (long)NSYMS * (NSYMS + 1) / 2) {
+		fprintf(stderr, "intern ids are not sequential\n");
+		return 1;
+	}
+	if (parallel_check != check || rt_intern_name(2 * NSYMS) == NULL || rt_intern_name(2 * NSYMS + 1) != NULL) {
+		fprintf(stderr, "parallel interning lost or duplicated symbols\n");
+		return 1;
+	}
+	if (strcmp(rt_intern_name(NSYMS), "sym_999999") != 0) {
+		fprintf(stderr, "reverse lookup failed\n");
+		return 1;
+	}
+
+	printf("insert  %d symbols: %8.1f ms (%6.1f ns/op)\n",
+		NSYMS, inserted - start, (inserted - start) * 1e6 / NSYMS);
+	printf("lookup  %d symbols: %8.1f ms (%6.1f ns/op)\n",
+		NSYMS, looked_up - inserted, (looked_up - inserted) * 1e6 / NSYMS);
+	printf("mixed   %d ops on %d threads: %8.1f ms (%6.1f ns/op)\n",
+		2 * NSYMS, BENCH_THREADS, parallel - looked_up, (parallel - looked_up) * 1e6 / (2 * NSYMS));
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+// Module loading benchmark: loads a number of copies of a source file as
+// independent modules, with the loader's pool at 1, 2, 4... threads up to
+// the core count, and reports the best wall time of each. The bytecode
+// cache is disabled, so every module is lexed, parsed and compiled.
+//
+// Usage: bench/load [-m modules] [-n iterations] <source.rt>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PDEBUG(msg)
+
+typedef struct ast_node ast_node_t;
+typedef struct code code_t;
+
+#include "../util.inc.cpp"
+#include "../arena.inc.cpp"
+#include "../types.inc.cpp"
+#include "../val.inc.cpp"
+#include "../ast.inc.cpp"
+#include "../lexer.inc.cpp"
+#include "../intern.inc.cpp"
+#include "../parser.inc.cpp"
+#include "../fold.inc.cpp"
+#include "../gc.inc.cpp"
+#include "../string.inc.cpp"
+#include "../bigint.inc.cpp"
+#include "../vector.inc.cpp"
+#include "../map.inc.cpp"
+#include "../list.inc.cpp"
+#include "../natives.inc.cpp"
+#include "../regalloc.inc.cpp"
+#include "../code.inc.cpp"
+#include "../compiler.inc.cpp"
+#include "../peephole.inc.cpp"
+#include "../cache.inc.cpp"
+#include "../loader.inc.cpp"
+#include "../profile.inc.cpp"
+#include "../vm.inc.cpp"
+#include "../sched.inc.cpp"
+#include "../chan.inc.cpp"
+
+val_t bench_nop(val_t *args, int nargs) {
+	return mk_nil();
+}
+
+// Stand-ins for the host natives that workloads call.
+rt_native_t bench_natives[] = {
+	{ "p1",     bench_nop,      NATIVE_VARIADIC,    0,              0 },
+	{ "p2",     bench_nop,      NATIVE_VARIADIC,    0,              0 },
+	{ NULL,     NULL,           0,                  0,              0 }
+};
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+	int nmodules = 64;
+	int iterations = 3;
+	int argi = 1;
+	while (argi + 1 < argc && argv[argi][0] == '-') {
+		if (strcmp(argv[argi], "-m") == 0) {
+			nmodules = atoi(argv[argi + 1]);
+		} else if (strcmp(argv[argi], "-n") == 0) {
+			iterations = atoi(argv[argi + 1]);
+		} else {
+			break;
+		}
+		argi += 2;
+	}
+	if (argi + 1 != argc || nmodules < 1 || iterations < 1) {
+		fprintf(stderr, "Usage: %s [-m modules] [-n iterations] <source.rt>\n", argv[0]);
+		return 1;
+	}
+
+	rt_source_t src;
+	if (!rt_source_open(&src, argv[argi]) || !src.text) {
+		fprintf(stderr, "unable to read source file: %s\n", argv[argi]);
+		return 1;
+	}
+
+	char dir[] = "/tmp/rt-load-XXXXXX";
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "unable to create module directory\n");
+		return 1;
+	}
+	char **paths = (char**)malloc(sizeof(char*) * nmodules);
+	for (int i = 0; i < nmodules; ++i) {
+		paths[i] = (char*)malloc(strlen(dir) + 32);
+		sprintf(paths[i], "%s/mod%d.rt", dir, i);
+		FILE *fp = fopen(paths[i], "w");
+		if (!fp || fwrite(src.text, 1, src.len, fp) != src.len) {
+			fprintf(stderr, "unable to write module: %s\n", paths[i]);
+			return 1;
+		}
+		fclose(fp);
+	}
+	rt_source_close(&src);
+	setenv("RT_CACHE_DIR", "", 1);
+
+	rt_intern_init();
+	rt_natives_t natives;
+	rt_natives_init(&natives);
+	rt_natives_add_all(&natives, bench_natives);
+
+	int ncores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	double base = 0;
+	for (int nthreads = 1; ; nthreads *= 2) {
+		if (nthreads > ncores) {
+			nthreads = ncores;
+		}
+		char workers[16];
+		snprintf(workers, sizeof(workers), "%d", nthreads);
+		setenv("RT_WORKERS", workers, 1);
+
+		double best = -1;
+		for (int it = 0; it < iterations; ++it) {
+			rt_loader_t loader;
+			rt_loader_init(&loader, &natives);
+			for (int i = 0; i < nmodules; ++i) {
+				rt_loader_add(&loader, paths[i]);
+			}
+			double start = now_ms();
+			int ok = rt_loader_load(&loader);
+			double elapsed = now_ms() - start;
+			if (!ok) {
+				fprintf(stderr, "%s\n", loader.modules[0].error ? loader.modules[0].error : "load failed");
+				return 1;
+			}
+			rt_loader_free(&loader, 0);
+			if (best < 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		if (nthreads == 1) {
+			base = best;
+		}
+		printf("%2d threads: %3d modules in %8.2f ms  (%5.2fx)\n", nthreads, nmodules, best, base / best);
+		if (nthreads == ncores) {
+			break;
+		}
+	}
+
+	for (int i = 0; i < nmodules; ++i) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	rmdir(dir);
+	return 0;
+}
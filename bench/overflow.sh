@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Measure the cost of integer overflow checks, by comparing a build whose
+# arithmetic wraps (-DRT_UNCHECKED_INT) with the normal, checked one.
+#
+# Usage: bench/overflow.sh <unchecked-binary> <checked-binary> <script.rt>... [-r runs]
+#
+# Each binary runs each script `runs` times (default 5) and the best
+# wall-clock time is reported.
+
+set -e
+
+UNCHECKED_BIN=$1
+CHECKED_BIN=$2
+shift 2
+RUNS=5
+SCRIPTS=()
+while [ $# -gt 0 ]; do
+	if [ "$1" = "-r" ]; then
+		RUNS=$2
+		shift 2
+	else
+		SCRIPTS+=("$1")
+		shift
+	fi
+done
+
+best_time() {
+	local best=""
+	for ((i = 0; i < RUNS; i++)); do
+		local start=$(date +%s%N)
+		RT_CACHE_DIR= "$1" "$2" > /dev/null 2>&1
+		local end=$(date +%s%N)
+		local ms=$(( (end - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+	done
+	echo $best
+}
+
+printf "%-24s %10s %10s %10s\n" "script" "unchecked" "checked" "overhead"
+for script in "${SCRIPTS[@]}"; do
+	unchecked_ms=$(best_time "$UNCHECKED_BIN" "$script")
+	checked_ms=$(best_time "$CHECKED_BIN" "$script")
+	overhead=$(awk -v u="$unchecked_ms" -v c="$checked_ms" 'BEGIN { if (u > 0) printf "%+.1f%%", (c - u) * 100 / u; else print "-" }')
+	printf "%-24s %7d ms %7d ms %10s\n" "$(basename "$script")" "$unchecked_ms" "$checked_ms" "$overhead"
+done
@@ -0,0 +1,87 @@
+// Parser throughput benchmark: parses the same source repeatedly, one
+// session per iteration, and reports throughput and peak RSS.
+//
+// Usage: bench/parse <source.rt> [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define PDEBUG(msg)
+
+typedef struct ast_node ast_node_t;
+typedef struct code code_t;
+
+#include "../util.inc.cpp"
+#include "../arena.inc.cpp"
+#include "../types.inc.cpp"
+#include "../val.inc.cpp"
+#include "../ast.inc.cpp"
+#include "../lexer.inc.cpp"
+#include "../intern.inc.cpp"
+#include "../parser.inc.cpp"
+
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <source.rt> [iterations]\n", argv[0]);
+		return 1;
+	}
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+	rt_intern_init();
+
+	rt_source_t src;
+	if (!rt_source_open(&src, argv[1]) || !src.text) {
+		fprintf(stderr, "unable to read source file: %s\n", argv[1]);
+		return 1;
+	}
+	const char *source = src.text;
+	size_t source_len = src.len;
+
+	rt_arena_t session;
+	rt_arena_init(&session, ast_arena_chunk_sz);
+	ast_arena = &session;
+
+	long nallocs = 0;
+	double start = now_ms();
+	for (int i = 0; i < iterations; ++i) {
+		rt_arena_reset(&session);
+		rt_parser_t parser;
+		rt_lexer_init(&parser.lexer, source, source_len);
+		rt_parser_init(&parser);
+		rt_parse_module(&parser);
+		if (parser.error) {
+			fprintf(stderr, "parse error: %s\n", parser.error);
+			return 1;
+		}
+		nallocs = session.nallocs;
+	}
+	double elapsed = now_ms() - start;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("%-9s %8.2f ms/parse  %7.1f MB/s  %8ld allocs/parse  peak RSS %7ld KB\n",
+#ifdef RT_NO_ARENA
+		"malloc",
+#else
+		"arena",
+#endif
+		elapsed / iterations,
+		(source_len * (double)iterations) / (elapsed * 1000.0),
+		nallocs,
+		usage.ru_maxrss);
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# Compare the vector kernel sets, by running scripts with each one forced
+# through RT_VECTOR_KERNELS. Sets the CPU doesn't support are shown as "-".
+#
+# Usage: bench/vector.sh <binary> <script.rt>... [-r runs]
+#
+# Each script runs `runs` times (default 5) per kernel set and the best
+# wall-clock time is reported.
+
+set -e
+
+BIN=$1
+shift
+RUNS=5
+SCRIPTS=()
+while [ $# -gt 0 ]; do
+	if [ "$1" = "-r" ]; then
+		RUNS=$2
+		shift 2
+	else
+		SCRIPTS+=("$1")
+		shift
+	fi
+done
+
+best_time() {
+	local best=""
+	for ((i = 0; i < RUNS; i++)); do
+		local start=$(date +%s%N)
+		if ! RT_CACHE_DIR= RT_VECTOR_KERNELS=$1 "$BIN" "$2" > /dev/null 2>&1; then
+			echo -
+			return
+		fi
+		local end=$(date +%s%N)
+		local ms=$(( (end - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+	done
+	echo $best
+}
+
+printf "%-24s %10s %10s %10s\n" "script" "scalar" "sse2" "avx2"
+for script in "${SCRIPTS[@]}"; do
+	scalar_ms=$(best_time scalar "$script")
+	sse2_ms=$(best_time sse2 "$script")
+	avx2_ms=$(best_time avx2 "$script")
+	printf "%-24s %7s ms %7s ms %7s ms\n" "$(basename "$script")" "$scalar_ms" "$sse2_ms" "$avx2_ms"
+done
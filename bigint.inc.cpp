@@ -0,0 +1,370 @@
+// Arbitrary-precision integers
+//
+// The VM does integer arithmetic inline for as long as the operands and
+// the result fit in a value, with overflow checks that cost a predictable
+// branch (see int_shifted() in val.inc.cpp), and calls in here only when
+// an operand is a bigint or a result overflows. Results are normalised:
+// one that fits inline is returned inline, so bigints and inline integers
+// never compare equal.
+//
+// A bigint is a sign and a magnitude in 32-bit limbs. Operands are
+// unpacked into views (an inline integer's view holds its own limbs),
+// results are computed into scratch buffers, and only then copied into a
+// single new heap object, so operands can't move while they're in use.
+// Division truncates towards zero, like C's.
+
+// Results of exponentiation are limited to this many limbs (256MB).
+#define BIGINT_MAX_LIMBS (1 << 26)
+
+typedef struct {
+    int sign;               // 1 or -1
+    int n;                  // limbs; 0 for zero
+    const uint32_t *limbs;
+    uint32_t small[2];      // an inline integer's limbs
+} bigint_view_t;
+
+// Unpacks integer `v` into `view`. Returns 0 if it isn't an integer.
+// Nil counts as 0, as it always has in arithmetic, since unassigned
+// variables are nil.
+int bigint_view(val_t v, bigint_view_t *view) {
+    if (int_p(v) || nil_p(v)) {
+        int64_t x = int_p(v) ? int_val(v) : 0;
+        uint64_t mag = x < 0 ? 0 - (uint64_t)x : (uint64_t)x;
+        view->sign = x < 0 ? -1 : 1;
+        view->small[0] = (uint32_t)mag;
+        view->small[1] = (uint32_t)(mag >> 32);
+        view->n = view->small[1] ? 2 : (view->small[0] ? 1 : 0);
+        view->limbs = view->small;
+        return 1;
+    }
+    if (bigint_p(v)) {
+        rt_bigint_t *big = bigint_val(v);
+        view->sign = big->sign;
+        view->n = big->nlimbs;
+        view->limbs = big->limbs;
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t *bigint_scratch(int n) {
+    uint32_t *limbs = (uint32_t*)calloc(n > 0 ? n : 1, sizeof(uint32_t));
+    if (!limbs) {
+        fprintf(stderr, "failed to allocate bigint\n");
+        exit(1);
+    }
+    return limbs;
+}
+
+// Returns the integer with sign `sign` and magnitude `limbs`, inline if
+// it fits.
+val_t bigint_result(int sign, const uint32_t *limbs, int n) {
+    while (n > 0 && limbs[n - 1] == 0) {
+        n--;
+    }
+    if (n <= 2) {
+        uint64_t mag = n == 0 ? 0 : (n == 1 ? limbs[0] : limbs[0] | ((uint64_t)limbs[1] << 32));
+        if (sign > 0 && mag <= (uint64_t)VAL_INT_MAX) {
+            return mk_int((int64_t)mag);
+        }
+        if (sign < 0 && mag <= (uint64_t)VAL_INT_MAX + 1) {
+            return mk_int((int64_t)(0 - mag));
+        }
+    }
+    rt_bigint_t *big = (rt_bigint_t*)rt_gc_alloc(T_BIGINT, sizeof(rt_bigint_t) + sizeof(uint32_t) * n);
+    big->sign = sign;
+    big->nlimbs = n;
+    memcpy(big->limbs, limbs, sizeof(uint32_t) * n);
+    return mk_bigint(big);
+}
+
+// Returns the integer `x`, which needn't fit inline.
+val_t rt_int_from_int64(int64_t x) {
+    if (int_fits_p(x)) {
+        return mk_int(x);
+    }
+    uint64_t mag = x < 0 ? 0 - (uint64_t)x : (uint64_t)x;
+    uint32_t limbs[2] = { (uint32_t)mag, (uint32_t)(mag >> 32) };
+    return bigint_result(x < 0 ? -1 : 1, limbs, 2);
+}
+
+int mag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn) {
+    if (an != bn) {
+        return an < bn ? -1 : 1;
+    }
+    for (int i = an - 1; i >= 0; --i) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// `out` has room for max(an, bn) + 1 limbs. Returns its length.
+int mag_add(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *out) {
+    if (an < bn) {
+        const uint32_t *t = a; a = b; b = t;
+        int tn = an; an = bn; bn = tn;
+    }
+    uint64_t carry = 0;
+    for (int i = 0; i < an; ++i) {
+        carry += (uint64_t)a[i] + (i < bn ? b[i] : 0);
+        out[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    out[an] = (uint32_t)carry;
+    return an + 1;
+}
+
+// Requires a >= b. `out` has room for an limbs. Returns its length.
+int mag_sub(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *out) {
+    int64_t borrow = 0;
+    for (int i = 0; i < an; ++i) {
+        int64_t d = (int64_t)a[i] - (i < bn ? b[i] : 0) - borrow;
+        borrow = d < 0;
+        out[i] = (uint32_t)(d + (borrow << 32));
+    }
+    return an;
+}
+
+// `out` has room for an + bn limbs, all 0. Returns its length.
+int mag_mul(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *out) {
+    for (int i = 0; i < an; ++i) {
+        uint64_t carry = 0;
+        for (int j = 0; j < bn; ++j) {
+            carry += (uint64_t)a[i] * b[j] + out[i + j];
+            out[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        out[i + bn] = (uint32_t)carry;
+    }
+    return an + bn;
+}
+
+// Divides a by b (non-zero), bit by bit. `q` has room for an limbs and
+// `r` for bn + 1, all 0.
+void mag_divmod(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *q, uint32_t *r) {
+    int rn = 0;
+    for (int i = an * 32 - 1; i >= 0; --i) {
+        // r = r << 1 | bit i of a
+        uint32_t carry = (a[i / 32] >> (i % 32)) & 1;
+        for (int j = 0; j < rn; ++j) {
+            uint32_t top = r[j] >> 31;
+            r[j] = (r[j] << 1) | carry;
+            carry = top;
+        }
+        if (carry) {
+            r[rn++] = carry;
+        }
+        if (mag_cmp(r, rn, b, bn) >= 0) {
+            mag_sub(r, rn, b, bn, r);
+            while (rn > 0 && r[rn - 1] == 0) {
+                rn--;
+            }
+            q[i / 32] |= 1u << (i % 32);
+        }
+    }
+}
+
+// Returns x + y, where each has its own sign.
+val_t bigint_add(int xsign, const uint32_t *x, int xn, int ysign, const uint32_t *y, int yn) {
+    int n = (xn > yn ? xn : yn) + 1;
+    uint32_t *out = bigint_scratch(n);
+    int sign = xsign;
+    if (xsign == ysign) {
+        n = mag_add(x, xn, y, yn, out);
+    } else if (mag_cmp(x, xn, y, yn) >= 0) {
+        n = mag_sub(x, xn, y, yn, out);
+    } else {
+        n = mag_sub(y, yn, x, xn, out);
+        sign = ysign;
+    }
+    val_t result = bigint_result(sign, out, n);
+    free(out);
+    return result;
+}
+
+val_t bigint_mul(const bigint_view_t *x, const bigint_view_t *y) {
+    uint32_t *out = bigint_scratch(x->n + y->n);
+    int n = mag_mul(x->limbs, x->n, y->limbs, y->n, out);
+    val_t result = bigint_result(x->sign * y->sign, out, n);
+    free(out);
+    return result;
+}
+
+val_t bigint_div(const bigint_view_t *x, const bigint_view_t *y) {
+    if (y->n == 0) {
+        fprintf(stderr, "division by zero\n");
+        exit(1);
+    }
+    uint32_t *q = bigint_scratch(x->n);
+    uint32_t *r = bigint_scratch(y->n + 1);
+    mag_divmod(x->limbs, x->n, y->limbs, y->n, q, r);
+    val_t result = bigint_result(x->sign * y->sign, q, x->n);
+    free(q);
+    free(r);
+    return result;
+}
+
+// Exponents below 1 give 1, as they always have.
+val_t bigint_pow(const bigint_view_t *x, val_t exponent) {
+    if (!int_p(exponent)) {
+        fprintf(stderr, "exponent too large\n");
+        exit(1);
+    }
+    int64_t e = int_val(exponent);
+    if (e < 1 || (x->n == 1 && x->limbs[0] == 1)) {
+        return mk_int(e < 1 || x->sign > 0 || (e & 1) == 0 ? 1 : -1);
+    }
+    if (x->n == 0) {
+        return mk_int(0);
+    }
+    // square and multiply, most significant exponent bit first
+    int bits = 64 - __builtin_clzll((uint64_t)e);
+    int64_t xbits = 32 * (int64_t)x->n - __builtin_clz(x->limbs[x->n - 1]);
+    if (e > (int64_t)BIGINT_MAX_LIMBS * 32 / xbits) {
+        fprintf(stderr, "integer too large\n");
+        exit(1);
+    }
+    int cap = (int)(xbits * e / 32) + 3;
+    uint32_t *acc = bigint_scratch(cap), *tmp = bigint_scratch(cap);
+    int n = x->n;
+    memcpy(acc, x->limbs, sizeof(uint32_t) * n);
+    for (int i = bits - 2; i >= 0; --i) {
+        memset(tmp, 0, sizeof(uint32_t) * cap);
+        n = mag_mul(acc, n, acc, n, tmp);
+        while (n > 0 && tmp[n - 1] == 0) n--;
+        uint32_t *t = acc; acc = tmp; tmp = t;
+        if ((e >> i) & 1) {
+            memset(tmp, 0, sizeof(uint32_t) * cap);
+            n = mag_mul(acc, n, x->limbs, x->n, tmp);
+            while (n > 0 && tmp[n - 1] == 0) n--;
+            t = acc; acc = tmp; tmp = t;
+        }
+    }
+    val_t result = bigint_result(x->sign < 0 && (e & 1) ? -1 : 1, acc, n);
+    free(acc);
+    free(tmp);
+    return result;
+}
+
+// Returns `a op b` for integer arithmetic opcode `op`, promoting to a
+// bigint as needed.
+val_t rt_int_arith(opcode_t op, val_t a, val_t b) {
+    // two inline integers stay inline if the result fits, as in the VM
+    if (ints_p(a, b)) {
+        int64_t r;
+        int overflow = 1;
+        switch (op) {
+            case OP_ADD:    overflow = __builtin_add_overflow(int_val(a), int_val(b), &r); break;
+            case OP_SUB:    overflow = __builtin_sub_overflow(int_val(a), int_val(b), &r); break;
+            case OP_MUL:    overflow = __builtin_mul_overflow(int_val(a), int_val(b), &r); break;
+            default:        break;
+        }
+        if (!overflow && int_fits_p(r)) {
+            return mk_int(r);
+        }
+    }
+    bigint_view_t x, y;
+    if (!bigint_view(a, &x) || !bigint_view(b, &y)) {
+        if (op == OP_ADD && (string_p(a) || string_p(b))) {
+            fprintf(stderr, "attempt to add a string to a non-string\n");
+        } else {
+            fprintf(stderr, "attempt to perform arithmetic on a non-integer\n");
+        }
+        exit(1);
+    }
+    switch (op) {
+        case OP_ADD:    return bigint_add(x.sign, x.limbs, x.n, y.sign, y.limbs, y.n);
+        case OP_SUB:    return bigint_add(x.sign, x.limbs, x.n, -y.sign, y.limbs, y.n);
+        case OP_MUL:    return bigint_mul(&x, &y);
+        case OP_DIV:    return bigint_div(&x, &y);
+        case OP_POW:    return bigint_pow(&x, b);
+        default:
+            fprintf(stderr, "BUG: not an integer arithmetic opcode: 0x%x\n", op);
+            exit(1);
+    }
+}
+
+// Returns -1, 0 or 1 as integer `a` is less than, equal to or greater
+// than `b`.
+int rt_int_compare(val_t a, val_t b) {
+    bigint_view_t x, y;
+    if (!bigint_view(a, &x) || !bigint_view(b, &y)) {
+        fprintf(stderr, "attempt to compare a non-integer\n");
+        exit(1);
+    }
+    int xs = x.n ? x.sign : 0, ys = y.n ? y.sign : 0;
+    if (xs != ys) {
+        return xs < ys ? -1 : 1;
+    }
+    return xs * mag_cmp(x.limbs, x.n, y.limbs, y.n);
+}
+
+int rt_bigint_equal(val_t a, val_t b) {
+    rt_bigint_t *x = bigint_val(a), *y = bigint_val(b);
+    return x->sign == y->sign && x->nlimbs == y->nlimbs
+        && memcmp(x->limbs, y->limbs, sizeof(uint32_t) * x->nlimbs) == 0;
+}
+
+uint32_t rt_bigint_hash(val_t v) {
+    rt_bigint_t *big = bigint_val(v);
+    return intern_hash((const char*)big->limbs, sizeof(uint32_t) * big->nlimbs) ^ (uint32_t)big->sign;
+}
+
+val_t rt_int_neg(val_t a) {
+    bigint_view_t x;
+    if (!bigint_view(a, &x)) {
+        fprintf(stderr, "attempt to perform arithmetic on a non-integer\n");
+        exit(1);
+    }
+    return bigint_result(-x.sign, x.limbs, x.n);
+}
+
+val_t rt_int_abs(val_t a) {
+    return rt_int_compare(a, mk_int(0)) < 0 ? rt_int_neg(a) : a;
+}
+
+// Returns the decimal representation of integer `v`, which the caller
+// must free.
+char *rt_int_format(val_t v) {
+    bigint_view_t x;
+    if (!bigint_view(v, &x)) {
+        fprintf(stderr, "attempt to format a non-integer\n");
+        exit(1);
+    }
+    // 10 digits per limb is plenty, plus a sign and the NUL
+    char *buf = (char*)malloc(x.n * 10 + 3);
+    uint32_t *mag = bigint_scratch(x.n);
+    if (!buf) {
+        fprintf(stderr, "failed to allocate integer string\n");
+        exit(1);
+    }
+    memcpy(mag, x.limbs, sizeof(uint32_t) * x.n);
+    char *end = buf + x.n * 10 + 2;
+    char *p = end;
+    *p = 0;
+    int n = x.n;
+    do {
+        // peel off nine digits at a time
+        uint64_t rem = 0;
+        for (int i = n - 1; i >= 0; --i) {
+            uint64_t cur = (rem << 32) | mag[i];
+            mag[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        while (n > 0 && mag[n - 1] == 0) n--;
+        for (int i = 0; i < 9 && (n > 0 || rem > 0 || i == 0); ++i) {
+            *--p = '0' + rem % 10;
+            rem /= 10;
+        }
+    } while (n > 0);
+    if (x.sign < 0) {
+        *--p = '-';
+    }
+    memmove(buf, p, end - p + 1);
+    free(mag);
+    return buf;
+}
+
+#undef BIGINT_MAX_LIMBS
@@ -0,0 +1,451 @@
+// Bytecode cache
+//
+// A compiled module can be saved as an image and loaded again in place of
+// lexing, parsing and compiling its source. An image holds every unit of
+// the module (the module itself, then its prototypes): instructions,
+// constant pool, register counts, and the names of the functions, which
+// are interned again on loading to rebuild the global table.
+//
+// Images are named after a 64-bit FNV-1a hash of the source, so an edited
+// script simply misses the cache. The header repeats the hash and also
+// records the source length, the format version (bump RT_CACHE_VERSION
+// whenever the instruction set or the layout changes) and a hash of the
+// native registry, since compiled code bakes in native indices and
+// intrinsics. Any mismatch is a miss, and the image is rewritten once the
+// source has been compiled.
+//
+// Loading maps the image read-only and executes instructions straight
+// from the mapped pages, which processes running the same script share.
+// Only the constant pools are copied out, because string constants too
+// long to be inline must be heap objects.
+//
+// The interpreter trusts its code, so a damaged image must never run. The
+// header holds a checksum of everything after it, and each unit then gets
+// one pass over its instructions and constants (see cache_check_code())
+// before the image is accepted. A failure of either is a miss too.
+//
+// Images live in $RT_CACHE_DIR, or else $XDG_CACHE_HOME/ratchet or
+// ~/.cache/ratchet; an empty RT_CACHE_DIR disables the cache. An image is
+// written to a temporary file and renamed into place, so a concurrent run
+// never sees a partial one. Failing to write an image isn't an error.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define RT_CACHE_VERSION 4
+
+typedef struct {
+    char magic[4];              // "RTBC"
+    uint32_t version;
+    uint32_t nopcodes;
+    uint32_t nunits;
+    uint64_t source_hash;
+    uint64_t source_len;
+    uint64_t natives_hash;
+    uint64_t size;              // of the whole image
+    uint64_t checksum;          // of the image after the header
+} rt_cache_header_t;
+
+// Offsets are from the start of the image.
+typedef struct {
+    uint64_t code;
+    uint64_t constants;
+    uint64_t name;              // of the function's name, or 0 for the module
+    uint32_t ninsts;
+    uint32_t nconstants;
+    int32_t nregs;
+    int32_t nparams;
+    int32_t nlocals;
+    uint32_t name_len;
+} rt_cache_unit_t;
+
+typedef struct {
+    uint64_t bits;              // or, for a string, its offset
+    uint32_t string_p;
+    uint32_t length;            // of the string
+} rt_cache_constant_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} cache_buf_t;
+
+uint64_t cache_hash(uint64_t h, const void *data, size_t len) {
+    // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        h ^= ((const unsigned char*)data)[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#define CACHE_HASH_INIT 14695981039346656037ULL
+
+// Checksums `len` bytes of an image. This runs over the whole image on
+// every load, so it's FNV-1a taken a word at a time rather than a byte.
+uint64_t cache_checksum(const char *data, size_t len) {
+    uint64_t h = CACHE_HASH_INIT;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    return cache_hash(h, data + i, len - i);
+}
+
+int cache_tmp_seq = 0;
+
+// Returns non-zero if constant `v` can be saved as its bits alone, which
+// is to say it's neither a pointer nor a symbol.
+int cache_plain_constant_p(val_t v) {
+    return float_p(v) || int_p(v) || nil_p(v) || v.bits == mk_true().bits || v.bits == mk_false().bits
+        || (inline_string_p(v) && inline_string_length(v) <= VAL_INLINE_STRING_MAX);
+}
+
+uint64_t cache_natives_hash(const rt_natives_t *natives) {
+    uint64_t h = CACHE_HASH_INIT;
+    for (int i = 0; i < natives->nnatives; ++i) {
+        const rt_native_t *n = &natives->natives[i];
+        h = cache_hash(h, n->name, strlen(n->name) + 1);
+        h = cache_hash(h, &n->arity, sizeof(n->arity));
+        h = cache_hash(h, &n->flags, sizeof(n->flags));
+        h = cache_hash(h, &n->intrinsic, sizeof(n->intrinsic));
+    }
+    return h;
+}
+
+// Returns the image path for `source`, or NULL if the cache is disabled.
+// The caller frees the path.
+char *cache_path(const char *source, size_t len) {
+    char dir[1024];
+    const char *env = getenv("RT_CACHE_DIR");
+    if (env) {
+        if (!*env) return NULL;
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/ratchet", env);
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/.cache/ratchet", env);
+    } else {
+        return NULL;
+    }
+    size_t path_len = strlen(dir) + 22;
+    char *path = (char*)malloc(path_len);
+    if (!path) {
+        fprintf(stderr, "failed to allocate cache path\n");
+        exit(1);
+    }
+    snprintf(path, path_len, "%s/%016llx.rtc", dir, (unsigned long long)cache_hash(CACHE_HASH_INIT, source, len));
+    return path;
+}
+
+// Creates every missing directory leading to file `path`.
+void cache_mkdirs(const char *path) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; *p; ++p) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(buf, 0755);
+            *p = '/';
+        }
+    }
+}
+
+// Appends `len` bytes (8-byte aligned), returning their offset. `data` may
+// be NULL to reserve space.
+uint64_t cache_put(cache_buf_t *buf, const void *data, size_t len) {
+    size_t off = (buf->len + 7) & ~(size_t)7;
+    if (off + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < off + len) cap *= 2;
+        buf->data = (char*)realloc(buf->data, cap);
+        if (!buf->data) {
+            fprintf(stderr, "failed to allocate cache image\n");
+            exit(1);
+        }
+        buf->cap = cap;
+    }
+    memset(buf->data + buf->len, 0, off - buf->len);
+    if (data) {
+        memcpy(buf->data + off, data, len);
+    } else {
+        memset(buf->data + off, 0, len);
+    }
+    buf->len = off + len;
+    return off;
+}
+
+// Appends unit `co`'s code and constants, filling in its record at
+// `unit_off`. Returns 0 if the unit can't be cached.
+int cache_put_unit(cache_buf_t *buf, uint64_t unit_off, code_t *co) {
+    rt_cache_unit_t unit;
+    unit.code = cache_put(buf, co->code, sizeof(inst_t) * co->pi);
+    unit.ninsts = co->pi;
+    unit.constants = cache_put(buf, NULL, sizeof(rt_cache_constant_t) * co->ki);
+    unit.nconstants = co->ki;
+    for (int i = 0; i < co->ki; ++i) {
+        val_t v = co->constants[i];
+        rt_cache_constant_t k = { v.bits, 0, 0 };
+        if (string_p(v) && !inline_string_p(v)) {
+            rt_string_t *str = string_val(v);
+            k.bits = cache_put(buf, str->str, str->length);
+            k.string_p = 1;
+            k.length = str->length;
+        } else if (!cache_plain_constant_p(v)) {
+            return 0;
+        }
+        memcpy(buf->data + unit.constants + sizeof(k) * i, &k, sizeof(k));
+    }
+    unit.name = 0;
+    unit.name_len = 0;
+    if (co->name >= 0) {
+        const char *name = rt_intern_name(co->name);
+        unit.name_len = strlen(name);
+        unit.name = cache_put(buf, name, unit.name_len);
+    }
+    unit.nregs = co->nregs;
+    unit.nparams = co->nparams;
+    unit.nlocals = co->nlocals;
+    memcpy(buf->data + unit_off, &unit, sizeof(unit));
+    return 1;
+}
+
+// Saves an image of compiled module `co`, from `source`.
+void rt_cache_save(code_t *co, const char *source, size_t len) {
+    // the loader rebuilds the globals as the natives then the prototypes
+    if (co->nglobals != co->natives->nnatives + co->nprotos) {
+        return;
+    }
+    char *path = cache_path(source, len);
+    if (!path) {
+        return;
+    }
+
+    cache_buf_t buf = { NULL, 0, 0 };
+    rt_cache_header_t header;
+    memcpy(header.magic, "RTBC", 4);
+    header.version = RT_CACHE_VERSION;
+    header.nopcodes = OPI_MAX;
+    header.nunits = 1 + co->nprotos;
+    header.source_hash = cache_hash(CACHE_HASH_INIT, source, len);
+    header.source_len = len;
+    header.natives_hash = cache_natives_hash(co->natives);
+    cache_put(&buf, &header, sizeof(header));
+    uint64_t units = cache_put(&buf, NULL, sizeof(rt_cache_unit_t) * header.nunits);
+    int ok = cache_put_unit(&buf, units, co);
+    for (int i = 0; ok && i < co->nprotos; ++i) {
+        ok = cache_put_unit(&buf, units + sizeof(rt_cache_unit_t) * (i + 1), co->protos[i]);
+    }
+    header.size = buf.len;
+    header.checksum = cache_checksum(buf.data + sizeof(header), buf.len - sizeof(header));
+    memcpy(buf.data, &header, sizeof(header));
+
+    if (ok) {
+        cache_mkdirs(path);
+        size_t tmp_len = strlen(path) + 32;
+        char *tmp = (char*)malloc(tmp_len);
+        if (!tmp) {
+            fprintf(stderr, "failed to allocate cache path\n");
+            exit(1);
+        }
+        // unique to the process and, for parallel loading, the call
+        snprintf(tmp, tmp_len, "%s.%d.%d", path, (int)getpid(), __atomic_add_fetch(&cache_tmp_seq, 1, __ATOMIC_RELAXED));
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            ok = write(fd, buf.data, buf.len) == (ssize_t)buf.len;
+            close(fd);
+            if (!ok || rename(tmp, path) != 0) {
+                unlink(tmp);
+            }
+        }
+        free(tmp);
+    }
+    free(buf.data);
+    free(path);
+}
+
+// Returns non-zero if `len` bytes at `off` lie within an image of `size`
+// bytes.
+int cache_in_bounds(uint64_t off, uint64_t len, uint64_t size) {
+    return off <= size && len <= size - off;
+}
+
+// Returns non-zero if the instructions of loaded unit `co` are ones the
+// compiler could have produced: every opcode exists, register operands are
+// below nregs, constant, global and native indices are in range, K
+// operands are integers, every jump lands on an instruction of the unit
+// and the last instruction doesn't fall off the end.
+int cache_check_code(code_t *co) {
+    const inst_t *code = co->code;
+    int n = co->pi;
+    int ok = n > 0;
+    int effects = 0;
+    for (int p = 0; ok && p < n; ++p) {
+        inst_t ext = 0;
+        if (INST_OP(code[p]) == OP_EXT) {
+            ext = code[p++];
+            if (p == n || INST_OP(code[p]) == OP_EXT) {
+                ok = 0;
+                break;
+            }
+        }
+        inst_t inst = code[p];
+        unsigned opi = inst >> OP_SHIFT;
+        if (opi == 0 || opi >= OPI_MAX) {
+            ok = 0;
+            break;
+        }
+        int a = (INST_A(ext) << 8) | INST_A(inst);
+        int b = (INST_B(ext) << 8) | INST_B(inst);
+        int c = (INST_C(ext) << 8) | INST_C(inst);
+        uint32_t k = (INST_K(ext) << 16) | INST_K(inst);
+        int fmt = opcode_formats[opi];
+        effects = opcode_effects[opi];
+        if (((effects & (E_DA | E_UA)) && a >= co->nregs)
+            || ((effects & E_UB) && b >= co->nregs)
+            || ((effects & E_UC) && c >= co->nregs)
+            || ((effects & E_CALL) && (a + b >= co->nregs || c >= co->nregs))
+            || ((effects & E_NCALL) && a + b > co->nregs)) {
+            ok = 0;
+        }
+        if (fmt == FMT_J || fmt == FMT_AJ) {
+            // prefixes never follow one another, so an instruction starts
+            // wherever the word before isn't a prefix
+            long target = (long)p + 1 + code_jump_offset(co, p);
+            ok = ok && target >= 0 && target < n && (target == 0 || INST_OP(code[target - 1]) != OP_EXT);
+        }
+        if (effects & E_PAIR) {
+            int q = p + 1 < n && INST_OP(code[p + 1]) == OP_EXT ? p + 2 : p + 1;
+            ok = ok && q < n && INST_OP(code[q]) == OP_JMP;
+        }
+        switch (INST_OP(inst)) {
+            case OP_LOADK:
+                ok = ok && k < (uint32_t)co->ki;
+                break;
+            case OP_GETG:
+                ok = ok && k < (uint32_t)co->module->nglobals;
+                break;
+            case OP_CALLN:
+                ok = ok && c < co->module->natives->nnatives;
+                break;
+            case OP_LTK_JMPF: case OP_LEK_JMPF: case OP_GTK_JMPF:
+            case OP_GEK_JMPF: case OP_EQK_JMPF: case OP_NEQK_JMPF:
+                ok = ok && b < co->ki && int_p(co->constants[b]);
+                break;
+            case OP_ADDK: case OP_SUBK: case OP_MULK:
+                ok = ok && c < co->ki && int_p(co->constants[c]);
+                break;
+        }
+    }
+    return ok && (effects & E_END);
+}
+
+// Fills in unit `co` from its record. Returns 0 if the record is corrupt.
+int cache_load_unit(code_t *co, const char *image, uint64_t size, const rt_cache_unit_t *unit) {
+    const rt_cache_constant_t *k = (const rt_cache_constant_t*)(image + unit->constants);
+    if (!cache_in_bounds(unit->code, (uint64_t)unit->ninsts * sizeof(inst_t), size)
+        || !cache_in_bounds(unit->constants, (uint64_t)unit->nconstants * sizeof(*k), size)
+        || ((unit->code | unit->constants) & 7) != 0   // as cache_put() aligns them
+        || unit->nparams < 0
+        || unit->nlocals < unit->nparams
+        || unit->nregs < unit->nlocals
+        || unit->nregs > INST_MAX_WIDE + 1) {
+        return 0;
+    }
+    co->code = (inst_t*)(image + unit->code);
+    co->pi = unit->ninsts;
+    co->code_cap = 0;
+    co->constants = (val_t*)malloc(sizeof(val_t) * (unit->nconstants ? unit->nconstants : 1));
+    if (!co->constants) {
+        fprintf(stderr, "failed to allocate constants\n");
+        exit(1);
+    }
+    co->constants_cap = unit->nconstants;
+    for (uint32_t i = 0; i < unit->nconstants; ++i) {
+        if (k[i].string_p) {
+            if (!cache_in_bounds(k[i].bits, k[i].length, size)) {
+                return 0;
+            }
+            rt_string_t *str = rt_gc_alloc_string(k[i].length, 1);
+            memcpy(str->str, image + k[i].bits, k[i].length);
+            co->constants[i] = mk_string(str);
+        } else {
+            co->constants[i].bits = k[i].bits;
+            if (!cache_plain_constant_p(co->constants[i])) {
+                return 0;
+            }
+        }
+        co->ki = i + 1;
+    }
+    co->nregs = unit->nregs;
+    co->nparams = unit->nparams;
+    co->nlocals = unit->nlocals;
+    return cache_check_code(co);
+}
+
+// Loads the cached image of `source` compiled against `natives`, or
+// returns NULL if there isn't a valid one.
+code_t *rt_cache_load(const char *source, size_t len, const rt_natives_t *natives) {
+    char *path = cache_path(source, len);
+    if (!path) {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(rt_cache_header_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const char *image = (const char*)map;
+    uint64_t size = st.st_size;
+    const rt_cache_header_t *header = (const rt_cache_header_t*)image;
+    const rt_cache_unit_t *units = (const rt_cache_unit_t*)(header + 1);
+    if (memcmp(header->magic, "RTBC", 4) != 0
+        || header->version != RT_CACHE_VERSION
+        || header->nopcodes != OPI_MAX
+        || header->size != size
+        || header->source_len != len
+        || header->source_hash != cache_hash(CACHE_HASH_INIT, source, len)
+        || header->natives_hash != cache_natives_hash(natives)
+        || header->nunits == 0
+        || !cache_in_bounds(sizeof(*header), (uint64_t)header->nunits * sizeof(*units), size)
+        || header->checksum != cache_checksum(image + sizeof(*header), size - sizeof(*header))) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    code_t *co = compile_new_module(natives);
+    co->image = map;
+    co->image_size = size;
+    for (uint32_t i = 1; i < header->nunits; ++i) {
+        const rt_cache_unit_t *unit = &units[i];
+        if (!cache_in_bounds(unit->name, unit->name_len, size)) {
+            code_free(co);
+            return NULL;
+        }
+        compile_new_proto(co, rt_intern(image + unit->name, unit->name_len));
+    }
+    int ok = cache_load_unit(co, image, size, &units[0]);
+    for (int i = 0; ok && i < co->nprotos; ++i) {
+        ok = cache_load_unit(co->protos[i], image, size, &units[i + 1]);
+    }
+    if (!ok) {
+        code_free(co);
+        return NULL;
+    }
+    return co;
+}
+
+#undef CACHE_HASH_INIT
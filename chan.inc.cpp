@@ -0,0 +1,580 @@
+// Channels
+//
+// chan() makes an unbounded channel, and chan(n) a bounded one buffering
+// at least n values (n is rounded up to a power of two, and to at least
+// 2). send(ch, v) queues a value, blocking the sending task while a
+// bounded channel is full; recv(ch) takes the oldest, blocking while the
+// channel is empty. select(ch1, ch2, ...) receives from whichever of its
+// channels first has a value, trying them in a rotating order so that
+// none is starved. send, recv and select are intrinsics; called
+// indirectly, they fail rather than block.
+//
+// Values are buffered in a bounded lock-free ring (Vyukov's MPMC queue),
+// so a send or receive that doesn't have to block, or wake a task that
+// has, is a single CAS and touches no lock. With one sender and one
+// receiver the CAS never fails, which makes that the SPSC fast path. An
+// unbounded channel has a 1024 value ring, and queues values that don't
+// fit in an overflow buffer under the channel's lock; once anything has
+// overflowed, every send goes there until it drains, to keep values in
+// order.
+//
+// Tasks that must block queue themselves on the channel, under its lock,
+// and then try again before giving up their worker; a task that makes
+// progress on a channel with waiters wakes one of them. The operation is
+// completed on the woken task's behalf where possible: a blocked
+// receiver is handed the next value directly, and a blocked sender's
+// value is moved into the ring as soon as there's room (or handed
+// straight to a receiver that finds the ring empty). Either way, running
+// the operation again when the task resumes just collects the result.
+//
+// A task in a select is queued on every channel at once, and each waker
+// must first claim it (task->wait_claimed) so that only one completes
+// its select. The task holds the locks of all the channels while it
+// queues itself, acquired in address order.
+//
+// Channels live in the old space and are never moved. The values they
+// buffer, and the tasks blocked on them, are GC roots, visited through a
+// list of every channel; channels are unlinked by their finalizer.
+//
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+#define CHAN_UNBOUNDED_RING 1024
+
+typedef struct {
+    long seq;
+    val_t value;
+} rt_chan_cell_t;
+
+typedef struct {
+    rt_waiter_t *head;
+    rt_waiter_t *tail;
+    int n;                          // atomic; waiters queued
+} rt_waitq_t;
+
+struct rt_chan {
+    rt_chan_cell_t *cells;
+    long mask;                      // ring capacity - 1
+    int bounded;
+    char pad0[64];                  // keeps head and tail on their own
+    long head;                      // atomic; next to receive
+    char pad1[64];                  // cache lines
+    long tail;                      // atomic; next to send
+    char pad2[64];
+    pthread_mutex_t lock;           // guards everything below
+    rt_waitq_t recvq;
+    rt_waitq_t sendq;
+    val_t *overflow;                // circular; unbounded channels only
+    long overflow_head;
+    long overflow_cap;
+    long noverflow;                 // atomic
+    struct rt_chan *prev;
+    struct rt_chan *next;
+};
+
+struct {
+    rt_chan_t *head;
+    int registered;                 // root and finalizer are installed
+    pthread_mutex_t lock;
+} rt_chans = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+void rt_sched_ready(rt_task_t *task);
+
+//
+// Ring
+
+int ring_push(rt_chan_t *ch, val_t v) {
+    long pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+    while (1) {
+        rt_chan_cell_t *cell = &ch->cells[pos & ch->mask];
+        long dif = __atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST) - pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ch->tail, &pos, pos + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                cell->value = v;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int ring_pop(rt_chan_t *ch, val_t *out) {
+    long pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+    while (1) {
+        rt_chan_cell_t *cell = &ch->cells[pos & ch->mask];
+        long dif = __atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST) - (pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ch->head, &pos, pos + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                *out = cell->value;
+                __atomic_store_n(&cell->seq, pos + ch->mask + 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+//
+// Wait queues; the channel's lock must be held
+
+void waitq_push(rt_waitq_t *q, rt_waiter_t *w) {
+    w->prev = q->tail;
+    w->next = NULL;
+    if (q->tail) {
+        q->tail->next = w;
+    } else {
+        q->head = w;
+    }
+    q->tail = w;
+    w->queued = 1;
+    __atomic_add_fetch(&q->n, 1, __ATOMIC_SEQ_CST);
+}
+
+void waitq_remove(rt_waitq_t *q, rt_waiter_t *w) {
+    if (!w->queued) {
+        return;
+    }
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        q->head = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    } else {
+        q->tail = w->prev;
+    }
+    w->queued = 0;
+    __atomic_sub_fetch(&q->n, 1, __ATOMIC_SEQ_CST);
+}
+
+int waitq_waiting_p(rt_waitq_t *q) {
+    return __atomic_load_n(&q->n, __ATOMIC_SEQ_CST) > 0;
+}
+
+// Dequeues the first waiter whose task nobody else has claimed, and
+// claims it. Waiters of tasks already claimed through another channel
+// are dropped on the way.
+rt_waiter_t *waitq_claim(rt_waitq_t *q) {
+    while (q->head) {
+        rt_waiter_t *w = q->head;
+        waitq_remove(q, w);
+        int unclaimed = 0;
+        if (__atomic_compare_exchange_n(&w->task->wait_claimed, &unclaimed, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+//
+// Channel operations; the channel's lock must be held
+
+int chan_take_locked(rt_chan_t *ch, val_t *out);
+
+// Wakes a blocked receiver, handing it the next value if there is one.
+void chan_wake_recv(rt_chan_t *ch) {
+    rt_waiter_t *w = waitq_claim(&ch->recvq);
+    if (w) {
+        if (chan_take_locked(ch, &w->task->wait_value)) {
+            w->task->wait_done = 1;
+        }
+        rt_sched_ready(w->task);
+    }
+}
+
+// Wakes a blocked sender, moving its value into the ring if it fits.
+void chan_wake_send(rt_chan_t *ch) {
+    rt_waiter_t *w = waitq_claim(&ch->sendq);
+    if (w) {
+        if (ring_push(ch, w->value)) {
+            w->task->wait_done = 1;
+            if (waitq_waiting_p(&ch->recvq)) {
+                chan_wake_recv(ch);
+            }
+        }
+        rt_sched_ready(w->task);
+    }
+}
+
+int chan_take_locked(rt_chan_t *ch, val_t *out) {
+    if (ring_pop(ch, out)) {
+        if (waitq_waiting_p(&ch->sendq)) {
+            chan_wake_send(ch);
+        }
+        return 1;
+    }
+    if (ch->noverflow) {
+        *out = ch->overflow[ch->overflow_head];
+        ch->overflow_head = (ch->overflow_head + 1) & (ch->overflow_cap - 1);
+        __atomic_sub_fetch(&ch->noverflow, 1, __ATOMIC_SEQ_CST);
+        return 1;
+    }
+    // the ring can be empty with a sender blocked on it if receivers
+    // emptied it before the sender could be woken
+    rt_waiter_t *w = waitq_claim(&ch->sendq);
+    if (w) {
+        *out = w->value;
+        w->task->wait_done = 1;
+        rt_sched_ready(w->task);
+        return 1;
+    }
+    return 0;
+}
+
+void chan_overflow(rt_chan_t *ch, val_t v) {
+    if (ch->noverflow == ch->overflow_cap) {
+        long cap = ch->overflow_cap ? ch->overflow_cap * 2 : 64;
+        val_t *grown = (val_t*)malloc(sizeof(val_t) * cap);
+        if (!grown) {
+            fprintf(stderr, "failed to allocate channel buffer\n");
+            exit(1);
+        }
+        for (long i = 0; i < ch->noverflow; ++i) {
+            grown[i] = ch->overflow[(ch->overflow_head + i) & (ch->overflow_cap - 1)];
+        }
+        free(ch->overflow);
+        ch->overflow = grown;
+        ch->overflow_head = 0;
+        ch->overflow_cap = cap;
+    }
+    ch->overflow[(ch->overflow_head + ch->noverflow) & (ch->overflow_cap - 1)] = v;
+    __atomic_add_fetch(&ch->noverflow, 1, __ATOMIC_SEQ_CST);
+}
+
+int chan_send_locked(rt_chan_t *ch, val_t v) {
+    if (ch->noverflow || !ring_push(ch, v)) {
+        if (ch->bounded) {
+            return 0;
+        }
+        chan_overflow(ch, v);
+    }
+    if (waitq_waiting_p(&ch->recvq)) {
+        chan_wake_recv(ch);
+    }
+    return 1;
+}
+
+//
+// Non-blocking attempts
+
+int chan_try_send(rt_chan_t *ch, val_t v) {
+    if (!__atomic_load_n(&ch->noverflow, __ATOMIC_SEQ_CST) && ring_push(ch, v)) {
+        if (waitq_waiting_p(&ch->recvq)) {
+            pthread_mutex_lock(&ch->lock);
+            chan_wake_recv(ch);
+            pthread_mutex_unlock(&ch->lock);
+        }
+        return 1;
+    }
+    if (ch->bounded) {
+        return 0;
+    }
+    pthread_mutex_lock(&ch->lock);
+    chan_send_locked(ch, v);
+    pthread_mutex_unlock(&ch->lock);
+    return 1;
+}
+
+int chan_try_recv(rt_chan_t *ch, val_t *out) {
+    if (ring_pop(ch, out)) {
+        if (waitq_waiting_p(&ch->sendq)) {
+            pthread_mutex_lock(&ch->lock);
+            chan_wake_send(ch);
+            pthread_mutex_unlock(&ch->lock);
+        }
+        return 1;
+    }
+    if (!__atomic_load_n(&ch->noverflow, __ATOMIC_SEQ_CST) && !waitq_waiting_p(&ch->sendq)) {
+        return 0;
+    }
+    pthread_mutex_lock(&ch->lock);
+    int ok = chan_take_locked(ch, out);
+    pthread_mutex_unlock(&ch->lock);
+    return ok;
+}
+
+//
+// Blocking
+
+// Dequeues a task that has been woken from wherever it's still queued.
+void chan_cancel(rt_task_t *task) {
+    for (int i = 0; i < task->nwaits; ++i) {
+        rt_waiter_t *w = &task->waits[i];
+        rt_chan_t *ch = chan_val(w->chan);
+        pthread_mutex_lock(&ch->lock);
+        waitq_remove(w->sending ? &ch->sendq : &ch->recvq, w);
+        pthread_mutex_unlock(&ch->lock);
+    }
+    if (task->waits != &task->wait) {
+        free(task->waits);
+    }
+    task->waits = NULL;
+    task->nwaits = 0;
+    __atomic_store_n(&task->wait_claimed, 0, __ATOMIC_SEQ_CST);
+}
+
+// Queues `task` on `ch`, holding the task's own claim so that a waker
+// run by the retry that follows skips it. The task must release the
+// claim if it goes on to block.
+void chan_wait_locked(rt_task_t *task, rt_waiter_t *w, val_t chan, val_t v, int sending) {
+    rt_chan_t *ch = chan_val(chan);
+    w->task = task;
+    w->chan = chan;
+    w->value = v;
+    w->sending = sending;
+    __atomic_store_n(&task->wait_claimed, 1, __ATOMIC_SEQ_CST);
+    waitq_push(sending ? &ch->sendq : &ch->recvq, w);
+}
+
+void chan_check(val_t chan, const char *what) {
+    if (!chan_p(chan)) {
+        fprintf(stderr, "attempt to %s a non-channel\n", what);
+        exit(1);
+    }
+}
+
+int rt_chan_send(rt_task_t *task, val_t chan, val_t value) {
+    chan_check(chan, "send on");
+    if (task->nwaits) {
+        chan_cancel(task);
+        if (task->wait_done) {
+            task->wait_done = 0;
+            return 1;
+        }
+    }
+    rt_chan_t *ch = chan_val(chan);
+    if (chan_try_send(ch, value)) {
+        return 1;
+    }
+    pthread_mutex_lock(&ch->lock);
+    task->waits = &task->wait;
+    task->nwaits = 1;
+    chan_wait_locked(task, &task->wait, chan, value, 1);
+    int ok = chan_send_locked(ch, value);
+    if (ok) {
+        waitq_remove(&ch->sendq, &task->wait);
+        task->waits = NULL;
+        task->nwaits = 0;
+    }
+    __atomic_store_n(&task->wait_claimed, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ch->lock);
+    return ok;
+}
+
+// Collects a value received on the task's behalf while it was blocked.
+int chan_resume_recv(rt_task_t *task, val_t *out) {
+    chan_cancel(task);
+    if (!task->wait_done) {
+        return 0;
+    }
+    *out = task->wait_value;
+    task->wait_value = mk_nil();
+    task->wait_done = 0;
+    task->messages++;
+    return 1;
+}
+
+int rt_chan_recv(rt_task_t *task, val_t chan, val_t *out) {
+    chan_check(chan, "receive from");
+    if (task->nwaits && chan_resume_recv(task, out)) {
+        return 1;
+    }
+    rt_chan_t *ch = chan_val(chan);
+    if (chan_try_recv(ch, out)) {
+        task->messages++;
+        return 1;
+    }
+    pthread_mutex_lock(&ch->lock);
+    task->waits = &task->wait;
+    task->nwaits = 1;
+    chan_wait_locked(task, &task->wait, chan, mk_nil(), 0);
+    int ok = chan_take_locked(ch, out);
+    if (ok) {
+        waitq_remove(&ch->recvq, &task->wait);
+        task->waits = NULL;
+        task->nwaits = 0;
+        task->messages++;
+    }
+    __atomic_store_n(&task->wait_claimed, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ch->lock);
+    return ok;
+}
+
+// Sorts the distinct channels among `chans` into `locks` by address,
+// returning how many there are.
+int chan_lock_order(const val_t *chans, int nchans, rt_chan_t **locks) {
+    int n = 0;
+    for (int i = 0; i < nchans; ++i) {
+        rt_chan_t *ch = chan_val(chans[i]);
+        int j = n;
+        while (j > 0 && locks[j - 1] > ch) j--;
+        if (j > 0 && locks[j - 1] == ch) continue;
+        memmove(&locks[j + 1], &locks[j], sizeof(rt_chan_t*) * (n - j));
+        locks[j] = ch;
+        n++;
+    }
+    return n;
+}
+
+int rt_chan_select(rt_task_t *task, const val_t *chans, int nchans, val_t *out) {
+    if (nchans == 0) {
+        fprintf(stderr, "select expects at least one channel\n");
+        exit(1);
+    }
+    for (int i = 0; i < nchans; ++i) {
+        chan_check(chans[i], "select on");
+    }
+    if (task->nwaits && chan_resume_recv(task, out)) {
+        return 1;
+    }
+    int start = (int)(task->messages % nchans);
+    for (int i = 0; i < nchans; ++i) {
+        if (chan_try_recv(chan_val(chans[(start + i) % nchans]), out)) {
+            task->messages++;
+            return 1;
+        }
+    }
+
+    rt_chan_t **locks = (rt_chan_t**)malloc(sizeof(rt_chan_t*) * nchans);
+    rt_waiter_t *waits = (rt_waiter_t*)malloc(sizeof(rt_waiter_t) * nchans);
+    if (!locks || !waits) {
+        fprintf(stderr, "failed to allocate select\n");
+        exit(1);
+    }
+    int nlocks = chan_lock_order(chans, nchans, locks);
+    for (int i = 0; i < nlocks; ++i) {
+        pthread_mutex_lock(&locks[i]->lock);
+    }
+    task->waits = waits;
+    task->nwaits = nchans;
+    for (int i = 0; i < nchans; ++i) {
+        chan_wait_locked(task, &waits[i], chans[i], mk_nil(), 0);
+    }
+    // `out` may alias `chans`
+    int ok = 0;
+    val_t v;
+    for (int i = 0; i < nchans && !ok; ++i) {
+        ok = chan_take_locked(chan_val(chans[(start + i) % nchans]), &v);
+    }
+    if (ok) {
+        for (int i = 0; i < nchans; ++i) {
+            waitq_remove(&chan_val(waits[i].chan)->recvq, &waits[i]);
+        }
+        *out = v;
+        free(waits);
+        task->waits = NULL;
+        task->nwaits = 0;
+        task->messages++;
+    }
+    __atomic_store_n(&task->wait_claimed, 0, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < nlocks; ++i) {
+        pthread_mutex_unlock(&locks[i]->lock);
+    }
+    free(locks);
+    return ok;
+}
+
+//
+// Indirect calls
+
+int rt_chan_try_send(val_t chan, val_t value) {
+    chan_check(chan, "send on");
+    return chan_try_send(chan_val(chan), value);
+}
+
+int rt_chan_try_recv(val_t chan, val_t *out) {
+    chan_check(chan, "receive from");
+    return chan_try_recv(chan_val(chan), out);
+}
+
+//
+// Lifetime
+
+// Runs with the world stopped.
+void chan_visit_roots(void *ctx) {
+    for (rt_chan_t *ch = rt_chans.head; ch; ch = ch->next) {
+        for (long i = ch->head; i < ch->tail; ++i) {
+            rt_gc_visit(&ch->cells[i & ch->mask].value);
+        }
+        for (long i = 0; i < ch->noverflow; ++i) {
+            rt_gc_visit(&ch->overflow[(ch->overflow_head + i) & (ch->overflow_cap - 1)]);
+        }
+        for (rt_waiter_t *w = ch->recvq.head; w; w = w->next) {
+            rt_task_visit(w->task);
+        }
+        for (rt_waiter_t *w = ch->sendq.head; w; w = w->next) {
+            rt_task_visit(w->task);
+        }
+    }
+}
+
+void chan_finalize(void *obj) {
+    rt_chan_t *ch = (rt_chan_t*)obj;
+    pthread_mutex_lock(&rt_chans.lock);
+    if (ch->prev) {
+        ch->prev->next = ch->next;
+    } else {
+        rt_chans.head = ch->next;
+    }
+    if (ch->next) {
+        ch->next->prev = ch->prev;
+    }
+    pthread_mutex_unlock(&rt_chans.lock);
+    pthread_mutex_destroy(&ch->lock);
+    free(ch->cells);
+    free(ch->overflow);
+}
+
+// Makes a channel buffering at least `cap` values, or an unbounded one if
+// `cap` is 0.
+val_t rt_chan_new(int cap) {
+    long ring = 2;
+    while (ring < (cap ? cap : CHAN_UNBOUNDED_RING)) ring *= 2;
+    rt_chan_t *ch = (rt_chan_t*)rt_gc_alloc_old(T_CHANNEL, sizeof(rt_chan_t));
+    ch->cells = (rt_chan_cell_t*)malloc(sizeof(rt_chan_cell_t) * ring);
+    if (!ch->cells) {
+        fprintf(stderr, "failed to allocate channel buffer\n");
+        exit(1);
+    }
+    for (long i = 0; i < ring; ++i) {
+        ch->cells[i].seq = i;
+        ch->cells[i].value = mk_nil();
+    }
+    ch->mask = ring - 1;
+    ch->bounded = cap != 0;
+    ch->head = 0;
+    ch->tail = 0;
+    pthread_mutex_init(&ch->lock, NULL);
+    ch->recvq.head = ch->recvq.tail = NULL;
+    ch->recvq.n = 0;
+    ch->sendq.head = ch->sendq.tail = NULL;
+    ch->sendq.n = 0;
+    ch->overflow = NULL;
+    ch->overflow_head = 0;
+    ch->overflow_cap = 0;
+    ch->noverflow = 0;
+
+    pthread_mutex_lock(&rt_chans.lock);
+    if (!rt_chans.registered) {
+        rt_gc_add_root(chan_visit_roots, NULL);
+        rt_gc_set_finalizer(T_CHANNEL, chan_finalize);
+        rt_chans.registered = 1;
+    }
+    ch->prev = NULL;
+    ch->next = rt_chans.head;
+    if (ch->next) {
+        ch->next->prev = ch;
+    }
+    rt_chans.head = ch;
+    pthread_mutex_unlock(&rt_chans.lock);
+    return mk_chan(ch);
+}
+
+#undef CHAN_UNBOUNDED_RING
@@ -0,0 +1,433 @@
+// Code units
+//
+// A code_t holds the instruction stream and constant pool produced by the
+// compiler. Both buffers grow geometrically. Identical constants share a
+// single pool slot; strings are identical if their contents are.
+//
+// A module's top-level code is one unit, and each function it defines is
+// another (a prototype), owned by the module. Globals (functions and
+// natives) live in a table on the module unit that all of its units share.
+// The module is a GC root for its units' constants and its globals.
+//
+// A module loaded from the bytecode cache (cache.inc.cpp) executes its
+// units' instructions straight out of the mapped image, which it owns.
+//
+// Instructions are 32 bits: a 6-bit opcode followed by operands laid out
+// according to the opcode's format in opcodes.x. Operands that don't fit
+// their short field are encoded by emitting an OP_EXT prefix carrying the
+// high bits. The EXT payload uses the same A/B/C layout as the instruction
+// it extends, so each of its operands can be up to 16 bits wide. AK and AJ
+// instructions take their high k bits from the prefix's low 16 bits, and
+// J instructions take theirs from the prefix's A field.
+
+#include <sys/mman.h>
+
+typedef uint32_t inst_t;
+
+#define INST_OP(i)      ((i) & 0xfc000000)
+#define INST_A(i)       (((i) >> 16) & 0xFF)
+#define INST_B(i)       (((i) >>  8) & 0xFF)
+#define INST_C(i)       (((i) >>  0) & 0xFF)
+#define INST_K(i)       (((i) >>  0) & 0xFFFF)
+#define INST_SK(i)      ((int16_t)((i) & 0xFFFF))
+#define INST_SJ(i)      (((int32_t)((i) << 8)) >> 8)
+
+// Operand formats, indexed by opcode number.
+enum {
+    FMT_N, FMT_X, FMT_C, FMT_AC, FMT_ABC, FMT_AK, FMT_J, FMT_AJ
+};
+
+const unsigned char opcode_formats[OPI_MAX] = {
+    FMT_X,
+    #define OPCODE(_, fmt, __) FMT_##fmt,
+    #include "opcodes.x"
+    #undef OPCODE
+};
+
+#define INST_FMT(i)     (opcode_formats[(i) >> OP_SHIFT])
+
+// Register and control flow effects, indexed by opcode number.
+enum {
+    E_NONE  = 0,
+    E_DA    = 1 << 0,   // defines a
+    E_UA    = 1 << 1,   // uses a
+    E_UB    = 1 << 2,   // uses b
+    E_UC    = 1 << 3,   // uses c
+    E_CALL  = 1 << 4,   // uses a to a+b, defines c
+    E_JUMP  = 1 << 5,   // may branch to k
+    E_END   = 1 << 6,   // never falls through
+    E_PAIR  = 1 << 7,   // branch target is held by the following JMP
+    E_NCALL = 1 << 8,   // uses a to a+b-1
+    E_IMPURE = 1 << 9   // has effects besides defining a
+};
+
+const unsigned short opcode_effects[OPI_MAX] = {
+    E_END,
+    #define OPCODE(_, __, effects) effects,
+    #include "opcodes.x"
+    #undef OPCODE
+};
+
+const char *opcode_names[OPI_MAX] = {
+    "ILLEGAL",
+    #define OPCODE(name, _, __) #name,
+    #include "opcodes.x"
+    #undef OPCODE
+};
+
+#define INST_MAX_WIDE   0xFFFF
+#define INST_SJ_MIN     (-(1 << 23))
+#define INST_SJ_MAX     ((1 << 23) - 1)
+
+struct code {
+    val_t *constants;
+    inst_t *code;
+    int pi;
+    int ki;
+    int code_cap;
+    int constants_cap;
+    int *constants_index;   // open-addressed: constant index + 1, or 0
+    int constants_index_cap;
+    int nregs;
+    int nparams;            // arguments arrive in registers 0 to nparams-1
+    int nlocals;            // registers pinned to parameters and locals
+    int name;               // interned function name, or -1 for a module
+    code_t *module;         // the module this unit belongs to; itself for a module
+    const rt_natives_t *natives;    // module only: the native registry
+    code_t **protos;        // module only: function prototypes, owned
+    int nprotos;
+    int protos_cap;
+    val_t *globals;         // module only: global values, by slot
+    int nglobals;
+    int globals_cap;
+    int *global_slots;      // module only: symbol -> global slot + 1, or 0
+    int global_slots_cap;
+    int folded;             // AST nodes removed by constant folding
+    regalloc_t *ra;         // only while the unit is being compiled
+    void *image;            // module only: mapped cache image, or NULL
+    size_t image_size;
+};
+
+void *code_grow(void *buffer, int *cap, size_t elem_sz) {
+    int new_cap = *cap ? *cap * 2 : 64;
+    buffer = realloc(buffer, elem_sz * new_cap);
+    if (!buffer) {
+        fprintf(stderr, "failed to grow code buffer\n");
+        exit(1);
+    }
+    *cap = new_cap;
+    return buffer;
+}
+
+void code_init(code_t *co) {
+    co->constants = NULL;
+    co->code = NULL;
+    co->pi = 0;
+    co->ki = 0;
+    co->code_cap = 0;
+    co->constants_cap = 0;
+    co->constants_index_cap = 64;
+    co->constants_index = (int*)calloc(co->constants_index_cap, sizeof(int));
+    co->nregs = 0;
+    co->nparams = 0;
+    co->nlocals = 0;
+    co->name = -1;
+    co->module = co;
+    co->natives = NULL;
+    co->protos = NULL;
+    co->nprotos = 0;
+    co->protos_cap = 0;
+    co->globals = NULL;
+    co->nglobals = 0;
+    co->globals_cap = 0;
+    co->global_slots = NULL;
+    co->global_slots_cap = 0;
+    co->folded = 0;
+    co->ra = NULL;
+    co->image = NULL;
+    co->image_size = 0;
+}
+
+// GC root callback for a module: its units' constants and its globals.
+void code_visit_roots(void *ctx) {
+    code_t *co = (code_t*)ctx;
+    for (int i = 0; i < co->ki; ++i) {
+        rt_gc_visit(&co->constants[i]);
+    }
+    for (int i = 0; i < co->nglobals; ++i) {
+        rt_gc_visit(&co->globals[i]);
+    }
+    for (int i = 0; i < co->nprotos; ++i) {
+        code_visit_roots(co->protos[i]);
+    }
+}
+
+void code_free(code_t *co) {
+    if (co->module == co) {
+        rt_gc_remove_root(code_visit_roots, co);
+    }
+    for (int i = 0; i < co->nprotos; ++i) {
+        code_free(co->protos[i]);
+    }
+    free(co->protos);
+    free(co->globals);
+    free(co->global_slots);
+    free(co->constants);
+    if (!co->module->image) {
+        free(co->code);
+    }
+    free(co->constants_index);
+    if (co->image) {
+        munmap(co->image, co->image_size);
+    }
+    free(co);
+}
+
+uint32_t code_hash_constant(val_t v) {
+    if (string_p(v)) {
+        return rt_string_hash(&v);
+    }
+    if (bigint_p(v)) {
+        return rt_bigint_hash(v);
+    }
+    uint64_t h = v.bits * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+void code_rehash_constants(code_t *co) {
+    int new_cap = co->constants_index_cap * 2;
+    int *index = (int*)calloc(new_cap, sizeof(int));
+    if (!index) {
+        fprintf(stderr, "failed to grow constant index\n");
+        exit(1);
+    }
+    for (int k = 0; k < co->ki; ++k) {
+        int ix = code_hash_constant(co->constants[k]) & (new_cap - 1);
+        while (index[ix]) {
+            ix = (ix + 1) & (new_cap - 1);
+        }
+        index[ix] = k + 1;
+    }
+    free(co->constants_index);
+    co->constants_index = index;
+    co->constants_index_cap = new_cap;
+}
+
+// Returns a copy of heap string `v` on the heap, where it lives for as
+// long as this unit's constant table refers to it. Literals point into
+// the session arena, which doesn't outlive compilation.
+val_t code_own_string(code_t *co, val_t v) {
+    rt_string_t *src = string_val(v);
+    rt_string_t *str = rt_gc_alloc_string(src->length, 1);
+    memcpy(str->str, src->str, src->length);
+    str->hash = src->hash;
+    return mk_string(str);
+}
+
+// As code_own_string, for a bigint literal.
+val_t code_own_bigint(code_t *co, val_t v) {
+    rt_bigint_t *src = bigint_val(v);
+    size_t size = sizeof(rt_bigint_t) + sizeof(uint32_t) * src->nlimbs;
+    rt_bigint_t *big = (rt_bigint_t*)rt_gc_alloc_old(T_BIGINT, size);
+    memcpy(big, src, size);
+    return mk_bigint(big);
+}
+
+// Returns the pool index of `v`, adding it if it isn't already present.
+// Constants are compared by representation, except that strings and
+// bigints are compared by contents: a literal that isn't inline is copied
+// onto the heap (see code_own_string) the first time it's added, and
+// every later literal with the same contents shares that copy.
+int code_add_constant(code_t *co, val_t v) {
+    int mask = co->constants_index_cap - 1;
+    int ix = code_hash_constant(v) & mask;
+    while (co->constants_index[ix]) {
+        int k = co->constants_index[ix] - 1;
+        val_t existing = co->constants[k];
+        if (existing.bits == v.bits
+            || (string_p(existing) && string_p(v) && rt_string_equal(&existing, &v))
+            || (bigint_p(existing) && bigint_p(v) && rt_bigint_equal(existing, v))) {
+            return k;
+        }
+        ix = (ix + 1) & mask;
+    }
+    if (string_p(v) && !inline_string_p(v)) {
+        v = code_own_string(co, v);
+    } else if (bigint_p(v)) {
+        v = code_own_bigint(co, v);
+    }
+    if (co->ki == co->constants_cap) {
+        co->constants = (val_t*)code_grow(co->constants, &co->constants_cap, sizeof(val_t));
+    }
+    int k = co->ki++;
+    co->constants[k] = v;
+    co->constants_index[ix] = k + 1;
+    if (co->ki * 2 > co->constants_index_cap) {
+        code_rehash_constants(co);
+    }
+    return k;
+}
+
+int code_emit(code_t *co, inst_t inst) {
+    if (co->pi == co->code_cap) {
+        co->code = (inst_t*)code_grow(co->code, &co->code_cap, sizeof(inst_t));
+    }
+    co->code[co->pi] = inst;
+    return co->pi++;
+}
+
+void code_check_operand(int operand) {
+    if (operand < 0 || operand > INST_MAX_WIDE) {
+        fprintf(stderr, "instruction operand out of range: %d\n", operand);
+        exit(1);
+    }
+}
+
+// Each emit_* function emits an instruction of the corresponding format,
+// preceded by an OP_EXT prefix if required, and returns its index.
+
+int emit_abc(code_t *co, opcode_t op, int a, int b, int c) {
+    code_check_operand(a);
+    code_check_operand(b);
+    code_check_operand(c);
+    if ((a | b | c) > 0xFF) {
+        code_emit(co, OP_EXT | ((a >> 8) << 16) | ((b >> 8) << 8) | (c >> 8));
+    }
+    return code_emit(co, op | ((a & 0xFF) << 16) | ((b & 0xFF) << 8) | (c & 0xFF));
+}
+
+int emit_ac(code_t *co, opcode_t op, int a, int c) {
+    return emit_abc(co, op, a, 0, c);
+}
+
+int emit_c(code_t *co, opcode_t op, int c) {
+    return emit_abc(co, op, 0, 0, c);
+}
+
+int emit_n(code_t *co, opcode_t op) {
+    return code_emit(co, op);
+}
+
+int emit_ak(code_t *co, opcode_t op, int a, uint32_t k) {
+    code_check_operand(a);
+    if (a > 0xFF || k > 0xFFFF) {
+        code_emit(co, OP_EXT | ((a >> 8) << 16) | (k >> 16));
+    }
+    return code_emit(co, op | ((a & 0xFF) << 16) | (k & 0xFFFF));
+}
+
+// Emits a jump to the already-known instruction index `target`.
+int emit_j(code_t *co, opcode_t op, int target) {
+    // the offset is relative to the instruction after the jump, which
+    // moves along by one if we need a prefix
+    int offset = target - (co->pi + 1);
+    if (offset < INST_SJ_MIN || offset > INST_SJ_MAX) {
+        offset--;
+        code_emit(co, OP_EXT | ((((uint32_t)offset >> 24) & 0xFF) << 16));
+    }
+    return code_emit(co, op | ((uint32_t)offset & 0x00FFFFFF));
+}
+
+// Emits a conditional jump on register `a` to the already-known
+// instruction index `target`.
+int emit_aj(code_t *co, opcode_t op, int a, int target) {
+    code_check_operand(a);
+    int offset = target - (co->pi + 1);
+    if (a > 0xFF || offset < INT16_MIN || offset > INT16_MAX) {
+        offset = target - (co->pi + 2);
+        code_emit(co, OP_EXT | ((a >> 8) << 16) | (((uint32_t)offset >> 16) & 0xFFFF));
+    }
+    return code_emit(co, op | ((a & 0xFF) << 16) | ((uint32_t)offset & 0xFFFF));
+}
+
+// Reserves an unconditional forward jump; the target is filled in later by
+// code_patch_aj().
+int emit_j_forward(code_t *co, opcode_t op) {
+    return code_emit(co, op);
+}
+
+// Reserves a conditional forward jump on register `a`; the target is filled
+// in later by code_patch_aj().
+int emit_aj_forward(code_t *co, opcode_t op, int a) {
+    code_check_operand(a);
+    if (a > 0xFF) {
+        code_emit(co, OP_EXT | ((a >> 8) << 16));
+    }
+    return code_emit(co, op | ((a & 0xFF) << 16));
+}
+
+// Returns the offset of the J or AJ format jump at `p`.
+int code_jump_offset(code_t *co, int p) {
+    inst_t inst = co->code[p];
+    int prefixed = p > 0 && INST_OP(co->code[p - 1]) == OP_EXT;
+    if (INST_FMT(inst) == FMT_J) {
+        return prefixed
+            ? (int32_t)((INST_A(co->code[p - 1]) << 24) | (inst & 0x00FFFFFF))
+            : INST_SJ(inst);
+    } else {
+        return prefixed
+            ? (int32_t)((INST_K(co->code[p - 1]) << 16) | INST_K(inst))
+            : INST_SK(inst);
+    }
+}
+
+// Rewrites the offset of the jump at `p`, which must fit the jump's
+// existing encoding. Returns 0 if it doesn't.
+int code_set_jump_offset(code_t *co, int p, int offset) {
+    inst_t inst = co->code[p];
+    int prefixed = p > 0 && INST_OP(co->code[p - 1]) == OP_EXT;
+    if (INST_FMT(inst) == FMT_J) {
+        if (prefixed) {
+            co->code[p - 1] = (co->code[p - 1] & 0xFF00FFFF) | ((((uint32_t)offset >> 24) & 0xFF) << 16);
+        } else if (offset < INST_SJ_MIN || offset > INST_SJ_MAX) {
+            return 0;
+        }
+        co->code[p] = (inst & 0xFF000000) | ((uint32_t)offset & 0x00FFFFFF);
+    } else {
+        if (prefixed) {
+            co->code[p - 1] = (co->code[p - 1] & 0xFFFF0000) | (((uint32_t)offset >> 16) & 0xFFFF);
+        } else if (offset < INT16_MIN || offset > INT16_MAX) {
+            return 0;
+        }
+        co->code[p] = (inst & 0xFFFF0000) | ((uint32_t)offset & 0xFFFF);
+    }
+    return 1;
+}
+
+// Points the forward jump at `at` to `target`. If the offset is too long
+// for the short encoding and the jump has no prefix yet, one is inserted
+// by shifting everything from `at` onwards up by one instruction, and every
+// other jump whose path crosses the insertion point (a loop's back edge
+// from inside the shifted range, or an earlier forward jump over `at`) is
+// adjusted to match. Jumps still waiting to be patched aren't affected.
+// `target` is given in terms of the code as it was before any insertion.
+// Returns the number of instructions inserted.
+int code_patch_aj(code_t *co, int at, int target) {
+    int offset = target - (at + 1);
+    if (code_set_jump_offset(co, at, offset)) {
+        return 0;
+    }
+    code_emit(co, 0);
+    memmove(&co->code[at + 1], &co->code[at], sizeof(inst_t) * (co->pi - at - 1));
+    co->code[at] = OP_EXT;
+    for (int p = 0; p < co->pi; ++p) {
+        if (p == at || p == at + 1) continue;
+        int fmt = INST_FMT(co->code[p]);
+        if (fmt != FMT_J && fmt != FMT_AJ) continue;
+        int jump_offset = code_jump_offset(co, p);
+        int adjusted = jump_offset;
+        if (p < at && p + 1 + jump_offset > at) {
+            adjusted++;
+        } else if (p > at && p + jump_offset <= at) {
+            // p + jump_offset is the target before the shift
+            adjusted--;
+        }
+        if (adjusted != jump_offset && !code_set_jump_offset(co, p, adjusted)) {
+            fprintf(stderr, "jump too long after relocation\n");
+            exit(1);
+        }
+    }
+    // both the jump and its target have moved by one, so the offset stands
+    code_set_jump_offset(co, at + 1, offset);
+    return 1;
+}
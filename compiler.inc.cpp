@@ -0,0 +1,546 @@
+/**
+ * Next steps
+ *
+ * 1. decorate AST
+ */
+
+int compile_exp(val_t exp, code_t *code);
+int compile_call(ast_call_t *call, code_t *co);
+void compile_print(val_t exp, code_t *co);
+void compile_while(val_t node, code_t *co);
+void compile_if(val_t node, code_t *co);
+void compile_return(val_t node, code_t *co);
+
+void compile_statements(val_t stmt, code_t *code) {
+    while (!nil_p(stmt)) {
+        val_t subj = ((ast_list_t*)ast_val(stmt))->exp;
+        switch (ast_p(subj) ? ast_type(subj) : -1) {
+            case AST_PRINT:
+                compile_print(subj, code);
+                break;
+            case AST_WHILE:
+                compile_while(subj, code);
+                break;
+            case AST_IF:
+                compile_if(subj, code);
+                break;
+            case AST_RETURN:
+                compile_return(subj, code);
+                break;
+            case AST_FN_DEF:
+                // hoisted; compiled separately by compile()
+                break;
+            default:
+                {
+                    int reg = compile_exp(subj, code);
+                    ra_free(code->ra, reg);
+                }
+                break;
+        }
+        stmt = ((ast_list_t*)ast_val(stmt))->next;
+    }
+}
+
+// Returns the slot of global `sym` in `module`, or -1 if there isn't one.
+int compile_global_slot(code_t *module, int sym) {
+    if (sym < module->global_slots_cap) {
+        return module->global_slots[sym] - 1;
+    }
+    return -1;
+}
+
+// Adds a global named `sym` to `module`, returning its slot.
+int compile_define_global(code_t *module, int sym, val_t value) {
+    if (compile_global_slot(module, sym) >= 0) {
+        fprintf(stderr, "duplicate definition of global: %s\n", rt_intern_name(sym));
+        exit(1);
+    }
+    if (sym >= module->global_slots_cap) {
+        int cap = module->global_slots_cap ? module->global_slots_cap : 64;
+        while (cap <= sym) cap *= 2;
+        module->global_slots = (int*)realloc(module->global_slots, sizeof(int) * cap);
+        if (!module->global_slots) {
+            fprintf(stderr, "failed to allocate global table\n");
+            exit(1);
+        }
+        for (int i = module->global_slots_cap; i < cap; ++i) {
+            module->global_slots[i] = 0;
+        }
+        module->global_slots_cap = cap;
+    }
+    if (module->nglobals == module->globals_cap) {
+        module->globals = (val_t*)code_grow(module->globals, &module->globals_cap, sizeof(val_t));
+    }
+    int slot = module->nglobals++;
+    module->globals[slot] = value;
+    module->global_slots[sym] = slot + 1;
+    return slot;
+}
+
+// Unbinds the name `sym` in `module`. Its slot keeps its value, for code
+// that refers to the slot directly.
+void compile_undefine_global(code_t *module, int sym) {
+    if (sym < module->global_slots_cap) {
+        module->global_slots[sym] = 0;
+    }
+}
+
+// Gives `co` a register allocator for the duration of its compilation,
+// with the module's globals visible to it.
+void compile_begin(code_t *co) {
+    co->ra = (regalloc_t*)malloc(sizeof(regalloc_t));
+    if (!co->ra) {
+        fprintf(stderr, "failed to allocate register allocator\n");
+        exit(1);
+    }
+    ra_init(co->ra);
+    ra_set_globals(co->ra, co->module->global_slots, co->module->global_slots_cap);
+}
+
+void compile_end(code_t *co) {
+    co->nregs = co->ra->nregs;
+    free(co->ra->sym_regs);
+    free(co->ra);
+    co->ra = NULL;
+}
+
+// Compiles both operands of a binary operator, in Sethi-Ullman order when
+// that's allowed.
+void compile_operands(ast_binop_t *op, code_t *co, int *lreg, int *rreg) {
+    if (ra_need(op->r) > ra_need(op->l) && ra_pure_p(op->l) && ra_pure_p(op->r)) {
+        *rreg = compile_exp(op->r, co);
+        *lreg = compile_exp(op->l, co);
+    } else {
+        *lreg = compile_exp(op->l, co);
+        *rreg = compile_exp(op->r, co);
+    }
+}
+
+// Returns the pool index of `v` if it's an integer literal that can be
+// encoded as a K operand, otherwise -1.
+int compile_k_operand(val_t v, code_t *co) {
+    if (!int_p(v)) {
+        return -1;
+    }
+    int k = code_add_constant(co, v);
+    return k <= INST_MAX_WIDE ? k : -1;
+}
+
+// Returns the register-constant form of arithmetic opcode `op`, or 0.
+opcode_t compile_k_opcode(opcode_t op) {
+    switch (op) {
+        case OP_ADD:    return OP_ADDK;
+        case OP_SUB:    return OP_SUBK;
+        case OP_MUL:    return OP_MULK;
+        default:        return (opcode_t)0;
+    }
+}
+
+// Returns the comparison `b op a` equivalent to `a op b`.
+opcode_t compile_swap_compare(opcode_t op) {
+    switch (op) {
+        case OP_LT:     return OP_GT;
+        case OP_LE:     return OP_GE;
+        case OP_GT:     return OP_LT;
+        case OP_GE:     return OP_LE;
+        default:        return op;
+    }
+}
+
+// Emits a jump that's taken when `cond` is false, to be pointed at its
+// target with code_patch_aj(), and returns its index. Comparisons branch
+// directly with a fused compare-and-branch instruction instead of
+// materialising a boolean for OP_JMPF.
+int compile_jump_unless(val_t cond, code_t *co) {
+    ast_binop_t *op = NULL;
+    opcode_t opcode = (opcode_t)0;
+    if (ast_p(cond) && ast_type(cond) == AST_BIN_OP) {
+        op = (ast_binop_t*)ast_val(cond);
+        if (op->op & OPERATOR_SIMPLE_BINOP_MASK) {
+            opcode = rt_simple_binop_opcodes[op->op & ~OPERATOR_SIMPLE_BINOP_MASK];
+        }
+    }
+    switch (opcode) {
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NEQ:
+            break;
+        default:
+            {
+                int reg = compile_exp(cond, co);
+                ra_free(co->ra, reg);
+                return emit_aj_forward(co, OP_JMPF, reg);
+            }
+    }
+    val_t l = op->l, r = op->r;
+    if (int_p(l) && !int_p(r)) {
+        l = op->r;
+        r = op->l;
+        opcode = compile_swap_compare(opcode);
+    }
+    int k = compile_k_operand(r, co);
+    if (k >= 0) {
+        int lreg = compile_exp(l, co);
+        ra_free(co->ra, lreg);
+        opcode_t fused;
+        switch (opcode) {
+            case OP_LT:     fused = OP_LTK_JMPF; break;
+            case OP_LE:     fused = OP_LEK_JMPF; break;
+            case OP_GT:     fused = OP_GTK_JMPF; break;
+            case OP_GE:     fused = OP_GEK_JMPF; break;
+            case OP_EQ:     fused = OP_EQK_JMPF; break;
+            default:        fused = OP_NEQK_JMPF; break;
+        }
+        emit_abc(co, fused, lreg, k, 0);
+    } else {
+        opcode = rt_simple_binop_opcodes[op->op & ~OPERATOR_SIMPLE_BINOP_MASK];
+        int lreg, rreg;
+        compile_operands(op, co, &lreg, &rreg);
+        ra_free(co->ra, lreg);
+        ra_free(co->ra, rreg);
+        // there are no register-register GT/GE forms: swap the operands
+        switch (opcode) {
+            case OP_LT:     emit_abc(co, OP_LT_JMPF, lreg, rreg, 0); break;
+            case OP_LE:     emit_abc(co, OP_LE_JMPF, lreg, rreg, 0); break;
+            case OP_GT:     emit_abc(co, OP_LT_JMPF, rreg, lreg, 0); break;
+            case OP_GE:     emit_abc(co, OP_LE_JMPF, rreg, lreg, 0); break;
+            case OP_EQ:     emit_abc(co, OP_EQ_JMPF, lreg, rreg, 0); break;
+            default:        emit_abc(co, OP_NEQ_JMPF, lreg, rreg, 0); break;
+        }
+    }
+    return emit_j_forward(co, OP_JMP);
+}
+
+// Returns the index of the native that `callee` names, or -1 if it isn't
+// the name of a native (or is shadowed by a local).
+int compile_native(val_t callee, code_t *co) {
+    if (!ident_p(callee) || ra_local(co->ra, ident_val(callee)) >= 0) {
+        return -1;
+    }
+    int slot = compile_global_slot(co->module, ident_val(callee));
+    return slot < co->module->natives->nnatives ? slot : -1;
+}
+
+// Evaluates each of `args` into consecutive registers from `base`.
+void compile_args(val_t args, int base, code_t *co) {
+    while (!nil_p(args)) {
+        int reg = compile_exp(((ast_list_t*)ast_val(args))->exp, co);
+        emit_ac(co, OP_COPY, base++, reg);
+        ra_free(co->ra, reg);
+        args = ((ast_list_t*)ast_val(args))->next;
+    }
+}
+
+// Compiles a call to a builtin as its intrinsic opcode. Intrinsics take
+// up to two operands; those that define no register produce no value, so
+// the call evaluates to nil. Variadic intrinsics are compiled by
+// compile_call() instead.
+int compile_intrinsic(opcode_t opcode, val_t args, code_t *co) {
+    int regs[2] = { 0, 0 };
+    int n = 0;
+    while (!nil_p(args)) {
+        regs[n++] = compile_exp(((ast_list_t*)ast_val(args))->exp, co);
+        args = ((ast_list_t*)ast_val(args))->next;
+    }
+    for (int i = 0; i < n; ++i) {
+        ra_free(co->ra, regs[i]);
+    }
+    if (!(opcode_effects[opcode >> OP_SHIFT] & E_DA)) {
+        if (opcode_formats[opcode >> OP_SHIFT] == FMT_N) {
+            emit_n(co, opcode);
+        } else if (opcode_formats[opcode >> OP_SHIFT] == FMT_C) {
+            emit_c(co, opcode, regs[0]);
+        } else {
+            emit_ac(co, opcode, regs[0], regs[1]);
+        }
+        return compile_exp(mk_nil(), co);
+    }
+    int dst = ra_alloc(co->ra);
+    if (opcode_formats[opcode >> OP_SHIFT] == FMT_AC) {
+        emit_ac(co, opcode, dst, regs[0]);
+    } else {
+        emit_abc(co, opcode, dst, regs[0], regs[1]);
+    }
+    return dst;
+}
+
+int compile_call(ast_call_t *call, code_t *co) {
+    int nargs = ast_list_len(call->args);
+    int native = compile_native(call->callee, co);
+    if (native >= 0) {
+        const rt_native_t *fn = &co->module->natives->natives[native];
+        if (fn->arity != NATIVE_VARIADIC && fn->arity != nargs) {
+            fprintf(stderr, "%s expects %d argument(s), got %d\n", fn->name, fn->arity, nargs);
+            exit(1);
+        }
+        if (fn->intrinsic && fn->arity != NATIVE_VARIADIC) {
+            return compile_intrinsic((opcode_t)fn->intrinsic, call->args, co);
+        }
+        // natives are called in place, with the result replacing the
+        // first argument; variadic intrinsics take their arguments the
+        // same way
+        int base = ra_alloc_block(co->ra, nargs ? nargs : 1);
+        compile_args(call->args, base, co);
+        for (int i = 1; i < nargs; ++i) {
+            ra_free(co->ra, base + i);
+        }
+        if (fn->intrinsic) {
+            emit_abc(co, (opcode_t)fn->intrinsic, base, nargs, 0);
+        } else {
+            emit_abc(co, OP_CALLN, base, nargs, native);
+        }
+        return base;
+    }
+
+    int r_callee = ra_alloc_frame(co->ra, nargs + 1);
+    int r_callee_val = compile_exp(call->callee, co);
+    emit_ac(co, OP_COPY, r_callee, r_callee_val);
+    ra_free(co->ra, r_callee_val);
+    compile_args(call->args, r_callee + 1, co);
+    for (int i = 1; i <= nargs; ++i) {
+        ra_free(co->ra, r_callee + i);
+    }
+    // the callee slot is dead once the call is made, so the result goes
+    // there
+    emit_abc(co, OP_CALL, r_callee, nargs, r_callee);
+    return r_callee;
+}
+
+// Returns the register holding the value of `val`. The caller owns the
+// register and must ra_free() it once it has been consumed; this is a
+// no-op for registers pinned to locals. Expressions that can't be
+// compiled yet evaluate to nil.
+int compile_exp(val_t val, code_t *co) {
+    // printf("compile exp: %d\n", ast_type(val));
+    if (ident_p(val)) {
+        int reg = ra_local(co->ra, ident_val(val));
+        if (reg < 0) {
+            reg = ra_alloc(co->ra);
+            emit_ak(co, OP_GETG, reg, compile_global_slot(co->module, ident_val(val)));
+        }
+        return reg;
+    } else if (!ast_p(val)) {
+        int constant = code_add_constant(co, val);
+        int dst = ra_alloc(co->ra);
+        emit_ak(co, OP_LOADK, dst, constant);
+        return dst;
+    } else {
+        if (ast_type(val) == AST_BIN_OP) {
+            ast_binop_t *op = (ast_binop_t*)ast_val(val);
+            if (op->op & OPERATOR_SIMPLE_BINOP_MASK) {
+                opcode_t opcode = rt_simple_binop_opcodes[op->op & ~OPERATOR_SIMPLE_BINOP_MASK];
+                opcode_t kopcode = compile_k_opcode(opcode);
+                val_t l = op->l, r = op->r;
+                if ((opcode == OP_ADD || opcode == OP_MUL) && int_p(l)) {
+                    l = op->r;
+                    r = op->l;
+                }
+                int k = kopcode ? compile_k_operand(r, co) : -1;
+                if (k >= 0) {
+                    int lreg = compile_exp(l, co);
+                    ra_free(co->ra, lreg);
+                    int oreg = ra_alloc(co->ra);
+                    emit_abc(co, kopcode, oreg, lreg, k);
+                    return oreg;
+                }
+                int lreg, rreg;
+                compile_operands(op, co, &lreg, &rreg);
+                ra_free(co->ra, lreg);
+                ra_free(co->ra, rreg);
+                int oreg = ra_alloc(co->ra);
+                emit_abc(co, opcode, oreg, lreg, rreg);
+                return oreg;
+            } else if (op->op == OPERATOR_ASSIGN) {
+                int dst = ra_local(co->ra, ident_val(op->l));
+                if (dst < 0) {
+                    fprintf(stderr, "cannot assign to global: %s\n", rt_intern_name(ident_val(op->l)));
+                    exit(1);
+                }
+                int src = compile_exp(op->r, co);
+                emit_ac(co, OP_COPY, dst, src);
+                ra_free(co->ra, src);
+                return dst;
+            }
+        } else if (ast_type(val) == AST_CALL) {
+            return compile_call((ast_call_t*)ast_val(val), co);
+        }
+        printf("unknown AST type for expression: %d\n", ast_type(val));
+        return compile_exp(mk_nil(), co);
+    }
+}
+
+void compile_print(val_t exp, code_t *co) {
+    int reg = compile_exp(((ast_print_t*)ast_val(exp))->exp, co);
+    emit_c(co, OP_PRINT, reg);
+    ra_free(co->ra, reg);
+}
+
+void compile_return(val_t node, code_t *co) {
+    if (co->module == co) {
+        fprintf(stderr, "return outside of a function\n");
+        exit(1);
+    }
+    int reg = compile_exp(((ast_return_t*)ast_val(node))->exp, co);
+    emit_c(co, OP_RET, reg);
+    ra_free(co->ra, reg);
+}
+
+void compile_while(val_t node, code_t *co) {
+    ast_while_t *loop = (ast_while_t*)ast_val(node);
+    int start = co->pi;
+    if (fold_always_p(loop->cond)) {
+        compile_statements(loop->body, co);
+        emit_j(co, OP_JMP, start);
+        return;
+    }
+    int jumper = compile_jump_unless(loop->cond, co);
+    compile_statements(loop->body, co);
+    emit_j(co, OP_JMP, start);
+    code_patch_aj(co, jumper, co->pi);
+}
+
+// Compiles the if chain starting at `node`. Each clause tests its condition
+// and skips to the next clause if it's false; a taken clause jumps past
+// the rest of the chain when its body is done. A clause without a
+// condition is the final else.
+void compile_if(val_t node, code_t *co) {
+    ast_if_t *clause = (ast_if_t*)ast_val(node);
+    if (fold_null_p(clause->cond)) {
+        compile_statements(clause->body, co);
+        return;
+    }
+    int jumper = compile_jump_unless(clause->cond, co);
+    compile_statements(clause->body, co);
+    if (fold_null_p(clause->next)) {
+        code_patch_aj(co, jumper, co->pi);
+        return;
+    }
+    int done = emit_j_forward(co, OP_JMP);
+    done += code_patch_aj(co, jumper, co->pi);
+    compile_if(clause->next, co);
+    code_patch_aj(co, done, co->pi);
+}
+
+// Compiles the body of function `def` into `fn`. Parameters take the
+// first registers, which is where the caller leaves the arguments.
+void compile_fn(ast_fn_def_t *def, code_t *fn) {
+    compile_begin(fn);
+    val_t param = def->params;
+    while (!nil_p(param)) {
+        ra_bind(fn->ra, ident_val(((ast_list_t*)ast_val(param))->exp), fn->nparams++);
+        param = ((ast_list_t*)ast_val(param))->next;
+    }
+    ra_declare_locals(fn->ra, def->body);
+    fn->nlocals = fn->ra->nregs;
+
+    compile_statements(def->body, fn);
+
+    // falling off the end returns nil
+    int reg = compile_exp(mk_nil(), fn);
+    emit_c(fn, OP_RET, reg);
+    ra_free(fn->ra, reg);
+    compile_end(fn);
+}
+
+// Creates an empty module in which every native in `natives` is visible
+// as a global, native i being global slot i.
+code_t *compile_new_module(const rt_natives_t *natives) {
+    code_t *co = (code_t*)malloc(sizeof(code_t));
+    if (!co) {
+        fprintf(stderr, "failed to allocate module\n");
+        exit(1);
+    }
+    code_init(co);
+    rt_gc_add_root(code_visit_roots, co);
+
+    co->natives = natives;
+    for (int i = 0; i < natives->nnatives; ++i) {
+        const char *name = natives->natives[i].name;
+        compile_define_global(co, rt_intern(name, strlen(name)), mk_foreign_fn(natives->natives[i].fn));
+    }
+    return co;
+}
+
+// Adds an empty prototype for function `name` to `module`, defining it as
+// a global. A function may take the name of a native, which then keeps
+// its slot but is no longer visible by name.
+code_t *compile_new_proto(code_t *module, int name) {
+    code_t *fn = (code_t*)malloc(sizeof(code_t));
+    if (!fn) {
+        fprintf(stderr, "failed to allocate function\n");
+        exit(1);
+    }
+    code_init(fn);
+    fn->name = name;
+    fn->module = module;
+    if (module->nprotos == module->protos_cap) {
+        module->protos = (code_t**)code_grow(module->protos, &module->protos_cap, sizeof(code_t*));
+    }
+    module->protos[module->nprotos++] = fn;
+    int slot = compile_global_slot(module, name);
+    if (slot >= 0 && slot < module->natives->nnatives) {
+        compile_undefine_global(module, name);
+    }
+    compile_define_global(module, name, mk_proto(fn));
+    return fn;
+}
+
+// Gives every function defined in `stmts`, at any depth, a prototype in
+// `module` and a global slot holding it. Definitions are hoisted, so
+// functions can be called before (and from above) their definition.
+void compile_declare_fns(code_t *module, val_t stmts, ast_fn_def_t ***defs) {
+    for (val_t stmt = stmts; !nil_p(stmt); stmt = ((ast_list_t*)ast_val(stmt))->next) {
+        val_t subj = ((ast_list_t*)ast_val(stmt))->exp;
+        switch (ast_p(subj) ? ast_type(subj) : -1) {
+            case AST_WHILE:
+                compile_declare_fns(module, ((ast_while_t*)ast_val(subj))->body, defs);
+                break;
+            case AST_IF:
+                for (val_t clause = subj; !fold_null_p(clause); clause = ((ast_if_t*)ast_val(clause))->next) {
+                    compile_declare_fns(module, ((ast_if_t*)ast_val(clause))->body, defs);
+                }
+                break;
+            case AST_FN_DEF:
+                {
+                    ast_fn_def_t *def = (ast_fn_def_t*)ast_val(subj);
+                    if (module->nprotos == module->protos_cap) {
+                        *defs = (ast_fn_def_t**)realloc(*defs, sizeof(ast_fn_def_t*) * (module->protos_cap ? module->protos_cap * 2 : 64));
+                        if (!*defs) {
+                            fprintf(stderr, "failed to allocate function list\n");
+                            exit(1);
+                        }
+                    }
+                    (*defs)[module->nprotos] = def;
+                    compile_new_proto(module, def->name);
+                    compile_declare_fns(module, def->body, defs);
+                }
+                break;
+        }
+    }
+}
+
+// Compiles module `program`. Every native in `natives` is visible to it
+// as a global, native i being global slot i.
+code_t* compile(val_t program, const rt_natives_t *natives) {
+    code_t *co = compile_new_module(natives);
+
+    fold_t fold = { 0 };
+    program = fold_statements(&fold, program);
+    co->folded = fold.folded;
+
+    ast_fn_def_t **defs = NULL;
+    compile_declare_fns(co, program, &defs);
+
+    compile_begin(co);
+    ra_declare_locals(co->ra, program);
+    co->nlocals = co->ra->nregs;
+    compile_statements(program, co);
+
+    emit_n(co, OP_HALT);
+    compile_end(co);
+
+    for (int i = 0; i < co->nprotos; ++i) {
+        compile_fn(defs[i], co->protos[i]);
+    }
+    free(defs);
+
+    return co;
+}
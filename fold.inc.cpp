@@ -0,0 +1,254 @@
+// Constant folding
+//
+// Runs over a module's AST before it's compiled, rewriting it in place.
+// Operators whose operands are integer literals are evaluated here and
+// replaced with their result, so e.g. `(1 + 2) * 3` compiles to a single
+// load. Each operator is evaluated exactly as the VM would evaluate the
+// opcode it maps to in rt_simple_binop_opcodes; anything the VM could
+// fault on (division by zero) is left for run time.
+//
+// Conditions that fold to a constant resolve control flow statically, using
+// the VM's notion of truth (only nil and false are false):
+//
+//   - a while loop with a false condition is dropped
+//   - an if/else if clause with a false condition is dropped from its
+//     chain, and one with a true condition becomes the chain's final else
+//   - an if statement left with no clauses is dropped
+//
+// The number of nodes folded away is recorded in fold_t.folded.
+
+typedef struct {
+    int folded;
+} fold_t;
+
+val_t fold_exp(fold_t *fold, val_t exp);
+val_t fold_statements(fold_t *fold, val_t stmts);
+
+// The condition of an if chain's final else.
+int fold_null_p(val_t exp) {
+    return ast_p(exp) && ast_val(exp) == NULL;
+}
+
+// Returns non-zero if `exp` is a literal whose value is known now.
+int fold_constant_p(val_t exp) {
+    return !ast_p(exp) && !ident_p(exp);
+}
+
+// An absent condition (the final else of an if chain) is always taken.
+int fold_always_p(val_t cond) {
+    return fold_null_p(cond) || (fold_constant_p(cond) && truthy_p(cond));
+}
+
+int fold_never_p(val_t cond) {
+    return fold_constant_p(cond) && !truthy_p(cond);
+}
+
+// Evaluates `l op r` into `out`. Returns 0 if it can't be done now,
+// which includes any result that wouldn't fit inline: the VM promotes
+// those to bigints, which have no place in the AST.
+int fold_binop(opcode_t opcode, val_t l, val_t r, val_t *out) {
+    if (!int_p(l) || !int_p(r)) {
+        return 0;
+    }
+    int64_t x = int_val(l), y = int_val(r), v;
+    switch (opcode) {
+        case OP_ADD:    v = x + y; break;
+        case OP_SUB:    v = x - y; break;
+        case OP_MUL:
+            if (__builtin_mul_overflow(x, y, &v)) return 0;
+            break;
+        case OP_POW:
+            if (y < 1 || x == 0 || x == 1 || x == -1) {
+                v = y < 1 || (x == -1 && (y & 1) == 0) ? 1 : x;
+                break;
+            }
+            // square and multiply, one step per bit of the exponent
+            v = 1;
+            for (int64_t exp = y;;) {
+                if ((exp & 1) && (__builtin_mul_overflow(v, x, &v) || !int_fits_p(v))) return 0;
+                if ((exp >>= 1) == 0) break;
+                if (__builtin_mul_overflow(x, x, &x)) return 0;
+            }
+            break;
+        case OP_DIV:
+            if (y == 0) {
+                return 0;
+            }
+            v = x / y;
+            break;
+        case OP_LT:     *out = mk_bool(x <  y); return 1;
+        case OP_LE:     *out = mk_bool(x <= y); return 1;
+        case OP_GT:     *out = mk_bool(x >  y); return 1;
+        case OP_GE:     *out = mk_bool(x >= y); return 1;
+        case OP_EQ:     *out = mk_bool(x == y); return 1;
+        case OP_NEQ:    *out = mk_bool(x != y); return 1;
+        default:        return 0;
+    }
+    if (!int_fits_p(v)) {
+        return 0;
+    }
+    *out = mk_int(v);
+    return 1;
+}
+
+int fold_unop(operator_t op, val_t v, val_t *out) {
+    switch (op) {
+        case OPERATOR_UNPLUS:
+            if (!int_p(v) && !float_p(v)) return 0;
+            *out = v;
+            return 1;
+        case OPERATOR_UNMINUS:
+            if (float_p(v)) {
+                *out = mk_float(-float_val(v));
+                return 1;
+            }
+            if (!int_p(v) || !int_fits_p(-int_val(v))) return 0;
+            *out = mk_int(-int_val(v));
+            return 1;
+        case OPERATOR_NEGATE:
+            if (!fold_constant_p(v)) return 0;
+            *out = mk_bool(!truthy_p(v));
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+val_t fold_exp(fold_t *fold, val_t exp) {
+    if (!ast_p(exp) || fold_null_p(exp)) {
+        return exp;
+    }
+    ast_node_t *node = ast_val(exp);
+    val_t out;
+    switch (node->type) {
+        case AST_BIN_OP:
+            {
+                ast_binop_t *op = (ast_binop_t*)node;
+                if (op->op != OPERATOR_ASSIGN) {
+                    op->l = fold_exp(fold, op->l);
+                }
+                op->r = fold_exp(fold, op->r);
+                if ((op->op & OPERATOR_SIMPLE_BINOP_MASK)
+                    && fold_binop(rt_simple_binop_opcodes[op->op & ~OPERATOR_SIMPLE_BINOP_MASK], op->l, op->r, &out)) {
+                    fold->folded++;
+                    return out;
+                }
+            }
+            break;
+        case AST_UN_OP:
+            {
+                ast_unop_t *op = (ast_unop_t*)node;
+                op->exp = fold_exp(fold, op->exp);
+                if (fold_unop(op->op, op->exp, &out)) {
+                    fold->folded++;
+                    return out;
+                }
+            }
+            break;
+        case AST_CALL:
+            {
+                ast_call_t *call = (ast_call_t*)node;
+                call->callee = fold_exp(fold, call->callee);
+                for (val_t arg = call->args; !nil_p(arg); arg = ((ast_list_t*)ast_val(arg))->next) {
+                    ast_list_t *item = (ast_list_t*)ast_val(arg);
+                    item->exp = fold_exp(fold, item->exp);
+                }
+            }
+            break;
+    }
+    return exp;
+}
+
+// Folds the clauses of the if chain starting at `clause`, returning the
+// new head of the chain, or mk_null() if no clause can ever be taken.
+val_t fold_if(fold_t *fold, val_t clause) {
+    while (!fold_null_p(clause)) {
+        ast_if_t *node = (ast_if_t*)ast_val(clause);
+        node->cond = fold_exp(fold, node->cond);
+        if (fold_never_p(node->cond)) {
+            fold->folded++;
+            clause = node->next;
+            continue;
+        }
+        node->body = fold_statements(fold, node->body);
+        if (fold_always_p(node->cond)) {
+            if (!fold_null_p(node->cond)) {
+                fold->folded++;
+                node->cond = mk_null();
+            }
+            node->next = mk_null();
+        } else {
+            node->next = fold_if(fold, node->next);
+        }
+        return clause;
+    }
+    return clause;
+}
+
+// Folds each statement of a statement list, unlinking any that can never
+// execute. Returns the new head of the list.
+val_t fold_statements(fold_t *fold, val_t stmts) {
+    val_t head = stmts;
+    ast_list_t *prev = NULL;
+    while (!nil_p(stmts)) {
+        ast_list_t *item = (ast_list_t*)ast_val(stmts);
+        val_t subj = item->exp;
+        int drop = 0;
+        switch (ast_p(subj) ? ast_type(subj) : -1) {
+            case AST_PRINT:
+                {
+                    ast_print_t *print = (ast_print_t*)ast_val(subj);
+                    print->exp = fold_exp(fold, print->exp);
+                }
+                break;
+            case AST_WHILE:
+                {
+                    ast_while_t *loop = (ast_while_t*)ast_val(subj);
+                    loop->cond = fold_exp(fold, loop->cond);
+                    if (fold_never_p(loop->cond)) {
+                        drop = 1;
+                    } else {
+                        loop->body = fold_statements(fold, loop->body);
+                    }
+                }
+                break;
+            case AST_IF:
+                {
+                    val_t chain = fold_if(fold, subj);
+                    if (fold_null_p(chain)) {
+                        drop = 1;
+                    } else {
+                        item->exp = chain;
+                    }
+                }
+                break;
+            case AST_RETURN:
+                {
+                    ast_return_t *ret = (ast_return_t*)ast_val(subj);
+                    ret->exp = fold_exp(fold, ret->exp);
+                }
+                break;
+            case AST_FN_DEF:
+                {
+                    ast_fn_def_t *def = (ast_fn_def_t*)ast_val(subj);
+                    def->body = fold_statements(fold, def->body);
+                }
+                break;
+            default:
+                item->exp = fold_exp(fold, subj);
+                break;
+        }
+        if (drop) {
+            fold->folded++;
+            if (prev) {
+                prev->next = item->next;
+            } else {
+                head = item->next;
+            }
+        } else {
+            prev = item;
+        }
+        stmts = item->next;
+    }
+    return head;
+}
@@ -0,0 +1,522 @@
+// Garbage collector
+//
+// Precise and generational. Heap objects are allocated from a
+// thread-local bump-pointer nursery. When it fills, a minor collection
+// copies every nursery object reachable from the roots or from the
+// remembered set into the old space (promotion after one survival), then
+// resets the nursery in O(1). The old space is a list of individually
+// allocated objects, collected by mark-sweep in a major collection once
+// it has grown past a threshold; after each major collection the
+// threshold is set to twice the live size, so memory stays proportional
+// to the live data however long a script runs. Objects too big for the
+// nursery, and objects known to be long-lived (constants), are
+// allocated in the old space directly.
+//
+// Roots are supplied by callbacks (rt_gc_add_root), which must call
+// rt_gc_visit() on every val_t slot they own: the VM registers its value
+// stack, and each module its constant tables and globals. Slots are
+// updated in place when the object they refer to moves.
+//
+// Roots are scanned in full by every collection, so storing into them
+// needs no barrier. A val_t field of a heap object must instead be stored
+// with rt_gc_write(), which records old objects that come to refer to
+// young ones; a minor collection treats those objects' fields as roots.
+//
+// Collections happen only inside rt_gc_alloc(). Native code holding an
+// object in a C variable across a second allocation must keep it
+// reachable meanwhile, e.g. in an argument slot. Code that builds a
+// structure of many objects, holding pointers to them all, can instead
+// bracket the work with rt_gc_hold() and rt_gc_release(): while held, a
+// thread never collects, and allocations that don't fit in its nursery go
+// to the old space, where they're remembered (as if written to) until the
+// next collection, so their fields may be stored without rt_gc_write().
+// rt_gc_reserve() beforehand makes that spilling unlikely.
+//
+// Several threads may run scripts at once, each allocating from its own
+// nursery. A thread counts as a mutator between rt_gc_enter() and
+// rt_gc_leave(), and must call rt_gc_safepoint() regularly while it is
+// one. A collection stops the world: the collecting thread waits until
+// every other mutator has reached a safepoint (or left), then promotes
+// from every nursery at once. Root callbacks run on the collecting thread.
+//
+// An object that owns memory or other resources outside the heap can be
+// given a finalizer for its type (rt_gc_set_finalizer), which runs when
+// a major collection frees it. Such objects must be allocated in the old
+// space, since minor collections free the nursery wholesale.
+//
+// Pause times and heap sizes are recorded in rt_gc_stats.
+
+#include <time.h>
+#include <pthread.h>
+
+// Both sizes may be overridden at build time, e.g. to stress the
+// collector with -DRT_GC_NURSERY_SIZE=4096.
+#ifndef RT_GC_NURSERY_SIZE
+#define RT_GC_NURSERY_SIZE  (1 << 20)
+#endif
+#ifndef RT_GC_OLD_THRESHOLD
+#define RT_GC_OLD_THRESHOLD (4 << 20)
+#endif
+#define GC_ALIGN            8
+
+enum {
+    GC_OLD          = 1 << 0,
+    GC_MARKED       = 1 << 1,
+    GC_REMEMBERED   = 1 << 2,
+    GC_FORWARDED    = 1 << 3
+};
+
+// Precedes every heap object; values point just past it.
+typedef struct rt_gc_header {
+    struct rt_gc_header *next;  // old space list; forwarding address once copied
+    uint32_t size;              // of the object, excluding this header
+    uint8_t type;               // T_* of values referring to the object
+    uint8_t flags;
+} rt_gc_header_t;
+
+#define GC_HEADER(obj)      ((rt_gc_header_t*)(obj) - 1)
+#define GC_OBJECT(hdr)      ((void*)((rt_gc_header_t*)(hdr) + 1))
+
+typedef void (*rt_gc_root_f)(void *ctx);
+typedef void (*rt_gc_finalizer_f)(void *obj);
+
+typedef struct {
+    rt_gc_root_f fn;
+    void *ctx;
+} rt_gc_root_t;
+
+typedef struct {
+    long allocated_bytes;
+    long promoted_bytes;
+    long freed_bytes;
+    long old_bytes;             // currently in the old space
+    long old_peak_bytes;
+    int minor_collections;
+    int major_collections;
+    double pause_ms;            // total
+    double max_pause_ms;
+} rt_gc_stats_t;
+
+typedef struct rt_nursery {
+    char *start;
+    char *top;
+    char *end;
+    long allocated;             // bytes, not yet added to rt_gc_stats
+    struct rt_nursery *next;    // every thread's nursery
+} rt_nursery_t;
+
+thread_local rt_nursery_t rt_nursery;
+thread_local int rt_gc_holds;
+
+struct {
+    rt_gc_header_t *old;        // every object in the old space
+    long old_threshold;
+    rt_gc_header_t **remembered;
+    int nremembered;
+    int remembered_cap;
+    rt_gc_header_t **gray;      // promoted or marked objects yet to be traced
+    int ngray;
+    int gray_cap;
+    rt_gc_root_t *roots;
+    int nroots;
+    int roots_cap;
+    rt_gc_finalizer_f finalizers[16];   // by type
+    int major;                  // current collection is a major one
+    rt_nursery_t *nurseries;
+    pthread_mutex_t lock;       // guards everything above outside a collection
+    pthread_cond_t stopped;     // signalled as mutators park or leave
+    int mutators;               // atomic
+    int stop;                   // atomic; a collection is waiting or running
+} rt_gc = { NULL, 0, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, { NULL }, 0, NULL,
+            PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+rt_gc_stats_t rt_gc_stats;
+
+void *gc_grow(void *buffer, int *cap, size_t elem_sz) {
+    int new_cap = *cap ? *cap * 2 : 64;
+    buffer = realloc(buffer, elem_sz * new_cap);
+    if (!buffer) {
+        fprintf(stderr, "failed to grow GC table\n");
+        exit(1);
+    }
+    *cap = new_cap;
+    return buffer;
+}
+
+double gc_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void rt_gc_add_root(rt_gc_root_f fn, void *ctx) {
+    pthread_mutex_lock(&rt_gc.lock);
+    if (rt_gc.nroots == rt_gc.roots_cap) {
+        rt_gc.roots = (rt_gc_root_t*)gc_grow(rt_gc.roots, &rt_gc.roots_cap, sizeof(rt_gc_root_t));
+    }
+    rt_gc.roots[rt_gc.nroots].fn = fn;
+    rt_gc.roots[rt_gc.nroots].ctx = ctx;
+    rt_gc.nroots++;
+    pthread_mutex_unlock(&rt_gc.lock);
+}
+
+void rt_gc_remove_root(rt_gc_root_f fn, void *ctx) {
+    pthread_mutex_lock(&rt_gc.lock);
+    for (int i = rt_gc.nroots - 1; i >= 0; --i) {
+        if (rt_gc.roots[i].fn == fn && rt_gc.roots[i].ctx == ctx) {
+            rt_gc.roots[i] = rt_gc.roots[--rt_gc.nroots];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rt_gc.lock);
+}
+
+void rt_gc_set_finalizer(int type, rt_gc_finalizer_f fn) {
+    rt_gc.finalizers[type] = fn;
+}
+
+// Makes the calling thread a mutator, waiting out any collection in
+// progress.
+void rt_gc_enter() {
+    __atomic_add_fetch(&rt_gc.mutators, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&rt_gc.stop, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&rt_gc.lock);
+        __atomic_sub_fetch(&rt_gc.mutators, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&rt_gc.stopped);
+        while (__atomic_load_n(&rt_gc.stop, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&rt_gc.stopped, &rt_gc.lock);
+        }
+        __atomic_add_fetch(&rt_gc.mutators, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&rt_gc.lock);
+    }
+}
+
+// The calling thread must not touch the heap until it enters again.
+void rt_gc_leave() {
+    __atomic_sub_fetch(&rt_gc.mutators, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rt_gc.stop, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&rt_gc.lock);
+        pthread_cond_broadcast(&rt_gc.stopped);
+        pthread_mutex_unlock(&rt_gc.lock);
+    }
+}
+
+int rt_gc_stop_requested() {
+    return __atomic_load_n(&rt_gc.stop, __ATOMIC_RELAXED);
+}
+
+// Called by mutators at points where they hold no heap pointers outside
+// the roots.
+void rt_gc_safepoint() {
+    if (rt_gc_stop_requested()) {
+        rt_gc_leave();
+        rt_gc_enter();
+    }
+}
+
+int gc_young_p(rt_gc_header_t *hdr) {
+    return !(hdr->flags & GC_OLD);
+}
+
+void gc_push_gray(rt_gc_header_t *hdr) {
+    if (rt_gc.ngray == rt_gc.gray_cap) {
+        rt_gc.gray = (rt_gc_header_t**)gc_grow(rt_gc.gray, &rt_gc.gray_cap, sizeof(rt_gc_header_t*));
+    }
+    rt_gc.gray[rt_gc.ngray++] = hdr;
+}
+
+rt_gc_header_t *gc_alloc_old(int type, size_t size) {
+    rt_gc_header_t *hdr = (rt_gc_header_t*)malloc(sizeof(rt_gc_header_t) + size);
+    if (!hdr) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", size);
+        exit(1);
+    }
+    hdr->size = (uint32_t)size;
+    hdr->type = (uint8_t)type;
+    hdr->flags = GC_OLD;
+    pthread_mutex_lock(&rt_gc.lock);
+    hdr->next = rt_gc.old;
+    rt_gc.old = hdr;
+    rt_gc_stats.old_bytes += size;
+    if (rt_gc_stats.old_bytes > rt_gc_stats.old_peak_bytes) {
+        rt_gc_stats.old_peak_bytes = rt_gc_stats.old_bytes;
+    }
+    pthread_mutex_unlock(&rt_gc.lock);
+    return hdr;
+}
+
+// Copies a young object into the old space, leaving a forwarding address.
+rt_gc_header_t *gc_promote(rt_gc_header_t *hdr) {
+    if (hdr->flags & GC_FORWARDED) {
+        return hdr->next;
+    }
+    rt_gc_header_t *copy = gc_alloc_old(hdr->type, hdr->size);
+    memcpy(GC_OBJECT(copy), GC_OBJECT(hdr), hdr->size);
+    rt_gc_stats.promoted_bytes += hdr->size;
+    hdr->flags |= GC_FORWARDED;
+    hdr->next = copy;
+    gc_push_gray(copy);
+    return copy;
+}
+
+// Called by root callbacks (and for object fields) on each val_t slot.
+void rt_gc_visit(val_t *slot) {
+    if (!heap_p(*slot)) {
+        return;
+    }
+    rt_gc_header_t *hdr = GC_HEADER(heap_val(*slot));
+    if (gc_young_p(hdr)) {
+        hdr = gc_promote(hdr);
+        *slot = heap_rebox(*slot, GC_OBJECT(hdr));
+    }
+    if (rt_gc.major && !(hdr->flags & GC_MARKED)) {
+        hdr->flags |= GC_MARKED;
+        gc_push_gray(hdr);
+    }
+}
+
+// Defined in string.inc.cpp.
+void rt_string_trace(rt_string_t *str);
+
+// Defined in map.inc.cpp and list.inc.cpp.
+void rt_map_trace(void *obj);
+void rt_list_trace(void *obj);
+
+// Visits the val_t fields of an object.
+void gc_trace(rt_gc_header_t *hdr) {
+    switch (hdr->type) {
+        case T_STRING:      // ropes refer to their halves
+            rt_string_trace((rt_string_t*)GC_OBJECT(hdr));
+            break;
+        case T_MAP:         // roots and nodes of maps and sets
+            rt_map_trace(GC_OBJECT(hdr));
+            break;
+        case T_LIST:        // roots and nodes of lists
+            rt_list_trace(GC_OBJECT(hdr));
+            break;
+        case T_CHANNEL:     // buffered values are roots; see chan.inc.cpp
+        default:
+            break;
+    }
+}
+
+// Adds old object `hdr` to the remembered set.
+void gc_remember(rt_gc_header_t *hdr) {
+    pthread_mutex_lock(&rt_gc.lock);
+    if (!(hdr->flags & GC_REMEMBERED)) {
+        hdr->flags |= GC_REMEMBERED;
+        if (rt_gc.nremembered == rt_gc.remembered_cap) {
+            rt_gc.remembered = (rt_gc_header_t**)gc_grow(rt_gc.remembered, &rt_gc.remembered_cap, sizeof(rt_gc_header_t*));
+        }
+        rt_gc.remembered[rt_gc.nremembered++] = hdr;
+    }
+    pthread_mutex_unlock(&rt_gc.lock);
+}
+
+// Stores `v` into `slot`, a field of heap object `obj`.
+void rt_gc_write(void *obj, val_t *slot, val_t v) {
+    *slot = v;
+    rt_gc_header_t *hdr = GC_HEADER(obj);
+    if ((hdr->flags & (GC_OLD | GC_REMEMBERED)) == GC_OLD
+        && heap_p(v) && gc_young_p(GC_HEADER(heap_val(v)))) {
+        gc_remember(hdr);
+    }
+}
+
+void gc_drain_gray() {
+    while (rt_gc.ngray > 0) {
+        gc_trace(rt_gc.gray[--rt_gc.ngray]);
+    }
+}
+
+// Promotes every live young object (and, for a major collection, marks
+// every live object).
+void gc_scan_roots() {
+    for (int i = 0; i < rt_gc.nroots; ++i) {
+        rt_gc.roots[i].fn(rt_gc.roots[i].ctx);
+    }
+    for (int i = 0; i < rt_gc.nremembered; ++i) {
+        rt_gc.remembered[i]->flags &= ~GC_REMEMBERED;
+        gc_trace(rt_gc.remembered[i]);
+    }
+    rt_gc.nremembered = 0;
+    gc_drain_gray();
+}
+
+void gc_sweep() {
+    rt_gc_header_t **link = &rt_gc.old;
+    while (*link) {
+        rt_gc_header_t *hdr = *link;
+        if (hdr->flags & GC_MARKED) {
+            hdr->flags &= ~GC_MARKED;
+            link = &hdr->next;
+        } else {
+            *link = hdr->next;
+            if (rt_gc.finalizers[hdr->type]) {
+                rt_gc.finalizers[hdr->type](GC_OBJECT(hdr));
+            }
+            rt_gc_stats.old_bytes -= hdr->size;
+            rt_gc_stats.freed_bytes += hdr->size;
+            free(hdr);
+        }
+    }
+}
+
+void gc_collect(int major) {
+    double start = gc_now_ms();
+    rt_gc.major = major;
+    gc_scan_roots();
+    for (rt_nursery_t *nursery = rt_gc.nurseries; nursery; nursery = nursery->next) {
+        nursery->top = nursery->start;
+    }
+    if (major) {
+        gc_sweep();
+        rt_gc.old_threshold = rt_gc_stats.old_bytes * 2 > RT_GC_OLD_THRESHOLD ? rt_gc_stats.old_bytes * 2 : RT_GC_OLD_THRESHOLD;
+        rt_gc_stats.major_collections++;
+    } else {
+        rt_gc_stats.minor_collections++;
+    }
+    rt_gc.major = 0;
+    double pause = gc_now_ms() - start;
+    rt_gc_stats.pause_ms += pause;
+    if (pause > rt_gc_stats.max_pause_ms) {
+        rt_gc_stats.max_pause_ms = pause;
+    }
+}
+
+// Adds each nursery's allocation count to rt_gc_stats. Only safe while
+// no other thread is a mutator.
+void rt_gc_flush_stats() {
+    for (rt_nursery_t *nursery = rt_gc.nurseries; nursery; nursery = nursery->next) {
+        rt_gc_stats.allocated_bytes += nursery->allocated;
+        nursery->allocated = 0;
+    }
+}
+
+// Runs a minor collection, and a major one too if the old space has
+// outgrown its threshold. If another thread is already collecting, waits
+// for it instead, which empties this thread's nursery just the same.
+void rt_gc_collect() {
+    pthread_mutex_lock(&rt_gc.lock);
+    if (__atomic_load_n(&rt_gc.stop, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_unlock(&rt_gc.lock);
+        rt_gc_safepoint();
+        return;
+    }
+    __atomic_store_n(&rt_gc.stop, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&rt_gc.mutators, __ATOMIC_SEQ_CST) > 1) {
+        pthread_cond_wait(&rt_gc.stopped, &rt_gc.lock);
+    }
+    pthread_mutex_unlock(&rt_gc.lock);
+
+    if (!rt_gc.old_threshold) {
+        rt_gc.old_threshold = RT_GC_OLD_THRESHOLD;
+    }
+    rt_gc_flush_stats();
+    gc_collect(0);
+    if (rt_gc_stats.old_bytes > rt_gc.old_threshold) {
+        gc_collect(1);
+    }
+
+    pthread_mutex_lock(&rt_gc.lock);
+    __atomic_store_n(&rt_gc.stop, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&rt_gc.stopped);
+    pthread_mutex_unlock(&rt_gc.lock);
+}
+
+// Allocates a `size` byte object that values of type `type` will refer to.
+void *rt_gc_alloc(int type, size_t size) {
+    size_t need = (sizeof(rt_gc_header_t) + size + GC_ALIGN - 1) & ~(size_t)(GC_ALIGN - 1);
+    rt_nursery.allocated += size;
+    if (need > RT_GC_NURSERY_SIZE / 4) {
+        rt_gc_header_t *hdr = gc_alloc_old(type, size);
+        if (rt_gc_holds) {
+            gc_remember(hdr);
+        }
+        return GC_OBJECT(hdr);
+    }
+    if (!rt_nursery.start) {
+        rt_nursery.start = (char*)malloc(RT_GC_NURSERY_SIZE);
+        if (!rt_nursery.start) {
+            fprintf(stderr, "failed to allocate nursery\n");
+            exit(1);
+        }
+        rt_nursery.top = rt_nursery.start;
+        rt_nursery.end = rt_nursery.start + RT_GC_NURSERY_SIZE;
+        pthread_mutex_lock(&rt_gc.lock);
+        rt_nursery.next = rt_gc.nurseries;
+        rt_gc.nurseries = &rt_nursery;
+        pthread_mutex_unlock(&rt_gc.lock);
+    }
+    if (rt_gc_holds && rt_nursery.top + need > rt_nursery.end) {
+        rt_gc_header_t *hdr = gc_alloc_old(type, size);
+        gc_remember(hdr);
+        return GC_OBJECT(hdr);
+    }
+    while (rt_nursery.top + need > rt_nursery.end) {
+        rt_gc_collect();
+    }
+    rt_gc_header_t *hdr = (rt_gc_header_t*)rt_nursery.top;
+    rt_nursery.top += need;
+    hdr->next = NULL;
+    hdr->size = (uint32_t)size;
+    hdr->type = (uint8_t)type;
+    hdr->flags = 0;
+    return GC_OBJECT(hdr);
+}
+
+// Collects now if the nursery has less than `size` bytes free, unless
+// that couldn't help. Objects about to be allocated under a hold should be
+// budgeted for with a header (16 bytes) each.
+void rt_gc_reserve(size_t size) {
+    if (!rt_gc_holds && rt_nursery.start && size <= RT_GC_NURSERY_SIZE / 2
+        && rt_nursery.top + size > rt_nursery.end) {
+        rt_gc_collect();
+    }
+}
+
+// Holds may nest; see the top of this file.
+void rt_gc_hold() {
+    rt_gc_holds++;
+}
+
+void rt_gc_release() {
+    rt_gc_holds--;
+}
+
+// Allocates an object that is expected to live long, such as a constant.
+void *rt_gc_alloc_old(int type, size_t size) {
+    rt_nursery.allocated += size;
+    return GC_OBJECT(gc_alloc_old(type, size));
+}
+
+rt_string_t *rt_gc_alloc_string(int length, int old) {
+    size_t size = sizeof(rt_string_t) + length + 1;
+    rt_string_t *str = (rt_string_t*)(old ? rt_gc_alloc_old(T_STRING, size) : rt_gc_alloc(T_STRING, size));
+    str->length = length;
+    str->hash = 0;
+    str->rope = 0;
+    str->str[length] = 0;
+    return str;
+}
+
+void rt_gc_reset_stats() {
+    rt_gc_flush_stats();
+    long old_bytes = rt_gc_stats.old_bytes;
+    memset(&rt_gc_stats, 0, sizeof(rt_gc_stats));
+    rt_gc_stats.old_bytes = old_bytes;
+    rt_gc_stats.old_peak_bytes = old_bytes;
+}
+
+void rt_gc_report(FILE *out) {
+    fprintf(out, "gc: %d minor, %d major, pause %.3fms total, %.3fms max\n",
+        rt_gc_stats.minor_collections, rt_gc_stats.major_collections,
+        rt_gc_stats.pause_ms, rt_gc_stats.max_pause_ms);
+    fprintf(out, "gc: %ld bytes allocated, %ld promoted, %ld freed; old space %ld bytes (peak %ld), nursery %d bytes\n",
+        rt_gc_stats.allocated_bytes, rt_gc_stats.promoted_bytes, rt_gc_stats.freed_bytes,
+        rt_gc_stats.old_bytes, rt_gc_stats.old_peak_bytes, RT_GC_NURSERY_SIZE);
+}
+
+#undef GC_HEADER
+#undef GC_OBJECT
+#undef GC_ALIGN
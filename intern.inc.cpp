@@ -1,71 +1,190 @@
-struct symt_entry;
+// Symbols are interned into a table split into shards, picked by the top
+// bits of a symbol's hash, so that threads loading modules in parallel
+// rarely contend. Each shard is an open-addressing hash table with linear
+// probing, with its own permanent arena (see arena.inc.cpp) for the
+// strings. Slots cache their string's hash and length so that probes only
+// fall through to a byte comparison on a genuine hash match.
+//
+// Lookups take no lock. A slot is filled in before its string pointer is
+// published, and a table that is outgrown is kept rather than freed, so a
+// reader racing an insertion or a resize sees either a complete entry or
+// an empty slot. Only when it reaches an empty slot does it take the
+// shard's lock and probe again, in the current table, inserting the
+// symbol if it still isn't there. The outgrown tables add up to less than
+// the current one.
+//
+// Symbol ids are handed out from a single atomic counter. symt_names maps
+// each id back to its string for diagnostics; it is a directory of
+// fixed-size chunks, so it grows without moving, and can be read without
+// a lock.
+#include <pthread.h>
+
 struct symt_entry {
 	const char *sym;
+	int len;
+	uint32_t hash;
 	int val;
-	struct symt_entry *next;
 };
 
-long symt_next = 1;
-struct symt_entry *symt_root = NULL;
+#define SYMT_SHARD_BITS		6
+#define SYMT_SHARDS			(1 << SYMT_SHARD_BITS)
+
+typedef struct symt_table {
+	int cap;
+	struct symt_table *prev;	// outgrown; readers may still probe it
+	struct symt_entry entries[1];
+} symt_table_t;
+
+typedef struct {
+	symt_table_t *table;
+	pthread_mutex_t lock;		// guards inserts
+	int count;
+	rt_arena_t arena;
+	char pad[64];				// keep neighbouring shards apart
+} symt_shard_t;
+
+#define SYMT_NAMES_CHUNK_BITS	12
+#define SYMT_NAMES_CHUNK		(1 << SYMT_NAMES_CHUNK_BITS)
+#define SYMT_NAMES_CHUNKS		65536
+
+int symt_next = 1;
+symt_shard_t symt_shards[SYMT_SHARDS];
+const char **symt_names[SYMT_NAMES_CHUNKS];
 
-const int symt_align = 8;
 const int symt_chunk_sz = 512;
-char *symt_chunk = 0;
-int symt_chunk_pos = 0;
 
-char *intern_alloc_chunk() {
-	char *chunk = (char*)malloc(symt_chunk_sz);
-	if (!chunk) {
-		fprintf(stderr, "failed to allocated intern chunk\n");
+char *intern_alloc_string(symt_shard_t *shard, const char *str, int len) {
+	char *slice = (char*)rt_arena_alloc(&shard->arena, len + 1);
+	for (int i = 0; i < len; ++i) {
+		slice[i] = str[i];
+	}
+	slice[len] = 0;
+	return slice;
+}
+
+uint32_t intern_hash(const char *str, int len) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < len; ++i) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+symt_table_t *intern_alloc_table(int cap) {
+	symt_table_t *table = (symt_table_t*)calloc(1, sizeof(symt_table_t) + sizeof(struct symt_entry) * (cap - 1));
+	if (!table) {
+		fprintf(stderr, "failed to allocate intern table\n");
 		exit(1);
 	}
-	return chunk;
+	table->cap = cap;
+	return table;
 }
 
-char *intern_get_slice(int len) {
-	if (len > symt_chunk_sz) {
-		char *slice = (char*)malloc(len);
-		if (!slice) {
-			fprintf(stderr, "failed to allocated intern slice");
-			exit(1);
+void intern_grow_table(symt_shard_t *shard) {
+	symt_table_t *old = shard->table;
+	int new_cap = old->cap * 2;
+	symt_table_t *table = intern_alloc_table(new_cap);
+	for (int i = 0; i < old->cap; ++i) {
+		struct symt_entry *e = &old->entries[i];
+		if (!e->sym) continue;
+		int ix = e->hash & (new_cap - 1);
+		while (table->entries[ix].sym) {
+			ix = (ix + 1) & (new_cap - 1);
 		}
-		return slice;
+		table->entries[ix] = *e;
 	}
-	if (symt_chunk_pos + len > symt_chunk_sz) {
-		symt_chunk = intern_alloc_chunk();
-		symt_chunk_pos = 0;
+	table->prev = old;
+	__atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+}
+
+// Probes `table` for the symbol. Returns its id, or 0 with `*ix` set to
+// the empty slot where it would go.
+int intern_probe(symt_table_t *table, const char *str, int len, uint32_t hash, int *ix) {
+	int i = hash & (table->cap - 1);
+	while (1) {
+		struct symt_entry *e = &table->entries[i];
+		const char *sym = __atomic_load_n(&e->sym, __ATOMIC_ACQUIRE);
+		if (!sym) {
+			*ix = i;
+			return 0;
+		}
+		if (e->hash == hash && e->len == len && memcmp(sym, str, len) == 0) {
+			return e->val;
+		}
+		i = (i + 1) & (table->cap - 1);
 	}
-	len = (len + symt_align - 1) & ~(symt_align - 1);
-	char *slice = symt_chunk + symt_chunk_pos;
-	symt_chunk_pos += len;
-	return slice;
 }
 
-char *intern_alloc_string(const char *str, int len) {
-	char *slice = intern_get_slice(len + 1);
-	for (int i = 0; i < len; ++i) {
-		slice[i] = str[i];
+void intern_add_name(int id, const char *sym) {
+	int chunk = id >> SYMT_NAMES_CHUNK_BITS;
+	if (chunk >= SYMT_NAMES_CHUNKS) {
+		fprintf(stderr, "too many symbols\n");
+		exit(1);
 	}
-	slice[len] = 0;
-	return slice;
+	const char **names = __atomic_load_n(&symt_names[chunk], __ATOMIC_ACQUIRE);
+	if (!names) {
+		const char **fresh = (const char**)calloc(SYMT_NAMES_CHUNK, sizeof(const char*));
+		if (!fresh) {
+			fprintf(stderr, "failed to allocate intern name table\n");
+			exit(1);
+		}
+		if (__atomic_compare_exchange_n(&symt_names[chunk], &names, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			names = fresh;
+		} else {
+			free(fresh);
+		}
+	}
+	__atomic_store_n(&names[id & (SYMT_NAMES_CHUNK - 1)], sym, __ATOMIC_RELEASE);
 }
 
 void rt_intern_init() {
-	symt_chunk = intern_alloc_chunk();
+	for (int i = 0; i < SYMT_SHARDS; ++i) {
+		symt_shard_t *shard = &symt_shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		rt_arena_init(&shard->arena, symt_chunk_sz);
+		shard->count = 0;
+		shard->table = intern_alloc_table(64);
+	}
 }
 
+// Returns the id of the symbol `str`, interning it if it's new. Safe to
+// call from any thread.
 int rt_intern(const char *str, int len) {
-	struct symt_entry *curr = symt_root;
-	while (curr) {
-		if (streql(curr->sym, str, len)) {
-			return curr->val;
+	uint32_t hash = intern_hash(str, len);
+	symt_shard_t *shard = &symt_shards[hash >> (32 - SYMT_SHARD_BITS)];
+	int ix;
+	int val = intern_probe(__atomic_load_n(&shard->table, __ATOMIC_ACQUIRE), str, len, hash, &ix);
+	if (val) {
+		return val;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	symt_table_t *table = shard->table;
+	val = intern_probe(table, str, len, hash, &ix);
+	if (!val) {
+		struct symt_entry *item = &table->entries[ix];
+		const char *sym = intern_alloc_string(shard, str, len);
+		item->len = len;
+		item->hash = hash;
+		item->val = val = __atomic_add_fetch(&symt_next, 1, __ATOMIC_RELAXED) - 1;
+		intern_add_name(val, sym);
+		__atomic_store_n(&item->sym, sym, __ATOMIC_RELEASE);
+		// keep the load factor at or below 1/2
+		if (++shard->count * 2 > table->cap) {
+			intern_grow_table(shard);
 		}
-		curr = curr->next;
 	}
-	struct symt_entry *item = (struct symt_entry*)malloc(sizeof(struct symt_entry));
-	item->sym = intern_alloc_string(str, len);
-	item->val = symt_next++;
-	item->next = symt_root;
-	symt_root = item;
-	return item->val;
-}
\ No newline at end of file
+	pthread_mutex_unlock(&shard->lock);
+	return val;
+}
+
+// Returns the string for symbol `id`, or NULL if no such symbol exists.
+const char *rt_intern_name(int id) {
+	if (id <= 0 || id >= __atomic_load_n(&symt_next, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	const char **names = __atomic_load_n(&symt_names[id >> SYMT_NAMES_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	return names ? __atomic_load_n(&names[id & (SYMT_NAMES_CHUNK - 1)], __ATOMIC_ACQUIRE) : NULL;
+}
@@ -8,6 +8,7 @@ enum {
     TOK_OP_MAX,
 
     TOK_INT,
+    TOK_FLOAT,
     TOK_IDENT,
     TOK_STRING,
 
@@ -15,6 +16,7 @@ enum {
     TOK_IF,
     TOK_DEF,
     TOK_ELSE,
+    TOK_RETURN,
     TOK_TRUE,
     TOK_FALSE,
 
@@ -29,25 +31,54 @@ enum {
     TOK_ERROR
 };
 
+// Reads up to `cap` bytes of input into `buf`, returning the number read,
+// or 0 at the end of the input.
+typedef size_t (*rt_lexer_refill_f)(void *ctx, char *buf, size_t cap);
+
+// The lexer scans [text, text + len). A streaming lexer owns its text: a
+// buffer it refills as it runs out, first sliding the current token to
+// the front, so a token's text stays valid until the next call to
+// rt_lexer_next.
+//
+// Runs of whitespace, identifier and digit characters, and string bodies,
+// are scanned a vector at a time: 32 bytes with AVX2 (when built with
+// -mavx2), else 16 with SSE2, else a byte at a time.
+//
+// Line and column aren't tracked while scanning. rt_lexer_position works
+// them out from a byte offset when an error needs them, using an index of
+// line starts that it builds on demand.
 typedef struct rt_lexer {
-    char *text;
+    const char *text;
+    size_t len;
     size_t pos;
-    int was_cr;
-    int line;
-    int column;
-    int tok_start;
+    size_t tok_start;           // offset of the current token
     int tok_len;
-    char *tok;
+    const char *tok;            // text of the current token, if it has any
     const char *error;
+    rt_lexer_refill_f refill;   // streaming only, until the input ends
+    void *refill_ctx;
+    char *buffer;               // streaming only
+    size_t buffer_cap;
+    int base_line;              // position of text[0]; input discarded from
+    int base_column;            // a stream's buffer is folded into these
+    size_t *lines;              // offsets of the line starts in text[0, indexed)
+    int nlines;
+    int lines_cap;
+    size_t indexed;
 } rt_lexer_t;
 
+#define LEXER_CHUNK_SZ  65536
+
 #define MARK() l->tok_start = l->pos; l->tok = &(l->text[l->pos])
 #define END() l->tok_len = l->pos - l->tok_start
 #define EMIT(tok) return tok
-#define CURR() (l->text[l->pos])
-#define NEXT() lexer_next(l)
+#define CURR() (l->pos < l->len || lexer_fill(l) ? l->text[l->pos] : '\0')
+#define NEXT() l->pos++
+#define SCAN(span) \
+    do { \
+        l->pos += span(l->text + l->pos, l->len - l->pos); \
+    } while (l->pos == l->len && lexer_fill(l))
 #define LEN() (l->tok_len)
-#define TEXTEQ(str) streql(str, l->tok, l->tok_len)
 #define ERROR(msg) \
     l->error = msg; \
     return TOK_ERROR
@@ -70,55 +101,303 @@ int ident_rest_p(char c) {
     return ident_start_p(c) || digit_p(c);
 }
 
-void lexer_next(rt_lexer_t *l) {
-    if (l->text[l->pos] == '\r') {
-        l->line++;
-        l->column = 1;
-        l->was_cr = 1;
-    } else {
-        if (l->text[l->pos] == '\n') {
-            if (!l->was_cr) {
-                l->line++;
-                l->column = 1;
+// Characters that end a string body: the closing quote, the escape
+// character and the end of input.
+int string_stop_p(char c) {
+    return c == '"' || c == '\'' || c == '\0';
+}
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define LEXER_VEC_SZ        32
+    #define LEXER_VEC_ALL       0xFFFFFFFFu
+    typedef __m256i lexer_vec_t;
+    #define VEC_LOAD(p)         _mm256_loadu_si256((const __m256i*)(p))
+    #define VEC_SET1(c)         _mm256_set1_epi8(c)
+    #define VEC_EQ(a, b)        _mm256_cmpeq_epi8(a, b)
+    #define VEC_GT(a, b)        _mm256_cmpgt_epi8(a, b)
+    #define VEC_AND(a, b)       _mm256_and_si256(a, b)
+    #define VEC_OR(a, b)        _mm256_or_si256(a, b)
+    #define VEC_MASK(v)         ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+    #define LEXER_VEC_SZ        16
+    #define LEXER_VEC_ALL       0xFFFFu
+    typedef __m128i lexer_vec_t;
+    #define VEC_LOAD(p)         _mm_loadu_si128((const __m128i*)(p))
+    #define VEC_SET1(c)         _mm_set1_epi8(c)
+    #define VEC_EQ(a, b)        _mm_cmpeq_epi8(a, b)
+    #define VEC_GT(a, b)        _mm_cmpgt_epi8(a, b)
+    #define VEC_AND(a, b)       _mm_and_si128(a, b)
+    #define VEC_OR(a, b)        _mm_or_si128(a, b)
+    #define VEC_MASK(v)         ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+#ifdef LEXER_VEC_SZ
+
+// Bytes in [lo, hi]. Bytes above 0x7F compare as negative, so they're
+// never in a range of ASCII characters.
+#define VEC_RANGE(v, lo, hi) VEC_AND(VEC_GT(v, VEC_SET1((lo) - 1)), VEC_GT(VEC_SET1((hi) + 1), v))
+
+lexer_vec_t lexer_vec_space(lexer_vec_t v) {
+    return VEC_OR(VEC_EQ(v, VEC_SET1(' ')), VEC_EQ(v, VEC_SET1('\t')));
+}
+
+lexer_vec_t lexer_vec_digit(lexer_vec_t v) {
+    return VEC_RANGE(v, '0', '9');
+}
+
+lexer_vec_t lexer_vec_ident_rest(lexer_vec_t v) {
+    // setting 0x20 folds upper case onto lower case, and moves nothing
+    // else into a-z
+    lexer_vec_t letters = VEC_RANGE(VEC_OR(v, VEC_SET1(0x20)), 'a', 'z');
+    return VEC_OR(VEC_OR(letters, VEC_RANGE(v, '0', '9')), VEC_EQ(v, VEC_SET1('_')));
+}
+
+lexer_vec_t lexer_vec_string_body(lexer_vec_t v) {
+    lexer_vec_t stop = VEC_OR(VEC_EQ(v, VEC_SET1('"')), VEC_EQ(v, VEC_SET1('\'')));
+    stop = VEC_OR(stop, VEC_EQ(v, VEC_SET1(0)));
+    return VEC_EQ(stop, VEC_SET1(0));
+}
+
+// Defines a function returning the length of the run of characters at `s`
+// matching `pred`, looking at no more than `n` bytes. `vpred` is `pred`
+// for a vector of characters.
+#define LEXER_SPAN(name, vpred, pred) \
+    size_t name(const char *s, size_t n) { \
+        size_t i = 0; \
+        for (; i + LEXER_VEC_SZ <= n; i += LEXER_VEC_SZ) { \
+            uint32_t mask = VEC_MASK(vpred(VEC_LOAD(s + i))); \
+            if (mask != LEXER_VEC_ALL) { \
+                return i + __builtin_ctz(~mask); \
+            } \
+        } \
+        while (i < n && pred(s[i])) { \
+            i++; \
+        } \
+        return i; \
+    }
+
+#else
+
+#define LEXER_SPAN(name, vpred, pred) \
+    size_t name(const char *s, size_t n) { \
+        size_t i = 0; \
+        while (i < n && pred(s[i])) { \
+            i++; \
+        } \
+        return i; \
+    }
+
+#endif
+
+#define string_body_p(c) (!string_stop_p(c))
+
+LEXER_SPAN(lexer_span_space, lexer_vec_space, space_p)
+LEXER_SPAN(lexer_span_digits, lexer_vec_digit, digit_p)
+LEXER_SPAN(lexer_span_ident, lexer_vec_ident_rest, ident_rest_p)
+LEXER_SPAN(lexer_span_string, lexer_vec_string_body, string_body_p)
+
+#undef string_body_p
+#undef LEXER_SPAN
+
+// Keywords, by perfect hash of length and first and last characters.
+typedef struct {
+    const char *text;
+    int len;
+    int tok;
+} lexer_keyword_t;
+
+#define KEYWORD_HASH(s, len) ((((len) << 1) + (s)[0] + (s)[(len) - 1]) & 7)
+
+const lexer_keyword_t lexer_keywords[8] = {
+    { "def",    3, TOK_DEF },
+    { "true",   4, TOK_TRUE },
+    { "else",   4, TOK_ELSE },
+    { "if",     2, TOK_IF },
+    { "return", 6, TOK_RETURN },
+    { "false",  5, TOK_FALSE },
+    { "while",  5, TOK_WHILE },
+    { NULL,     0, 0 }
+};
+
+// Returns the token for identifier `s`: a keyword's, or TOK_IDENT.
+int lexer_keyword(const char *s, int len) {
+    const lexer_keyword_t *kw = &lexer_keywords[KEYWORD_HASH(s, len)];
+    if (kw->len == len && memcmp(kw->text, s, len) == 0) {
+        return kw->tok;
+    }
+    return TOK_IDENT;
+}
+
+// Returns the position of text[pos]: line and column, both from 1. A line
+// break is "\n", "\r\n" or a lone "\r".
+void rt_lexer_position(rt_lexer_t *l, size_t pos, int *line, int *column) {
+    for (; l->indexed < pos; ++l->indexed) {
+        size_t i = l->indexed;
+        if (l->text[i] == '\n' || (l->text[i] == '\r' && (i + 1 >= l->len || l->text[i + 1] != '\n'))) {
+            if (l->nlines == l->lines_cap) {
+                l->lines_cap = l->lines_cap ? l->lines_cap * 2 : 64;
+                l->lines = (size_t*)realloc(l->lines, sizeof(size_t) * l->lines_cap);
+                if (!l->lines) {
+                    fprintf(stderr, "failed to grow line index\n");
+                    exit(1);
+                }
             }
+            l->lines[l->nlines++] = i + 1;
+        }
+    }
+    // the number of line starts at or before pos
+    int lo = 0, hi = l->nlines;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (l->lines[mid] <= pos) {
+            lo = mid + 1;
         } else {
-            l->column++;
+            hi = mid;
         }
-        l->was_cr = 0;
     }
-    l->pos++;
+    *line = l->base_line + lo;
+    *column = lo ? (int)(pos - l->lines[lo - 1]) + 1 : l->base_column + (int)pos;
 }
 
-void rt_lexer_init(rt_lexer_t *lexer, char *text) {
-    lexer->text = text;
+// Reads more input into a streaming lexer's buffer. Returns 0 if there
+// is no more.
+int lexer_fill(rt_lexer_t *l) {
+    if (!l->refill) {
+        return 0;
+    }
+    size_t keep = l->tok_start;
+    if (keep && l->text[keep - 1] == '\r') {
+        // whether it ends a line depends on the next character
+        keep--;
+    }
+    rt_lexer_position(l, keep, &l->base_line, &l->base_column);
+    l->nlines = 0;
+    l->indexed = 0;
+    memmove(l->buffer, l->buffer + keep, l->len - keep);
+    l->len -= keep;
+    l->pos -= keep;
+    l->tok_start -= keep;
+    if (l->len == l->buffer_cap) {
+        // a token longer than the buffer
+        l->buffer_cap *= 2;
+        l->buffer = (char*)realloc(l->buffer, l->buffer_cap);
+        if (!l->buffer) {
+            fprintf(stderr, "failed to grow lexer buffer\n");
+            exit(1);
+        }
+    }
+    l->text = l->buffer;
+    if (l->tok) {
+        l->tok = l->text + l->tok_start;
+    }
+    size_t n = l->refill(l->refill_ctx, l->buffer + l->len, l->buffer_cap - l->len);
+    if (n == 0) {
+        l->refill = NULL;
+        return 0;
+    }
+    l->len += n;
+    return 1;
+}
+
+void lexer_init(rt_lexer_t *lexer) {
+    lexer->text = NULL;
+    lexer->len = 0;
     lexer->pos = 0;
-    lexer->was_cr = 0;
-    lexer->line = 1;
-    lexer->column = 1;
     lexer->tok_start = 0;
     lexer->tok_len = 0;
     lexer->tok = NULL;
     lexer->error = NULL;
+    lexer->refill = NULL;
+    lexer->refill_ctx = NULL;
+    lexer->buffer = NULL;
+    lexer->buffer_cap = 0;
+    lexer->base_line = 1;
+    lexer->base_column = 1;
+    lexer->lines = NULL;
+    lexer->nlines = 0;
+    lexer->lines_cap = 0;
+    lexer->indexed = 0;
+}
+
+// Initialises `lexer` to scan the `len` bytes at `text`.
+void rt_lexer_init(rt_lexer_t *lexer, const char *text, size_t len) {
+    lexer_init(lexer);
+    lexer->text = text;
+    lexer->len = len;
+}
+
+// Initialises `lexer` to scan the input produced by `refill`, which is
+// called whenever the lexer needs more.
+void rt_lexer_init_stream(rt_lexer_t *lexer, rt_lexer_refill_f refill, void *ctx) {
+    lexer_init(lexer);
+    lexer->refill = refill;
+    lexer->refill_ctx = ctx;
+    lexer->buffer_cap = LEXER_CHUNK_SZ;
+    lexer->buffer = (char*)malloc(lexer->buffer_cap);
+    if (!lexer->buffer) {
+        fprintf(stderr, "failed to allocate lexer buffer\n");
+        exit(1);
+    }
+    lexer->text = lexer->buffer;
+}
+
+// Initialises `lexer` to scan `src`, in place if it is mapped.
+void rt_lexer_init_source(rt_lexer_t *lexer, rt_source_t *src) {
+    if (src->text) {
+        rt_lexer_init(lexer, src->text, src->len);
+    } else {
+        rt_lexer_init_stream(lexer, rt_source_read, src);
+    }
 }
 
+void rt_lexer_free(rt_lexer_t *lexer) {
+    free(lexer->buffer);
+    free(lexer->lines);
+    lexer->buffer = NULL;
+    lexer->lines = NULL;
+    lexer->nlines = 0;
+    lexer->lines_cap = 0;
+    lexer->indexed = 0;
+}
+
+// Copies lexer state, for lookahead. Only lexers scanning in place can be
+// cloned; a streaming lexer's buffer moves under it. The copy starts with
+// an empty line index.
 void rt_lexer_clone(rt_lexer_t *d, const rt_lexer_t *s) {
     d->text = s->text;
+    d->len = s->len;
     d->pos = s->pos;
-    d->was_cr = s->was_cr;
-    d->line = s->line;
-    d->column = s->column;
     d->tok_start = s->tok_start;
     d->tok_len = s->tok_len;
     d->tok = s->tok;
     d->error = s->error;
+    d->refill = NULL;
+    d->refill_ctx = NULL;
+    d->buffer = NULL;
+    d->buffer_cap = 0;
+    d->base_line = s->base_line;
+    d->base_column = s->base_column;
+    d->lines = NULL;
+    d->nlines = 0;
+    d->lines_cap = 0;
+    d->indexed = 0;
 }
 
 int rt_lexer_next(rt_lexer_t *l) {
     if (l->error) {
         return TOK_ERROR;
     }
-    while (space_p(l->text[l->pos])) {
-        l->pos++;
+    l->tok = NULL;
+    l->tok_start = l->pos;
+    if (space_p(CURR())) {
+        // usually a single space, not worth a vector
+        NEXT();
+        if (space_p(CURR())) {
+            SCAN(lexer_span_space);
+        }
+        l->tok_start = l->pos;
     }
     switch (CURR()) {
         case '\0': EMIT(TOK_EOF);
@@ -179,62 +458,141 @@ int rt_lexer_next(rt_lexer_t *l) {
                 ERROR("expected: '='");
             }
         case '"':
-            {
-                MARK(); NEXT();
-                int state = 0;
-                while (1) {
-                    if (CURR() == '\0') {
+            MARK(); NEXT();
+            while (1) {
+                SCAN(lexer_span_string);
+                switch (CURR()) {
+                    case '\0':
                         ERROR("unexpected EOF");
-                    }
-                    switch (state) {
-                        case 0:
-                            if (CURR() == '\'') {
-                                state = 1;
-                            } else if (CURR() == '"') {
-                                NEXT();
-                                END();
-                                EMIT(TOK_STRING);
-                            }
-                            break;
-                        case 1:
-                            state = 0;
-                            break;
-                    }
-                    NEXT();
+                    case '"':
+                        NEXT();
+                        END();
+                        EMIT(TOK_STRING);
+                    default:
+                        // escape: the next character is part of the body
+                        NEXT();
+                        if (CURR() == '\0') {
+                            ERROR("unexpected EOF");
+                        }
+                        NEXT();
                 }
             }
         default:
             if (ident_start_p(CURR())) {
                 MARK(); NEXT();
-                while (ident_rest_p(CURR())) {
-                    NEXT();
-                }
+                SCAN(lexer_span_ident);
                 END();
-                if (TEXTEQ("while"))    EMIT(TOK_WHILE);
-                if (TEXTEQ("if"))       EMIT(TOK_IF);
-                if (TEXTEQ("def"))      EMIT(TOK_DEF);
-                if (TEXTEQ("else"))     EMIT(TOK_ELSE);
-                if (TEXTEQ("true"))     EMIT(TOK_TRUE);
-                if (TEXTEQ("false"))    EMIT(TOK_FALSE);
-                EMIT(TOK_IDENT);
+                EMIT(lexer_keyword(l->tok, l->tok_len));
             } else if (digit_p(CURR())) {
                 MARK(); NEXT();
-                while (digit_p(CURR())) {
-                    NEXT();
+                SCAN(lexer_span_digits);
+                if (CURR() != '.') {
+                    END();
+                    EMIT(TOK_INT);
                 }
+                NEXT();
+                if (!digit_p(CURR())) {
+                    ERROR("expected a digit after the decimal point");
+                }
+                SCAN(lexer_span_digits);
                 END();
-                EMIT(TOK_INT);
+                EMIT(TOK_FLOAT);
             } else {
                 ERROR("unexpected character in input");
             }
     }
 }
 
+// A whole input tokenized in one pass, stored as parallel arrays (kind,
+// byte offset, length) indexed by token number. The last token is TOK_EOF
+// or, if the input doesn't lex, TOK_ERROR. Tokenizing touches nothing but
+// its own arguments, so separate inputs can be tokenized on separate
+// threads.
+typedef struct {
+    uint16_t *kinds;
+    uint32_t *offsets;
+    uint32_t *lens;
+    int ntokens;
+    int cap;
+    const char *text;
+    const char *error;      // the lexer's, if the last token is TOK_ERROR
+    rt_lexer_t lexer;       // kept for rt_lexer_position
+} rt_tokens_t;
+
+void tokens_resize(rt_tokens_t *toks, int cap) {
+    toks->cap = cap;
+    toks->kinds = (uint16_t*)realloc(toks->kinds, sizeof(uint16_t) * toks->cap);
+    toks->offsets = (uint32_t*)realloc(toks->offsets, sizeof(uint32_t) * toks->cap);
+    toks->lens = (uint32_t*)realloc(toks->lens, sizeof(uint32_t) * toks->cap);
+    if (!toks->kinds || !toks->offsets || !toks->lens) {
+        fprintf(stderr, "failed to grow token buffer\n");
+        exit(1);
+    }
+}
+
+void rt_tokens_init(rt_tokens_t *toks) {
+    toks->kinds = NULL;
+    toks->offsets = NULL;
+    toks->lens = NULL;
+    toks->ntokens = 0;
+    toks->cap = 0;
+    toks->text = NULL;
+    toks->error = NULL;
+    lexer_init(&toks->lexer);
+}
+
+// Tokenizes the `len` bytes at `text`, which must outlive the tokens,
+// into `toks`, reusing its buffer.
+void rt_tokenize(rt_tokens_t *toks, const char *text, size_t len) {
+    if (len > UINT32_MAX) {
+        fprintf(stderr, "source too large to tokenize; stream it instead\n");
+        exit(1);
+    }
+    toks->ntokens = 0;
+    toks->text = text;
+    toks->error = NULL;
+
+    // guess from the average token, with its whitespace, being ~2 bytes
+    if ((size_t)toks->cap < len / 2 + 64) {
+        tokens_resize(toks, len / 2 + 64);
+    }
+
+    rt_lexer_free(&toks->lexer);
+    rt_lexer_t *l = &toks->lexer;
+    rt_lexer_init(l, text, len);
+    while (1) {
+        int tok = rt_lexer_next(l);
+        if (toks->ntokens == toks->cap) {
+            tokens_resize(toks, toks->cap * 2);
+        }
+        toks->kinds[toks->ntokens] = tok;
+        toks->offsets[toks->ntokens] = l->tok_start;
+        toks->lens[toks->ntokens] = l->pos - l->tok_start;
+        toks->ntokens++;
+        if (tok == TOK_EOF || tok == TOK_ERROR) {
+            break;
+        }
+    }
+    toks->error = l->error;
+}
+
+void rt_tokens_free(rt_tokens_t *toks) {
+    free(toks->kinds);
+    free(toks->offsets);
+    free(toks->lens);
+    rt_lexer_free(&toks->lexer);
+    toks->kinds = NULL;
+    toks->offsets = NULL;
+    toks->lens = NULL;
+    toks->ntokens = 0;
+    toks->cap = 0;
+}
+
 #undef MARK
 #undef END
 #undef EMIT
 #undef CURR
 #undef NEXT
+#undef SCAN
 #undef LEN
-#undef TEXTEQ
 #undef ERROR
\ No newline at end of file
@@ -0,0 +1,887 @@
+// Persistent lists
+//
+// A list is a relaxed radix balanced tree (RRB tree). Like a Clojure
+// vector, it's a tree of nodes of up to 32 slots with the elements in its
+// leaves, plus a tail: a leaf kept apart that appends go into, so that
+// conj copies only the tail until it fills, and then adds it to the tree
+// whole. Unlike a Clojure vector, the tree's leaves and subtrees needn't
+// be full, which is what lets concat and slice share nearly all of their
+// operands' nodes. concat rebuilds only the nodes along the seam between
+// two trees, spreading their slots over as few nodes as it can (Bagwell
+// and Rompf's concatenation, with the plan from L'orange's "Improving
+// RRB-Tree Performance through Transience"); slice copies only the nodes
+// along its two edges.
+//
+// Each branch keeps the running total of the elements below each of its
+// children. To find an element, a branch guesses the child from the bits
+// of the index, as in a full tree, then steps right while the totals say
+// the element is further on. In a tree built by appending, the guess is
+// always right; a child holds at most as many elements as in a full tree,
+// so the guess is never too far right.
+//
+// Lists are values, and are built in bulk through transients, in the same
+// way as maps; see map.inc.cpp.
+//
+// Builtins:
+//
+//   list(x, ...)       a list of the given elements
+//   pop(l)             l without its last element
+//   concat(a, b)       the elements of list a followed by those of list b
+//   slice(l, i, j)     a list of elements i to j - 1 of l
+//
+// get, assoc, conj and into take lists too (see natives.inc.cpp); get
+// fails on an index out of range, and assoc on one past the end appends.
+
+enum { LIST_ROOT, LIST_LEAF, LIST_BRANCH };
+
+#define LIST_BITS       5
+#define LIST_WIDTH      (1 << LIST_BITS)
+// concat leaves at most LIST_EXTRAS more nodes at a level than the fewest
+// that could hold their slots, and doesn't rearrange nodes that are at
+// most LIST_INVARIANT slots short of full.
+#define LIST_INVARIANT  1
+#define LIST_EXTRAS     2
+
+// The first field of every T_LIST object.
+struct rt_list {
+    uint8_t kind;       // LIST_ROOT
+    uint8_t shift;      // of the tree's root; 0 if it's a leaf
+    uint32_t edit;      // of the transient building it, or 0 once persistent
+    int count;          // including the tail
+    uint32_t hash;      // of the contents, or 0 until first needed
+    val_t root;         // nil if the tree is empty
+    val_t tail;         // a leaf, or nil if empty
+};
+
+typedef struct {
+    uint8_t kind;       // LIST_LEAF or LIST_BRANCH
+    uint8_t n;          // slots in use
+    uint8_t cap;
+    uint32_t edit;      // of the transient that may change it in place
+    val_t slots[0];     // elements, or children; a branch's are followed
+                        // by cap running totals (uint32_t)
+} list_node_t;
+
+// Bytes that appending, changing or removing one element can allocate:
+// a copy of a full branch at each level, a leaf, and a new root.
+#define LIST_PATH_BYTES (8 * (16 + sizeof(list_node_t) + LIST_WIDTH * (sizeof(val_t) + sizeof(uint32_t))) \
+                         + 2 * (16 + sizeof(list_node_t) + LIST_WIDTH * sizeof(val_t)) + 16 + sizeof(rt_list_t))
+
+uint32_t list_next_edit = 1;
+
+val_t list_node_ref(list_node_t *node) {
+    return mk_list((rt_list_t*)node);
+}
+
+list_node_t *list_node_val(val_t v) {
+    return (list_node_t*)list_val(v);
+}
+
+uint32_t *list_sizes(list_node_t *node) {
+    return (uint32_t*)(node->slots + node->cap);
+}
+
+list_node_t *list_child(list_node_t *node, int i) {
+    return list_node_val(node->slots[i]);
+}
+
+// Returns the number of elements under `node`.
+int list_node_size(list_node_t *node) {
+    return node->kind == LIST_LEAF ? node->n : (int)list_sizes(node)[node->n - 1];
+}
+
+// Returns a node with `n` slots, to be filled in by the caller. A
+// transient's nodes have room for a full complement.
+list_node_t *list_node_new(int kind, int n, uint32_t edit) {
+    int cap = edit ? LIST_WIDTH : n;
+    size_t size = sizeof(list_node_t) + cap * sizeof(val_t) + (kind == LIST_BRANCH ? cap * sizeof(uint32_t) : 0);
+    list_node_t *node = (list_node_t*)rt_gc_alloc(T_LIST, size);
+    node->kind = (uint8_t)kind;
+    node->n = (uint8_t)n;
+    node->cap = (uint8_t)cap;
+    node->edit = edit;
+    return node;
+}
+
+// Fills in the running totals of branch `node`'s children.
+void list_branch_sum(list_node_t *node) {
+    uint32_t *sizes = list_sizes(node);
+    uint32_t total = 0;
+    for (int i = 0; i < node->n; ++i) {
+        total += list_node_size(list_child(node, i));
+        sizes[i] = total;
+    }
+}
+
+list_node_t *list_branch_of(list_node_t **children, int n, uint32_t edit) {
+    list_node_t *node = list_node_new(LIST_BRANCH, n, edit);
+    for (int i = 0; i < n; ++i) {
+        node->slots[i] = list_node_ref(children[i]);
+    }
+    list_branch_sum(node);
+    return node;
+}
+
+// Returns a copy of `node` with only `n` of its slots starting at `from`,
+// and room for `extra` more. Totals are copied but not adjusted.
+list_node_t *list_node_copy(list_node_t *node, int from, int n, int extra, uint32_t edit) {
+    list_node_t *copy = list_node_new(node->kind, n + extra, edit);
+    copy->n = (uint8_t)n;
+    memcpy(copy->slots, &node->slots[from], sizeof(val_t) * n);
+    if (node->kind == LIST_BRANCH) {
+        memcpy(list_sizes(copy), &list_sizes(node)[from], sizeof(uint32_t) * n);
+    }
+    return copy;
+}
+
+// Returns `node`, if transient `edit` owns it and it has room for `extra`
+// more slots, or else a copy that does.
+list_node_t *list_node_editable(list_node_t *node, int extra, uint32_t edit) {
+    if (edit && node->edit == edit && node->n + extra <= node->cap) {
+        return node;
+    }
+    return list_node_copy(node, 0, node->n, extra, edit);
+}
+
+// Returns the slot of the element at `index` under `node`, at level
+// `shift`.
+val_t *list_node_slot(list_node_t *node, int shift, int index) {
+    for (; shift > 0; shift -= LIST_BITS) {
+        uint32_t *sizes = list_sizes(node);
+        int i = index >> shift;
+        while (sizes[i] <= (uint32_t)index) {
+            i++;
+        }
+        if (i > 0) {
+            index -= sizes[i - 1];
+        }
+        node = list_child(node, i);
+    }
+    return &node->slots[index];
+}
+
+// Returns the child of branch `node`, at level `shift`, holding the
+// element at `index`, and sets `*base` to the index of its first element.
+int list_branch_find(list_node_t *node, int shift, int index, int *base) {
+    uint32_t *sizes = list_sizes(node);
+    int i = index >> shift;
+    while (sizes[i] <= (uint32_t)index) {
+        i++;
+    }
+    *base = i > 0 ? sizes[i - 1] : 0;
+    return i;
+}
+
+// Returns a chain of single-child branches down from level `shift` to
+// `leaf`.
+list_node_t *list_path(int shift, list_node_t *leaf, uint32_t edit) {
+    if (shift == 0) {
+        return leaf;
+    }
+    list_node_t *child = list_path(shift - LIST_BITS, leaf, edit);
+    return list_branch_of(&child, 1, edit);
+}
+
+// Returns `node`, at level `shift`, with `leaf` added after its last
+// element, or NULL if it has no room.
+list_node_t *list_push_leaf(list_node_t *node, int shift, list_node_t *leaf, uint32_t edit) {
+    if (shift > LIST_BITS) {
+        list_node_t *updated = list_push_leaf(list_child(node, node->n - 1), shift - LIST_BITS, leaf, edit);
+        if (updated) {
+            node = list_node_editable(node, 0, edit);
+            node->slots[node->n - 1] = list_node_ref(updated);
+            list_sizes(node)[node->n - 1] += leaf->n;
+            return node;
+        }
+    }
+    if (node->n == LIST_WIDTH) {
+        return NULL;
+    }
+    list_node_t *child = list_path(shift - LIST_BITS, leaf, edit);
+    node = list_node_editable(node, 1, edit);
+    list_sizes(node)[node->n] = list_sizes(node)[node->n - 1] + leaf->n;
+    node->slots[node->n++] = list_node_ref(child);
+    return node;
+}
+
+// Returns `node`, at level `shift`, with the element at `index` set to
+// `value`.
+list_node_t *list_node_assoc(list_node_t *node, int shift, int index, val_t value, uint32_t edit) {
+    node = list_node_editable(node, 0, edit);
+    if (shift == 0) {
+        node->slots[index] = value;
+        return node;
+    }
+    int base;
+    int i = list_branch_find(node, shift, index, &base);
+    node->slots[i] = list_node_ref(list_node_assoc(list_child(node, i), shift - LIST_BITS, index - base, value, edit));
+    return node;
+}
+
+// Returns `node`, at level `shift`, cut down to its first `end` elements.
+list_node_t *list_slice_right(list_node_t *node, int shift, int end) {
+    if (shift == 0) {
+        return end == node->n ? node : list_node_copy(node, 0, end, 0, 0);
+    }
+    int base;
+    int i = list_branch_find(node, shift, end - 1, &base);
+    list_node_t *child = list_child(node, i);
+    list_node_t *cut = list_slice_right(child, shift - LIST_BITS, end - base);
+    if (i == node->n - 1 && cut == child) {
+        return node;
+    }
+    node = list_node_copy(node, 0, i + 1, 0, 0);
+    node->slots[i] = list_node_ref(cut);
+    list_sizes(node)[i] = end;
+    return node;
+}
+
+// Returns `node`, at level `shift`, without its first `start` elements.
+list_node_t *list_slice_left(list_node_t *node, int shift, int start) {
+    if (start == 0) {
+        return node;
+    } else if (shift == 0) {
+        return list_node_copy(node, start, node->n - start, 0, 0);
+    }
+    int base;
+    int i = list_branch_find(node, shift, start, &base);
+    list_node_t *cut = list_slice_left(list_child(node, i), shift - LIST_BITS, start - base);
+    node = list_node_copy(node, i, node->n - i, 0, 0);
+    node->slots[0] = list_node_ref(cut);
+    uint32_t *sizes = list_sizes(node);
+    for (int j = 0; j < node->n; ++j) {
+        sizes[j] -= start;
+    }
+    return node;
+}
+
+//
+// Concatenation
+
+// Works out how to spread the slots of nodes `all` over fewer nodes, so
+// that there are at most LIST_EXTRAS more than the fewest possible.
+// Leaves the number of slots for each new node in `counts`, and returns
+// how many there are.
+int list_concat_plan(list_node_t **all, int n, int *counts) {
+    int total = 0;
+    for (int i = 0; i < n; ++i) {
+        counts[i] = all[i]->n;
+        total += counts[i];
+    }
+    int optimal = (total - 1) / LIST_WIDTH + 1;
+    int i = 0;
+    while (optimal + LIST_EXTRAS < n) {
+        // skip nodes that are full enough, then spread the first short
+        // one's slots over those that follow it, which removes a node
+        while (counts[i] > LIST_WIDTH - LIST_INVARIANT) {
+            i++;
+        }
+        int remaining = counts[i];
+        do {
+            int size = remaining + counts[i + 1] < LIST_WIDTH ? remaining + counts[i + 1] : LIST_WIDTH;
+            remaining += counts[i + 1] - size;
+            counts[i] = size;
+            i++;
+        } while (remaining > 0);
+        for (int j = i; j < n - 1; ++j) {
+            counts[j] = counts[j + 1];
+        }
+        n--;
+        i--;
+    }
+    return n;
+}
+
+// Redistributes the slots of nodes `all`, which are at level `shift`,
+// into `m` nodes of `counts` slots each, left in `out`. Nodes that the
+// plan leaves alone are reused.
+void list_concat_execute(list_node_t **all, int *counts, int m, int shift, list_node_t **out) {
+    int from = 0, offset = 0;
+    for (int i = 0; i < m; ++i) {
+        if (offset == 0 && all[from]->n == counts[i]) {
+            out[i] = all[from++];
+            continue;
+        }
+        list_node_t *node = list_node_new(shift ? LIST_BRANCH : LIST_LEAF, counts[i], 0);
+        for (int filled = 0; filled < counts[i]; ) {
+            int n = all[from]->n - offset;
+            if (n > counts[i] - filled) {
+                n = counts[i] - filled;
+            }
+            memcpy(&node->slots[filled], &all[from]->slots[offset], sizeof(val_t) * n);
+            filled += n;
+            offset += n;
+            if (offset == all[from]->n) {
+                from++;
+                offset = 0;
+            }
+        }
+        if (shift) {
+            list_branch_sum(node);
+        }
+        out[i] = node;
+    }
+}
+
+// Joins the children of branches `left` and `right` (either may be NULL),
+// all at level `shift`, around those of `centre`, at the same level,
+// which replaces the last child of `left` and the first of `right`.
+list_node_t *list_rebalance(list_node_t *left, list_node_t *centre, list_node_t *right, int shift, int top, int *out_shift) {
+    list_node_t *all[3 * LIST_WIDTH], *merged[3 * LIST_WIDTH];
+    int counts[3 * LIST_WIDTH];
+    int n = 0;
+    for (int i = 0; left && i < left->n - 1; ++i) {
+        all[n++] = list_child(left, i);
+    }
+    for (int i = 0; i < centre->n; ++i) {
+        all[n++] = list_child(centre, i);
+    }
+    for (int i = 1; right && i < right->n; ++i) {
+        all[n++] = list_child(right, i);
+    }
+    int m = list_concat_plan(all, n, counts);
+    list_concat_execute(all, counts, m, shift - LIST_BITS, merged);
+    if (m <= LIST_WIDTH) {
+        list_node_t *node = list_branch_of(merged, m, 0);
+        if (top) {
+            *out_shift = shift;
+            return node;
+        }
+        *out_shift = shift + LIST_BITS;
+        return list_branch_of(&node, 1, 0);
+    }
+    list_node_t *halves[2];
+    halves[0] = list_branch_of(merged, LIST_WIDTH, 0);
+    halves[1] = list_branch_of(merged + LIST_WIDTH, m - LIST_WIDTH, 0);
+    *out_shift = shift + LIST_BITS;
+    return list_branch_of(halves, 2, 0);
+}
+
+// Returns the tree made by joining trees `left` and `right`, at levels
+// `lshift` and `rshift`, and sets `*shift` to its level. Unless `top`,
+// the result is a branch of one or two nodes, one level above the higher
+// of the two.
+list_node_t *list_concat_tree(list_node_t *left, int lshift, list_node_t *right, int rshift, int top, int *shift) {
+    int centre_shift;
+    if (lshift > rshift) {
+        list_node_t *centre = list_concat_tree(list_child(left, left->n - 1), lshift - LIST_BITS, right, rshift, 0, &centre_shift);
+        return list_rebalance(left, centre, NULL, lshift, top, shift);
+    } else if (lshift < rshift) {
+        list_node_t *centre = list_concat_tree(left, lshift, list_child(right, 0), rshift - LIST_BITS, 0, &centre_shift);
+        return list_rebalance(NULL, centre, right, rshift, top, shift);
+    } else if (lshift == 0) {
+        if (top && left->n + right->n <= LIST_WIDTH) {
+            list_node_t *leaf = list_node_copy(left, 0, left->n, right->n, 0);
+            memcpy(&leaf->slots[left->n], right->slots, sizeof(val_t) * right->n);
+            leaf->n += right->n;
+            *shift = 0;
+            return leaf;
+        }
+        list_node_t *leaves[2] = { left, right };
+        *shift = LIST_BITS;
+        return list_branch_of(leaves, 2, 0);
+    }
+    list_node_t *centre = list_concat_tree(list_child(left, left->n - 1), lshift - LIST_BITS,
+        list_child(right, 0), rshift - LIST_BITS, 0, &centre_shift);
+    return list_rebalance(left, centre, right, lshift, top, shift);
+}
+
+//
+// Lists
+
+rt_list_t *list_new(uint32_t edit) {
+    rt_list_t *list = (rt_list_t*)rt_gc_alloc(T_LIST, sizeof(rt_list_t));
+    list->kind = LIST_ROOT;
+    list->shift = 0;
+    list->edit = edit;
+    list->count = 0;
+    list->hash = 0;
+    list->root = mk_nil();
+    list->tail = mk_nil();
+    return list;
+}
+
+rt_list_t *list_copy(rt_list_t *list, uint32_t edit) {
+    rt_list_t *copy = list_new(edit);
+    copy->shift = list->shift;
+    copy->count = list->count;
+    copy->root = list->root;
+    copy->tail = list->tail;
+    return copy;
+}
+
+int list_tail_count(rt_list_t *list) {
+    return nil_p(list->tail) ? 0 : list_node_val(list->tail)->n;
+}
+
+// Drops single-child branches from the top of `list`'s tree.
+void list_trim(rt_list_t *list) {
+    while (list->shift > 0 && list_node_val(list->root)->n == 1) {
+        list->root = list_node_val(list->root)->slots[0];
+        list->shift -= LIST_BITS;
+    }
+}
+
+// Adds `leaf` to the end of `list`'s tree.
+void list_push_tree(rt_list_t *list, list_node_t *leaf, uint32_t edit) {
+    if (nil_p(list->root)) {
+        list->root = list_node_ref(leaf);
+        list->shift = 0;
+        return;
+    }
+    list_node_t *root = list_node_val(list->root);
+    list_node_t *pushed = list->shift ? list_push_leaf(root, list->shift, leaf, edit) : NULL;
+    if (pushed) {
+        list->root = list_node_ref(pushed);
+        return;
+    }
+    list_node_t *children[2] = { root, list_path(list->shift, leaf, edit) };
+    list->root = list_node_ref(list_branch_of(children, 2, edit));
+    list->shift += LIST_BITS;
+}
+
+// Appends `value` to `list`, which is new or transient `edit`'s.
+void list_conj_into(rt_list_t *list, val_t value, uint32_t edit) {
+    list_node_t *tail;
+    if (nil_p(list->tail)) {
+        tail = list_node_new(LIST_LEAF, 1, edit);
+        tail->n = 0;
+    } else {
+        tail = list_node_val(list->tail);
+        if (tail->n == LIST_WIDTH) {
+            list_push_tree(list, tail, edit);
+            tail = list_node_new(LIST_LEAF, 1, edit);
+            tail->n = 0;
+        } else {
+            tail = list_node_editable(tail, 1, edit);
+        }
+    }
+    tail->slots[tail->n++] = value;
+    list->tail = list_node_ref(tail);
+    list->count++;
+}
+
+// Returns the slot of the element at `index`, which must be in range.
+val_t *list_slot(rt_list_t *list, int index) {
+    int tree_count = list->count - list_tail_count(list);
+    if (index >= tree_count) {
+        return &list_node_val(list->tail)->slots[index - tree_count];
+    }
+    return list_node_slot(list_node_val(list->root), list->shift, index);
+}
+
+// Calls `fn` with each element slot under `node`, in order, stopping
+// early if it returns 0. Returns 0 if it stopped early.
+int list_node_each(list_node_t *node, int (*fn)(val_t *value, void *ctx), void *ctx) {
+    for (int i = 0; i < node->n; ++i) {
+        if (node->kind == LIST_LEAF ? !fn(&node->slots[i], ctx) : !list_node_each(list_child(node, i), fn, ctx)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Calls `fn` with each element slot of `list`. Must be called under a
+// hold if `fn` allocates.
+int list_each(rt_list_t *list, int (*fn)(val_t *value, void *ctx), void *ctx) {
+    return (nil_p(list->root) || list_node_each(list_node_val(list->root), fn, ctx))
+        && (nil_p(list->tail) || list_node_each(list_node_val(list->tail), fn, ctx));
+}
+
+// Called by the collector to visit a list object's fields.
+void rt_list_trace(void *obj) {
+    if (((rt_list_t*)obj)->kind == LIST_ROOT) {
+        rt_gc_visit(&((rt_list_t*)obj)->root);
+        rt_gc_visit(&((rt_list_t*)obj)->tail);
+        return;
+    }
+    list_node_t *node = (list_node_t*)obj;
+    for (int i = 0; i < node->n; ++i) {
+        rt_gc_visit(&node->slots[i]);
+    }
+}
+
+int rt_list_count(val_t v) {
+    return list_val(v)->count;
+}
+
+// Returns a transient copy of `list`. Must be called under a hold.
+rt_list_t *list_transient(rt_list_t *list) {
+    return list_copy(list, __atomic_fetch_add(&list_next_edit, 1, __ATOMIC_RELAXED));
+}
+
+// Makes transient `list` persistent.
+val_t list_persistent(rt_list_t *list) {
+    list->edit = 0;
+    return mk_list(list);
+}
+
+// Appends `value` to transient `list`. Must be called under a hold.
+void list_transient_conj(rt_list_t *list, val_t value) {
+    list_conj_into(list, value, list->edit);
+}
+
+// Returns a new list of `n` elements, which `fill` appends to the
+// transient it's given with list_transient_conj(). `n` need only be a
+// guess; it's used to reserve space.
+val_t rt_list_from(int n, void (*fill)(rt_list_t *list, void *ctx), void *ctx) {
+    rt_gc_reserve((size_t)n * sizeof(val_t) * 9 / 8 + LIST_PATH_BYTES);
+    rt_gc_hold();
+    rt_list_t *list = list_transient(list_new(0));
+    fill(list, ctx);
+    val_t out = list_persistent(list);
+    rt_gc_release();
+    return out;
+}
+
+void list_check_index(val_t *list, val_t *index, int extra) {
+    if (!int_p(*index) || int_val(*index) < 0 || int_val(*index) >= list_val(*list)->count + extra) {
+        fprintf(stderr, "list index out of range\n");
+        exit(1);
+    }
+}
+
+val_t rt_list_get(val_t *list, val_t *index) {
+    list_check_index(list, index, 0);
+    return *list_slot(list_val(*list), (int)int_val(*index));
+}
+
+val_t rt_list_conj(val_t *list, val_t *value) {
+    rt_gc_reserve(LIST_PATH_BYTES);
+    rt_gc_hold();
+    rt_list_t *out = list_copy(list_val(*list), 0);
+    list_conj_into(out, *value, 0);
+    rt_gc_release();
+    return mk_list(out);
+}
+
+// Returns `list` with the element at `index` set to `value`; an index
+// one past the end appends.
+val_t rt_list_assoc(val_t *list, val_t *index, val_t *value) {
+    list_check_index(list, index, 1);
+    int i = (int)int_val(*index);
+    if (i == list_val(*list)->count) {
+        return rt_list_conj(list, value);
+    }
+    rt_gc_reserve(LIST_PATH_BYTES);
+    rt_gc_hold();
+    rt_list_t *out = list_copy(list_val(*list), 0);
+    int tree_count = out->count - list_tail_count(out);
+    if (i >= tree_count) {
+        list_node_t *tail = list_node_editable(list_node_val(out->tail), 0, 0);
+        tail->slots[i - tree_count] = *value;
+        out->tail = list_node_ref(tail);
+    } else {
+        out->root = list_node_ref(list_node_assoc(list_node_val(out->root), out->shift, i, *value, 0));
+    }
+    rt_gc_release();
+    return mk_list(out);
+}
+
+val_t rt_list_pop(val_t *list) {
+    if (list_val(*list)->count == 0) {
+        fprintf(stderr, "pop from an empty list\n");
+        exit(1);
+    }
+    rt_gc_reserve(LIST_PATH_BYTES);
+    rt_gc_hold();
+    rt_list_t *out = list_copy(list_val(*list), 0);
+    if (nil_p(out->tail)) {
+        // take the tree's last leaf as the tail
+        list_node_t *root = list_node_val(out->root);
+        list_node_t *leaf = root;
+        for (int shift = out->shift; shift > 0; shift -= LIST_BITS) {
+            leaf = list_child(leaf, leaf->n - 1);
+        }
+        out->tail = list_node_ref(leaf);
+        if (out->count == leaf->n) {
+            out->root = mk_nil();
+            out->shift = 0;
+        } else {
+            out->root = list_node_ref(list_slice_right(root, out->shift, out->count - leaf->n));
+            list_trim(out);
+        }
+    }
+    list_node_t *tail = list_node_val(out->tail);
+    out->tail = tail->n == 1 ? mk_nil() : list_node_ref(list_node_copy(tail, 0, tail->n - 1, 0, 0));
+    out->count--;
+    rt_gc_release();
+    return mk_list(out);
+}
+
+int list_conj_each(val_t *value, void *ctx) {
+    list_transient_conj((rt_list_t*)ctx, *value);
+    return 1;
+}
+
+// Returns the elements of list `a` followed by those of list `b`.
+val_t rt_list_concat(val_t *a, val_t *b) {
+    rt_list_t *x = list_val(*a), *y = list_val(*b);
+    if (y->count == 0) {
+        return *a;
+    } else if (x->count == 0) {
+        return *b;
+    }
+    rt_gc_reserve(4 * LIST_PATH_BYTES);
+    rt_gc_hold();
+    x = list_val(*a);
+    y = list_val(*b);
+    val_t out;
+    if (y->count <= LIST_WIDTH) {
+        // short enough to append one by one
+        rt_list_t *list = list_transient(x);
+        list_each(y, list_conj_each, list);
+        out = list_persistent(list);
+    } else {
+        // x's tail joins its tree, and y's tree joins that; y's tail
+        // stays the tail
+        rt_list_t *list = list_copy(x, 0);
+        if (!nil_p(list->tail)) {
+            list_push_tree(list, list_node_val(list->tail), 0);
+        }
+        int shift;
+        list_node_t *root = list_concat_tree(list_node_val(list->root), list->shift,
+            list_node_val(y->root), y->shift, 1, &shift);
+        list->root = list_node_ref(root);
+        list->shift = (uint8_t)shift;
+        list->tail = y->tail;
+        list->count = x->count + y->count;
+        list_trim(list);
+        out = mk_list(list);
+    }
+    rt_gc_release();
+    return out;
+}
+
+// Returns a list of elements `from` to `to` - 1 of `list`.
+val_t rt_list_slice(val_t *list, int from, int to) {
+    rt_list_t *src = list_val(*list);
+    if (from < 0 || to > src->count || from > to) {
+        fprintf(stderr, "slice out of range\n");
+        exit(1);
+    }
+    if (from == 0 && to == src->count) {
+        return *list;
+    }
+    rt_gc_reserve(2 * LIST_PATH_BYTES);
+    rt_gc_hold();
+    src = list_val(*list);
+    rt_list_t *out = list_new(0);
+    out->count = to - from;
+    int tree_count = src->count - list_tail_count(src);
+    if (from < tree_count && from < to) {
+        list_node_t *root = list_node_val(src->root);
+        root = list_slice_right(root, src->shift, to < tree_count ? to : tree_count);
+        out->root = list_node_ref(list_slice_left(root, src->shift, from));
+        out->shift = src->shift;
+        list_trim(out);
+    }
+    if (to > tree_count && from < to) {
+        int start = from > tree_count ? from - tree_count : 0;
+        list_node_t *tail = list_node_val(src->tail);
+        out->tail = list_node_ref(start == 0 && to - tree_count == tail->n
+            ? tail : list_node_copy(tail, start, to - tree_count - start, 0, 0));
+    }
+    rt_gc_release();
+    return mk_list(out);
+}
+
+int list_hash_each(val_t *value, void *ctx) {
+    *(uint32_t*)ctx = *(uint32_t*)ctx * 31 + rt_val_hash(value);
+    return 1;
+}
+
+uint32_t rt_list_hash(val_t *slot) {
+    rt_list_t *list = list_val(*slot);
+    uint32_t hash = __atomic_load_n(&list->hash, __ATOMIC_RELAXED);
+    if (hash) {
+        return hash;
+    }
+    rt_gc_hold();
+    list = list_val(*slot);
+    hash = 1;
+    list_each(list, list_hash_each, &hash);
+    hash = map_mix(hash) ? map_mix(hash) : 1;
+    __atomic_store_n(&list->hash, hash, __ATOMIC_RELAXED);
+    rt_gc_release();
+    return hash;
+}
+
+typedef struct {
+    rt_list_t *other;
+    int index;
+} list_equal_t;
+
+int list_equal_each(val_t *value, void *ctx) {
+    list_equal_t *eq = (list_equal_t*)ctx;
+    return rt_val_equal(value, list_slot(eq->other, eq->index++));
+}
+
+// Returns non-zero if the lists in slots `a` and `b` have equal elements
+// in the same order.
+int rt_list_equal(val_t *a, val_t *b) {
+    rt_list_t *x = list_val(*a), *y = list_val(*b);
+    if (x->count != y->count || (x->hash && y->hash && x->hash != y->hash)) {
+        return 0;
+    }
+    rt_gc_hold();
+    list_equal_t eq = { list_val(*b), 0 };
+    int equal = list_each(list_val(*a), list_equal_each, &eq);
+    rt_gc_release();
+    return equal;
+}
+
+//
+// Formatting
+
+typedef struct {
+    char *str;
+    int len;
+    int cap;
+} list_buf_t;
+
+void list_buf_add(list_buf_t *buf, const char *str, int len) {
+    if (buf->len + len + 1 > buf->cap) {
+        while (buf->len + len + 1 > buf->cap) {
+            buf->cap = buf->cap ? buf->cap * 2 : 64;
+        }
+        buf->str = (char*)realloc(buf->str, buf->cap);
+        if (!buf->str) {
+            fprintf(stderr, "failed to allocate string\n");
+            exit(1);
+        }
+    }
+    memcpy(buf->str + buf->len, str, len);
+    buf->len += len;
+    buf->str[buf->len] = 0;
+}
+
+void list_buf_puts(list_buf_t *buf, const char *str) {
+    list_buf_add(buf, str, strlen(str));
+}
+
+void list_format_value(list_buf_t *buf, val_t *slot);
+
+typedef struct {
+    list_buf_t *buf;
+    int first;
+    int pairs;
+} list_format_t;
+
+int list_format_each(val_t *value, void *ctx) {
+    list_format_t *fmt = (list_format_t*)ctx;
+    if (!fmt->first) {
+        list_buf_puts(fmt->buf, ", ");
+    }
+    fmt->first = 0;
+    list_format_value(fmt->buf, value);
+    return 1;
+}
+
+int list_format_pair(val_t *key, val_t *value, void *ctx) {
+    list_format_t *fmt = (list_format_t*)ctx;
+    list_format_each(key, ctx);
+    if (fmt->pairs) {
+        list_buf_puts(fmt->buf, ": ");
+        list_format_value(fmt->buf, value);
+    }
+    return 1;
+}
+
+void list_format_value(list_buf_t *buf, val_t *slot) {
+    char tmp[32];
+    if (nil_p(*slot)) {
+        list_buf_puts(buf, "nil");
+    } else if (slot->bits == mk_true().bits || slot->bits == mk_false().bits) {
+        list_buf_puts(buf, truthy_p(*slot) ? "true" : "false");
+    } else if (int_p(*slot)) {
+        list_buf_add(buf, tmp, snprintf(tmp, sizeof(tmp), "%lld", (long long)int_val(*slot)));
+    } else if (float_p(*slot)) {
+        list_buf_add(buf, tmp, rt_float_format(float_val(*slot), 0, tmp));
+    } else if (bigint_p(*slot) || vector_p(*slot)) {
+        char *str = bigint_p(*slot) ? rt_int_format(*slot) : rt_vector_format(*slot);
+        list_buf_puts(buf, str);
+        free(str);
+    } else if (string_p(*slot)) {
+        list_buf_puts(buf, "\"");
+        list_buf_add(buf, rt_string_chars(slot, tmp), rt_string_length(*slot));
+        list_buf_puts(buf, "\"");
+    } else if (list_p(*slot)) {
+        list_format_t fmt = { buf, 1, 0 };
+        list_buf_puts(buf, "[");
+        list_each(list_val(*slot), list_format_each, &fmt);
+        list_buf_puts(buf, "]");
+    } else if (map_p(*slot)) {
+        list_format_t fmt = { buf, 1, !map_val(*slot)->set };
+        list_buf_puts(buf, fmt.pairs ? "{" : "#{");
+        map_each(map_val(*slot), list_format_pair, &fmt);
+        list_buf_puts(buf, "}");
+    } else if (chan_p(*slot)) {
+        list_buf_puts(buf, "<channel>");
+    } else {
+        list_buf_puts(buf, "<function>");
+    }
+}
+
+// Returns a malloc()ed string showing the list, map or set in `slot`,
+// e.g. [1, "a", {2: 3.5}, #{nil}].
+char *rt_coll_format(val_t *slot) {
+    list_buf_t buf = { NULL, 0, 0 };
+    rt_gc_hold();
+    list_format_value(&buf, slot);
+    rt_gc_release();
+    return buf.str;
+}
+
+//
+// Builtins
+
+val_t rt_builtin_list(val_t *args, int nargs) {
+    rt_gc_reserve((size_t)nargs * sizeof(val_t) * 9 / 8 + LIST_PATH_BYTES);
+    rt_gc_hold();
+    rt_list_t *list = list_transient(list_new(0));
+    for (int i = 0; i < nargs; ++i) {
+        list_transient_conj(list, args[i]);
+    }
+    val_t out = list_persistent(list);
+    rt_gc_release();
+    return out;
+}
+
+void list_expect(val_t v, const char *name) {
+    if (!list_p(v)) {
+        fprintf(stderr, "%s expects a list\n", name);
+        exit(1);
+    }
+}
+
+val_t rt_builtin_pop(val_t *args, int nargs) {
+    list_expect(args[0], "pop");
+    return rt_list_pop(&args[0]);
+}
+
+val_t rt_builtin_concat(val_t *args, int nargs) {
+    list_expect(args[0], "concat");
+    list_expect(args[1], "concat");
+    return rt_list_concat(&args[0], &args[1]);
+}
+
+val_t rt_builtin_slice(val_t *args, int nargs) {
+    list_expect(args[0], "slice");
+    if (!int_p(args[1]) || !int_p(args[2])) {
+        fprintf(stderr, "slice expects a list and two indices\n");
+        exit(1);
+    }
+    int64_t count = list_val(args[0])->count, from = int_val(args[1]), to = int_val(args[2]);
+    if (from < 0 || to > count || from > to) {
+        fprintf(stderr, "slice out of range\n");
+        exit(1);
+    }
+    return rt_list_slice(&args[0], (int)from, (int)to);
+}
+
+#undef LIST_BITS
+#undef LIST_WIDTH
+#undef LIST_INVARIANT
+#undef LIST_EXTRAS
+#undef LIST_PATH_BYTES
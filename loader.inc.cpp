@@ -0,0 +1,289 @@
+// Module loader
+//
+// Loads a set of source files, each into its own module, lexing, parsing
+// and compiling them in parallel on a pool of threads (one per core
+// unless RT_WORKERS says otherwise; the pool exists only while loading).
+// Modules form a dependency graph: a module isn't loaded until every
+// module it depends on has been, so independent modules load side by
+// side and dependent ones wait their turn. A cycle is an error.
+//
+// Each thread parses into its own AST arena and token buffer. What the
+// threads share (the symbol table, the old generation, the GC root list
+// and the bytecode cache directory) is safe for concurrent use. A module
+// that fails to load records an error; the others still load.
+
+#include <pthread.h>
+#include <stdarg.h>
+
+typedef struct {
+    const char *path;
+    code_t *code;           // once loaded
+    char *error;            // if loading failed
+    int *deps;              // modules to load first
+    int ndeps;
+    int deps_cap;
+    int pending;            // deps not loaded yet
+} rt_module_t;
+
+typedef struct {
+    const rt_natives_t *natives;
+    rt_module_t *modules;
+    int nmodules;
+    int modules_cap;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int *ready;             // modules whose deps are loaded, in load order
+    int nready;
+    int next_ready;
+    int unfinished;         // modules not loaded or failed yet
+    int busy;               // threads loading a module
+} rt_loader_t;
+
+void rt_loader_init(rt_loader_t *ld, const rt_natives_t *natives) {
+    ld->natives = natives;
+    ld->modules = NULL;
+    ld->nmodules = 0;
+    ld->modules_cap = 0;
+    ld->ready = NULL;
+    ld->nready = 0;
+    ld->next_ready = 0;
+    ld->unfinished = 0;
+    ld->busy = 0;
+    pthread_mutex_init(&ld->lock, NULL);
+    pthread_cond_init(&ld->wake, NULL);
+}
+
+// Adds the module at `path`, which must outlive the loader, unless it
+// has been added already. Returns its index.
+int rt_loader_add(rt_loader_t *ld, const char *path) {
+    for (int i = 0; i < ld->nmodules; ++i) {
+        if (strcmp(ld->modules[i].path, path) == 0) {
+            return i;
+        }
+    }
+    if (ld->nmodules == ld->modules_cap) {
+        ld->modules = (rt_module_t*)code_grow(ld->modules, &ld->modules_cap, sizeof(rt_module_t));
+    }
+    rt_module_t *m = &ld->modules[ld->nmodules];
+    m->path = path;
+    m->code = NULL;
+    m->error = NULL;
+    m->deps = NULL;
+    m->ndeps = 0;
+    m->deps_cap = 0;
+    m->pending = 0;
+    return ld->nmodules++;
+}
+
+// Makes module `module` depend on module `dep`.
+void rt_loader_depend(rt_loader_t *ld, int module, int dep) {
+    rt_module_t *m = &ld->modules[module];
+    if (m->ndeps == m->deps_cap) {
+        m->deps = (int*)code_grow(m->deps, &m->deps_cap, sizeof(int));
+    }
+    m->deps[m->ndeps++] = dep;
+}
+
+char *loader_error(const char *fmt, ...) {
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    char *error = strdup(buf);
+    if (!error) {
+        fprintf(stderr, "failed to allocate error message\n");
+        exit(1);
+    }
+    return error;
+}
+
+// Loads module `m` on the calling thread, from the bytecode cache if
+// possible. `tokens` is the thread's token buffer.
+void loader_load(rt_loader_t *ld, rt_module_t *m, rt_tokens_t *tokens) {
+    rt_source_t source;
+    if (!rt_source_open(&source, m->path)) {
+        m->error = loader_error("unable to read source file: %s", m->path);
+        return;
+    }
+
+    // streamed input is never cached: it isn't known until it's been lexed
+    m->code = source.text ? rt_cache_load(source.text, source.len, ld->natives) : NULL;
+    if (!m->code) {
+        rt_arena_t session;
+        rt_arena_init(&session, ast_arena_chunk_sz);
+        ast_arena = &session;
+
+        // a mapped source is tokenized in one pass up front; a stream is
+        // lexed as the parser goes
+        rt_parser_t parser;
+        if (source.text) {
+            rt_tokenize(tokens, source.text, source.len);
+            rt_parser_init_tokens(&parser, tokens);
+        } else {
+            rt_lexer_init_source(&parser.lexer, &source);
+            rt_parser_init(&parser);
+        }
+
+        val_t mod = rt_parse_module(&parser);
+
+        if (parser.error) {
+            int line, column;
+            rt_parser_position(&parser, &line, &column);
+            m->error = loader_error("%s: parse error at line %d, column %d: %s", m->path, line, column, rt_parser_error(&parser));
+        } else {
+            m->code = compile(mod, ld->natives);
+            peephole(m->code);
+            if (source.text) {
+                rt_cache_save(m->code, source.text, source.len);
+            }
+        }
+        if (!source.text) {
+            rt_lexer_free(&parser.lexer);
+        }
+
+        // the AST is dead once compiled
+        rt_arena_free(&session);
+        ast_arena = NULL;
+    }
+
+    rt_source_close(&source);
+}
+
+// Queues the modules that were waiting only for module `done`. Called
+// with the lock held.
+void loader_finish(rt_loader_t *ld, int done) {
+    for (int i = 0; i < ld->nmodules; ++i) {
+        rt_module_t *m = &ld->modules[i];
+        for (int j = 0; j < m->ndeps; ++j) {
+            if (m->deps[j] == done && --m->pending == 0) {
+                ld->ready[ld->nready++] = i;
+            }
+        }
+    }
+    ld->unfinished--;
+}
+
+// Skips module `failed`, and every module that depends on it. Called
+// with the lock held.
+void loader_fail(rt_loader_t *ld, int failed) {
+    for (int i = 0; i < ld->nmodules; ++i) {
+        rt_module_t *m = &ld->modules[i];
+        if (m->code || m->error) {
+            continue;
+        }
+        for (int j = 0; j < m->ndeps; ++j) {
+            if (m->deps[j] == failed) {
+                m->error = loader_error("%s: not loaded: depends on %s", m->path, ld->modules[failed].path);
+                m->pending = -1;
+                loader_fail(ld, i);
+                break;
+            }
+        }
+    }
+    ld->unfinished--;
+}
+
+void *loader_thread(void *arg) {
+    rt_loader_t *ld = (rt_loader_t*)arg;
+    rt_tokens_t tokens;
+    rt_tokens_init(&tokens);
+    pthread_mutex_lock(&ld->lock);
+    while (1) {
+        if (ld->next_ready < ld->nready) {
+            int i = ld->ready[ld->next_ready++];
+            ld->busy++;
+            pthread_mutex_unlock(&ld->lock);
+            loader_load(ld, &ld->modules[i], &tokens);
+            pthread_mutex_lock(&ld->lock);
+            ld->busy--;
+            if (ld->modules[i].error) {
+                loader_fail(ld, i);
+            } else {
+                loader_finish(ld, i);
+            }
+            pthread_cond_broadcast(&ld->wake);
+        } else if (ld->unfinished == 0 || ld->busy == 0) {
+            // done, or nothing in flight can unblock what's left
+            pthread_cond_broadcast(&ld->wake);
+            break;
+        } else {
+            pthread_cond_wait(&ld->wake, &ld->lock);
+        }
+    }
+    pthread_mutex_unlock(&ld->lock);
+    rt_tokens_free(&tokens);
+    return NULL;
+}
+
+// Loads every module added to `ld`. Returns 1 if they all loaded, or 0
+// if any failed, in which case those modules have an error and no code.
+int rt_loader_load(rt_loader_t *ld) {
+    ld->ready = (int*)malloc(sizeof(int) * (ld->nmodules ? ld->nmodules : 1));
+    if (!ld->ready) {
+        fprintf(stderr, "failed to allocate module queue\n");
+        exit(1);
+    }
+    ld->nready = 0;
+    ld->next_ready = 0;
+    ld->unfinished = ld->nmodules;
+    for (int i = 0; i < ld->nmodules; ++i) {
+        rt_module_t *m = &ld->modules[i];
+        m->pending = m->ndeps;
+        if (m->pending == 0) {
+            ld->ready[ld->nready++] = i;
+        }
+    }
+
+    const char *env = getenv("RT_WORKERS");
+    int n = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > ld->nmodules) n = ld->nmodules;
+    if (n < 1) n = 1;
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * n);
+    if (!threads) {
+        fprintf(stderr, "failed to allocate loader threads\n");
+        exit(1);
+    }
+    // the calling thread is one of the pool
+    for (int i = 1; i < n; ++i) {
+        if (pthread_create(&threads[i], NULL, loader_thread, ld) != 0) {
+            fprintf(stderr, "failed to start loader thread\n");
+            exit(1);
+        }
+    }
+    loader_thread(ld);
+    for (int i = 1; i < n; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    int ok = 1;
+    for (int i = 0; i < ld->nmodules; ++i) {
+        rt_module_t *m = &ld->modules[i];
+        if (!m->code && !m->error) {
+            m->error = loader_error("%s: not loaded: circular dependency", m->path);
+        }
+        if (m->error) {
+            ok = 0;
+        }
+    }
+    free(ld->ready);
+    ld->ready = NULL;
+    return ok;
+}
+
+// Frees the loader, and the code of every module it loaded unless
+// `keep_code` is set.
+void rt_loader_free(rt_loader_t *ld, int keep_code) {
+    for (int i = 0; i < ld->nmodules; ++i) {
+        rt_module_t *m = &ld->modules[i];
+        if (m->code && !keep_code) {
+            code_free(m->code);
+        }
+        free(m->error);
+        free(m->deps);
+    }
+    free(ld->modules);
+    pthread_mutex_destroy(&ld->lock);
+    pthread_cond_destroy(&ld->wake);
+}
@@ -0,0 +1,742 @@
+// Persistent maps and sets
+//
+// A map is a hash array mapped trie (HAMT): a tree indexed by successive
+// 5-bit slices of each key's 32-bit hash, so that finding a key visits at
+// most 7 nodes. A node has two bitmaps over its 32 slots, one marking the
+// slots that hold a key and its value and one marking those that hold a
+// child node, and stores only the occupied slots, packed: pairs first,
+// then children (the CHAMP layout). A node is never left holding a single
+// pair and nothing else below the root; removing a key pulls such a pair
+// up into the parent, so that a map's shape depends only on its contents.
+// Keys whose hashes agree in all 32 bits share a collision node, which is
+// a plain list of pairs.
+//
+// Maps are values: assoc and dissoc return a new map, copying only the
+// nodes on the way to the key and sharing the rest with the original.
+// Tasks can therefore share a map, passing it over a channel or to
+// spawn(), and go on using it without copying or locking. A set is a map
+// from each member to itself.
+//
+// Bulk construction goes through a transient, a map that its builder
+// changes in place. Each transient has an edit id, which it stamps on
+// every node it allocates; a node bearing the id is changed in place
+// rather than copied, and is allocated with room to grow. Making the
+// transient persistent retires its id, so none of its nodes change again.
+// Transients are only used from C, within one native call and under a
+// collector hold (see gc.inc.cpp), so the pointers they keep stay good
+// and nodes they allocate need no write barrier. Scripts only ever see
+// persistent maps.
+//
+// Keys are compared as `=` compares them (rt_val_equal) and hashed to
+// agree (rt_val_hash): strings by their contents, with the symbol table's
+// hash function and their cached hash; collections by their elements,
+// caching the result in the collection.
+//
+// Builtins:
+//
+//   map(k1, v1, ...)   a map of the given keys and values
+//   set(x, ...)        a set of the given members
+//   dissoc(m, k)       m without key k
+//   disj(s, x)         s without member x
+//   has(c, k)          whether map c has key k, or set c member k
+//   keys(m), vals(m)   lists of a map's keys and values (or a set's
+//                      members), in the same order
+//
+// get, assoc, conj and into take maps and sets too (see natives.inc.cpp).
+
+enum { MAP_ROOT, MAP_NODE, MAP_COLLISION };
+
+#define MAP_BITS        5
+#define MAP_MASK        ((1 << MAP_BITS) - 1)
+#define MAP_HASH_BITS   32
+
+// The first field of every T_MAP object.
+struct rt_map {
+    uint8_t kind;       // MAP_ROOT
+    uint8_t set;
+    uint32_t edit;      // of the transient building it, or 0 once persistent
+    int count;
+    uint32_t hash;      // of the contents, or 0 until first needed
+    val_t root;         // a node, or nil if empty
+};
+
+typedef struct {
+    uint8_t kind;       // MAP_NODE or MAP_COLLISION
+    uint8_t nnodes;
+    uint16_t npairs;
+    uint16_t cap;       // slots
+    uint32_t edit;      // of the transient that may change it in place
+    uint32_t datamap;   // for a collision node, the hash of its keys
+    uint32_t nodemap;
+    val_t slots[0];     // npairs keys and values, then nnodes children
+} map_node_t;
+
+// Bytes that a single assoc or dissoc can allocate: a copy of a full node
+// at each level, and a new root.
+#define MAP_PATH_BYTES  (8 * (16 + sizeof(map_node_t) + 64 * sizeof(val_t)) + 16 + sizeof(rt_map_t))
+
+uint32_t map_next_edit = 1;
+
+// Defined in list.inc.cpp.
+uint32_t rt_list_hash(val_t *slot);
+int rt_list_equal(val_t *a, val_t *b);
+
+val_t map_node_ref(map_node_t *node) {
+    return mk_map((rt_map_t*)node);
+}
+
+map_node_t *map_node_val(val_t v) {
+    return (map_node_t*)map_val(v);
+}
+
+uint32_t map_mix(uint64_t x) {
+    // the finalizer of MurmurHash3
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+uint32_t rt_map_hash(val_t *slot);
+int rt_map_equal(val_t *a, val_t *b);
+
+// Returns non-zero if the values in slots `a` and `b` are equal, as `=`
+// decides. May allocate.
+int rt_val_equal(val_t *a, val_t *b) {
+    return a->bits == b->bits
+        || (string_p(*a) && string_p(*b) && rt_string_equal(a, b))
+        || (bigint_p(*a) && bigint_p(*b) && rt_bigint_equal(*a, *b))
+        || (vector_p(*a) && vector_p(*b) && rt_vector_equal(*a, *b))
+        || (map_p(*a) && map_p(*b) && rt_map_equal(a, b))
+        || (list_p(*a) && list_p(*b) && rt_list_equal(a, b));
+}
+
+// Returns a hash of the value in `slot` that agrees with rt_val_equal().
+// May allocate.
+uint32_t rt_val_hash(val_t *slot) {
+    if (string_p(*slot)) {
+        return rt_string_hash(slot);
+    } else if (bigint_p(*slot)) {
+        return rt_bigint_hash(*slot);
+    } else if (vector_p(*slot)) {
+        return rt_vector_hash(*slot);
+    } else if (map_p(*slot)) {
+        return rt_map_hash(slot);
+    } else if (list_p(*slot)) {
+        return rt_list_hash(slot);
+    }
+    return map_mix(slot->bits);
+}
+
+//
+// Nodes
+
+map_node_t *map_node_new(int kind, int npairs, int nnodes, uint32_t edit) {
+    int need = 2 * npairs + nnodes;
+    // a transient's nodes have room for a few more slots, so that most
+    // inserts into them needn't copy
+    int cap = edit && kind == MAP_NODE ? (need + 4 < 2 * (1 << MAP_BITS) ? need + 4 : 2 * (1 << MAP_BITS)) : need;
+    if (cap > UINT16_MAX) {
+        fprintf(stderr, "too many colliding keys\n");
+        exit(1);
+    }
+    map_node_t *node = (map_node_t*)rt_gc_alloc(T_MAP, sizeof(map_node_t) + sizeof(val_t) * cap);
+    node->kind = (uint8_t)kind;
+    node->nnodes = (uint8_t)nnodes;
+    node->npairs = (uint16_t)npairs;
+    node->cap = (uint16_t)cap;
+    node->edit = edit;
+    node->datamap = 0;
+    node->nodemap = 0;
+    return node;
+}
+
+int map_index(uint32_t bitmap, uint32_t bit) {
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+val_t *map_child_slot(map_node_t *node, int i) {
+    return &node->slots[2 * node->npairs + i];
+}
+
+// Returns `node`, if transient `edit` owns it, or else a copy it owns.
+map_node_t *map_node_editable(map_node_t *node, uint32_t edit) {
+    if (edit && node->edit == edit) {
+        return node;
+    }
+    map_node_t *copy = map_node_new(node->kind, node->npairs, node->nnodes, edit);
+    copy->datamap = node->datamap;
+    copy->nodemap = node->nodemap;
+    memcpy(copy->slots, node->slots, sizeof(val_t) * (2 * node->npairs + node->nnodes));
+    return copy;
+}
+
+// Returns a copy of `node` with room for `npairs` pairs and `nnodes`
+// children, with its slots from `at` on moved along by `gap` (which may be
+// negative), so that the caller can fill in or drop the slots between.
+// Changes `node` in place if `edit` owns it and it has room.
+map_node_t *map_node_resize(map_node_t *node, int npairs, int nnodes, int at, int gap, uint32_t edit) {
+    int used = 2 * node->npairs + node->nnodes;
+    map_node_t *out;
+    if (edit && node->edit == edit && 2 * npairs + nnodes <= node->cap) {
+        out = node;
+    } else {
+        out = map_node_new(node->kind, npairs, nnodes, edit);
+        out->datamap = node->datamap;
+        out->nodemap = node->nodemap;
+        memcpy(out->slots, node->slots, sizeof(val_t) * (gap < 0 ? at + gap : at));
+    }
+    memmove(&out->slots[at + gap], &node->slots[at], sizeof(val_t) * (used - at));
+    out->npairs = (uint16_t)npairs;
+    out->nnodes = (uint8_t)nnodes;
+    return out;
+}
+
+// Returns `node` with the pair for `bit` swapped for `child`.
+map_node_t *map_node_pair_to_child(map_node_t *node, uint32_t bit, map_node_t *child, uint32_t edit) {
+    int i = map_index(node->datamap, bit), j = map_index(node->nodemap, bit);
+    int np = node->npairs, nn = node->nnodes;
+    // one slot fewer, so a node that edit owns always has room
+    map_node_t *out = edit && node->edit == edit ? node : map_node_new(MAP_NODE, np - 1, nn + 1, edit);
+    if (out != node) {
+        memcpy(out->slots, node->slots, sizeof(val_t) * 2 * i);
+    }
+    memmove(&out->slots[2 * i], &node->slots[2 * i + 2], sizeof(val_t) * (2 * (np - i - 1) + j));
+    memmove(&out->slots[2 * np - 1 + j], &node->slots[2 * np + j], sizeof(val_t) * (nn - j));
+    out->slots[2 * np - 2 + j] = map_node_ref(child);
+    out->npairs = (uint16_t)(np - 1);
+    out->nnodes = (uint8_t)(nn + 1);
+    out->datamap = node->datamap & ~bit;
+    out->nodemap = node->nodemap | bit;
+    return out;
+}
+
+// Returns `node` with the child for `bit` swapped for the pair `key`,
+// `value`.
+map_node_t *map_node_child_to_pair(map_node_t *node, uint32_t bit, val_t key, val_t value, uint32_t edit) {
+    int i = map_index(node->datamap, bit), j = map_index(node->nodemap, bit);
+    int np = node->npairs, nn = node->nnodes;
+    map_node_t *out = edit && node->edit == edit && 2 * np + nn + 1 <= node->cap
+        ? node : map_node_new(MAP_NODE, np + 1, nn - 1, edit);
+    if (out != node) {
+        memcpy(out->slots, node->slots, sizeof(val_t) * 2 * i);
+    }
+    // back to front, as the slots move up
+    memmove(&out->slots[2 * np + 2 + j], &node->slots[2 * np + j + 1], sizeof(val_t) * (nn - j - 1));
+    memmove(&out->slots[2 * np + 2], &node->slots[2 * np], sizeof(val_t) * j);
+    memmove(&out->slots[2 * i + 2], &node->slots[2 * i], sizeof(val_t) * 2 * (np - i));
+    out->slots[2 * i] = key;
+    out->slots[2 * i + 1] = value;
+    out->npairs = (uint16_t)(np + 1);
+    out->nnodes = (uint8_t)(nn - 1);
+    out->datamap = node->datamap | bit;
+    out->nodemap = node->nodemap & ~bit;
+    return out;
+}
+
+// Returns a node below level `shift` holding two pairs whose keys differ.
+map_node_t *map_node_pair(int shift, uint32_t h1, val_t k1, val_t v1, uint32_t h2, val_t k2, val_t v2, uint32_t edit) {
+    if (shift >= MAP_HASH_BITS) {
+        map_node_t *node = map_node_new(MAP_COLLISION, 2, 0, edit);
+        node->datamap = h1;
+        node->slots[0] = k1;
+        node->slots[1] = v1;
+        node->slots[2] = k2;
+        node->slots[3] = v2;
+        return node;
+    }
+    uint32_t b1 = (h1 >> shift) & MAP_MASK, b2 = (h2 >> shift) & MAP_MASK;
+    if (b1 == b2) {
+        map_node_t *child = map_node_pair(shift + MAP_BITS, h1, k1, v1, h2, k2, v2, edit);
+        map_node_t *node = map_node_new(MAP_NODE, 0, 1, edit);
+        node->nodemap = 1u << b1;
+        node->slots[0] = map_node_ref(child);
+        return node;
+    }
+    map_node_t *node = map_node_new(MAP_NODE, 2, 0, edit);
+    node->datamap = (1u << b1) | (1u << b2);
+    int first = b1 < b2 ? 0 : 2;
+    node->slots[first] = k1;
+    node->slots[first + 1] = v1;
+    node->slots[2 - first] = k2;
+    node->slots[3 - first] = v2;
+    return node;
+}
+
+// Returns the slot holding the key equal to `key`, or NULL.
+val_t *map_node_find(map_node_t *node, uint32_t hash, val_t *key) {
+    for (int shift = 0; ; shift += MAP_BITS) {
+        if (node->kind == MAP_COLLISION) {
+            if (node->datamap != hash) {
+                return NULL;
+            }
+            for (int i = 0; i < node->npairs; ++i) {
+                if (rt_val_equal(&node->slots[2 * i], key)) {
+                    return &node->slots[2 * i];
+                }
+            }
+            return NULL;
+        }
+        uint32_t bit = 1u << ((hash >> shift) & MAP_MASK);
+        if (node->datamap & bit) {
+            val_t *slot = &node->slots[2 * map_index(node->datamap, bit)];
+            return rt_val_equal(slot, key) ? slot : NULL;
+        } else if (node->nodemap & bit) {
+            node = map_node_val(*map_child_slot(node, map_index(node->nodemap, bit)));
+        } else {
+            return NULL;
+        }
+    }
+}
+
+// Returns `node` (at level `shift`) with `key` mapped to `value`, setting
+// `*added` if the key is new.
+map_node_t *map_node_assoc(map_node_t *node, int shift, uint32_t hash, val_t key, val_t value, uint32_t edit, int *added) {
+    if (node->kind == MAP_COLLISION) {
+        // every key that gets here has the node's hash
+        for (int i = 0; i < node->npairs; ++i) {
+            if (rt_val_equal(&node->slots[2 * i], &key)) {
+                if (node->slots[2 * i + 1].bits == value.bits) {
+                    return node;
+                }
+                node = map_node_editable(node, edit);
+                node->slots[2 * i + 1] = value;
+                return node;
+            }
+        }
+        int n = node->npairs;
+        node = map_node_resize(node, n + 1, 0, 2 * n, 2, edit);
+        node->slots[2 * n] = key;
+        node->slots[2 * n + 1] = value;
+        *added = 1;
+        return node;
+    }
+    uint32_t bit = 1u << ((hash >> shift) & MAP_MASK);
+    if (node->datamap & bit) {
+        int i = map_index(node->datamap, bit);
+        if (rt_val_equal(&node->slots[2 * i], &key)) {
+            if (node->slots[2 * i + 1].bits == value.bits) {
+                return node;
+            }
+            node = map_node_editable(node, edit);
+            node->slots[2 * i + 1] = value;
+            return node;
+        }
+        // the pair moves down into a new child, along with the new one
+        val_t old_key = node->slots[2 * i], old_value = node->slots[2 * i + 1];
+        map_node_t *child = map_node_pair(shift + MAP_BITS, rt_val_hash(&node->slots[2 * i]), old_key, old_value,
+            hash, key, value, edit);
+        *added = 1;
+        return map_node_pair_to_child(node, bit, child, edit);
+    } else if (node->nodemap & bit) {
+        int j = map_index(node->nodemap, bit);
+        map_node_t *child = map_node_val(*map_child_slot(node, j));
+        map_node_t *updated = map_node_assoc(child, shift + MAP_BITS, hash, key, value, edit, added);
+        if (updated == child) {
+            return node;
+        }
+        node = map_node_editable(node, edit);
+        *map_child_slot(node, j) = map_node_ref(updated);
+        return node;
+    }
+    int i = map_index(node->datamap, bit);
+    node = map_node_resize(node, node->npairs + 1, node->nnodes, 2 * i, 2, edit);
+    node->datamap |= bit;
+    node->slots[2 * i] = key;
+    node->slots[2 * i + 1] = value;
+    *added = 1;
+    return node;
+}
+
+// Returns non-zero if `node` should be folded into its parent as a pair.
+int map_node_single_p(map_node_t *node) {
+    return node->npairs == 1 && node->nnodes == 0;
+}
+
+// Returns `node` (at level `shift`) without `key`, or NULL if that leaves
+// it empty, setting `*removed` if the key was there.
+map_node_t *map_node_dissoc(map_node_t *node, int shift, uint32_t hash, val_t key, uint32_t edit, int *removed) {
+    if (node->kind == MAP_COLLISION) {
+        for (int i = 0; i < node->npairs; ++i) {
+            if (rt_val_equal(&node->slots[2 * i], &key)) {
+                *removed = 1;
+                if (node->npairs == 1) {
+                    return NULL;
+                }
+                return map_node_resize(node, node->npairs - 1, 0, 2 * i + 2, -2, edit);
+            }
+        }
+        return node;
+    }
+    uint32_t bit = 1u << ((hash >> shift) & MAP_MASK);
+    if (node->datamap & bit) {
+        int i = map_index(node->datamap, bit);
+        if (!rt_val_equal(&node->slots[2 * i], &key)) {
+            return node;
+        }
+        *removed = 1;
+        if (node->npairs == 1 && node->nnodes == 0) {
+            return NULL;
+        }
+        node = map_node_resize(node, node->npairs - 1, node->nnodes, 2 * i + 2, -2, edit);
+        node->datamap &= ~bit;
+        return node;
+    } else if (node->nodemap & bit) {
+        int j = map_index(node->nodemap, bit);
+        map_node_t *child = map_node_val(*map_child_slot(node, j));
+        map_node_t *updated = map_node_dissoc(child, shift + MAP_BITS, hash, key, edit, removed);
+        if (updated == child) {
+            return node;
+        }
+        if (updated == NULL) {
+            // only collision nodes can empty out like this, since any
+            // other node left with a single pair is folded away
+            if (node->npairs == 0 && node->nnodes == 1) {
+                return NULL;
+            }
+            node = map_node_resize(node, node->npairs, node->nnodes - 1, 2 * node->npairs + j + 1, -1, edit);
+            node->nodemap &= ~bit;
+            return node;
+        }
+        if (map_node_single_p(updated)) {
+            if (node->npairs == 0 && node->nnodes == 1) {
+                // pass the pair further up
+                return updated;
+            }
+            return map_node_child_to_pair(node, bit, updated->slots[0], updated->slots[1], edit);
+        }
+        node = map_node_editable(node, edit);
+        *map_child_slot(node, j) = map_node_ref(updated);
+        return node;
+    }
+    return node;
+}
+
+// Returns `root`, the result of removing a key from a map's root node,
+// fixed up in case it's a lone pair passed up from further down, which
+// sits at the wrong bit for the root (or in a collision node).
+map_node_t *map_root_fix(map_node_t *root, uint32_t edit) {
+    if (!root || !map_node_single_p(root)) {
+        return root;
+    }
+    uint32_t bit = 1u << (rt_val_hash(&root->slots[0]) & MAP_MASK);
+    if (root->kind == MAP_NODE && root->datamap == bit) {
+        return root;
+    }
+    map_node_t *node = map_node_new(MAP_NODE, 1, 0, edit);
+    node->datamap = bit;
+    node->slots[0] = root->slots[0];
+    node->slots[1] = root->slots[1];
+    return node;
+}
+
+// Calls `fn` with each key and value slot under `node`, stopping early if
+// it returns 0. Returns 0 if it stopped early.
+int map_node_each(map_node_t *node, int (*fn)(val_t *key, val_t *value, void *ctx), void *ctx) {
+    for (int i = 0; i < node->npairs; ++i) {
+        if (!fn(&node->slots[2 * i], &node->slots[2 * i + 1], ctx)) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < node->nnodes; ++i) {
+        if (!map_node_each(map_node_val(*map_child_slot(node, i)), fn, ctx)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Called by the collector to visit a map object's fields.
+void rt_map_trace(void *obj) {
+    if (((rt_map_t*)obj)->kind == MAP_ROOT) {
+        rt_gc_visit(&((rt_map_t*)obj)->root);
+        return;
+    }
+    map_node_t *node = (map_node_t*)obj;
+    int n = 2 * node->npairs + node->nnodes;
+    for (int i = 0; i < n; ++i) {
+        rt_gc_visit(&node->slots[i]);
+    }
+}
+
+//
+// Maps
+
+rt_map_t *map_new(int set, int count, val_t root, uint32_t edit) {
+    rt_map_t *map = (rt_map_t*)rt_gc_alloc(T_MAP, sizeof(rt_map_t));
+    map->kind = MAP_ROOT;
+    map->set = (uint8_t)set;
+    map->edit = edit;
+    map->count = count;
+    map->hash = 0;
+    map->root = root;
+    return map;
+}
+
+int rt_map_count(val_t v) {
+    return map_val(v)->count;
+}
+
+int rt_set_p(val_t v) {
+    return map_p(v) && map_val(v)->set;
+}
+
+// Returns a transient copy of `map`. Must be called under a hold.
+rt_map_t *map_transient(rt_map_t *map) {
+    return map_new(map->set, map->count, map->root, __atomic_fetch_add(&map_next_edit, 1, __ATOMIC_RELAXED));
+}
+
+// Makes transient `map` persistent.
+val_t map_persistent(rt_map_t *map) {
+    map->edit = 0;
+    return mk_map(map);
+}
+
+// Maps `key` to `value` in transient `map`. Must be called under a hold.
+void map_transient_assoc(rt_map_t *map, val_t key, val_t value) {
+    uint32_t hash = rt_val_hash(&key);
+    if (nil_p(map->root)) {
+        map_node_t *node = map_node_new(MAP_NODE, 1, 0, map->edit);
+        node->datamap = 1u << (hash & MAP_MASK);
+        node->slots[0] = key;
+        node->slots[1] = value;
+        map->root = map_node_ref(node);
+        map->count = 1;
+        return;
+    }
+    int added = 0;
+    map->root = map_node_ref(map_node_assoc(map_node_val(map->root), 0, hash, key, value, map->edit, &added));
+    map->count += added;
+}
+
+// Removes `key` from transient `map`. Must be called under a hold.
+void map_transient_dissoc(rt_map_t *map, val_t key) {
+    if (nil_p(map->root)) {
+        return;
+    }
+    int removed = 0;
+    map_node_t *root = map_node_dissoc(map_node_val(map->root), 0, rt_val_hash(&key), key, map->edit, &removed);
+    root = map_root_fix(root, map->edit);
+    map->root = root ? map_node_ref(root) : mk_nil();
+    map->count -= removed;
+}
+
+// Returns the slot holding `key` in `map`, or NULL. Must be called under
+// a hold.
+val_t *map_find(rt_map_t *map, val_t *key) {
+    if (nil_p(map->root)) {
+        return NULL;
+    }
+    return map_node_find(map_node_val(map->root), rt_val_hash(key), key);
+}
+
+// Returns the value that `map` maps `key` to, or nil.
+val_t rt_map_get(val_t *map, val_t *key) {
+    rt_gc_hold();
+    val_t *slot = map_find(map_val(*map), key);
+    val_t out = slot ? slot[1] : mk_nil();
+    rt_gc_release();
+    return out;
+}
+
+int rt_map_has(val_t *map, val_t *key) {
+    rt_gc_hold();
+    int found = map_find(map_val(*map), key) != NULL;
+    rt_gc_release();
+    return found;
+}
+
+// Returns `map` with `key` mapped to `value`; for a set, `value` is
+// ignored.
+val_t rt_map_assoc(val_t *map, val_t *key, val_t *value) {
+    rt_gc_reserve(MAP_PATH_BYTES);
+    rt_gc_hold();
+    rt_map_t *m = map_val(*map);
+    val_t v = m->set ? *key : *value;
+    uint32_t hash = rt_val_hash(key);
+    int added = 0;
+    map_node_t *root;
+    if (nil_p(m->root)) {
+        root = map_node_new(MAP_NODE, 1, 0, 0);
+        root->datamap = 1u << (hash & MAP_MASK);
+        root->slots[0] = *key;
+        root->slots[1] = v;
+        added = 1;
+    } else {
+        root = map_node_assoc(map_node_val(m->root), 0, hash, *key, v, 0, &added);
+    }
+    val_t out = *map;
+    if (root != map_node_val(m->root)) {
+        out = mk_map(map_new(m->set, m->count + added, map_node_ref(root), 0));
+    }
+    rt_gc_release();
+    return out;
+}
+
+// Returns `map` without `key`.
+val_t rt_map_dissoc(val_t *map, val_t *key) {
+    rt_gc_reserve(MAP_PATH_BYTES);
+    rt_gc_hold();
+    rt_map_t *m = map_val(*map);
+    val_t out = *map;
+    if (!nil_p(m->root)) {
+        int removed = 0;
+        map_node_t *root = map_node_dissoc(map_node_val(m->root), 0, rt_val_hash(key), *key, 0, &removed);
+        if (removed) {
+            root = map_root_fix(root, 0);
+            out = mk_map(map_new(m->set, m->count - 1, root ? map_node_ref(root) : mk_nil(), 0));
+        }
+    }
+    rt_gc_release();
+    return out;
+}
+
+// Calls `fn` with each key and value slot of `map`. Must be called under a
+// hold if `fn` allocates.
+int map_each(rt_map_t *map, int (*fn)(val_t *key, val_t *value, void *ctx), void *ctx) {
+    return nil_p(map->root) || map_node_each(map_node_val(map->root), fn, ctx);
+}
+
+int map_hash_entry(val_t *key, val_t *value, void *ctx) {
+    // added up, so that the order of the entries doesn't matter
+    *(uint32_t*)ctx += map_mix(((uint64_t)rt_val_hash(key) << 32) | rt_val_hash(value));
+    return 1;
+}
+
+uint32_t rt_map_hash(val_t *slot) {
+    rt_map_t *map = map_val(*slot);
+    uint32_t hash = __atomic_load_n(&map->hash, __ATOMIC_RELAXED);
+    if (hash) {
+        return hash;
+    }
+    rt_gc_hold();
+    map = map_val(*slot);
+    hash = (uint32_t)map->count * 2654435761u + map->set;
+    map_each(map, map_hash_entry, &hash);
+    hash = hash ? hash : 1;
+    __atomic_store_n(&map->hash, hash, __ATOMIC_RELAXED);
+    rt_gc_release();
+    return hash;
+}
+
+int map_entry_in(val_t *key, val_t *value, void *ctx) {
+    val_t *slot = map_find((rt_map_t*)ctx, key);
+    return slot && rt_val_equal(&slot[1], value);
+}
+
+// Returns non-zero if the maps in slots `a` and `b` have the same keys,
+// mapped to equal values.
+int rt_map_equal(val_t *a, val_t *b) {
+    rt_map_t *x = map_val(*a), *y = map_val(*b);
+    if (x->count != y->count || x->set != y->set) {
+        return 0;
+    }
+    if (x->hash && y->hash && x->hash != y->hash) {
+        return 0;
+    }
+    rt_gc_hold();
+    int equal = map_each(map_val(*a), map_entry_in, map_val(*b));
+    rt_gc_release();
+    return equal;
+}
+
+//
+// Builtins
+
+val_t rt_list_from(int n, void (*fill)(rt_list_t *list, void *ctx), void *ctx);
+void list_transient_conj(rt_list_t *list, val_t value);
+
+val_t rt_builtin_map(val_t *args, int nargs) {
+    if (nargs % 2) {
+        fprintf(stderr, "map expects keys and values in pairs\n");
+        exit(1);
+    }
+    rt_gc_reserve(nargs / 2 * (sizeof(map_node_t) + 80) + sizeof(rt_map_t) + 64);
+    rt_gc_hold();
+    rt_map_t *map = map_transient(map_new(0, 0, mk_nil(), 0));
+    for (int i = 0; i < nargs; i += 2) {
+        map_transient_assoc(map, args[i], args[i + 1]);
+    }
+    val_t out = map_persistent(map);
+    rt_gc_release();
+    return out;
+}
+
+val_t rt_builtin_set(val_t *args, int nargs) {
+    rt_gc_reserve(nargs * (sizeof(map_node_t) + 80) + sizeof(rt_map_t) + 64);
+    rt_gc_hold();
+    rt_map_t *set = map_transient(map_new(1, 0, mk_nil(), 0));
+    for (int i = 0; i < nargs; ++i) {
+        map_transient_assoc(set, args[i], args[i]);
+    }
+    val_t out = map_persistent(set);
+    rt_gc_release();
+    return out;
+}
+
+void map_expect(val_t v, int set, const char *name) {
+    if (!map_p(v) || map_val(v)->set != set) {
+        fprintf(stderr, "%s expects a %s\n", name, set ? "set" : "map");
+        exit(1);
+    }
+}
+
+val_t rt_builtin_dissoc(val_t *args, int nargs) {
+    map_expect(args[0], 0, "dissoc");
+    return rt_map_dissoc(&args[0], &args[1]);
+}
+
+val_t rt_builtin_disj(val_t *args, int nargs) {
+    map_expect(args[0], 1, "disj");
+    return rt_map_dissoc(&args[0], &args[1]);
+}
+
+val_t rt_builtin_has(val_t *args, int nargs) {
+    if (!map_p(args[0])) {
+        fprintf(stderr, "has expects a map or a set\n");
+        exit(1);
+    }
+    return mk_bool(rt_map_has(&args[0], &args[1]));
+}
+
+int map_conj_key(val_t *key, val_t *value, void *ctx) {
+    list_transient_conj((rt_list_t*)ctx, *key);
+    return 1;
+}
+
+int map_conj_value(val_t *key, val_t *value, void *ctx) {
+    list_transient_conj((rt_list_t*)ctx, *value);
+    return 1;
+}
+
+// `ctx` is the map's slot.
+void map_fill_keys(rt_list_t *list, void *ctx) {
+    map_each(map_val(*(val_t*)ctx), map_conj_key, list);
+}
+
+void map_fill_values(rt_list_t *list, void *ctx) {
+    map_each(map_val(*(val_t*)ctx), map_conj_value, list);
+}
+
+val_t rt_builtin_keys(val_t *args, int nargs) {
+    if (!map_p(args[0])) {
+        fprintf(stderr, "keys expects a map or a set\n");
+        exit(1);
+    }
+    return rt_list_from(rt_map_count(args[0]), map_fill_keys, &args[0]);
+}
+
+val_t rt_builtin_vals(val_t *args, int nargs) {
+    if (!map_p(args[0])) {
+        fprintf(stderr, "vals expects a map or a set\n");
+        exit(1);
+    }
+    return rt_list_from(rt_map_count(args[0]), map_fill_values, &args[0]);
+}
+
+#undef MAP_BITS
+#undef MAP_MASK
+#undef MAP_HASH_BITS
+#undef MAP_PATH_BYTES
@@ -0,0 +1,385 @@
+// Native function registry
+//
+// Host code registers named natives, each with a declared arity (or
+// NATIVE_VARIADIC) and flags, before compiling. The compiler resolves a
+// call to a registered name at compile time: it checks the argument count
+// and emits OP_CALLN, which calls the native straight out of the
+// registry, rather than loading the callee into a register and going
+// through OP_CALL. The registry must therefore outlive any code compiled
+// against it.
+//
+// A few builtins are registered by rt_natives_init() and also have an
+// intrinsic opcode that the compiler emits in place of any call at all.
+// Their native functions behave identically and are only used when the
+// builtin is called indirectly, e.g. through a variable. Registering a
+// name again replaces the previous native, including any intrinsic.
+//
+// spawn(f, args...) starts a task calling f(args...); see sched.inc.cpp.
+// yield() suspends the calling task in favour of any others, but only as
+// an intrinsic: called indirectly, it does nothing. Likewise, send, recv
+// and select (see chan.inc.cpp) only block as intrinsics; called
+// indirectly, they fail if they would have to.
+//
+// The numeric vector and matrix builtins (vec, mat, dot...) are described
+// in vector.inc.cpp, and those for maps, sets and lists in map.inc.cpp and
+// list.inc.cpp. A few work on any of these collections:
+//
+//   get(c, k)          the value of key k in a map, the member k of a set
+//                      (or nil), or element k of a list or vector
+//   assoc(c, k, v)     c with key or index k set to v
+//   conj(c, x)         c with x appended to a list or added to a set
+//   into(c, from)      c with the elements of from conj'ed on, or for a
+//                      map, the entries of map from assoc'ed
+//
+// Natives flagged NATIVE_PURE have no side effects, so the optimizer may
+// delete a call whose result is unused.
+
+#define NATIVE_VARIADIC -1
+
+enum {
+    NATIVE_PURE = 1 << 0
+};
+
+typedef struct {
+    const char *name;
+    foreign_fn_f fn;
+    int arity;          // or NATIVE_VARIADIC
+    int flags;
+    uint32_t intrinsic; // opcode replacing calls to this native, or 0
+} rt_native_t;
+
+typedef struct {
+    rt_native_t *natives;
+    int nnatives;
+    int natives_cap;
+    int *by_sym;        // symbol -> native index + 1, or 0
+    int by_sym_cap;
+} rt_natives_t;
+
+val_t rt_builtin_print(val_t *args, int nargs) {
+    if (string_p(args[0])) {
+        char buf[VAL_INLINE_STRING_MAX + 1];
+        printf("print: %s\n", rt_string_chars(&args[0], buf));
+    } else if (bigint_p(args[0]) || vector_p(args[0])) {
+        char *str = bigint_p(args[0]) ? rt_int_format(args[0]) : rt_vector_format(args[0]);
+        printf("print: %s\n", str);
+        free(str);
+    } else if (float_p(args[0])) {
+        char buf[32];
+        rt_float_format(float_val(args[0]), 0, buf);
+        printf("print: %s\n", buf);
+    } else if (map_p(args[0]) || list_p(args[0])) {
+        char *str = rt_coll_format(&args[0]);
+        printf("print: %s\n", str);
+        free(str);
+    } else {
+        printf("print: %lld\n", (long long)int_val(args[0]));
+    }
+    return mk_nil();
+}
+
+val_t rt_builtin_abs(val_t *args, int nargs) {
+    return rt_int_abs(args[0]);
+}
+
+val_t rt_builtin_min(val_t *args, int nargs) {
+    return rt_compare(args[0], args[1]) <= 0 ? args[0] : args[1];
+}
+
+val_t rt_builtin_max(val_t *args, int nargs) {
+    return rt_compare(args[0], args[1]) >= 0 ? args[0] : args[1];
+}
+
+// Returns the decimal representation of a number, or of a vector's
+// elements, or a collection as print shows it.
+val_t rt_builtin_str(val_t *args, int nargs) {
+    if (bigint_p(args[0]) || vector_p(args[0]) || map_p(args[0]) || list_p(args[0])) {
+        char *str = bigint_p(args[0]) ? rt_int_format(args[0])
+            : vector_p(args[0]) ? rt_vector_format(args[0]) : rt_coll_format(&args[0]);
+        val_t out = rt_string_new(str, strlen(str));
+        free(str);
+        return out;
+    }
+    char buf[32];
+    int len;
+    if (float_p(args[0])) {
+        len = rt_float_format(float_val(args[0]), 0, buf);
+    } else {
+        len = snprintf(buf, sizeof(buf), "%lld", (long long)int_val(args[0]));
+    }
+    return rt_string_new(buf, len);
+}
+
+val_t rt_builtin_len(val_t *args, int nargs) {
+    if (vector_p(args[0])) {
+        return mk_int(vector_val(args[0])->length);
+    } else if (map_p(args[0])) {
+        return mk_int(rt_map_count(args[0]));
+    } else if (list_p(args[0])) {
+        return mk_int(rt_list_count(args[0]));
+    }
+    return string_p(args[0]) ? mk_int(rt_string_length(args[0])) : mk_nil();
+}
+
+val_t rt_builtin_get(val_t *args, int nargs) {
+    if (nargs == 2 && map_p(args[0])) {
+        return rt_map_get(&args[0], &args[1]);
+    } else if (nargs == 2 && list_p(args[0])) {
+        return rt_list_get(&args[0], &args[1]);
+    }
+    return vector_builtin_get(args, nargs);
+}
+
+val_t rt_builtin_assoc(val_t *args, int nargs) {
+    if (map_p(args[0])) {
+        return rt_map_assoc(&args[0], &args[1], &args[2]);
+    } else if (list_p(args[0])) {
+        return rt_list_assoc(&args[0], &args[1], &args[2]);
+    }
+    fprintf(stderr, "assoc expects a map or a list\n");
+    exit(1);
+}
+
+val_t rt_builtin_conj(val_t *args, int nargs) {
+    if (list_p(args[0])) {
+        return rt_list_conj(&args[0], &args[1]);
+    } else if (rt_set_p(args[0])) {
+        return rt_map_assoc(&args[0], &args[1], &args[1]);
+    }
+    fprintf(stderr, "conj expects a list or a set\n");
+    exit(1);
+}
+
+int into_list_each(val_t *value, void *ctx) {
+    list_transient_conj((rt_list_t*)ctx, *value);
+    return 1;
+}
+
+int into_list_key(val_t *key, val_t *value, void *ctx) {
+    list_transient_conj((rt_list_t*)ctx, *key);
+    return 1;
+}
+
+int into_set_each(val_t *value, void *ctx) {
+    map_transient_assoc((rt_map_t*)ctx, *value, *value);
+    return 1;
+}
+
+int into_map_entry(val_t *key, val_t *value, void *ctx) {
+    map_transient_assoc((rt_map_t*)ctx, *key, *value);
+    return 1;
+}
+
+// Adds everything in `from` to `to` through a transient, so that the
+// nodes it copies are copied only once.
+val_t rt_builtin_into(val_t *args, int nargs) {
+    int to_list = list_p(args[0]), to_set = rt_set_p(args[0]);
+    int ok = to_list ? list_p(args[1]) || rt_set_p(args[1])
+        : to_set ? list_p(args[1]) || rt_set_p(args[1])
+        : map_p(args[0]) && map_p(args[1]) && !rt_set_p(args[1]);
+    if (!ok) {
+        fprintf(stderr, "into expects a list or a set and a list or a set, or two maps\n");
+        exit(1);
+    }
+    int n = list_p(args[1]) ? rt_list_count(args[1]) : rt_map_count(args[1]);
+    rt_gc_reserve((size_t)n * 64 + 1024);
+    rt_gc_hold();
+    val_t out;
+    if (to_list) {
+        rt_list_t *list = list_transient(list_val(args[0]));
+        if (list_p(args[1])) {
+            list_each(list_val(args[1]), into_list_each, list);
+        } else {
+            map_each(map_val(args[1]), into_list_key, list);
+        }
+        out = list_persistent(list);
+    } else {
+        rt_map_t *map = map_transient(map_val(args[0]));
+        if (list_p(args[1])) {
+            list_each(list_val(args[1]), into_set_each, map);
+        } else {
+            map_each(map_val(args[1]), into_map_entry, map);
+        }
+        out = map_persistent(map);
+    }
+    rt_gc_release();
+    return out;
+}
+
+void rt_spawn(val_t fn, val_t *args, int nargs);
+
+val_t rt_builtin_spawn(val_t *args, int nargs) {
+    if (nargs == 0) {
+        fprintf(stderr, "spawn expects a function\n");
+        exit(1);
+    }
+    rt_spawn(args[0], args + 1, nargs - 1);
+    return mk_nil();
+}
+
+val_t rt_builtin_yield(val_t *args, int nargs) {
+    return mk_nil();
+}
+
+val_t rt_chan_new(int cap);
+int rt_chan_try_send(val_t chan, val_t value);
+int rt_chan_try_recv(val_t chan, val_t *out);
+
+// the ring is rounded up to a power of two, so this keeps it within a long
+#define CHAN_MAX_CAPACITY (1 << 30)
+
+// chan() or chan(capacity)
+val_t rt_builtin_chan(val_t *args, int nargs) {
+    if (nargs > 1) {
+        fprintf(stderr, "chan expects at most 1 argument(s), got %d\n", nargs);
+        exit(1);
+    }
+    if (nargs == 1 && (!int_p(args[0]) || int_val(args[0]) < 1 || int_val(args[0]) > CHAN_MAX_CAPACITY)) {
+        fprintf(stderr, "channel capacity must be an integer from 1 to %d\n", CHAN_MAX_CAPACITY);
+        exit(1);
+    }
+    return rt_chan_new(nargs ? (int)int_val(args[0]) : 0);
+}
+
+val_t rt_builtin_send(val_t *args, int nargs) {
+    if (!rt_chan_try_send(args[0], args[1])) {
+        fprintf(stderr, "send would block when called indirectly\n");
+        exit(1);
+    }
+    return mk_nil();
+}
+
+val_t rt_builtin_recv(val_t *args, int nargs) {
+    val_t out;
+    if (!rt_chan_try_recv(args[0], &out)) {
+        fprintf(stderr, "recv would block when called indirectly\n");
+        exit(1);
+    }
+    return out;
+}
+
+val_t rt_builtin_select(val_t *args, int nargs) {
+    val_t out;
+    if (nargs == 0) {
+        fprintf(stderr, "select expects at least one channel\n");
+        exit(1);
+    }
+    for (int i = 0; i < nargs; ++i) {
+        if (rt_chan_try_recv(args[i], &out)) {
+            return out;
+        }
+    }
+    fprintf(stderr, "select would block when called indirectly\n");
+    exit(1);
+}
+
+const rt_native_t rt_builtins[] = {
+    { "print",  rt_builtin_print,   1,               0,              OP_PRINT    },
+    { "abs",    rt_builtin_abs,     1,               NATIVE_PURE,    OP_IABS     },
+    { "min",    rt_builtin_min,     2,               NATIVE_PURE,    OP_IMIN     },
+    { "max",    rt_builtin_max,     2,               NATIVE_PURE,    OP_IMAX     },
+    { "str",    rt_builtin_str,     1,               NATIVE_PURE,    0           },
+    { "len",    rt_builtin_len,     1,               NATIVE_PURE,    0           },
+    { "spawn",  rt_builtin_spawn,   NATIVE_VARIADIC, 0,              0           },
+    { "yield",  rt_builtin_yield,   0,               0,              OP_YIELD    },
+    { "chan",   rt_builtin_chan,    NATIVE_VARIADIC, 0,              0           },
+    { "send",   rt_builtin_send,    2,               0,              OP_SEND     },
+    { "recv",   rt_builtin_recv,    1,               0,              OP_RECV     },
+    { "select", rt_builtin_select,  NATIVE_VARIADIC, 0,              OP_SELECT   },
+    { "vec",    rt_builtin_vec,     NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "vec32",  rt_builtin_vec32,   NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "ivec",   rt_builtin_ivec,    NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "mat",    rt_builtin_mat,     NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "mat32",  rt_builtin_mat32,   NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "vrange", rt_builtin_vrange,  1,               NATIVE_PURE,    0           },
+    { "f64",    rt_builtin_f64,     1,               NATIVE_PURE,    0           },
+    { "f32",    rt_builtin_f32,     1,               NATIVE_PURE,    0           },
+    { "i32",    rt_builtin_i32,     1,               NATIVE_PURE,    0           },
+    { "get",    rt_builtin_get,     NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "sum",    rt_builtin_sum,     1,               NATIVE_PURE,    0           },
+    { "dot",    rt_builtin_dot,     2,               NATIVE_PURE,    0           },
+    { "map",    rt_builtin_map,     NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "set",    rt_builtin_set,     NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "list",   rt_builtin_list,    NATIVE_VARIADIC, NATIVE_PURE,    0           },
+    { "assoc",  rt_builtin_assoc,   3,               NATIVE_PURE,    0           },
+    { "dissoc", rt_builtin_dissoc,  2,               NATIVE_PURE,    0           },
+    { "conj",   rt_builtin_conj,    2,               NATIVE_PURE,    0           },
+    { "disj",   rt_builtin_disj,    2,               NATIVE_PURE,    0           },
+    { "has",    rt_builtin_has,     2,               NATIVE_PURE,    0           },
+    { "into",   rt_builtin_into,    2,               NATIVE_PURE,    0           },
+    { "keys",   rt_builtin_keys,    1,               NATIVE_PURE,    0           },
+    { "vals",   rt_builtin_vals,    1,               NATIVE_PURE,    0           },
+    { "pop",    rt_builtin_pop,     1,               NATIVE_PURE,    0           },
+    { "concat", rt_builtin_concat,  2,               NATIVE_PURE,    0           },
+    { "slice",  rt_builtin_slice,   3,               NATIVE_PURE,    0           },
+    { NULL,     NULL,               0,               0,              0           }
+};
+
+// Returns the index of the native named by `sym`, or -1.
+int rt_natives_find(const rt_natives_t *reg, int sym) {
+    if (sym < reg->by_sym_cap) {
+        return reg->by_sym[sym] - 1;
+    }
+    return -1;
+}
+
+void rt_natives_add(rt_natives_t *reg, const rt_native_t *native) {
+    int sym = rt_intern(native->name, strlen(native->name));
+    int ix = rt_natives_find(reg, sym);
+    if (ix >= 0) {
+        reg->natives[ix] = *native;
+        return;
+    }
+    if (sym >= reg->by_sym_cap) {
+        int cap = reg->by_sym_cap ? reg->by_sym_cap : 64;
+        while (cap <= sym) cap *= 2;
+        reg->by_sym = (int*)realloc(reg->by_sym, sizeof(int) * cap);
+        if (!reg->by_sym) {
+            fprintf(stderr, "failed to allocate native registry\n");
+            exit(1);
+        }
+        for (int i = reg->by_sym_cap; i < cap; ++i) {
+            reg->by_sym[i] = 0;
+        }
+        reg->by_sym_cap = cap;
+    }
+    if (reg->nnatives == reg->natives_cap) {
+        reg->natives_cap = reg->natives_cap ? reg->natives_cap * 2 : 64;
+        reg->natives = (rt_native_t*)realloc(reg->natives, sizeof(rt_native_t) * reg->natives_cap);
+        if (!reg->natives) {
+            fprintf(stderr, "failed to allocate native registry\n");
+            exit(1);
+        }
+    }
+    reg->natives[reg->nnatives] = *native;
+    reg->by_sym[sym] = ++reg->nnatives;
+}
+
+// Registers a host native. Hosts with many natives will usually find
+// rt_natives_add_all() and a static table more convenient.
+void rt_natives_register(rt_natives_t *reg, const char *name, foreign_fn_f fn, int arity, int flags) {
+    rt_native_t native = { name, fn, arity, flags, 0 };
+    rt_natives_add(reg, &native);
+}
+
+// Registers every native in `table`, which ends with a NULL name.
+void rt_natives_add_all(rt_natives_t *reg, const rt_native_t *table) {
+    for (int i = 0; table[i].name; ++i) {
+        rt_natives_add(reg, &table[i]);
+    }
+}
+
+// Initialises `reg` with the builtins.
+void rt_natives_init(rt_natives_t *reg) {
+    reg->natives = NULL;
+    reg->nnatives = 0;
+    reg->natives_cap = 0;
+    reg->by_sym = NULL;
+    reg->by_sym_cap = 0;
+    rt_natives_add_all(reg, rt_builtins);
+}
+
+void rt_natives_free(rt_natives_t *reg) {
+    free(reg->natives);
+    free(reg->by_sym);
+}
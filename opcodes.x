@@ -0,0 +1,65 @@
+/*
+ *      opcode      format  effects                 operands
+ *
+ * Formats (see code.inc.cpp):
+ *   N    -                             AC   a: 8, c: 8
+ *   C    c: 8                          ABC  a: 8, b: 8, c: 8
+ *   AK   a: 8, k: 16                   J    k: signed 24
+ *   AJ   a: 8, k: signed 16            X    extension prefix
+ *
+ * Jump offsets are relative to the following instruction. An OP_EXT
+ * prefix widens every operand of the instruction after it.
+ *
+ * Effects describe which register operands are defined (E_DA) or used
+ * (E_UA, E_UB, E_UC), for the benefit of the optimizer. E_CALL uses
+ * registers a to a+b and defines c; E_NCALL uses registers a to a+b-1 (its
+ * arguments, the first of which its result replaces); E_JUMP instructions
+ * branch to k; E_END instructions never fall through; E_IMPURE
+ * instructions are kept even if the register they define is dead. An
+ * E_PAIR instruction is always followed by a JMP holding its branch target; it
+ * either falls through past the JMP or takes it, all in one dispatch.
+ */
+OPCODE( EXT,        X,      E_NONE                  )   /* high operand bits for next instruction   */ \
+OPCODE( PRINT,      C,      E_UC                    )   /* r                                        */ \
+OPCODE( HALT,       N,      E_END                   )   /* -                                        */ \
+OPCODE( ADD,        ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( SUB,        ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( MUL,        ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( POW,        ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( DIV,        ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( LOADK,      AK,     E_DA                    )   /* rd, k                                    */ \
+OPCODE( COPY,       AC,     E_DA|E_UC               )   /* rd, rs                                   */ \
+OPCODE( CALL,       ABC,    E_CALL                  )   /* base, nargs, result                      */ \
+OPCODE( RET,        C,      E_UC|E_END              )   /* r                                        */ \
+OPCODE( GETG,       AK,     E_DA                    )   /* rd, global slot                          */ \
+OPCODE( CALLN,      ABC,    E_DA|E_NCALL            )   /* base (and result), nargs, native         */ \
+OPCODE( IABS,       AC,     E_DA|E_UC               )   /* rd, rs                                   */ \
+OPCODE( IMIN,       ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( IMAX,       ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( LT,         ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( LE,         ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( GT,         ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( GE,         ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( EQ,         ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( NEQ,        ABC,    E_DA|E_UB|E_UC          )   /* rd, r2, r3                               */ \
+OPCODE( JMP,        J,      E_JUMP|E_END            )   /* offset                                   */ \
+OPCODE( JMPF,       AJ,     E_UA|E_JUMP             )   /* r, offset                                */ \
+OPCODE( LT_JMPF,    ABC,    E_UA|E_UB|E_JUMP|E_PAIR )   /* r1, r2; jump unless r1 < r2              */ \
+OPCODE( LE_JMPF,    ABC,    E_UA|E_UB|E_JUMP|E_PAIR )   /* r1, r2; jump unless r1 <= r2             */ \
+OPCODE( EQ_JMPF,    ABC,    E_UA|E_UB|E_JUMP|E_PAIR )   /* r1, r2; jump unless r1 = r2              */ \
+OPCODE( NEQ_JMPF,   ABC,    E_UA|E_UB|E_JUMP|E_PAIR )   /* r1, r2; jump unless r1 != r2             */ \
+OPCODE( LTK_JMPF,   ABC,    E_UA|E_JUMP|E_PAIR      )   /* r, k; jump unless r < k                  */ \
+OPCODE( LEK_JMPF,   ABC,    E_UA|E_JUMP|E_PAIR      )   /* r, k; jump unless r <= k                 */ \
+OPCODE( GTK_JMPF,   ABC,    E_UA|E_JUMP|E_PAIR      )   /* r, k; jump unless r > k                  */ \
+OPCODE( GEK_JMPF,   ABC,    E_UA|E_JUMP|E_PAIR      )   /* r, k; jump unless r >= k                 */ \
+OPCODE( EQK_JMPF,   ABC,    E_UA|E_JUMP|E_PAIR      )   /* r, k; jump unless r = k                  */ \
+OPCODE( NEQK_JMPF,  ABC,    E_UA|E_JUMP|E_PAIR      )   /* r, k; jump unless r != k                 */ \
+OPCODE( ADDK,       ABC,    E_DA|E_UB               )   /* rd, r, k                                 */ \
+OPCODE( SUBK,       ABC,    E_DA|E_UB               )   /* rd, r, k                                 */ \
+OPCODE( MULK,       ABC,    E_DA|E_UB               )   /* rd, r, k                                 */ \
+OPCODE( YIELD,      N,      E_NONE                  )   /* -                                        */ \
+OPCODE( SEND,       AC,     E_UA|E_UC               )   /* channel, value                           */ \
+OPCODE( RECV,       AC,     E_DA|E_UC|E_IMPURE      )   /* rd, channel                              */ \
+OPCODE( SELECT,     ABC,    E_DA|E_NCALL            )   /* base (and result), nchannels             */ \
+
+
@@ -1,10 +1,14 @@
+// The parser reads tokens either from its lexer, one at a time, or by
+// index from a buffer tokenized up front (rt_parser_init_tokens).
 typedef struct rt_parser {
 	rt_lexer_t lexer;
+	rt_tokens_t *tokens;	// or NULL to pull tokens from the lexer
+	int ti;					// index of the current token in tokens
 	int curr;
 	const char *error;
 } rt_parser_t;
 
-int pdebug_depth = 0;
+thread_local int pdebug_depth = 0;
 void pdebug_print(const char *msg) {
 	if (msg[0] == '<') pdebug_depth--;
 	for (int i = 0; i < pdebug_depth; ++i) {
@@ -15,7 +19,9 @@ void pdebug_print(const char *msg) {
 	if (msg[0] == '>') pdebug_depth++;
 }
 
+#ifndef PDEBUG
 #define PDEBUG(msg) pdebug_print(msg)
+#endif
 
 typedef val_t (*prefix_parse_f)(rt_parser_t *p);
 typedef val_t (*infix_parse_f)(rt_parser_t *p, val_t left);
@@ -79,16 +85,16 @@ struct infix_op {
 	NEXT()
 
 #define NEXT() \
-	p->curr = rt_lexer_next(&p->lexer)
+	p->curr = p->tokens ? parser_next_token(p) : rt_lexer_next(&p->lexer)
 
 #define CURR() \
 	(p->curr)
 
 #define TEXT() \
-	(p->lexer.tok)
+	(p->tokens ? p->tokens->text + p->tokens->offsets[p->ti] : p->lexer.tok)
 
 #define TEXT_LEN() \
-	(p->lexer.tok_len)
+	(p->tokens ? (int)p->tokens->lens[p->ti] : p->lexer.tok_len)
 
 #define AT(tok) \
 	(CURR() == tok)
@@ -96,6 +102,15 @@ struct infix_op {
 #define MK2(type, arg1, arg2) \
 	mk_ast_##type(arg1, arg2)
 
+// Advances through the token buffer, stopping at its last token (TOK_EOF
+// or TOK_ERROR), as the lexer does.
+int parser_next_token(rt_parser_t *p) {
+	if (p->ti < p->tokens->ntokens - 1) {
+		p->ti++;
+	}
+	return p->tokens->kinds[p->ti];
+}
+
 val_t parse_expression_list(rt_parser_t *p) {
 	PDEBUG("> expression list");
 	val_t head = mk_nil(), tail = mk_nil();
@@ -143,21 +158,23 @@ val_t parse_ident(rt_parser_t *p) {
 }
 
 val_t parse_string(rt_parser_t *p) {
-	val_t str = mk_string_from_token(p->lexer.tok, p->lexer.tok_len);
+	val_t str = mk_string_from_token(ast_arena, TEXT(), TEXT_LEN());
 	NEXT();
 	return str;
 }
 
 val_t parse_int(rt_parser_t *p) {
-	// TODO: overflow
-	// TODO: use correct int type
-	int val = 0;
-	for (int i = 0; i < p->lexer.tok_len; ++i) {
-		val = (val * 10) + (p->lexer.tok[i] - '0');
-	}
+	val_t val = mk_int_from_token(ast_arena, TEXT(), TEXT_LEN());
 	NEXT();
 	PDEBUG("- int");
-	return mk_int(val);
+	return val;
+}
+
+val_t parse_float(rt_parser_t *p) {
+	val_t val = mk_float_from_token(TEXT(), TEXT_LEN());
+	NEXT();
+	PDEBUG("- float");
+	return val;
 }
 
 val_t parse_prefix_op(rt_parser_t *p) {
@@ -208,6 +225,8 @@ val_t parse_expression(rt_parser_t *p, int precedence) {
 		PARSE_INTO(left, string);
 	} else if (AT(TOK_INT)) {
 		PARSE_INTO(left, int);
+	} else if (AT(TOK_FLOAT)) {
+		PARSE_INTO(left, float);
 	} else if ((CURR() < TOK_OP_MAX)
 				&& (prefix_ops[CURR()].parser != NULL)) {
 		left = prefix_ops[CURR()].parser(p);
@@ -282,7 +301,7 @@ val_t parse_fn_def(rt_parser_t *p) {
 	if (!AT(TOK_IDENT)) {
 		ERROR("expected: identifier");
 	}
-	int name = rt_intern(p->lexer.tok, p->lexer.tok_len);
+	int name = rt_intern(TEXT(), TEXT_LEN());
 	NEXT();
 	val_t params_head = mk_nil(), params_tail = mk_nil();
 	if (AT(TOK_LPAREN)) {
@@ -312,6 +331,17 @@ val_t parse_fn_def(rt_parser_t *p) {
 	return mk_ast_fn_def(name, params_head, body);
 }
 
+val_t parse_return(rt_parser_t *p, int terminator) {
+	PDEBUG("> return");
+	ACCEPT(TOK_RETURN);
+	val_t exp = mk_nil();
+	if (!AT(TOK_NL) && !AT(terminator)) {
+		PARSE_INTO(exp, expression, 0);
+	}
+	PDEBUG("< return");
+	return mk_ast_return(exp);
+}
+
 val_t parse_statement(rt_parser_t *p, int terminator) {
 	PDEBUG("> statement");
 	val_t stmt;
@@ -322,7 +352,11 @@ val_t parse_statement(rt_parser_t *p, int terminator) {
 	} else if (AT(TOK_DEF)) {
 		PARSE_INTO(stmt, fn_def);
 	} else {
-		PARSE_INTO(stmt, expression, 0);
+		if (AT(TOK_RETURN)) {
+			PARSE_INTO(stmt, return, terminator);
+		} else {
+			PARSE_INTO(stmt, expression, 0);
+		}
 		if (AT(TOK_NL)) {
 			SKIP_NL();
 		} else if (AT(terminator)) {
@@ -363,11 +397,41 @@ val_t parse_module(rt_parser_t *p) {
 
 /* Public Interface */
 
+// Initialises `parser` to pull tokens from parser->lexer, which the
+// caller has initialised.
 void rt_parser_init(rt_parser_t *parser) {
+	parser->tokens = NULL;
+	parser->ti = 0;
 	parser->curr = rt_lexer_next(&parser->lexer);
 	parser->error = NULL;
 }
 
+// Initialises `parser` to walk `tokens`.
+void rt_parser_init_tokens(rt_parser_t *parser, rt_tokens_t *tokens) {
+	parser->tokens = tokens;
+	parser->ti = 0;
+	parser->curr = tokens->kinds[0];
+	parser->error = NULL;
+}
+
+// Returns the error message for a failed parse: the lexer's, if it was
+// the input that didn't lex.
+const char *rt_parser_error(rt_parser_t *parser) {
+	if (parser->curr == TOK_ERROR) {
+		return parser->tokens ? parser->tokens->error : parser->lexer.error;
+	}
+	return parser->error;
+}
+
+// Gets the position of the current token, for reporting errors.
+void rt_parser_position(rt_parser_t *parser, int *line, int *column) {
+	if (parser->tokens) {
+		rt_lexer_position(&parser->tokens->lexer, parser->tokens->offsets[parser->ti], line, column);
+	} else {
+		rt_lexer_position(&parser->lexer, parser->lexer.tok_start, line, column);
+	}
+}
+
 val_t rt_parse_module(rt_parser_t *parser) {
 	return parse_module(parser);
 }
@@ -0,0 +1,434 @@
+// Peephole optimizer
+//
+// Runs over a compiled code unit before it's executed. The instruction
+// stream is decoded into an array of instructions with full-width operands
+// and jump targets held as instruction indices, rewritten in place, and
+// re-encoded. A paired compare-and-branch and the JMP after it are a
+// single instruction here. Deleting instructions or widening an operand therefore can't
+// leave a stale jump offset behind. The rewrites are:
+//
+//   - a jump to an unconditional jump is pointed at its final target, and
+//     a jump to the next instruction is deleted
+//   - unreachable instructions are deleted
+//   - COPY r, r is deleted
+//   - an instruction that defines a temporary which is never read is
+//     deleted, if it has no other effect (this includes calls to pure
+//     natives)
+//   - an instruction defining temporary t followed by COPY r, t, where t is
+//     dead after the copy, defines r directly and the copy is deleted
+//
+// Rewrites are repeated until none applies, since each can expose more
+// (e.g. deleting a dead copy can make the load feeding it dead).
+//
+// Liveness is computed for temporaries only; registers pinned to locals
+// and parameters (those below nlocals) are always assumed live.
+
+typedef struct {
+    opcode_t op;
+    int a, b, c;
+    int k;          // constant index, or target instruction for jumps
+    int dead;
+    int target_p;   // some jump lands here
+} ph_inst_t;
+
+typedef struct {
+    ph_inst_t *insts;
+    int n;
+    int *temps;     // register -> temporary number, or -1 if pinned
+    int ntemps;
+    int words;      // uint64_t words per live set
+    uint64_t *live; // live-in set of each instruction
+    const rt_native_t *natives;
+} peephole_t;
+
+#define PH_EFFECTS(in)      (opcode_effects[(in)->op >> OP_SHIFT])
+#define PH_FORMAT(in)       (opcode_formats[(in)->op >> OP_SHIFT])
+#define PH_LIVE(ph, i)      (&(ph)->live[(size_t)(i) * (ph)->words])
+#define PH_TEST(set, t)     ((set)[(t) >> 6] & (1ULL << ((t) & 63)))
+#define PH_SET(set, t)      ((set)[(t) >> 6] |= (1ULL << ((t) & 63)))
+#define PH_CLEAR(set, t)    ((set)[(t) >> 6] &= ~(1ULL << ((t) & 63)))
+
+void ph_decode(peephole_t *ph, code_t *co) {
+    // maps each original position to the instruction that starts there
+    int *index = (int*)malloc(sizeof(int) * (co->pi + 1));
+    ph->insts = (ph_inst_t*)malloc(sizeof(ph_inst_t) * (co->pi + 1));
+    if (!index || !ph->insts) {
+        fprintf(stderr, "failed to allocate peephole buffers\n");
+        exit(1);
+    }
+    ph->n = 0;
+    for (int p = 0; p < co->pi; ++p) {
+        index[p] = ph->n;
+        inst_t ext = 0;
+        if (INST_OP(co->code[p]) == OP_EXT) {
+            ext = co->code[p++];
+            index[p] = ph->n;
+        }
+        inst_t inst = co->code[p];
+        ph_inst_t *in = &ph->insts[ph->n++];
+        in->op = (opcode_t)INST_OP(inst);
+        in->a = (INST_A(ext) << 8) | INST_A(inst);
+        in->b = (INST_B(ext) << 8) | INST_B(inst);
+        in->c = (INST_C(ext) << 8) | INST_C(inst);
+        in->k = (int)((INST_K(ext) << 16) | INST_K(inst));
+        in->dead = 0;
+        in->target_p = 0;
+        int fmt = INST_FMT(inst);
+        if (fmt == FMT_AK) {
+            in->b = in->c = 0;
+        } else if (fmt == FMT_J || fmt == FMT_AJ) {
+            // resolved to an instruction index below
+            in->k = p + 1 + code_jump_offset(co, p);
+            if (fmt == FMT_J) in->a = 0;
+            in->b = in->c = 0;
+        } else if (PH_EFFECTS(in) & E_PAIR) {
+            // fold the JMP holding the target into this instruction
+            index[++p] = ph->n - 1;
+            if (INST_OP(co->code[p]) == OP_EXT) {
+                index[++p] = ph->n - 1;
+            }
+            in->k = p + 1 + code_jump_offset(co, p);
+        }
+    }
+    index[co->pi] = ph->n;
+    for (int i = 0; i < ph->n; ++i) {
+        if (PH_EFFECTS(&ph->insts[i]) & E_JUMP) {
+            ph->insts[i].k = index[ph->insts[i].k];
+        }
+    }
+    free(index);
+}
+
+// Returns the first live instruction at or after `i`, or n.
+int ph_resolve(peephole_t *ph, int i) {
+    while (i < ph->n && ph->insts[i].dead) i++;
+    return i;
+}
+
+int ph_delete(peephole_t *ph, int i) {
+    ph->insts[i].dead = 1;
+    if (ph->insts[i].target_p) {
+        int next = ph_resolve(ph, i);
+        if (next < ph->n) ph->insts[next].target_p = 1;
+    }
+    return 1;
+}
+
+// Returns the register defined by `in`, or -1.
+int ph_def(ph_inst_t *in) {
+    int effects = PH_EFFECTS(in);
+    if (effects & E_DA) return in->a;
+    if (effects & E_CALL) return in->c;
+    return -1;
+}
+
+void ph_set_def(ph_inst_t *in, int r) {
+    if (PH_EFFECTS(in) & E_DA) {
+        in->a = r;
+    } else {
+        in->c = r;
+    }
+}
+
+// Points every jump at the end of its chain of unconditional jumps and
+// deletes jumps to the following instruction.
+int ph_thread_jumps(peephole_t *ph) {
+    int changed = 0;
+    for (int i = 0; i < ph->n; ++i) {
+        ph_inst_t *in = &ph->insts[i];
+        if (in->dead || !(PH_EFFECTS(in) & E_JUMP)) continue;
+        int target = ph_resolve(ph, in->k);
+        // bounded, in case of a cycle of jumps
+        for (int hops = 0; hops < ph->n && target < ph->n; ++hops) {
+            ph_inst_t *to = &ph->insts[target];
+            if (to->op != OP_JMP || target == i) break;
+            target = ph_resolve(ph, to->k);
+        }
+        if (target != in->k) {
+            in->k = target;
+            changed = 1;
+        }
+        if (target == ph_resolve(ph, i + 1)) {
+            changed = ph_delete(ph, i);
+        }
+    }
+    return changed;
+}
+
+int ph_delete_unreachable(peephole_t *ph) {
+    char *reached = (char*)calloc(ph->n + 1, 1);
+    int *stack = (int*)malloc(sizeof(int) * (ph->n + 1));
+    if (!reached || !stack) {
+        fprintf(stderr, "failed to allocate peephole buffers\n");
+        exit(1);
+    }
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        int i = ph_resolve(ph, stack[--sp]);
+        if (i >= ph->n || reached[i]) continue;
+        reached[i] = 1;
+        ph_inst_t *in = &ph->insts[i];
+        if (PH_EFFECTS(in) & E_JUMP) stack[sp++] = in->k;
+        if (!(PH_EFFECTS(in) & E_END)) stack[sp++] = i + 1;
+    }
+    int changed = 0;
+    for (int i = 0; i < ph->n; ++i) {
+        if (!ph->insts[i].dead && !reached[i]) {
+            ph->insts[i].dead = 1;
+            changed = 1;
+        }
+    }
+    free(stack);
+    free(reached);
+    return changed;
+}
+
+void ph_mark_targets(peephole_t *ph) {
+    for (int i = 0; i < ph->n; ++i) {
+        ph->insts[i].target_p = 0;
+    }
+    for (int i = 0; i < ph->n; ++i) {
+        ph_inst_t *in = &ph->insts[i];
+        if (in->dead || !(PH_EFFECTS(in) & E_JUMP)) continue;
+        in->k = ph_resolve(ph, in->k);
+        if (in->k < ph->n) ph->insts[in->k].target_p = 1;
+    }
+}
+
+// Computes the live-out set of instruction `i` into `out`.
+void ph_live_out(peephole_t *ph, int i, uint64_t *out) {
+    ph_inst_t *in = &ph->insts[i];
+    for (int w = 0; w < ph->words; ++w) out[w] = 0;
+    int succ[2], nsucc = 0;
+    if (!(PH_EFFECTS(in) & E_END)) succ[nsucc++] = ph_resolve(ph, i + 1);
+    if (PH_EFFECTS(in) & E_JUMP) succ[nsucc++] = ph_resolve(ph, in->k);
+    for (int s = 0; s < nsucc; ++s) {
+        if (succ[s] >= ph->n) continue;
+        uint64_t *live = PH_LIVE(ph, succ[s]);
+        for (int w = 0; w < ph->words; ++w) out[w] |= live[w];
+    }
+}
+
+void ph_use(peephole_t *ph, uint64_t *set, int r) {
+    if (ph->temps[r] >= 0) PH_SET(set, ph->temps[r]);
+}
+
+// Backward dataflow to a fixed point: live-in = uses + (live-out - defs).
+void ph_liveness(peephole_t *ph, uint64_t *scratch) {
+    for (size_t w = 0; w < (size_t)ph->n * ph->words; ++w) {
+        ph->live[w] = 0;
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = ph->n - 1; i >= 0; --i) {
+            ph_inst_t *in = &ph->insts[i];
+            if (in->dead) continue;
+            ph_live_out(ph, i, scratch);
+            int effects = PH_EFFECTS(in);
+            int def = ph_def(in);
+            if (def >= 0 && ph->temps[def] >= 0) PH_CLEAR(scratch, ph->temps[def]);
+            if (effects & E_UA) ph_use(ph, scratch, in->a);
+            if (effects & E_UB) ph_use(ph, scratch, in->b);
+            if (effects & E_UC) ph_use(ph, scratch, in->c);
+            if (effects & E_CALL) {
+                for (int r = in->a; r <= in->a + in->b; ++r) ph_use(ph, scratch, r);
+            }
+            if (effects & E_NCALL) {
+                for (int r = in->a; r < in->a + in->b; ++r) ph_use(ph, scratch, r);
+            }
+            uint64_t *live = PH_LIVE(ph, i);
+            for (int w = 0; w < ph->words; ++w) {
+                if (live[w] != scratch[w]) {
+                    live[w] = scratch[w];
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+// Returns non-zero if `in` does nothing but define its destination register.
+int ph_pure_p(peephole_t *ph, ph_inst_t *in) {
+    int effects = PH_EFFECTS(in);
+    if (in->op == OP_CALLN) {
+        return (ph->natives[in->c].flags & NATIVE_PURE) != 0;
+    }
+    return (effects & E_DA) && !(effects & ~(E_DA | E_UB | E_UC));
+}
+
+// Returns non-zero if temporary register `r` may be read after `i` executes.
+int ph_live_after(peephole_t *ph, int i, int r, uint64_t *scratch) {
+    if (ph->temps[r] < 0) return 1;
+    ph_live_out(ph, i, scratch);
+    return PH_TEST(scratch, ph->temps[r]) != 0;
+}
+
+// One forward sweep of the register rewrites. Liveness is not updated as
+// instructions are rewritten, but every rewrite only shrinks the true live
+// sets, so the stale ones remain a safe over-approximation.
+int ph_sweep(peephole_t *ph, uint64_t *scratch) {
+    int changed = 0;
+    int prev = -1;
+    for (int i = 0; i < ph->n; ++i) {
+        ph_inst_t *in = &ph->insts[i];
+        if (in->dead) continue;
+        int def = ph_def(in);
+        if (in->op == OP_COPY && in->a == in->c) {
+            changed = ph_delete(ph, i);
+            continue;
+        }
+        if (ph_pure_p(ph, in) && !ph_live_after(ph, i, def, scratch)) {
+            changed = ph_delete(ph, i);
+            continue;
+        }
+        if (in->op == OP_COPY && prev >= 0 && !in->target_p
+            && ph->temps[in->c] >= 0 && ph_def(&ph->insts[prev]) == in->c
+            && !(PH_EFFECTS(&ph->insts[prev]) & (E_JUMP | E_END | E_NCALL))
+            && !ph_live_after(ph, i, in->c, scratch)) {
+            ph_set_def(&ph->insts[prev], in->a);
+            changed = ph_delete(ph, i);
+            continue;
+        }
+        prev = i;
+    }
+    return changed;
+}
+
+// Returns non-zero if `in` needs an OP_EXT prefix when its following
+// instruction starts at `next` and its target (if any) at `target`. For a
+// paired instruction this covers only the instruction itself.
+int ph_wide_p(ph_inst_t *in, int next, int target) {
+    switch (PH_FORMAT(in)) {
+        case FMT_AK:
+            return in->a > 0xFF || (uint32_t)in->k > 0xFFFF;
+        case FMT_J:
+            return target - next < INST_SJ_MIN || target - next > INST_SJ_MAX;
+        case FMT_AJ:
+            return in->a > 0xFF || target - next < INT16_MIN || target - next > INT16_MAX;
+        default:
+            return (in->a | in->b | in->c) > 0xFF;
+    }
+}
+
+// The number of words `in` occupies. Bit 0 of `wide` gives its own prefix;
+// bit 1 the prefix of the JMP that follows a paired instruction.
+int ph_size(ph_inst_t *in, int wide) {
+    int size = 1 + (wide & 1);
+    if (PH_EFFECTS(in) & E_PAIR) {
+        size += 1 + ((wide >> 1) & 1);
+    }
+    return size;
+}
+
+void ph_encode(peephole_t *ph, code_t *co) {
+    // Lay out the surviving instructions. A jump's prefix depends on its
+    // offset, which depends on which other jumps have prefixes; offsets
+    // only grow as prefixes are added, so iterate until nothing changes.
+    int *pos = (int*)malloc(sizeof(int) * (ph->n + 1));
+    char *wide = (char*)calloc(ph->n + 1, 1);
+    if (!pos || !wide) {
+        fprintf(stderr, "failed to allocate peephole buffers\n");
+        exit(1);
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        int p = 0;
+        for (int i = 0; i < ph->n; ++i) {
+            pos[i] = p;
+            if (!ph->insts[i].dead) p += ph_size(&ph->insts[i], wide[i]);
+        }
+        pos[ph->n] = p;
+        for (int i = 0; i < ph->n; ++i) {
+            ph_inst_t *in = &ph->insts[i];
+            if (in->dead) continue;
+            int target = (PH_EFFECTS(in) & E_JUMP) ? pos[in->k] : 0;
+            int w = wide[i];
+            if (!(w & 1) && ph_wide_p(in, pos[i] + 1, target)) {
+                w |= 1;
+            }
+            if ((PH_EFFECTS(in) & E_PAIR) && !(w & 2)) {
+                int next = pos[i] + (w & 1) + 2;
+                if (target - next < INST_SJ_MIN || target - next > INST_SJ_MAX) {
+                    w |= 2;
+                }
+            }
+            if (w != wide[i]) {
+                wide[i] = w;
+                changed = 1;
+            }
+        }
+    }
+
+    co->pi = 0;
+    for (int i = 0; i < ph->n; ++i) {
+        ph_inst_t *in = &ph->insts[i];
+        if (in->dead) continue;
+        switch (PH_FORMAT(in)) {
+            case FMT_N:     emit_n(co, in->op); break;
+            case FMT_AK:    emit_ak(co, in->op, in->a, in->k); break;
+            case FMT_J:     emit_j(co, in->op, pos[in->k]); break;
+            case FMT_AJ:    emit_aj(co, in->op, in->a, pos[in->k]); break;
+            default:        emit_abc(co, in->op, in->a, in->b, in->c); break;
+        }
+        if (PH_EFFECTS(in) & E_PAIR) {
+            emit_j(co, OP_JMP, pos[in->k]);
+        }
+    }
+    if (co->pi != pos[ph->n]) {
+        fprintf(stderr, "peephole: encoded %d instructions, expected %d\n", co->pi, pos[ph->n]);
+        exit(1);
+    }
+
+    free(wide);
+    free(pos);
+}
+
+void peephole(code_t *co) {
+    for (int i = 0; i < co->nprotos; ++i) {
+        peephole(co->protos[i]);
+    }
+
+    peephole_t ph;
+    ph_decode(&ph, co);
+    ph.natives = co->module->natives->natives;
+
+    ph.temps = (int*)malloc(sizeof(int) * (co->nregs + 1));
+    ph.ntemps = 0;
+    for (int r = 0; r < co->nregs; ++r) {
+        ph.temps[r] = r < co->nlocals ? -1 : ph.ntemps++;
+    }
+    ph.words = (ph.ntemps + 63) / 64;
+    if (ph.words == 0) ph.words = 1;
+    ph.live = (uint64_t*)malloc(sizeof(uint64_t) * ph.words * ((size_t)ph.n + 1));
+    uint64_t *scratch = (uint64_t*)malloc(sizeof(uint64_t) * ph.words);
+    if (!ph.temps || !ph.live || !scratch) {
+        fprintf(stderr, "failed to allocate peephole buffers\n");
+        exit(1);
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = ph_thread_jumps(&ph);
+        changed |= ph_delete_unreachable(&ph);
+        ph_mark_targets(&ph);
+        ph_liveness(&ph, scratch);
+        changed |= ph_sweep(&ph, scratch);
+    }
+
+    ph_encode(&ph, co);
+
+    free(scratch);
+    free(ph.live);
+    free(ph.temps);
+    free(ph.insts);
+}
+
+#undef PH_EFFECTS
+#undef PH_FORMAT
+#undef PH_LIVE
+#undef PH_TEST
+#undef PH_SET
+#undef PH_CLEAR
@@ -0,0 +1,158 @@
+// VM profiling
+//
+// Building with -DRT_PROFILE produces an instrumented interpreter that
+// counts executions of each opcode and of each pair of consecutively
+// executed opcodes (bigrams). Adding -DRT_PROFILE_CYCLES also samples the
+// cycle counter at every dispatch and attributes the elapsed cycles to the
+// instruction that just finished, building a per-opcode log2 histogram.
+//
+// The report is printed to stderr when the VM executes OP_HALT, or on
+// SIGUSR1 at the next instruction boundary. Without RT_PROFILE none of this
+// is compiled in.
+
+#ifdef RT_PROFILE
+
+#include <signal.h>
+
+#ifdef RT_PROFILE_CYCLES
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CYCLES() __rdtsc()
+#else
+#include <time.h>
+uint64_t profile_cycles_fallback() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define PROFILE_CYCLES() profile_cycles_fallback()
+#endif
+#endif
+
+#define PROFILE_HIST_BUCKETS 32
+#define PROFILE_TOP_PAIRS 20
+
+typedef struct {
+    uint64_t counts[OPI_MAX];
+    uint64_t pairs[OPI_MAX][OPI_MAX];
+    int prev;
+#ifdef RT_PROFILE_CYCLES
+    uint64_t cycles[OPI_MAX];
+    uint64_t hist[OPI_MAX][PROFILE_HIST_BUCKETS];
+    uint64_t last;
+#endif
+} rt_profile_t;
+
+rt_profile_t rt_profile;
+volatile sig_atomic_t rt_profile_requested = 0;
+
+void profile_signal_handler(int sig) {
+    rt_profile_requested = 1;
+}
+
+void rt_profile_init() {
+    memset(&rt_profile, 0, sizeof(rt_profile));
+    signal(SIGUSR1, profile_signal_handler);
+#ifdef RT_PROFILE_CYCLES
+    rt_profile.last = PROFILE_CYCLES();
+#endif
+}
+
+void rt_profile_report(FILE *out) {
+    uint64_t total = 0;
+    int order[OPI_MAX];
+    int nops = 0;
+    for (int i = 0; i < OPI_MAX; ++i) {
+        total += rt_profile.counts[i];
+        if (rt_profile.counts[i]) {
+            order[nops++] = i;
+        }
+    }
+    // insertion sort by count, descending; there are only a few dozen
+    for (int i = 1; i < nops; ++i) {
+        int op = order[i], j = i;
+        while (j > 0 && rt_profile.counts[order[j - 1]] < rt_profile.counts[op]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = op;
+    }
+
+    fprintf(out, "\n=== opcode profile: %llu instructions ===\n", (unsigned long long)total);
+#ifdef RT_PROFILE_CYCLES
+    fprintf(out, "%-10s %14s %7s %10s  %s\n", "opcode", "count", "%", "cyc/op", "cycle histogram (log2 buckets: count)");
+#else
+    fprintf(out, "%-10s %14s %7s\n", "opcode", "count", "%");
+#endif
+    for (int i = 0; i < nops; ++i) {
+        int op = order[i];
+        uint64_t n = rt_profile.counts[op];
+        fprintf(out, "%-10s %14llu %6.2f%%", opcode_names[op], (unsigned long long)n, 100.0 * n / total);
+#ifdef RT_PROFILE_CYCLES
+        fprintf(out, " %10.1f ", (double)rt_profile.cycles[op] / n);
+        for (int b = 0; b < PROFILE_HIST_BUCKETS; ++b) {
+            if (rt_profile.hist[op][b]) {
+                fprintf(out, " %d:%llu", 1 << b, (unsigned long long)rt_profile.hist[op][b]);
+            }
+        }
+#endif
+        fputc('\n', out);
+    }
+
+    fprintf(out, "\n=== hottest opcode pairs ===\n");
+    uint64_t shown_above = UINT64_MAX;
+    int shown = 0;
+    while (shown < PROFILE_TOP_PAIRS) {
+        // next-largest pair count below the last one shown
+        uint64_t best = 0;
+        for (int a = 0; a < OPI_MAX; ++a) {
+            for (int b = 0; b < OPI_MAX; ++b) {
+                uint64_t n = rt_profile.pairs[a][b];
+                if (n < shown_above && n > best) best = n;
+            }
+        }
+        if (best == 0) break;
+        for (int a = 0; a < OPI_MAX && shown < PROFILE_TOP_PAIRS; ++a) {
+            for (int b = 0; b < OPI_MAX && shown < PROFILE_TOP_PAIRS; ++b) {
+                if (rt_profile.pairs[a][b] == best) {
+                    fprintf(out, "%-10s -> %-10s %14llu %6.2f%%\n",
+                        a ? opcode_names[a] : "<start>", opcode_names[b],
+                        (unsigned long long)best, 100.0 * best / total);
+                    shown++;
+                }
+            }
+        }
+        shown_above = best;
+    }
+    fflush(out);
+}
+
+inline void rt_profile_instruction(inst_t op) {
+    int curr = op >> OP_SHIFT;
+#ifdef RT_PROFILE_CYCLES
+    uint64_t now = PROFILE_CYCLES();
+    if (rt_profile.prev) {
+        uint64_t elapsed = now - rt_profile.last;
+        rt_profile.cycles[rt_profile.prev] += elapsed;
+        int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+        if (bucket >= PROFILE_HIST_BUCKETS) bucket = PROFILE_HIST_BUCKETS - 1;
+        rt_profile.hist[rt_profile.prev][bucket]++;
+    }
+    rt_profile.last = now;
+#endif
+    rt_profile.counts[curr]++;
+    rt_profile.pairs[rt_profile.prev][curr]++;
+    rt_profile.prev = curr;
+    if (rt_profile_requested) {
+        rt_profile_requested = 0;
+        rt_profile_report(stderr);
+    }
+}
+
+#define PROFILE_INSTRUCTION(op) rt_profile_instruction(op)
+
+#else
+
+#define PROFILE_INSTRUCTION(op)
+
+#endif
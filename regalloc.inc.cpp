@@ -0,0 +1,264 @@
+// Register allocation
+//
+// Named locals are pinned to registers up front, in order of first
+// appearance, and keep them for the lifetime of the code unit. Names that
+// refer to globals (functions and host bindings) are marked as such and
+// never get a register, unless the code unit assigns to them, in which
+// case the local shadows the global throughout. Everything else is
+// a temporary with a single definition and a single use, emitted in
+// postorder, so its live interval ends at the instruction that consumes
+// it. Linear scan over such intervals reduces to: allocate the lowest free
+// register at the definition, and expire it at the use. Because every
+// temporary has expired by the end of its statement, registers are reused
+// across statements and the frame only grows to the deepest expression.
+//
+// To keep that depth down, binary operator operands are evaluated in
+// Sethi-Ullman order: the side needing more registers goes first, so its
+// temporaries are released before the cheaper side allocates. Operands
+// are only reordered when neither side can have side effects.
+//
+// https://en.wikipedia.org/wiki/Sethi%E2%80%93Ullman_algorithm
+// https://lambda.uta.edu/cse5317/fall02/notes/node40.html
+// http://www.christianwimmer.at/Publications/Wimmer10a/Wimmer10a.pdf
+
+// Registers beyond 255 are reached through OP_EXT-prefixed instructions.
+#define RA_MAX_REGS 65536
+
+typedef struct {
+    uint32_t used[RA_MAX_REGS / 32];
+    uint32_t pinned[RA_MAX_REGS / 32];
+    int nregs;
+    int *sym_regs;
+    int sym_cap;
+    const int *globals;     // non-zero for each symbol naming a global
+    int globals_cap;
+} regalloc_t;
+
+#define RA_TEST(set, r)     ((set)[(r) >> 5] & (1u << ((r) & 31)))
+#define RA_SET(set, r)      ((set)[(r) >> 5] |= (1u << ((r) & 31)))
+#define RA_CLEAR(set, r)    ((set)[(r) >> 5] &= ~(1u << ((r) & 31)))
+
+void ra_init(regalloc_t *ra) {
+    for (int i = 0; i < RA_MAX_REGS / 32; ++i) {
+        ra->used[i] = 0;
+        ra->pinned[i] = 0;
+    }
+    ra->nregs = 0;
+    ra->sym_regs = NULL;
+    ra->sym_cap = 0;
+    ra->globals = NULL;
+    ra->globals_cap = 0;
+}
+
+void ra_mark(regalloc_t *ra, int r) {
+    RA_SET(ra->used, r);
+    if (r >= ra->nregs) {
+        ra->nregs = r + 1;
+    }
+}
+
+int ra_alloc_block(regalloc_t *ra, int n) {
+    int run = 0;
+    for (int r = 0; r < RA_MAX_REGS; ++r) {
+        if (run == 0 && (r & 31) == 0 && ra->used[r >> 5] == 0xFFFFFFFF) {
+            r += 31;
+            continue;
+        }
+        run = RA_TEST(ra->used, r) ? 0 : run + 1;
+        if (run == n) {
+            int base = r - n + 1;
+            for (int i = base; i <= r; ++i) {
+                ra_mark(ra, i);
+            }
+            return base;
+        }
+    }
+    fprintf(stderr, "register allocation failed: expression needs more than %d registers\n", RA_MAX_REGS);
+    exit(1);
+}
+
+int ra_alloc(regalloc_t *ra) {
+    return ra_alloc_block(ra, 1);
+}
+
+// Allocates `n` contiguous registers above every register in use. A call
+// block must be allocated this way: the callee's frame starts inside the
+// block and extends beyond it, over anything the caller keeps higher up.
+int ra_alloc_frame(regalloc_t *ra, int n) {
+    int base = ra->nregs;
+    while (base > 0 && !RA_TEST(ra->used, base - 1)) {
+        base--;
+    }
+    if (base + n > RA_MAX_REGS) {
+        fprintf(stderr, "register allocation failed: expression needs more than %d registers\n", RA_MAX_REGS);
+        exit(1);
+    }
+    for (int i = base; i < base + n; ++i) {
+        ra_mark(ra, i);
+    }
+    return base;
+}
+
+// Expire a register. Pinned registers belong to locals and are never freed.
+void ra_free(regalloc_t *ra, int r) {
+    if (!RA_TEST(ra->pinned, r)) {
+        RA_CLEAR(ra->used, r);
+    }
+}
+
+void ra_reserve_sym(regalloc_t *ra, int sym) {
+    if (sym >= ra->sym_cap) {
+        int cap = ra->sym_cap ? ra->sym_cap : 64;
+        while (cap <= sym) cap *= 2;
+        ra->sym_regs = (int*)realloc(ra->sym_regs, sizeof(int) * cap);
+        if (!ra->sym_regs) {
+            fprintf(stderr, "failed to allocate symbol register map\n");
+            exit(1);
+        }
+        for (int i = ra->sym_cap; i < cap; ++i) {
+            ra->sym_regs[i] = -1;
+        }
+        ra->sym_cap = cap;
+    }
+}
+
+void ra_bind(regalloc_t *ra, int sym, int r) {
+    ra_reserve_sym(ra, sym);
+    ra->sym_regs[sym] = r;
+    ra_mark(ra, r);
+    RA_SET(ra->pinned, r);
+}
+
+// Names for which `globals[sym]` is non-zero refer to globals, unless
+// bound as locals beforehand (as parameters are).
+void ra_set_globals(regalloc_t *ra, const int *globals, int cap) {
+    ra->globals = globals;
+    ra->globals_cap = cap;
+}
+
+// Returns the register holding local `sym`, pinning a fresh one on first
+// use, or -1 if `sym` names a global.
+int ra_local(regalloc_t *ra, int sym) {
+    if (sym < ra->sym_cap && ra->sym_regs[sym] != -1) {
+        return ra->sym_regs[sym];
+    } else if (sym < ra->globals_cap && ra->globals[sym]) {
+        return -1;
+    }
+    int r = ra_alloc(ra);
+    ra_bind(ra, sym, r);
+    return r;
+}
+
+// Pins a register for every local referenced in `exp` (a statement list or
+// any node within one). Locals are live for the whole code unit, so this
+// must happen before any temporary is allocated; otherwise a local first
+// seen inside a loop could be given a register that an earlier part of the
+// same loop uses as a temporary.
+void ra_declare_locals(regalloc_t *ra, val_t exp) {
+    if (ident_p(exp)) {
+        ra_local(ra, ident_val(exp));
+        return;
+    } else if (!ast_p(exp) || ast_val(exp) == NULL) {
+        return;
+    }
+    ast_node_t *node = ast_val(exp);
+    switch (node->type) {
+        case AST_LIST:
+            while (!nil_p(exp)) {
+                ra_declare_locals(ra, ((ast_list_t*)ast_val(exp))->exp);
+                exp = ((ast_list_t*)ast_val(exp))->next;
+            }
+            break;
+        case AST_BIN_OP:
+            // assigning to a name makes it local, shadowing any global
+            // (such as a builtin) of the same name
+            if (((ast_binop_t*)node)->op == OPERATOR_ASSIGN) {
+                int sym = ident_val(((ast_binop_t*)node)->l);
+                if (sym >= ra->sym_cap || ra->sym_regs[sym] == -1) {
+                    ra_bind(ra, sym, ra_alloc(ra));
+                }
+            }
+            ra_declare_locals(ra, ((ast_binop_t*)node)->l);
+            ra_declare_locals(ra, ((ast_binop_t*)node)->r);
+            break;
+        case AST_UN_OP:
+            ra_declare_locals(ra, ((ast_unop_t*)node)->exp);
+            break;
+        case AST_CALL:
+            ra_declare_locals(ra, ((ast_call_t*)node)->callee);
+            ra_declare_locals(ra, ((ast_call_t*)node)->args);
+            break;
+        case AST_PRINT:
+            ra_declare_locals(ra, ((ast_print_t*)node)->exp);
+            break;
+        case AST_RETURN:
+            ra_declare_locals(ra, ((ast_return_t*)node)->exp);
+            break;
+        case AST_WHILE:
+            ra_declare_locals(ra, ((ast_while_t*)node)->cond);
+            ra_declare_locals(ra, ((ast_while_t*)node)->body);
+            break;
+        case AST_FN_DEF:
+            // function bodies are separate code units
+            break;
+        case AST_IF:
+            ra_declare_locals(ra, ((ast_if_t*)node)->cond);
+            ra_declare_locals(ra, ((ast_if_t*)node)->body);
+            ra_declare_locals(ra, ((ast_if_t*)node)->next);
+            break;
+    }
+}
+
+// Returns non-zero if evaluating `exp` can't have side effects, i.e. it
+// contains no calls or assignments and may be freely reordered.
+int ra_pure_p(val_t exp) {
+    if (!ast_p(exp)) {
+        return 1;
+    }
+    ast_node_t *node = ast_val(exp);
+    if (node->type == AST_BIN_OP) {
+        ast_binop_t *op = (ast_binop_t*)node;
+        return op->op != OPERATOR_ASSIGN && ra_pure_p(op->l) && ra_pure_p(op->r);
+    }
+    return 0;
+}
+
+// Sethi-Ullman label: the number of temporaries needed to evaluate `exp`.
+// Idents live in their pinned register and need none.
+int ra_need(val_t exp) {
+    if (ident_p(exp)) {
+        return 0;
+    } else if (!ast_p(exp)) {
+        return 1;
+    }
+    ast_node_t *node = ast_val(exp);
+    if (node->type == AST_BIN_OP) {
+        ast_binop_t *op = (ast_binop_t*)node;
+        if (op->need < 0) {
+            if (op->op == OPERATOR_ASSIGN) {
+                op->need = ra_need(op->r);
+            } else {
+                int l = ra_need(op->l), r = ra_need(op->r);
+                op->need = (l == r) ? l + 1 : (l > r ? l : r);
+            }
+        }
+        return op->need;
+    } else if (node->type == AST_CALL) {
+        ast_call_t *call = (ast_call_t*)node;
+        int need = 1 + ra_need(call->callee);
+        int slot = 1;
+        val_t arg = call->args;
+        while (!nil_p(arg)) {
+            int arg_need = slot + ra_need(((ast_list_t*)ast_val(arg))->exp);
+            if (arg_need > need) need = arg_need;
+            slot++;
+            arg = ((ast_list_t*)ast_val(arg))->next;
+        }
+        return need > slot ? need : slot;
+    }
+    return 1;
+}
+
+#undef RA_TEST
+#undef RA_SET
+#undef RA_CLEAR
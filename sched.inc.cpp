@@ -0,0 +1,374 @@
+// Task scheduler
+//
+// Every script runs as a task: the module's top-level code to begin with,
+// plus one for each call to spawn(f, args...), which starts f(args...) in
+// a new task and evaluates to nil. A task owns its register window (value
+// stack) and call stack, so spawning costs one small allocation and
+// thousands of tasks can be live at once.
+//
+// Tasks are multiplexed onto a fixed pool of worker threads. The thread
+// calling run() is worker 0; the others are started by the first spawn,
+// one per core unless RT_WORKERS says otherwise, and outlive the run,
+// sleeping while there is nothing to do. Each worker has a Chase-Lev
+// deque which only it pushes onto: tasks spawned or preempted on a worker
+// go onto the bottom of its deque. Tasks are always taken from the top,
+// so a worker runs its own tasks oldest first (a preempted task goes to
+// the back of the line) and, when it has none, steals the oldest task of
+// another worker picked at random.
+//
+// Preemption is cooperative. A task runs until it finishes or calls
+// yield(), or, while other tasks are runnable or a collection is waiting,
+// until it has made RT_TASK_BUDGET backward jumps and calls. A native
+// that blocks therefore blocks its worker.
+//
+// A task blocked on a channel belongs to the channel rather than to any
+// deque, and is pushed onto its waker's deque by rt_sched_ready(). The
+// waker may get there before the blocked task's worker has let go of it,
+// so the two race on the task's state and whichever comes second queues
+// it. If every live task is blocked, the script can't make progress, and
+// is stopped with an error.
+//
+// Workers are GC mutators except while asleep, and reach a safepoint
+// between any two tasks, at which point they hold none. The collector
+// finds the tasks it must visit in the deques and, for the worker that is
+// collecting, in `current`.
+//
+// run() returns once every task has finished.
+//
+// https://www.dre.vanderbilt.edu/~schmidt/PDF/work-stealing-dequeue.pdf
+// https://fzn.fr/readings/ppopp13.pdf
+
+#include <pthread.h>
+#include <sched.h>
+
+#define RT_MAX_WORKERS 64
+
+// Idle loops a worker makes looking for tasks before it goes to sleep.
+#define SCHED_SPINS 64
+
+typedef struct rt_deque_buf {
+    long cap;                       // a power of two
+    struct rt_deque_buf *prev;      // outgrown; thieves may still read it
+    rt_task_t *tasks[1];
+} rt_deque_buf_t;
+
+typedef struct {
+    long top;                       // oldest task; advanced by CAS
+    long bottom;                    // next free slot; written by the owner
+    rt_deque_buf_t *buf;
+} rt_deque_t;
+
+typedef struct {
+    rt_deque_t deque;
+    rt_task_t *current;             // task being run
+    unsigned seed;                  // for picking victims
+    pthread_t thread;
+} __attribute__((aligned(64))) rt_worker_t;
+
+struct {
+    rt_worker_t workers[RT_MAX_WORKERS];
+    int nworkers;
+    int started;                    // pool threads are running
+    long ntasks;                    // atomic; live tasks, plus
+                                    // SCHED_BLOCKED for each blocked one
+    int sleeping;                   // atomic
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} rt_sched;
+
+// Counted in the high half of rt_sched.ntasks.
+#define SCHED_BLOCKED (1L << 32)
+#define SCHED_LIVE(n) ((n) & (SCHED_BLOCKED - 1))
+
+thread_local rt_worker_t *rt_worker;
+
+// Messages received on channels by tasks that have finished.
+long rt_chan_messages = 0;
+
+rt_deque_buf_t *deque_buf_new(long cap, rt_deque_buf_t *prev) {
+    rt_deque_buf_t *buf = (rt_deque_buf_t*)malloc(sizeof(rt_deque_buf_t) + sizeof(rt_task_t*) * (cap - 1));
+    if (!buf) {
+        fprintf(stderr, "failed to allocate task queue\n");
+        exit(1);
+    }
+    buf->cap = cap;
+    buf->prev = prev;
+    return buf;
+}
+
+void deque_init(rt_deque_t *dq) {
+    dq->top = 0;
+    dq->bottom = 0;
+    dq->buf = deque_buf_new(256, NULL);
+}
+
+// Only the owner may push. A full deque doubles in size; the old buffer
+// is kept, since thieves that loaded it may still read from it.
+void deque_push(rt_deque_t *dq, rt_task_t *task) {
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    rt_deque_buf_t *buf = __atomic_load_n(&dq->buf, __ATOMIC_RELAXED);
+    if (b - t > buf->cap - 1) {
+        rt_deque_buf_t *grown = deque_buf_new(buf->cap * 2, buf);
+        for (long i = t; i < b; ++i) {
+            grown->tasks[i & (grown->cap - 1)] = buf->tasks[i & (buf->cap - 1)];
+        }
+        __atomic_store_n(&dq->buf, grown, __ATOMIC_RELEASE);
+        buf = grown;
+    }
+    __atomic_store_n(&buf->tasks[b & (buf->cap - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+// Takes the oldest task. Any thread may call this; it returns NULL if the
+// deque is empty or another thread took the task first.
+rt_task_t *deque_steal(rt_deque_t *dq) {
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+        return NULL;
+    }
+    rt_deque_buf_t *buf = __atomic_load_n(&dq->buf, __ATOMIC_ACQUIRE);
+    rt_task_t *task = __atomic_load_n(&buf->tasks[t & (buf->cap - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
+
+int deque_empty_p(rt_deque_t *dq) {
+    return __atomic_load_n(&dq->top, __ATOMIC_SEQ_CST) >= __atomic_load_n(&dq->bottom, __ATOMIC_SEQ_CST);
+}
+
+int rt_sched_contended() {
+    long n = __atomic_load_n(&rt_sched.ntasks, __ATOMIC_RELAXED);
+    return SCHED_LIVE(n) - (n >> 32) > 1 || rt_gc_stop_requested();
+}
+
+// Runs with the world stopped, so no deque changes underneath it.
+void sched_visit_roots(void *ctx) {
+    for (int i = 0; i < rt_sched.nworkers; ++i) {
+        rt_worker_t *worker = &rt_sched.workers[i];
+        if (worker->current) {
+            rt_task_visit(worker->current);
+        }
+        rt_deque_t *dq = &worker->deque;
+        for (long j = dq->top; j < dq->bottom; ++j) {
+            rt_task_visit(dq->buf->tasks[j & (dq->buf->cap - 1)]);
+        }
+    }
+}
+
+void sched_init() {
+    if (rt_sched.nworkers) {
+        return;
+    }
+    int n = 1;
+#ifndef RT_PROFILE
+    // the profiler's counters aren't thread-safe
+    const char *env = getenv("RT_WORKERS");
+    n = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1) n = 1;
+    if (n > RT_MAX_WORKERS) n = RT_MAX_WORKERS;
+    for (int i = 0; i < n; ++i) {
+        deque_init(&rt_sched.workers[i].deque);
+        rt_sched.workers[i].current = NULL;
+        rt_sched.workers[i].seed = 2654435761u * (i + 1);
+    }
+    rt_sched.nworkers = n;
+    pthread_mutex_init(&rt_sched.lock, NULL);
+    pthread_cond_init(&rt_sched.wake, NULL);
+    rt_gc_add_root(sched_visit_roots, NULL);
+}
+
+// Takes a task from this worker's deque, or else steals one.
+rt_task_t *sched_find(rt_worker_t *self) {
+    rt_task_t *task = deque_steal(&self->deque);
+    if (task || rt_sched.nworkers == 1) {
+        return task;
+    }
+    self->seed = self->seed * 1103515245 + 12345;
+    int start = (self->seed >> 16) % rt_sched.nworkers;
+    for (int i = 0; i < rt_sched.nworkers; ++i) {
+        rt_worker_t *victim = &rt_sched.workers[(start + i) % rt_sched.nworkers];
+        if (victim != self && (task = deque_steal(&victim->deque))) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+int sched_work_p() {
+    for (int i = 0; i < rt_sched.nworkers; ++i) {
+        if (!deque_empty_p(&rt_sched.workers[i].deque)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sleeps until there might be work. Worker 0 is woken when the last task
+// finishes; any worker is woken by a spawn or a task being readied, and
+// checks again every few milliseconds while tasks are live anyway, in
+// case work appeared without one (a preempted task pushed back onto a
+// busy worker).
+void sched_sleep(int primary) {
+    rt_gc_leave();
+    pthread_mutex_lock(&rt_sched.lock);
+    __atomic_add_fetch(&rt_sched.sleeping, 1, __ATOMIC_SEQ_CST);
+    long ntasks = __atomic_load_n(&rt_sched.ntasks, __ATOMIC_SEQ_CST);
+    if (!(primary && ntasks == 0) && !sched_work_p()) {
+        if (ntasks == 0) {
+            pthread_cond_wait(&rt_sched.wake, &rt_sched.lock);
+        } else {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 5000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&rt_sched.wake, &rt_sched.lock, &ts);
+        }
+    }
+    __atomic_sub_fetch(&rt_sched.sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&rt_sched.lock);
+    rt_gc_enter();
+}
+
+void sched_wake(int all) {
+    if (__atomic_load_n(&rt_sched.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&rt_sched.lock);
+        if (all) {
+            pthread_cond_broadcast(&rt_sched.wake);
+        } else {
+            pthread_cond_signal(&rt_sched.wake);
+        }
+        pthread_mutex_unlock(&rt_sched.lock);
+    }
+}
+
+// Queues `task`, which is blocked, to run again. Called by the task that
+// woke it, so at most once per block.
+void rt_sched_ready(rt_task_t *task) {
+    if (__atomic_exchange_n(&task->state, TASK_READY, __ATOMIC_SEQ_CST) == TASK_PARKED) {
+        __atomic_sub_fetch(&rt_sched.ntasks, SCHED_BLOCKED, __ATOMIC_SEQ_CST);
+        deque_push(&rt_worker->deque, task);
+        sched_wake(0);
+    }
+}
+
+// Runs tasks until none are left, if `primary`, or forever.
+void sched_loop(rt_worker_t *self, int primary) {
+    int idle = 0;
+    while (1) {
+        rt_task_t *task = sched_find(self);
+        if (task) {
+            idle = 0;
+            self->current = task;
+            __atomic_store_n(&task->state, TASK_RUNNING, __ATOMIC_SEQ_CST);
+            switch (run_task(task)) {
+                case TASK_YIELDED:
+                    deque_push(&self->deque, task);
+                    break;
+                case TASK_BLOCKED:
+                    // if it has been woken already, it's up to us to
+                    // queue it. It's counted as blocked only once parked,
+                    // so the deadlock check below never counts a task
+                    // that is about to be queued here.
+                    if (__atomic_exchange_n(&task->state, TASK_PARKED, __ATOMIC_SEQ_CST) == TASK_READY) {
+                        deque_push(&self->deque, task);
+                    } else {
+                        __atomic_add_fetch(&rt_sched.ntasks, SCHED_BLOCKED, __ATOMIC_SEQ_CST);
+                    }
+                    break;
+                default:
+                    __atomic_add_fetch(&rt_chan_messages, task->messages, __ATOMIC_RELAXED);
+                    rt_task_free(task);
+                    if (__atomic_sub_fetch(&rt_sched.ntasks, 1, __ATOMIC_SEQ_CST) == 0) {
+                        sched_wake(1);
+                    }
+                    break;
+            }
+            self->current = NULL;
+            rt_gc_safepoint();
+            continue;
+        }
+        long ntasks = __atomic_load_n(&rt_sched.ntasks, __ATOMIC_SEQ_CST);
+        if (primary && ntasks == 0) {
+            return;
+        }
+        if (primary && SCHED_LIVE(ntasks) && (ntasks >> 32) == SCHED_LIVE(ntasks)) {
+            fprintf(stderr, "deadlock: every task is blocked on a channel\n");
+            exit(1);
+        }
+        rt_gc_safepoint();
+        if (++idle < SCHED_SPINS) {
+            sched_yield();
+        } else {
+            sched_sleep(primary);
+            idle = 0;
+        }
+    }
+}
+
+void *sched_worker_main(void *arg) {
+    rt_worker = (rt_worker_t*)arg;
+    rt_gc_enter();
+    sched_loop(rt_worker, 0);
+    return NULL;
+}
+
+void sched_start() {
+    for (int i = 1; i < rt_sched.nworkers; ++i) {
+        if (pthread_create(&rt_sched.workers[i].thread, NULL, sched_worker_main, &rt_sched.workers[i])) {
+            fprintf(stderr, "failed to start worker thread\n");
+            exit(1);
+        }
+    }
+    rt_sched.started = 1;
+}
+
+// Starts a task calling `fn` with `nargs` arguments. Must be called from
+// a task.
+void rt_spawn(val_t fn, val_t *args, int nargs) {
+    if (!proto_p(fn)) {
+        fprintf(stderr, "attempt to spawn a non-function\n");
+        exit(1);
+    }
+    rt_task_t *task = rt_task_new(proto_val(fn), args, nargs);
+    __atomic_add_fetch(&rt_sched.ntasks, 1, __ATOMIC_SEQ_CST);
+    if (!rt_sched.started) {
+        sched_start();
+    }
+    deque_push(&rt_worker->deque, task);
+    sched_wake(0);
+}
+
+// Runs module `co` and every task it spawns to completion.
+void run(code_t *co) {
+    sched_init();
+
+#ifdef RT_PROFILE
+    rt_profile_init();
+#endif
+
+    rt_worker = &rt_sched.workers[0];
+    rt_gc_enter();
+    __atomic_add_fetch(&rt_sched.ntasks, 1, __ATOMIC_SEQ_CST);
+    deque_push(&rt_worker->deque, rt_task_new(co, NULL, 0));
+    sched_loop(rt_worker, 1);
+    rt_gc_leave();
+    rt_gc_flush_stats();
+
+    printf("execution terminated\n");
+#ifdef RT_PROFILE
+    rt_profile_report(stderr);
+#endif
+}
+
+#undef SCHED_SPINS
+#undef SCHED_BLOCKED
+#undef SCHED_LIVE
@@ -0,0 +1,222 @@
+// Strings
+//
+// A string value takes one of three forms. Up to VAL_INLINE_STRING_MAX
+// bytes live in the value itself (see val.inc.cpp) and never touch the
+// heap. Longer strings are flat heap strings (rt_string_t), NUL-terminated
+// so that they can be handed straight to C. Concatenations at least
+// STRING_ROPE_MIN bytes long make a rope instead: a node that refers to
+// its two halves without copying them, so that building a string up with
+// repeated `+` costs time linear in its length rather than quadratic.
+//
+// A rope is flattened on demand, the first time its bytes are needed:
+// the bytes are copied into a new flat string that the rope keeps. The
+// halves are dropped by the next collection, since nothing needs them
+// once the rope is flat.
+//
+// A heap string caches the hash of its contents, computed when it's
+// first asked for. Equality checks compare hashes before bytes, so
+// repeatedly comparing long strings is cheap unless they really are
+// equal.
+//
+// Anything here may allocate, and so may move strings, which is why
+// strings are passed by slot: the slot is kept up to date, and any
+// pointer into a string is only good until the next allocation.
+
+// Concatenations shorter than this are copied flat.
+#define STRING_ROPE_MIN 64
+
+typedef struct {
+    rt_string_t head;   // length and hash; rope is set
+    val_t left;
+    val_t right;
+    val_t flat;         // nil until flattened
+} rt_rope_t;
+
+// Returns a string holding a copy of `len` bytes of `str`.
+val_t rt_string_new(const char *str, int len) {
+    if (len <= VAL_INLINE_STRING_MAX) {
+        return mk_inline_string(str, len);
+    }
+    rt_string_t *out = rt_gc_alloc_string(len, 0);
+    memcpy(out->str, str, len);
+    return mk_string(out);
+}
+
+int rt_string_length(val_t v) {
+    return inline_string_p(v) ? inline_string_length(v) : string_val(v)->length;
+}
+
+// Copies rope `rope`'s bytes to `dst`, back to front. The walk uses an
+// explicit stack, since a rope built by appending in a loop is as deep
+// as it is long.
+void string_copy_rope(rt_rope_t *rope, char *dst) {
+    val_t local[64];
+    val_t *stack = local;
+    int cap = 64, n = 0;
+    char *end = dst + rope->head.length;
+    stack[n++] = mk_string(&rope->head);
+    while (n > 0) {
+        val_t v = stack[--n];
+        if (inline_string_p(v)) {
+            int len = inline_string_length(v);
+            char buf[VAL_INLINE_STRING_MAX + 1];
+            inline_string_copy(v, buf);
+            end -= len;
+            memcpy(end, buf, len);
+            continue;
+        }
+        rt_string_t *str = string_val(v);
+        if (str->rope) {
+            rt_rope_t *node = (rt_rope_t*)str;
+            if (nil_p(node->flat)) {
+                if (n + 2 > cap) {
+                    val_t *grown = (val_t*)malloc(sizeof(val_t) * cap * 2);
+                    if (!grown) {
+                        fprintf(stderr, "failed to allocate rope stack\n");
+                        exit(1);
+                    }
+                    memcpy(grown, stack, sizeof(val_t) * n);
+                    if (stack != local) {
+                        free(stack);
+                    }
+                    stack = grown;
+                    cap *= 2;
+                }
+                stack[n++] = node->left;
+                stack[n++] = node->right;
+                continue;
+            }
+            str = string_val(node->flat);
+        }
+        end -= str->length;
+        memcpy(end, str->str, str->length);
+    }
+    if (stack != local) {
+        free(stack);
+    }
+}
+
+// Returns the flat string holding the bytes of the heap string in `slot`.
+rt_string_t *string_flatten(val_t *slot) {
+    rt_string_t *str = string_val(*slot);
+    if (!str->rope) {
+        return str;
+    }
+    if (!nil_p(((rt_rope_t*)str)->flat)) {
+        return string_val(((rt_rope_t*)str)->flat);
+    }
+    rt_string_t *flat = rt_gc_alloc_string(str->length, 0);
+    rt_rope_t *rope = (rt_rope_t*)string_val(*slot);
+    string_copy_rope(rope, flat->str);
+    flat->hash = rope->head.hash;
+    rt_gc_write(rope, &rope->flat, mk_string(flat));
+    return flat;
+}
+
+// Returns the bytes of the string in `slot`, NUL-terminated. An inline
+// string is copied to `buf`, which must have room for
+// VAL_INLINE_STRING_MAX + 1 bytes.
+const char *rt_string_chars(val_t *slot, char *buf) {
+    if (inline_string_p(*slot)) {
+        inline_string_copy(*slot, buf);
+        return buf;
+    }
+    return string_flatten(slot)->str;
+}
+
+uint32_t string_hash_bytes(const char *str, int len) {
+    uint32_t hash = intern_hash(str, len);
+    return hash ? hash : 1;
+}
+
+// Returns the hash of the string in `slot`'s contents, which is the same
+// whatever form the string takes. Constants are shared between threads,
+// so the cached hash is read and written atomically.
+uint32_t rt_string_hash(val_t *slot) {
+    if (inline_string_p(*slot)) {
+        char buf[VAL_INLINE_STRING_MAX + 1];
+        inline_string_copy(*slot, buf);
+        return string_hash_bytes(buf, inline_string_length(*slot));
+    }
+    rt_string_t *str = string_val(*slot);
+    uint32_t hash = __atomic_load_n(&str->hash, __ATOMIC_RELAXED);
+    if (hash) {
+        return hash;
+    }
+    rt_string_t *flat = string_flatten(slot);
+    hash = string_hash_bytes(flat->str, flat->length);
+    __atomic_store_n(&flat->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&string_val(*slot)->hash, hash, __ATOMIC_RELAXED);
+    return hash;
+}
+
+// Returns non-zero if the strings in slots `a` and `b` have the same
+// contents.
+int rt_string_equal(val_t *a, val_t *b) {
+    if (a->bits == b->bits) {
+        return 1;
+    }
+    if (inline_string_p(*a) && inline_string_p(*b)) {
+        return 0;
+    }
+    int len = rt_string_length(*a);
+    if (len != rt_string_length(*b)) {
+        return 0;
+    }
+    // hashing flattens both, so fetching their bytes can't allocate
+    if (rt_string_hash(a) != rt_string_hash(b)) {
+        return 0;
+    }
+    char abuf[VAL_INLINE_STRING_MAX + 1], bbuf[VAL_INLINE_STRING_MAX + 1];
+    const char *x = rt_string_chars(a, abuf);
+    const char *y = rt_string_chars(b, bbuf);
+    return memcmp(x, y, len) == 0;
+}
+
+// Returns the concatenation of the strings in slots `a` and `b`.
+val_t rt_string_concat(val_t *a, val_t *b) {
+    int alen = rt_string_length(*a), blen = rt_string_length(*b);
+    if (alen == 0) return *b;
+    if (blen == 0) return *a;
+    if (alen > INT32_MAX - blen) {
+        fprintf(stderr, "string too long\n");
+        exit(1);
+    }
+    int len = alen + blen;
+    if (len < STRING_ROPE_MIN) {
+        // neither is a rope, since ropes are longer, so fetching their
+        // bytes doesn't allocate
+        char buf[STRING_ROPE_MIN];
+        char abuf[VAL_INLINE_STRING_MAX + 1], bbuf[VAL_INLINE_STRING_MAX + 1];
+        memcpy(buf, rt_string_chars(a, abuf), alen);
+        memcpy(buf + alen, rt_string_chars(b, bbuf), blen);
+        return rt_string_new(buf, len);
+    }
+    rt_rope_t *rope = (rt_rope_t*)rt_gc_alloc(T_STRING, sizeof(rt_rope_t));
+    rope->head.length = len;
+    rope->head.hash = 0;
+    rope->head.rope = 1;
+    // a new object is young, so needs no write barrier
+    rope->left = *a;
+    rope->right = *b;
+    rope->flat = mk_nil();
+    return mk_string(&rope->head);
+}
+
+// Called by the collector to visit a heap string's fields.
+void rt_string_trace(rt_string_t *str) {
+    if (!str->rope) {
+        return;
+    }
+    rt_rope_t *rope = (rt_rope_t*)str;
+    if (nil_p(rope->flat)) {
+        rt_gc_visit(&rope->left);
+        rt_gc_visit(&rope->right);
+    } else {
+        rope->left = mk_nil();
+        rope->right = mk_nil();
+        rt_gc_visit(&rope->flat);
+    }
+}
+
+#undef STRING_ROPE_MIN
@@ -2,30 +2,29 @@
 // The actual AST structs are declared in ast.inc.cpp
 enum {
     AST_BIN_OP, AST_CALL, AST_FN_DEF, AST_IDENT, AST_IF,
-    AST_LIST, AST_PRINT, AST_UN_OP, AST_WHILE
+    AST_LIST, AST_PRINT, AST_RETURN, AST_UN_OP, AST_WHILE
 };
 
 #define OP_SHIFT 26
-#define OP_BITS(x) (x << OP_SHIFT)
+#define OP_BITS(x) ((uint32_t)(x) << OP_SHIFT)
+
+// Opcode numbers, in declaration order. The full list lives in opcodes.x
+// so that everything which must enumerate the opcodes (this enum, the
+// interpreter's jump table) is generated from a single source.
+enum {
+    __UNUSED_OPCODE__ = 0,
+
+    #define OPCODE(name, _, __) OPI_##name,
+    #include "opcodes.x"
+    #undef OPCODE
+
+    OPI_MAX
+};
 
 enum opcode_t {
-    OP_PRINT    = OP_BITS(1),
-    OP_HALT     = OP_BITS(2),
-    OP_ADD      = OP_BITS(3),
-    OP_SUB      = OP_BITS(4),
-    OP_MUL      = OP_BITS(5),
-    OP_DIV      = OP_BITS(6),
-    OP_LOADK    = OP_BITS(7),
-    OP_COPY     = OP_BITS(8),
-    OP_CALL     = OP_BITS(9),
-    OP_LT       = OP_BITS(10),
-    OP_LE       = OP_BITS(11),
-    OP_GT       = OP_BITS(12),
-    OP_GE       = OP_BITS(13),
-    OP_EQ       = OP_BITS(12),
-    OP_NEQ      = OP_BITS(13),
-    OP_JMP      = OP_BITS(11),
-    OP_JMPF     = OP_BITS(12)
+    #define OPCODE(name, _, __) OP_##name = OP_BITS(OPI_##name),
+    #include "opcodes.x"
+    #undef OPCODE
 };
 
 // Mask that identifies an operator_t as a simple binary operator;
@@ -60,6 +59,7 @@ const opcode_t rt_simple_binop_opcodes[] = {
     OP_ADD,
     OP_SUB,
     OP_MUL,
+    OP_POW,
     OP_DIV,
     OP_LT,
     OP_LE,
@@ -73,7 +73,36 @@ const opcode_t rt_simple_unop_opcodes[] = {
 
 };
 
+// A heap string. Strings short enough to fit in a value never get one
+// (see val.inc.cpp), and a rope (string.inc.cpp) has this header but no
+// bytes of its own.
 typedef struct {
     int length;
+    uint32_t hash;      // of the contents, or 0 until first needed
+    int rope;
     char str[0];
-} rt_string_t;
\ No newline at end of file
+} rt_string_t;
+
+// An integer too big to be inline (see val.inc.cpp and bigint.inc.cpp).
+typedef struct {
+    int sign;           // 1 or -1
+    int nlimbs;
+    uint32_t limbs[0];  // magnitude, least significant first; the last isn't 0
+} rt_bigint_t;
+
+// A packed numeric vector, or a matrix stored row by row (see
+// vector.inc.cpp).
+typedef struct {
+    int kind;           // VEC_F64, VEC_F32 or VEC_I32
+    int rows;           // 0 for a vector
+    int cols;           // the length, for a vector
+    int length;         // of data, in elements
+    char data[0];
+} rt_vector_t;
+
+// Persistent collections; defined in map.inc.cpp and list.inc.cpp.
+typedef struct rt_map rt_map_t;
+typedef struct rt_list rt_list_t;
+
+// Defined in chan.inc.cpp.
+typedef struct rt_chan rt_chan_t;
\ No newline at end of file
@@ -1,31 +1,74 @@
-char *readfile(const char *filename) {
-	char *source = NULL;
-	size_t read;
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Source input. A regular file is mapped, and lexed in place over
+// [text, text + len); nothing is copied and no terminator is needed.
+// Anything else (a pipe, a terminal, or "-" for stdin) is read in chunks
+// by the lexer as it goes, via rt_source_read, so lexing starts before
+// the input is complete. A stream's text is NULL.
+typedef struct {
+	const char *text;
+	size_t len;
+	int fd;			// stream only, else -1
+} rt_source_t;
+
+// Opens `filename` as source input. Returns 0 on failure.
+int rt_source_open(rt_source_t *src, const char *filename) {
 	struct stat fi;
-	FILE *fp = NULL;
+	int fd = strcmp(filename, "-") == 0 ? dup(0) : open(filename, O_RDONLY);
+	if (fd == -1) return 0;
+	if (fstat(fd, &fi) == -1) {
+		close(fd);
+		return 0;
+	}
 
-	if (stat(filename, &fi) == -1) goto error;
-	source = (char*)malloc(sizeof(char) * (fi.st_size + 1));
-	if (source == NULL) goto error;
-	fp = fopen(filename, "r");
-	if (!fp) goto error;
-	read = fread(source, sizeof(char), fi.st_size, fp);
-	if (read != fi.st_size) goto error;
-	source[fi.st_size] = '\0';
-	goto ok;
+	src->text = NULL;
+	src->len = 0;
+	src->fd = fd;
+	if (!S_ISREG(fi.st_mode)) return 1;
 
-error:
-	if (source) {
-		free(source);
-		source = NULL;
+	src->fd = -1;
+	src->len = fi.st_size;
+	if (src->len == 0) {
+		src->text = "";
+	} else {
+		void *map = mmap(NULL, src->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return 0;
+		}
+		madvise(map, src->len, MADV_SEQUENTIAL);
+		src->text = (const char*)map;
 	}
+	close(fd);
+	return 1;
+}
 
-ok:
-	if (fp) {
-		fclose(fp);
+// Refill callback for a streamed source: reads up to `cap` bytes into
+// `buf`, returning the number read, or 0 at the end of the input.
+size_t rt_source_read(void *ctx, char *buf, size_t cap) {
+	rt_source_t *src = (rt_source_t*)ctx;
+	while (1) {
+		ssize_t n = read(src->fd, buf, cap);
+		if (n >= 0) return n;
+		if (errno != EINTR) {
+			fprintf(stderr, "error reading source: %s\n", strerror(errno));
+			exit(1);
+		}
 	}
+}
 
-	return source;
+void rt_source_close(rt_source_t *src) {
+	if (src->fd != -1) {
+		close(src->fd);
+	} else if (src->len) {
+		munmap((void*)src->text, src->len);
+	}
+	src->text = NULL;
+	src->len = 0;
+	src->fd = -1;
 }
 
 int streql(const char *str1, const char *str2, int len2) {
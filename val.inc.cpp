@@ -6,66 +6,229 @@ enum {
     T_INT,
     T_IDENT,
     T_FOREIGN_FN,
-    T_STRING
+    T_STRING,
+    T_PROTO,
+    T_CHANNEL,
+    T_BIGINT,
+    T_VECTOR,
+    T_MAP,
+    T_LIST
 };
 
 typedef struct val val_t;
 
 typedef val_t (*foreign_fn_f)(val_t *args, int nargs);
 
+// Values are NaN-boxed into a single 64-bit word. Any bit pattern below
+// VAL_QNAN is an IEEE double (a float); everything else is a
+// negative quiet NaN carrying a 4-bit tag in bits 47-50 and a 47-bit
+// payload, which is wide enough for a user-space pointer on x86-64 and
+// AArch64. Tag 0 is never used so that the hardware's default NaN
+// (0xFFF8000000000000) can't be mistaken for a tagged value; tags are
+// therefore the T_* constant plus one.
+//
+// Floats are canonicalised so that every NaN is the positive quiet NaN;
+// a negative NaN could otherwise look like a tagged value.
+//
+// An integer is a 47-bit two's complement payload. Integers outside that
+// range are bigints (T_BIGINT, see bigint.inc.cpp) on the heap, and
+// integers inside it never are, so each integer has exactly one
+// representation.
+//
+// A string of up to VAL_INLINE_STRING_MAX bytes is stored in the value
+// itself rather than on the heap: its payload has bit 0 set (which is
+// never set in a pointer to an aligned heap object), its length in bits
+// 1-3 and its bytes from bit VAL_INLINE_STRING_SHIFT up, with every other
+// bit clear, so that two inline strings are equal exactly when their
+// values are.
+//
+// Nothing outside this file should look at `bits` directly; use the
+// mk_*, *_p and *_val accessors below.
 struct val {
-    int type;
-    union {
-        int ival;
-        ast_node_t *ast;
-        foreign_fn_f fn;
-        rt_string_t *str;
-    };
+    uint64_t bits;
 };
 
+static_assert(sizeof(val_t) == 8, "val_t must fit in a single machine word");
+
+#define VAL_QNAN            0xFFF8000000000000ULL
+#define VAL_TAG_SHIFT       47
+#define VAL_TAG_MASK        (0xFULL << VAL_TAG_SHIFT)
+#define VAL_PAYLOAD_MASK    ((1ULL << VAL_TAG_SHIFT) - 1)
+#define VAL_TAG(t)          (VAL_QNAN | ((uint64_t)((t) + 1) << VAL_TAG_SHIFT))
+#define VAL_BOX(t, payload) { VAL_TAG(t) | ((uint64_t)(payload) & VAL_PAYLOAD_MASK) }
+
+#define VAL_INT_SHIFT           (64 - VAL_TAG_SHIFT)
+#define VAL_INT_MIN             (-(1LL << (VAL_TAG_SHIFT - 1)))
+#define VAL_INT_MAX             ((1LL << (VAL_TAG_SHIFT - 1)) - 1)
+
+#define VAL_INLINE_STRING_MAX   5
+#define VAL_INLINE_STRING_SHIFT 7
+
+int val_type(val_t v) {
+    return (int)((v.bits & VAL_TAG_MASK) >> VAL_TAG_SHIFT) - 1;
+}
+
 val_t mk_nil() {
-    val_t out = { .type = T_NIL };
+    val_t out = VAL_BOX(T_NIL, 0);
     return out;
 }
 
 val_t mk_null() {
-    val_t out = { .type = T_AST, .ast = NULL };
+    val_t out = VAL_BOX(T_AST, 0);
     return out;
 }
 
 val_t mk_true() {
-    val_t out = { .type = T_TRUE };
+    val_t out = VAL_BOX(T_TRUE, 0);
     return out;
 }
 
 val_t mk_false() {
-    val_t out = { .type = T_FALSE };
+    val_t out = VAL_BOX(T_FALSE, 0);
     return out;
 }
 
-val_t mk_int(int val) {
-    val_t out;
-    out.type = T_INT;
-    out.ival = val;
+val_t mk_bool(int b) {
+    return b ? mk_true() : mk_false();
+}
+
+int int_fits_p(int64_t val) {
+    return val >= VAL_INT_MIN && val <= VAL_INT_MAX;
+}
+
+// `val` must fit inline; see int_fits_p().
+val_t mk_int(int64_t val) {
+    val_t out = VAL_BOX(T_INT, (uint64_t)val);
+    return out;
+}
+
+// Makes an integer from one shifted as by int_shifted().
+val_t mk_int_shifted(int64_t shifted) {
+    val_t out = { VAL_TAG(T_INT) | ((uint64_t)shifted >> VAL_INT_SHIFT) };
     return out;
 }
 
 val_t mk_ident(int id) {
-    val_t out;
-    out.type = T_IDENT;
-    out.ival = id;
+    val_t out = VAL_BOX(T_IDENT, (uint32_t)id);
+    return out;
+}
+
+val_t mk_foreign_fn(foreign_fn_f fn) {
+    val_t out = VAL_BOX(T_FOREIGN_FN, (uintptr_t)fn);
     return out;
 }
 
 val_t mk_string(rt_string_t *str) {
+    val_t out = VAL_BOX(T_STRING, (uintptr_t)str);
+    return out;
+}
+
+// `len` must be at most VAL_INLINE_STRING_MAX.
+val_t mk_inline_string(const char *str, int len) {
+    uint64_t payload = 1 | ((uint64_t)len << 1);
+    for (int i = 0; i < len; ++i) {
+        payload |= (uint64_t)(unsigned char)str[i] << (VAL_INLINE_STRING_SHIFT + 8 * i);
+    }
+    val_t out = VAL_BOX(T_STRING, payload);
+    return out;
+}
+
+// A function compiled from script source.
+val_t mk_proto(code_t *code) {
+    val_t out = VAL_BOX(T_PROTO, (uintptr_t)code);
+    return out;
+}
+
+val_t mk_bigint(rt_bigint_t *big) {
+    val_t out = VAL_BOX(T_BIGINT, (uintptr_t)big);
+    return out;
+}
+
+val_t mk_float(double val) {
     val_t out;
-    out.type = T_STRING;
-    out.str = str;
+    if (val != val) {
+        out.bits = 0x7FF8000000000000ULL;
+    } else {
+        memcpy(&out.bits, &val, sizeof(val));
+    }
+    return out;
+}
+
+val_t mk_vector(rt_vector_t *vec) {
+    val_t out = VAL_BOX(T_VECTOR, (uintptr_t)vec);
+    return out;
+}
+
+// Maps and sets (see map.inc.cpp).
+val_t mk_map(rt_map_t *map) {
+    val_t out = VAL_BOX(T_MAP, (uintptr_t)map);
+    return out;
+}
+
+val_t mk_list(rt_list_t *list) {
+    val_t out = VAL_BOX(T_LIST, (uintptr_t)list);
+    return out;
+}
+
+val_t mk_chan(rt_chan_t *chan) {
+    val_t out = VAL_BOX(T_CHANNEL, (uintptr_t)chan);
+    return out;
+}
+
+val_t mk_ast(ast_node_t *node) {
+    val_t out = VAL_BOX(T_AST, (uintptr_t)node);
     return out;
 }
 
-// TODO: need to think about string allocation
-val_t mk_string_from_token(const char *tok, int tok_len) {
+// Decodes an integer literal token, into `arena` if it's a bigint.
+val_t mk_int_from_token(rt_arena_t *arena, const char *tok, int tok_len) {
+    int64_t val = 0;
+    int i;
+    for (i = 0; i < tok_len; ++i) {
+        int64_t next = val * 10 + (tok[i] - '0');
+        if (next > VAL_INT_MAX) break;
+        val = next;
+    }
+    if (i == tok_len) {
+        return mk_int(val);
+    }
+
+    // each digit adds under 3.33 bits, so 9 of them fit in a limb
+    rt_bigint_t *big = (rt_bigint_t*)rt_arena_alloc(arena, sizeof(rt_bigint_t) + sizeof(uint32_t) * (tok_len / 9 + 2));
+    big->sign = 1;
+    big->nlimbs = 0;
+    for (i = 0; i < tok_len; ++i) {
+        uint64_t carry = tok[i] - '0';
+        for (int j = 0; j < big->nlimbs; ++j) {
+            uint64_t x = (uint64_t)big->limbs[j] * 10 + carry;
+            big->limbs[j] = (uint32_t)x;
+            carry = x >> 32;
+        }
+        if (carry) {
+            big->limbs[big->nlimbs++] = (uint32_t)carry;
+        }
+    }
+    return mk_bigint(big);
+}
+
+// Decodes a float literal token: digits, a point, and more digits.
+val_t mk_float_from_token(const char *tok, int tok_len) {
+    char buf[64];
+    if (tok_len >= (int)sizeof(buf)) {
+        char *copy = (char*)malloc(tok_len + 1);
+        memcpy(copy, tok, tok_len);
+        copy[tok_len] = 0;
+        val_t out = mk_float(strtod(copy, NULL));
+        free(copy);
+        return out;
+    }
+    memcpy(buf, tok, tok_len);
+    buf[tok_len] = 0;
+    return mk_float(strtod(buf, NULL));
+}
+
+// Decodes a string literal token into `arena`.
+val_t mk_string_from_token(rt_arena_t *arena, const char *tok, int tok_len) {
     const int tok_start = 1;
     const int tok_end = tok_len - 1;
 
@@ -80,11 +243,13 @@ val_t mk_string_from_token(const char *tok, int tok_len) {
         }
     }
 
-    // allocate storage
-    rt_string_t *str = (rt_string_t*)malloc(sizeof(rt_string_t) + (sizeof(char) * (length + 1)));
-    if (str == NULL) {
-        // TODO: error
-        return mk_nil();
+    // allocate storage, unless it fits in the value
+    char inline_str[VAL_INLINE_STRING_MAX];
+    rt_string_t *str = NULL;
+    char *dst = inline_str;
+    if (length > VAL_INLINE_STRING_MAX) {
+        str = (rt_string_t*)rt_arena_alloc(arena, sizeof(rt_string_t) + (sizeof(char) * (length + 1)));
+        dst = str->str;
     }
 
     // copy decoded string
@@ -95,13 +260,13 @@ val_t mk_string_from_token(const char *tok, int tok_len) {
             if (tok[i] == '\\') {
                 state = 1;
             } else {
-                str->str[ix++] = tok[i];
+                dst[ix++] = tok[i];
             }
         } else {
             switch (tok[i]) {
-                case 'n': str->str[ix++] = '\n'; break;
-                case 'r': str->str[ix++] = '\r'; break;
-                case 't': str->str[ix++] = '\t'; break;
+                case 'n': dst[ix++] = '\n'; break;
+                case 'r': dst[ix++] = '\r'; break;
+                case 't': dst[ix++] = '\t'; break;
                 default:
                     fprintf(stderr, "BUG: illegal string escape character leaked to decoder\n");
                     exit(1);
@@ -109,20 +274,168 @@ val_t mk_string_from_token(const char *tok, int tok_len) {
         }
     }
 
+    if (!str) {
+        return mk_inline_string(inline_str, length);
+    }
     str->length = length;
+    str->hash = 0;
+    str->rope = 0;
     str->str[length] = 0;
 
     return mk_string(str);
 }
 
 int nil_p(val_t v) {
-    return v.type == T_NIL;
+    return v.bits == VAL_TAG(T_NIL);
 }
 
 int truthy_p(val_t v) {
-    return (v.type != T_NIL) && (v.type != T_FALSE);
+    return (v.bits != VAL_TAG(T_NIL)) && (v.bits != VAL_TAG(T_FALSE));
+}
+
+int int_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_INT);
+}
+
+// Returns non-zero if `a` and `b` are both inline integers, in one test.
+int ints_p(val_t a, val_t b) {
+    return (((a.bits ^ VAL_TAG(T_INT)) | (b.bits ^ VAL_TAG(T_INT))) & (VAL_QNAN | VAL_TAG_MASK)) == 0;
+}
+
+int ident_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_IDENT);
+}
+
+int string_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_STRING);
+}
+
+int bigint_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_BIGINT);
+}
+
+int float_p(val_t v) {
+    return v.bits < VAL_QNAN;
+}
+
+int vector_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_VECTOR);
+}
+
+int map_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_MAP);
+}
+
+int list_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_LIST);
+}
+
+int inline_string_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK | 1)) == (VAL_TAG(T_STRING) | 1);
+}
+
+int foreign_fn_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_FOREIGN_FN);
+}
+
+int proto_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_PROTO);
+}
+
+int chan_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_CHANNEL);
+}
+
+int ast_p(val_t v) {
+    return (v.bits & (VAL_QNAN | VAL_TAG_MASK)) == VAL_TAG(T_AST);
+}
+
+int64_t int_val(val_t v) {
+    return (int64_t)(v.bits << VAL_INT_SHIFT) >> VAL_INT_SHIFT;
+}
+
+// Returns inline integer `v` shifted to the top of 64 bits. Adding two
+// shifted integers, or multiplying one by an unshifted integer, overflows
+// int64_t exactly when the result wouldn't fit inline, so a single
+// __builtin_*_overflow() check covers both.
+int64_t int_shifted(val_t v) {
+    return (int64_t)(v.bits << VAL_INT_SHIFT);
+}
+
+int ident_val(val_t v) {
+    return (int)(uint32_t)v.bits;
+}
+
+foreign_fn_f fn_val(val_t v) {
+    return (foreign_fn_f)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+// Only for strings that aren't inline.
+rt_string_t* string_val(val_t v) {
+    return (rt_string_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+int inline_string_length(val_t v) {
+    return (int)((v.bits >> 1) & 7);
+}
+
+// Copies inline string `v` into `buf`, which must have room for
+// VAL_INLINE_STRING_MAX bytes and a terminating NUL.
+void inline_string_copy(val_t v, char *buf) {
+    int len = inline_string_length(v);
+    for (int i = 0; i < len; ++i) {
+        buf[i] = (char)(v.bits >> (VAL_INLINE_STRING_SHIFT + 8 * i));
+    }
+    buf[len] = 0;
+}
+
+rt_bigint_t* bigint_val(val_t v) {
+    return (rt_bigint_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+double float_val(val_t v) {
+    double out;
+    memcpy(&out, &v.bits, sizeof(out));
+    return out;
+}
+
+rt_vector_t* vector_val(val_t v) {
+    return (rt_vector_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+rt_map_t* map_val(val_t v) {
+    return (rt_map_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+rt_list_t* list_val(val_t v) {
+    return (rt_list_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+code_t* proto_val(val_t v) {
+    return (code_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+rt_chan_t* chan_val(val_t v) {
+    return (rt_chan_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+// Returns non-zero if `v` refers to an object managed by the collector.
+int heap_p(val_t v) {
+    return (string_p(v) && !inline_string_p(v)) || chan_p(v) || bigint_p(v) || vector_p(v)
+        || map_p(v) || list_p(v);
+}
+
+void* heap_val(val_t v) {
+    return (void*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
+}
+
+// Returns `v` pointing at `obj` instead, for the collector to use when it
+// moves an object.
+val_t heap_rebox(val_t v, void *obj) {
+    val_t out = { (v.bits & ~VAL_PAYLOAD_MASK) | ((uintptr_t)obj & VAL_PAYLOAD_MASK) };
+    return out;
 }
 
 ast_node_t* ast_val(val_t v) {
-    return v.ast;
+    return (ast_node_t*)(uintptr_t)(v.bits & VAL_PAYLOAD_MASK);
 }
\ No newline at end of file
@@ -0,0 +1,1080 @@
+// Numeric vectors and matrices
+//
+// A vector is a packed run of f64, f32 or i32 elements in a single heap
+// object; a matrix is the same, its elements stored row by row. Both are
+// values: arithmetic makes a new one rather than changing an operand, and
+// two are equal if their kinds, shapes and elements are.
+//
+// `+`, `-`, `*` and `/` work element by element on two vectors (or two
+// matrices) of the same kind and shape, except that `*` on two matrices
+// is the matrix product, and a matrix times a vector transforms the
+// vector. `*` and `/` also scale by a number. i32 arithmetic wraps, as
+// the hardware's does, but dividing by 0 is an error.
+//
+// The loops run on a set of kernels picked at first use to suit the CPU:
+// AVX2 (with FMA), else SSE2, else plain C. $RT_VECTOR_KERNELS names the
+// set to use instead ("avx2", "sse2" or "scalar"), for comparing them.
+// Float reductions add up in a different order in each set, so their
+// last bits may differ.
+//
+// The elements follow the header at an 8-byte boundary, which is all the
+// collector guarantees for an object it may move, so the kernels use
+// unaligned loads. Those cost nothing extra on data that happens to be
+// aligned, and little on data that isn't.
+//
+// Arithmetic on anything other than two inline integers comes through
+// here too (rt_arith), so that vectors, floats and bigints can be told
+// apart in one place. Floats are what float vectors reduce to; mixing one
+// with an integer gives a float.
+
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define VEC_X86 1
+#include <immintrin.h>
+#define VEC_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+enum { VEC_F64, VEC_F32, VEC_I32 };
+enum { VEC_ADD, VEC_SUB, VEC_MUL, VEC_DIV };
+
+const int vec_elem_size[] = { 8, 4, 4 };
+const char *vec_kind_names[] = { "f64", "f32", "i32" };
+
+// Vectors are limited to this many elements, so that their size fits the
+// collector's object header.
+#define VEC_MAX_LENGTH (1 << 28)
+
+typedef struct {
+    const char *name;
+    void (*f64_binop)(int op, const double *a, const double *b, double *out, int n);
+    void (*f32_binop)(int op, const float *a, const float *b, float *out, int n);
+    void (*i32_binop)(int op, const int32_t *a, const int32_t *b, int32_t *out, int n);   // not VEC_DIV
+    void (*f64_scale)(int op, const double *a, double s, double *out, int n);               // VEC_MUL or VEC_DIV
+    void (*f32_scale)(int op, const float *a, float s, float *out, int n);
+    double (*f64_dot)(const double *a, const double *b, int n);
+    double (*f32_dot)(const float *a, const float *b, int n);
+    int64_t (*i32_dot)(const int32_t *a, const int32_t *b, int n);
+    double (*f64_sum)(const double *a, int n);
+    double (*f32_sum)(const float *a, int n);
+    int64_t (*i32_sum)(const int32_t *a, int n);
+    void (*f64_mat4)(const double *a, const double *b, double *out);
+    void (*f32_mat4)(const float *a, const float *b, float *out);
+} vec_kernels_t;
+
+//
+// Scalar kernels
+
+// i32 arithmetic is done unsigned, so that it wraps without undefined
+// behaviour.
+#define VEC_WRAP(x, op, y) ((int32_t)((uint32_t)(x) op (uint32_t)(y)))
+
+void vec_scalar_f64_binop(int op, const double *a, const double *b, double *out, int n) {
+    switch (op) {
+        case VEC_ADD: for (int i = 0; i < n; ++i) out[i] = a[i] + b[i]; break;
+        case VEC_SUB: for (int i = 0; i < n; ++i) out[i] = a[i] - b[i]; break;
+        case VEC_MUL: for (int i = 0; i < n; ++i) out[i] = a[i] * b[i]; break;
+        case VEC_DIV: for (int i = 0; i < n; ++i) out[i] = a[i] / b[i]; break;
+    }
+}
+
+void vec_scalar_f32_binop(int op, const float *a, const float *b, float *out, int n) {
+    switch (op) {
+        case VEC_ADD: for (int i = 0; i < n; ++i) out[i] = a[i] + b[i]; break;
+        case VEC_SUB: for (int i = 0; i < n; ++i) out[i] = a[i] - b[i]; break;
+        case VEC_MUL: for (int i = 0; i < n; ++i) out[i] = a[i] * b[i]; break;
+        case VEC_DIV: for (int i = 0; i < n; ++i) out[i] = a[i] / b[i]; break;
+    }
+}
+
+void vec_scalar_i32_binop(int op, const int32_t *a, const int32_t *b, int32_t *out, int n) {
+    switch (op) {
+        case VEC_ADD: for (int i = 0; i < n; ++i) out[i] = VEC_WRAP(a[i], +, b[i]); break;
+        case VEC_SUB: for (int i = 0; i < n; ++i) out[i] = VEC_WRAP(a[i], -, b[i]); break;
+        case VEC_MUL: for (int i = 0; i < n; ++i) out[i] = VEC_WRAP(a[i], *, b[i]); break;
+    }
+}
+
+void vec_scalar_f64_scale(int op, const double *a, double s, double *out, int n) {
+    if (op == VEC_MUL) {
+        for (int i = 0; i < n; ++i) out[i] = a[i] * s;
+    } else {
+        for (int i = 0; i < n; ++i) out[i] = a[i] / s;
+    }
+}
+
+void vec_scalar_f32_scale(int op, const float *a, float s, float *out, int n) {
+    if (op == VEC_MUL) {
+        for (int i = 0; i < n; ++i) out[i] = a[i] * s;
+    } else {
+        for (int i = 0; i < n; ++i) out[i] = a[i] / s;
+    }
+}
+
+double vec_scalar_f64_dot(const double *a, const double *b, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+double vec_scalar_f32_dot(const float *a, const float *b, int n) {
+    float sum = 0;
+    for (int i = 0; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+// i32 products and sums are taken in 64 bits, wrapping there.
+int64_t vec_scalar_i32_dot(const int32_t *a, const int32_t *b, int n) {
+    uint64_t sum = 0;
+    for (int i = 0; i < n; ++i) sum += (uint64_t)((int64_t)a[i] * b[i]);
+    return (int64_t)sum;
+}
+
+double vec_scalar_f64_sum(const double *a, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += a[i];
+    return sum;
+}
+
+double vec_scalar_f32_sum(const float *a, int n) {
+    float sum = 0;
+    for (int i = 0; i < n; ++i) sum += a[i];
+    return sum;
+}
+
+int64_t vec_scalar_i32_sum(const int32_t *a, int n) {
+    uint64_t sum = 0;
+    for (int i = 0; i < n; ++i) sum += (uint64_t)(int64_t)a[i];
+    return (int64_t)sum;
+}
+
+void vec_scalar_f64_mat4(const double *a, const double *b, double *out) {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            double sum = 0;
+            for (int k = 0; k < 4; ++k) sum += a[i * 4 + k] * b[k * 4 + j];
+            out[i * 4 + j] = sum;
+        }
+    }
+}
+
+void vec_scalar_f32_mat4(const float *a, const float *b, float *out) {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            float sum = 0;
+            for (int k = 0; k < 4; ++k) sum += a[i * 4 + k] * b[k * 4 + j];
+            out[i * 4 + j] = sum;
+        }
+    }
+}
+
+const vec_kernels_t vec_scalar_kernels = {
+    "scalar",
+    vec_scalar_f64_binop, vec_scalar_f32_binop, vec_scalar_i32_binop,
+    vec_scalar_f64_scale, vec_scalar_f32_scale,
+    vec_scalar_f64_dot, vec_scalar_f32_dot, vec_scalar_i32_dot,
+    vec_scalar_f64_sum, vec_scalar_f32_sum, vec_scalar_i32_sum,
+    vec_scalar_f64_mat4, vec_scalar_f32_mat4
+};
+
+#ifdef VEC_X86
+
+// The body of an element-wise float kernel: `width` elements at a time
+// with the given intrinsics, then the rest one at a time.
+#define VEC_BINOP_BODY(width, load, store, add, sub, mul, div) \
+    int i = 0; \
+    switch (op) { \
+        case VEC_ADD: \
+            for (; i + (width) <= n; i += (width)) store(out + i, add(load(a + i), load(b + i))); \
+            for (; i < n; ++i) out[i] = a[i] + b[i]; \
+            break; \
+        case VEC_SUB: \
+            for (; i + (width) <= n; i += (width)) store(out + i, sub(load(a + i), load(b + i))); \
+            for (; i < n; ++i) out[i] = a[i] - b[i]; \
+            break; \
+        case VEC_MUL: \
+            for (; i + (width) <= n; i += (width)) store(out + i, mul(load(a + i), load(b + i))); \
+            for (; i < n; ++i) out[i] = a[i] * b[i]; \
+            break; \
+        case VEC_DIV: \
+            for (; i + (width) <= n; i += (width)) store(out + i, div(load(a + i), load(b + i))); \
+            for (; i < n; ++i) out[i] = a[i] / b[i]; \
+            break; \
+    }
+
+#define VEC_SCALE_BODY(width, load, store, set1, mul, div) \
+    int i = 0; \
+    if (op == VEC_MUL) { \
+        for (; i + (width) <= n; i += (width)) store(out + i, mul(load(a + i), set1(s))); \
+        for (; i < n; ++i) out[i] = a[i] * s; \
+    } else { \
+        for (; i + (width) <= n; i += (width)) store(out + i, div(load(a + i), set1(s))); \
+        for (; i < n; ++i) out[i] = a[i] / s; \
+    }
+
+#define VEC_LOAD_SI128(p)       _mm_loadu_si128((const __m128i*)(p))
+#define VEC_STORE_SI128(p, x)   _mm_storeu_si128((__m128i*)(p), x)
+#define VEC_LOAD_SI256(p)       _mm256_loadu_si256((const __m256i*)(p))
+#define VEC_STORE_SI256(p, x)   _mm256_storeu_si256((__m256i*)(p), x)
+
+//
+// SSE2 kernels, which every x86-64 CPU has
+
+void vec_sse2_f64_binop(int op, const double *a, const double *b, double *out, int n) {
+    VEC_BINOP_BODY(2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd)
+}
+
+void vec_sse2_f32_binop(int op, const float *a, const float *b, float *out, int n) {
+    VEC_BINOP_BODY(4, _mm_loadu_ps, _mm_storeu_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps)
+}
+
+// SSE2 has no 32-bit multiply that keeps the low halves, so that's left
+// to the scalar kernel.
+void vec_sse2_i32_binop(int op, const int32_t *a, const int32_t *b, int32_t *out, int n) {
+    int i = 0;
+    switch (op) {
+        case VEC_ADD:
+            for (; i + 4 <= n; i += 4) VEC_STORE_SI128(out + i, _mm_add_epi32(VEC_LOAD_SI128(a + i), VEC_LOAD_SI128(b + i)));
+            for (; i < n; ++i) out[i] = VEC_WRAP(a[i], +, b[i]);
+            break;
+        case VEC_SUB:
+            for (; i + 4 <= n; i += 4) VEC_STORE_SI128(out + i, _mm_sub_epi32(VEC_LOAD_SI128(a + i), VEC_LOAD_SI128(b + i)));
+            for (; i < n; ++i) out[i] = VEC_WRAP(a[i], -, b[i]);
+            break;
+        case VEC_MUL:
+            vec_scalar_i32_binop(op, a, b, out, n);
+            break;
+    }
+}
+
+void vec_sse2_f64_scale(int op, const double *a, double s, double *out, int n) {
+    VEC_SCALE_BODY(2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_mul_pd, _mm_div_pd)
+}
+
+void vec_sse2_f32_scale(int op, const float *a, float s, float *out, int n) {
+    VEC_SCALE_BODY(4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_mul_ps, _mm_div_ps)
+}
+
+double vec_sse2_f64_dot(const double *a, const double *b, int n) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1];
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+double vec_sse2_f32_dot(const float *a, const float *b, int n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+double vec_sse2_f64_sum(const double *a, int n) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1];
+    for (; i < n; ++i) sum += a[i];
+    return sum;
+}
+
+double vec_sse2_f32_sum(const float *a, int n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_loadu_ps(a + i));
+        acc1 = _mm_add_ps(acc1, _mm_loadu_ps(a + i + 4));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) sum += a[i];
+    return sum;
+}
+
+// Sign-extends each half of four i32s to 64 bits, and adds them up.
+int64_t vec_sse2_i32_sum(const int32_t *a, int n) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = VEC_LOAD_SI128(a + i);
+        __m128i sign = _mm_srai_epi32(x, 31);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(x, sign));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(x, sign));
+    }
+    int64_t lanes[2];
+    VEC_STORE_SI128(lanes, acc);
+    uint64_t sum = (uint64_t)lanes[0] + (uint64_t)lanes[1];
+    for (; i < n; ++i) sum += (uint64_t)(int64_t)a[i];
+    return (int64_t)sum;
+}
+
+// Each row of the product is the rows of `b` weighted by a row of `a`.
+void vec_sse2_f64_mat4(const double *a, const double *b, double *out) {
+    for (int i = 0; i < 4; ++i) {
+        __m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+        for (int k = 0; k < 4; ++k) {
+            __m128d w = _mm_set1_pd(a[i * 4 + k]);
+            lo = _mm_add_pd(lo, _mm_mul_pd(w, _mm_loadu_pd(b + k * 4)));
+            hi = _mm_add_pd(hi, _mm_mul_pd(w, _mm_loadu_pd(b + k * 4 + 2)));
+        }
+        _mm_storeu_pd(out + i * 4, lo);
+        _mm_storeu_pd(out + i * 4 + 2, hi);
+    }
+}
+
+void vec_sse2_f32_mat4(const float *a, const float *b, float *out) {
+    __m128 b0 = _mm_loadu_ps(b), b1 = _mm_loadu_ps(b + 4), b2 = _mm_loadu_ps(b + 8), b3 = _mm_loadu_ps(b + 12);
+    for (int i = 0; i < 4; ++i) {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(a[i * 4]), b0);
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(a[i * 4 + 1]), b1));
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(a[i * 4 + 2]), b2));
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(a[i * 4 + 3]), b3));
+        _mm_storeu_ps(out + i * 4, row);
+    }
+}
+
+const vec_kernels_t vec_sse2_kernels = {
+    "sse2",
+    vec_sse2_f64_binop, vec_sse2_f32_binop, vec_sse2_i32_binop,
+    vec_sse2_f64_scale, vec_sse2_f32_scale,
+    vec_sse2_f64_dot, vec_sse2_f32_dot, vec_scalar_i32_dot,
+    vec_sse2_f64_sum, vec_sse2_f32_sum, vec_sse2_i32_sum,
+    vec_sse2_f64_mat4, vec_sse2_f32_mat4
+};
+
+//
+// AVX2 kernels, compiled for AVX2 and FMA whatever the build targets, and
+// only used if the CPU has both
+
+VEC_AVX2 void vec_avx2_f64_binop(int op, const double *a, const double *b, double *out, int n) {
+    VEC_BINOP_BODY(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd)
+}
+
+VEC_AVX2 void vec_avx2_f32_binop(int op, const float *a, const float *b, float *out, int n) {
+    VEC_BINOP_BODY(8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps)
+}
+
+VEC_AVX2 void vec_avx2_i32_binop(int op, const int32_t *a, const int32_t *b, int32_t *out, int n) {
+    int i = 0;
+    switch (op) {
+        case VEC_ADD:
+            for (; i + 8 <= n; i += 8) VEC_STORE_SI256(out + i, _mm256_add_epi32(VEC_LOAD_SI256(a + i), VEC_LOAD_SI256(b + i)));
+            for (; i < n; ++i) out[i] = VEC_WRAP(a[i], +, b[i]);
+            break;
+        case VEC_SUB:
+            for (; i + 8 <= n; i += 8) VEC_STORE_SI256(out + i, _mm256_sub_epi32(VEC_LOAD_SI256(a + i), VEC_LOAD_SI256(b + i)));
+            for (; i < n; ++i) out[i] = VEC_WRAP(a[i], -, b[i]);
+            break;
+        case VEC_MUL:
+            for (; i + 8 <= n; i += 8) VEC_STORE_SI256(out + i, _mm256_mullo_epi32(VEC_LOAD_SI256(a + i), VEC_LOAD_SI256(b + i)));
+            for (; i < n; ++i) out[i] = VEC_WRAP(a[i], *, b[i]);
+            break;
+    }
+}
+
+VEC_AVX2 void vec_avx2_f64_scale(int op, const double *a, double s, double *out, int n) {
+    VEC_SCALE_BODY(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_mul_pd, _mm256_div_pd)
+}
+
+VEC_AVX2 void vec_avx2_f32_scale(int op, const float *a, float s, float *out, int n) {
+    VEC_SCALE_BODY(8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_mul_ps, _mm256_div_ps)
+}
+
+VEC_AVX2 double vec_avx2_f64_dot(const double *a, const double *b, int n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), acc1);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+VEC_AVX2 double vec_avx2_f32_dot(const float *a, const float *b, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    float sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+// Sign-extends four i32s at a time to 64 bits, then multiplies the low
+// halves, which are the originals.
+VEC_AVX2 int64_t vec_avx2_i32_dot(const int32_t *a, const int32_t *b, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_cvtepi32_epi64(VEC_LOAD_SI128(a + i));
+        __m256i y = _mm256_cvtepi32_epi64(VEC_LOAD_SI128(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(x, y));
+    }
+    int64_t lanes[4];
+    VEC_STORE_SI256(lanes, acc);
+    uint64_t sum = (uint64_t)lanes[0] + (uint64_t)lanes[1] + (uint64_t)lanes[2] + (uint64_t)lanes[3];
+    for (; i < n; ++i) sum += (uint64_t)((int64_t)a[i] * b[i]);
+    return (int64_t)sum;
+}
+
+VEC_AVX2 double vec_avx2_f64_sum(const double *a, int n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) sum += a[i];
+    return sum;
+}
+
+VEC_AVX2 double vec_avx2_f32_sum(const float *a, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(a + i));
+        acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(a + i + 8));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    float sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; i < n; ++i) sum += a[i];
+    return sum;
+}
+
+VEC_AVX2 int64_t vec_avx2_i32_sum(const int32_t *a, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(VEC_LOAD_SI128(a + i)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(VEC_LOAD_SI128(a + i + 4)));
+    }
+    int64_t lanes[4];
+    VEC_STORE_SI256(lanes, acc);
+    uint64_t sum = (uint64_t)lanes[0] + (uint64_t)lanes[1] + (uint64_t)lanes[2] + (uint64_t)lanes[3];
+    for (; i < n; ++i) sum += (uint64_t)(int64_t)a[i];
+    return (int64_t)sum;
+}
+
+// A row of four doubles fills a register, so each row of the product is
+// four fused multiply-adds.
+VEC_AVX2 void vec_avx2_f64_mat4(const double *a, const double *b, double *out) {
+    __m256d b0 = _mm256_loadu_pd(b), b1 = _mm256_loadu_pd(b + 4), b2 = _mm256_loadu_pd(b + 8), b3 = _mm256_loadu_pd(b + 12);
+    for (int i = 0; i < 4; ++i) {
+        __m256d row = _mm256_mul_pd(_mm256_set1_pd(a[i * 4]), b0);
+        row = _mm256_fmadd_pd(_mm256_set1_pd(a[i * 4 + 1]), b1, row);
+        row = _mm256_fmadd_pd(_mm256_set1_pd(a[i * 4 + 2]), b2, row);
+        row = _mm256_fmadd_pd(_mm256_set1_pd(a[i * 4 + 3]), b3, row);
+        _mm256_storeu_pd(out + i * 4, row);
+    }
+}
+
+VEC_AVX2 void vec_avx2_f32_mat4(const float *a, const float *b, float *out) {
+    __m128 b0 = _mm_loadu_ps(b), b1 = _mm_loadu_ps(b + 4), b2 = _mm_loadu_ps(b + 8), b3 = _mm_loadu_ps(b + 12);
+    for (int i = 0; i < 4; ++i) {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(a[i * 4]), b0);
+        row = _mm_fmadd_ps(_mm_set1_ps(a[i * 4 + 1]), b1, row);
+        row = _mm_fmadd_ps(_mm_set1_ps(a[i * 4 + 2]), b2, row);
+        row = _mm_fmadd_ps(_mm_set1_ps(a[i * 4 + 3]), b3, row);
+        _mm_storeu_ps(out + i * 4, row);
+    }
+}
+
+const vec_kernels_t vec_avx2_kernels = {
+    "avx2",
+    vec_avx2_f64_binop, vec_avx2_f32_binop, vec_avx2_i32_binop,
+    vec_avx2_f64_scale, vec_avx2_f32_scale,
+    vec_avx2_f64_dot, vec_avx2_f32_dot, vec_avx2_i32_dot,
+    vec_avx2_f64_sum, vec_avx2_f32_sum, vec_avx2_i32_sum,
+    vec_avx2_f64_mat4, vec_avx2_f32_mat4
+};
+
+#undef VEC_BINOP_BODY
+#undef VEC_SCALE_BODY
+#undef VEC_LOAD_SI128
+#undef VEC_STORE_SI128
+#undef VEC_LOAD_SI256
+#undef VEC_STORE_SI256
+
+#endif // VEC_X86
+
+const vec_kernels_t *vec_kernels_in_use = NULL;
+
+// Returns the best kernels this CPU supports, or the ones named by
+// $RT_VECTOR_KERNELS.
+const vec_kernels_t *vec_pick_kernels() {
+    const vec_kernels_t *supported[3];
+    int nsupported = 0;
+#ifdef VEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        supported[nsupported++] = &vec_avx2_kernels;
+    }
+    supported[nsupported++] = &vec_sse2_kernels;
+#endif
+    supported[nsupported++] = &vec_scalar_kernels;
+
+    const char *name = getenv("RT_VECTOR_KERNELS");
+    if (!name || !*name) {
+        return supported[0];
+    }
+    for (int i = 0; i < nsupported; ++i) {
+        if (strcmp(supported[i]->name, name) == 0) {
+            return supported[i];
+        }
+    }
+    fprintf(stderr, "vector kernels not supported here: %s\n", name);
+    exit(1);
+}
+
+// Picking is idempotent, so threads racing to do it first is harmless.
+const vec_kernels_t *vec_kernels() {
+    const vec_kernels_t *kernels = __atomic_load_n(&vec_kernels_in_use, __ATOMIC_ACQUIRE);
+    if (!kernels) {
+        kernels = vec_pick_kernels();
+        __atomic_store_n(&vec_kernels_in_use, kernels, __ATOMIC_RELEASE);
+    }
+    return kernels;
+}
+
+//
+// Vectors
+
+// Returns a new vector (if `rows` is 0) or matrix, with its elements 0.
+// May collect.
+val_t vector_new(int kind, int rows, int cols) {
+    int64_t length = rows ? (int64_t)rows * cols : cols;
+    if (rows < 0 || cols < 0 || length > VEC_MAX_LENGTH) {
+        fprintf(stderr, "vector too large\n");
+        exit(1);
+    }
+    size_t bytes = (size_t)length * vec_elem_size[kind];
+    rt_vector_t *vec = (rt_vector_t*)rt_gc_alloc(T_VECTOR, sizeof(rt_vector_t) + bytes);
+    vec->kind = kind;
+    vec->rows = rows;
+    vec->cols = cols;
+    vec->length = (int)length;
+    memset(vec->data, 0, bytes);
+    return mk_vector(vec);
+}
+
+#define VEC_F64_DATA(vec)   ((double*)(vec)->data)
+#define VEC_F32_DATA(vec)   ((float*)(vec)->data)
+#define VEC_I32_DATA(vec)   ((int32_t*)(vec)->data)
+
+// Converts a bigint to the nearest double.
+double bigint_to_double(rt_bigint_t *big) {
+    double out = 0;
+    for (int i = big->nlimbs - 1; i >= 0; --i) {
+        out = out * 4294967296.0 + big->limbs[i];
+    }
+    return big->sign * out;
+}
+
+// Sets `*out` to number `v` as a double. Returns 0 if `v` isn't a number.
+// Nil counts as 0, as in integer arithmetic.
+int number_val(val_t v, double *out) {
+    if (float_p(v)) {
+        *out = float_val(v);
+    } else if (int_p(v)) {
+        *out = (double)int_val(v);
+    } else if (bigint_p(v)) {
+        *out = bigint_to_double(bigint_val(v));
+    } else if (nil_p(v)) {
+        *out = 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Sets `*out` to integer `v`, if it fits an i32 element.
+int i32_val(val_t v, int32_t *out) {
+    if (nil_p(v)) {
+        *out = 0;
+        return 1;
+    }
+    if (!int_p(v) || int_val(v) < INT32_MIN || int_val(v) > INT32_MAX) {
+        return 0;
+    }
+    *out = (int32_t)int_val(v);
+    return 1;
+}
+
+// As i32_val(), but also truncating a float to an integer.
+int i32_convert(val_t v, int32_t *out) {
+    if (float_p(v) && float_val(v) > INT32_MIN - 1.0 && float_val(v) < INT32_MAX + 1.0) {
+        *out = (int32_t)float_val(v);
+        return 1;
+    }
+    return i32_val(v, out);
+}
+
+// Stores number `v` as element `i` of `vec`.
+void vector_set(rt_vector_t *vec, int i, val_t v) {
+    double x;
+    if (vec->kind == VEC_I32) {
+        if (!i32_convert(v, &VEC_I32_DATA(vec)[i])) {
+            fprintf(stderr, "i32 vector elements must be integers in 32 bits\n");
+            exit(1);
+        }
+    } else if (!number_val(v, &x)) {
+        fprintf(stderr, "vector elements must be numbers\n");
+        exit(1);
+    } else if (vec->kind == VEC_F64) {
+        VEC_F64_DATA(vec)[i] = x;
+    } else {
+        VEC_F32_DATA(vec)[i] = (float)x;
+    }
+}
+
+val_t vector_get(rt_vector_t *vec, int i) {
+    switch (vec->kind) {
+        case VEC_F64:   return mk_float(VEC_F64_DATA(vec)[i]);
+        case VEC_F32:   return mk_float(VEC_F32_DATA(vec)[i]);
+        default:        return mk_int(VEC_I32_DATA(vec)[i]);
+    }
+}
+
+int rt_vector_equal(val_t a, val_t b) {
+    rt_vector_t *x = vector_val(a), *y = vector_val(b);
+    return x->kind == y->kind && x->rows == y->rows && x->cols == y->cols
+        && memcmp(x->data, y->data, (size_t)x->length * vec_elem_size[x->kind]) == 0;
+}
+
+// Agrees with rt_vector_equal().
+uint32_t rt_vector_hash(val_t v) {
+    rt_vector_t *vec = vector_val(v);
+    uint32_t hash = intern_hash(vec->data, (int)((size_t)vec->length * vec_elem_size[vec->kind]));
+    return hash ^ (uint32_t)(vec->kind * 31 + vec->rows) * 16777619u;
+}
+
+// Multiplies matrix `x` by matrix or vector `y` into `z`, which has the
+// right shape. 4x4 float matrices have kernels of their own.
+void vector_matmul(rt_vector_t *x, rt_vector_t *y, rt_vector_t *z) {
+    int n = x->rows, m = x->cols, p = y->rows ? y->cols : 1;
+    if (n == 4 && m == 4 && p == 4 && x->kind == VEC_F64) {
+        vec_kernels()->f64_mat4(VEC_F64_DATA(x), VEC_F64_DATA(y), VEC_F64_DATA(z));
+        return;
+    }
+    if (n == 4 && m == 4 && p == 4 && x->kind == VEC_F32) {
+        vec_kernels()->f32_mat4(VEC_F32_DATA(x), VEC_F32_DATA(y), VEC_F32_DATA(z));
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < p; ++j) {
+            switch (x->kind) {
+                case VEC_F64: {
+                    double sum = 0;
+                    for (int k = 0; k < m; ++k) sum += VEC_F64_DATA(x)[i * m + k] * VEC_F64_DATA(y)[k * p + j];
+                    VEC_F64_DATA(z)[i * p + j] = sum;
+                    break;
+                }
+                case VEC_F32: {
+                    float sum = 0;
+                    for (int k = 0; k < m; ++k) sum += VEC_F32_DATA(x)[i * m + k] * VEC_F32_DATA(y)[k * p + j];
+                    VEC_F32_DATA(z)[i * p + j] = sum;
+                    break;
+                }
+                default: {
+                    int32_t sum = 0;
+                    for (int k = 0; k < m; ++k) sum = VEC_WRAP(sum, +, VEC_WRAP(VEC_I32_DATA(x)[i * m + k], *, VEC_I32_DATA(y)[k * p + j]));
+                    VEC_I32_DATA(z)[i * p + j] = sum;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Returns `*a op *b` where either is a vector.
+val_t vector_arith(opcode_t op, val_t *a, val_t *b) {
+    int vop;
+    switch (op) {
+        case OP_ADD:    vop = VEC_ADD; break;
+        case OP_SUB:    vop = VEC_SUB; break;
+        case OP_MUL:    vop = VEC_MUL; break;
+        case OP_DIV:    vop = VEC_DIV; break;
+        default:
+            fprintf(stderr, "attempt to raise a vector to a power\n");
+            exit(1);
+    }
+
+    if (!vector_p(*a) || !vector_p(*b)) {
+        // scaling by a number
+        val_t *vslot = vector_p(*a) ? a : b, s = vector_p(*a) ? *b : *a;
+        rt_vector_t *x = vector_val(*vslot);
+        double d = 0;
+        int32_t n = 0;
+        if (vop == VEC_ADD || vop == VEC_SUB || (vop == VEC_DIV && vslot != a)) {
+            fprintf(stderr, "attempt to %s a vector and a number\n", vop == VEC_DIV ? "divide" : vop == VEC_ADD ? "add" : "subtract");
+            exit(1);
+        }
+        if (x->kind == VEC_I32 ? !i32_val(s, &n) : !number_val(s, &d)) {
+            fprintf(stderr, "attempt to scale a%s vector by a non-%s\n", x->kind == VEC_I32 ? "n i32" : " float", x->kind == VEC_I32 ? "i32" : "number");
+            exit(1);
+        }
+        if (x->kind == VEC_I32 && vop == VEC_DIV && n == 0) {
+            fprintf(stderr, "division by zero\n");
+            exit(1);
+        }
+        val_t out = vector_new(x->kind, x->rows, x->cols);
+        x = vector_val(*vslot);
+        rt_vector_t *z = vector_val(out);
+        switch (x->kind) {
+            case VEC_F64:
+                vec_kernels()->f64_scale(vop, VEC_F64_DATA(x), d, VEC_F64_DATA(z), x->length);
+                break;
+            case VEC_F32:
+                vec_kernels()->f32_scale(vop, VEC_F32_DATA(x), (float)d, VEC_F32_DATA(z), x->length);
+                break;
+            default:
+                for (int i = 0; i < x->length; ++i) {
+                    int32_t e = VEC_I32_DATA(x)[i];
+                    // INT32_MIN / -1 wraps, like everything else
+                    VEC_I32_DATA(z)[i] = vop == VEC_MUL ? VEC_WRAP(e, *, n) : (n == -1 ? VEC_WRAP(0, -, e) : e / n);
+                }
+                break;
+        }
+        return out;
+    }
+
+    rt_vector_t *x = vector_val(*a), *y = vector_val(*b);
+    if (x->kind != y->kind) {
+        fprintf(stderr, "attempt to combine %s and %s vectors\n", vec_kind_names[x->kind], vec_kind_names[y->kind]);
+        exit(1);
+    }
+    if (vop == VEC_MUL && x->rows && (y->rows ? x->cols == y->rows : x->cols == y->cols)) {
+        val_t out = vector_new(x->kind, y->rows ? x->rows : 0, y->rows ? y->cols : x->rows);
+        vector_matmul(vector_val(*a), vector_val(*b), vector_val(out));
+        return out;
+    }
+    if (x->rows != y->rows || x->cols != y->cols) {
+        fprintf(stderr, "attempt to combine vectors of different shapes\n");
+        exit(1);
+    }
+    if (x->kind == VEC_I32 && vop == VEC_DIV) {
+        for (int i = 0; i < y->length; ++i) {
+            if (VEC_I32_DATA(y)[i] == 0) {
+                fprintf(stderr, "division by zero\n");
+                exit(1);
+            }
+        }
+    }
+    val_t out = vector_new(x->kind, x->rows, x->cols);
+    x = vector_val(*a);
+    y = vector_val(*b);
+    rt_vector_t *z = vector_val(out);
+    switch (x->kind) {
+        case VEC_F64:
+            vec_kernels()->f64_binop(vop, VEC_F64_DATA(x), VEC_F64_DATA(y), VEC_F64_DATA(z), x->length);
+            break;
+        case VEC_F32:
+            vec_kernels()->f32_binop(vop, VEC_F32_DATA(x), VEC_F32_DATA(y), VEC_F32_DATA(z), x->length);
+            break;
+        default:
+            if (vop == VEC_DIV) {
+                for (int i = 0; i < x->length; ++i) {
+                    int32_t e = VEC_I32_DATA(x)[i], d = VEC_I32_DATA(y)[i];
+                    VEC_I32_DATA(z)[i] = d == -1 ? VEC_WRAP(0, -, e) : e / d;
+                }
+            } else {
+                vec_kernels()->i32_binop(vop, VEC_I32_DATA(x), VEC_I32_DATA(y), VEC_I32_DATA(z), x->length);
+            }
+            break;
+    }
+    return out;
+}
+
+// Returns `*a op *b` for an arithmetic opcode, where the operands aren't
+// both inline integers. The operands are slots, since making a vector may
+// collect.
+val_t rt_arith(opcode_t op, val_t *a, val_t *b) {
+    if (vector_p(*a) || vector_p(*b)) {
+        return vector_arith(op, a, b);
+    }
+    double x, y;
+    if ((float_p(*a) || float_p(*b)) && number_val(*a, &x) && number_val(*b, &y)) {
+        switch (op) {
+            case OP_ADD:    return mk_float(x + y);
+            case OP_SUB:    return mk_float(x - y);
+            case OP_MUL:    return mk_float(x * y);
+            case OP_DIV:    return mk_float(x / y);
+            default:        return mk_float(pow(x, y));
+        }
+    }
+    return rt_int_arith(op, *a, *b);
+}
+
+// As rt_int_compare(), but comparing floats too.
+int rt_compare(val_t a, val_t b) {
+    double x, y;
+    if ((float_p(a) || float_p(b)) && number_val(a, &x) && number_val(b, &y)) {
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    return rt_int_compare(a, b);
+}
+
+// Formats float `x` into `buf` (at least 32 bytes) as the shortest
+// decimal that reads back as the same double (or float, if `single`),
+// with ".0" added if it would otherwise look like an integer.
+int rt_float_format(double x, int single, char *buf) {
+    int len = 0;
+    for (int prec = single ? 6 : 15; prec <= 17; ++prec) {
+        len = snprintf(buf, 32, "%.*g", prec, x);
+        double back = strtod(buf, NULL);
+        if (single ? (float)back == (float)x : back == x) {
+            break;
+        }
+    }
+    if (strspn(buf, "-0123456789") == (size_t)len) {
+        buf[len++] = '.';
+        buf[len++] = '0';
+        buf[len] = 0;
+    }
+    return len;
+}
+
+// Returns vector `v` formatted as [1, 2, 3], or a matrix as
+// [[1, 2], [3, 4]]. The caller must free it.
+char *rt_vector_format(val_t v) {
+    rt_vector_t *vec = vector_val(v);
+    // an element takes at most 32 bytes, with its separator
+    size_t cap = (size_t)vec->length * 32 + (size_t)(vec->rows + 1) * 4 + 8;
+    char *out = (char*)malloc(cap);
+    if (!out) {
+        fprintf(stderr, "failed to allocate vector string\n");
+        exit(1);
+    }
+    char *p = out;
+    int rows = vec->rows ? vec->rows : 1;
+    if (vec->rows) *p++ = '[';
+    for (int r = 0; r < rows; ++r) {
+        if (r > 0) {
+            *p++ = ',';
+            *p++ = ' ';
+        }
+        *p++ = '[';
+        for (int c = 0; c < vec->cols; ++c) {
+            int i = r * vec->cols + c;
+            if (c > 0) {
+                *p++ = ',';
+                *p++ = ' ';
+            }
+            switch (vec->kind) {
+                case VEC_F64:   p += rt_float_format(VEC_F64_DATA(vec)[i], 0, p); break;
+                case VEC_F32:   p += rt_float_format(VEC_F32_DATA(vec)[i], 1, p); break;
+                default:        p += sprintf(p, "%d", VEC_I32_DATA(vec)[i]); break;
+            }
+        }
+        *p++ = ']';
+    }
+    if (vec->rows) *p++ = ']';
+    *p = 0;
+    return out;
+}
+
+//
+// Natives
+
+val_t vector_from_args(int kind, int rows, int cols, val_t *args, int nargs) {
+    val_t out = vector_new(kind, rows, cols);
+    rt_vector_t *vec = vector_val(out);
+    for (int i = 0; i < nargs; ++i) {
+        vector_set(vec, i, args[i]);
+    }
+    return out;
+}
+
+// vec(x, y, ...), vec32(...) and ivec(...) make f64, f32 and i32 vectors.
+val_t rt_builtin_vec(val_t *args, int nargs) {
+    return vector_from_args(VEC_F64, 0, nargs, args, nargs);
+}
+
+val_t rt_builtin_vec32(val_t *args, int nargs) {
+    return vector_from_args(VEC_F32, 0, nargs, args, nargs);
+}
+
+val_t rt_builtin_ivec(val_t *args, int nargs) {
+    return vector_from_args(VEC_I32, 0, nargs, args, nargs);
+}
+
+// mat(rows, cols, elements...) makes an f64 matrix from its elements, row
+// by row, or of zeros if there are none; mat32 makes an f32 one.
+val_t matrix_from_args(int kind, const char *name, val_t *args, int nargs) {
+    if (nargs < 2 || !int_p(args[0]) || !int_p(args[1]) || int_val(args[0]) < 1 || int_val(args[1]) < 1
+        || int_val(args[0]) > VEC_MAX_LENGTH || int_val(args[1]) > VEC_MAX_LENGTH) {
+        fprintf(stderr, "%s expects a number of rows and columns\n", name);
+        exit(1);
+    }
+    int rows = (int)int_val(args[0]), cols = (int)int_val(args[1]);
+    if (nargs > 2 && nargs - 2 != (int64_t)rows * cols) {
+        fprintf(stderr, "%s expects %d element(s), got %d\n", name, rows * cols, nargs - 2);
+        exit(1);
+    }
+    return vector_from_args(kind, rows, cols, args + 2, nargs - 2);
+}
+
+val_t rt_builtin_mat(val_t *args, int nargs) {
+    return matrix_from_args(VEC_F64, "mat", args, nargs);
+}
+
+val_t rt_builtin_mat32(val_t *args, int nargs) {
+    return matrix_from_args(VEC_F32, "mat32", args, nargs);
+}
+
+// vrange(n) makes the f64 vector [0, 1, ..., n - 1].
+val_t rt_builtin_vrange(val_t *args, int nargs) {
+    if (!int_p(args[0]) || int_val(args[0]) < 0 || int_val(args[0]) > VEC_MAX_LENGTH) {
+        fprintf(stderr, "vrange expects a length\n");
+        exit(1);
+    }
+    val_t out = vector_new(VEC_F64, 0, (int)int_val(args[0]));
+    rt_vector_t *vec = vector_val(out);
+    for (int i = 0; i < vec->length; ++i) {
+        VEC_F64_DATA(vec)[i] = i;
+    }
+    return out;
+}
+
+// Converts vector `*slot` to `kind`; i32 elements are truncated.
+val_t vector_convert(int kind, val_t *slot) {
+    rt_vector_t *vec = vector_val(*slot);
+    if (vec->kind == kind) {
+        return *slot;
+    }
+    val_t out = vector_new(kind, vec->rows, vec->cols);
+    vec = vector_val(*slot);
+    rt_vector_t *to = vector_val(out);
+    for (int i = 0; i < vec->length; ++i) {
+        vector_set(to, i, vector_get(vec, i));
+    }
+    return out;
+}
+
+// f64(x), f32(x) and i32(x) convert a vector to that kind, or a number to
+// the nearest double, float or integer.
+val_t rt_builtin_f64(val_t *args, int nargs) {
+    double x;
+    if (vector_p(args[0])) return vector_convert(VEC_F64, &args[0]);
+    if (!number_val(args[0], &x)) {
+        fprintf(stderr, "f64 expects a number or a vector\n");
+        exit(1);
+    }
+    return mk_float(x);
+}
+
+val_t rt_builtin_f32(val_t *args, int nargs) {
+    double x;
+    if (vector_p(args[0])) return vector_convert(VEC_F32, &args[0]);
+    if (!number_val(args[0], &x)) {
+        fprintf(stderr, "f32 expects a number or a vector\n");
+        exit(1);
+    }
+    return mk_float((float)x);
+}
+
+val_t rt_builtin_i32(val_t *args, int nargs) {
+    int32_t n;
+    if (vector_p(args[0])) return vector_convert(VEC_I32, &args[0]);
+    if (!i32_convert(args[0], &n)) {
+        fprintf(stderr, "i32 expects a number in 32 bits or a vector\n");
+        exit(1);
+    }
+    return mk_int(n);
+}
+
+// get(v, i) returns element i of vector v, or get(m, row, col) that of
+// matrix m, counting from 0. Called by rt_builtin_get() (natives.inc.cpp).
+val_t vector_builtin_get(val_t *args, int nargs) {
+    if ((nargs != 2 && nargs != 3) || !vector_p(args[0])) {
+        fprintf(stderr, "get expects a vector and an index, or a matrix, a row and a column\n");
+        exit(1);
+    }
+    rt_vector_t *vec = vector_val(args[0]);
+    int64_t i;
+    if (nargs == 2) {
+        i = int_p(args[1]) ? int_val(args[1]) : -1;
+        if (i < 0 || i >= vec->length) {
+            fprintf(stderr, "vector index out of range\n");
+            exit(1);
+        }
+    } else {
+        int64_t r = int_p(args[1]) ? int_val(args[1]) : -1, c = int_p(args[2]) ? int_val(args[2]) : -1;
+        if (!vec->rows || r < 0 || r >= vec->rows || c < 0 || c >= vec->cols) {
+            fprintf(stderr, "matrix index out of range\n");
+            exit(1);
+        }
+        i = r * vec->cols + c;
+    }
+    return vector_get(vec, (int)i);
+}
+
+val_t rt_builtin_sum(val_t *args, int nargs) {
+    if (!vector_p(args[0])) {
+        fprintf(stderr, "sum expects a vector\n");
+        exit(1);
+    }
+    rt_vector_t *vec = vector_val(args[0]);
+    switch (vec->kind) {
+        case VEC_F64:   return mk_float(vec_kernels()->f64_sum(VEC_F64_DATA(vec), vec->length));
+        case VEC_F32:   return mk_float(vec_kernels()->f32_sum(VEC_F32_DATA(vec), vec->length));
+        default:        return rt_int_from_int64(vec_kernels()->i32_sum(VEC_I32_DATA(vec), vec->length));
+    }
+}
+
+val_t rt_builtin_dot(val_t *args, int nargs) {
+    if (!vector_p(args[0]) || !vector_p(args[1])) {
+        fprintf(stderr, "dot expects two vectors\n");
+        exit(1);
+    }
+    rt_vector_t *x = vector_val(args[0]), *y = vector_val(args[1]);
+    if (x->kind != y->kind || x->length != y->length) {
+        fprintf(stderr, "dot expects vectors of the same kind and length\n");
+        exit(1);
+    }
+    switch (x->kind) {
+        case VEC_F64:   return mk_float(vec_kernels()->f64_dot(VEC_F64_DATA(x), VEC_F64_DATA(y), x->length));
+        case VEC_F32:   return mk_float(vec_kernels()->f32_dot(VEC_F32_DATA(x), VEC_F32_DATA(y), x->length));
+        default:        return rt_int_from_int64(vec_kernels()->i32_dot(VEC_I32_DATA(x), VEC_I32_DATA(y), x->length));
+    }
+}
+
+#undef VEC_F64_DATA
+#undef VEC_F32_DATA
+#undef VEC_I32_DATA
+#undef VEC_WRAP
+#undef VEC_MAX_LENGTH
+#undef VEC_X86
+#undef VEC_AVX2
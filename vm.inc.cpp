@@ -0,0 +1,664 @@
+// Interpreter dispatch
+//
+// By default, on compilers that support labels-as-values, each opcode
+// handler ends with its own indirect jump through a table generated from
+// opcodes.x ("threaded" dispatch), giving the branch predictor one
+// dispatch site per opcode instead of one shared site. Define
+// RT_SWITCH_DISPATCH to fall back to the portable switch-based loop.
+//
+// Every handler decodes its operands into a, b, c and k according to its
+// format and then falls into its body_ label. OP_EXT decodes the wide form
+// of the following instruction and jumps straight to that body, so the
+// short encoding never pays for the prefix.
+//
+// Every frame lives on one contiguous value stack, Lua-style. A call
+// block is allocated above all of the caller's live registers, with the
+// callee in its first register and the arguments after it, so the
+// callee's frame simply starts at the first argument: its parameters are
+// already in place and a call neither copies arguments nor allocates.
+// The stack grows (and `reg` is rebased) only when a frame would run
+// past its end.
+//
+// The stack is a GC root up to the highest frame top reached so far.
+// Every register of a new frame is cleared when it's pushed, so each slot
+// in that range holds a value the collector has kept up to date, even if
+// it's dead.
+//
+// The value stack and call stack belong to a task (rt_task_t), and
+// run_task() keeps the interpreter state in locals only while the task
+// runs: it saves them back when the task finishes, yields or is
+// preempted, and picks up from there when called again. Preemption checks
+// happen only at backward jumps and calls, so straight-line code pays
+// nothing for it. The scheduler (sched.inc.cpp) decides what runs when.
+//
+// A channel operation that can't complete suspends the task with
+// TASK_BLOCKED, leaving ip at the operation, so that it runs again when
+// the task is woken; by then the operation has usually been completed on
+// the task's behalf (see chan.inc.cpp), and running it again just
+// collects the result.
+
+// Calls nested deeper than this are reported as a stack overflow.
+#define RT_MAX_FRAMES 200000
+
+// Backward jumps and calls a task makes between preemption checks.
+#define RT_TASK_BUDGET 1024
+
+enum {
+    TASK_DONE,
+    TASK_YIELDED,
+    TASK_BLOCKED
+};
+
+// rt_task_t.state, for handing blocked tasks back to the scheduler.
+enum {
+    TASK_RUNNING,
+    TASK_PARKED,        // blocked, and the scheduler has let go of it
+    TASK_READY          // woken
+};
+
+typedef struct {
+    code_t *co;
+    int ip;
+    int base;       // of the caller's registers
+    int result;     // caller register receiving the return value
+} rt_frame_t;
+
+typedef struct rt_task rt_task_t;
+
+// A task's place in a channel's queue of blocked senders or receivers.
+typedef struct rt_waiter {
+    rt_task_t *task;
+    val_t chan;
+    val_t value;                // being sent
+    struct rt_waiter *prev;
+    struct rt_waiter *next;
+    int queued;
+    int sending;
+} rt_waiter_t;
+
+// A task's interpreter state while it isn't running. `stack` and `top`
+// are kept current while it is, for the collector's benefit.
+struct rt_task {
+    code_t *co;
+    int ip;
+    int base;
+    val_t *stack;
+    int stack_cap;
+    int top;            // stack slots the collector visits
+    rt_frame_t *frames;
+    int frames_cap;
+    int depth;
+
+    // channel operation the task is blocked on
+    int state;          // atomic
+    int wait_claimed;   // atomic; a waker has taken this task
+    int wait_done;      // the operation was completed for the task
+    val_t wait_value;   // received on the task's behalf
+    rt_waiter_t wait;
+    rt_waiter_t *waits; // wait, or one per channel of a select
+    int nwaits;
+    long messages;      // received
+};
+
+// Implemented by the scheduler: non-zero if a running task should give
+// up its worker at the next opportunity.
+int rt_sched_contended();
+
+// Implemented in chan.inc.cpp. Each returns 0 if the task must block.
+int rt_chan_send(rt_task_t *task, val_t chan, val_t value);
+int rt_chan_recv(rt_task_t *task, val_t chan, val_t *out);
+int rt_chan_select(rt_task_t *task, const val_t *chans, int nchans, val_t *out);
+
+#if defined(__GNUC__) && !defined(RT_SWITCH_DISPATCH)
+#define RT_THREADED_DISPATCH 1
+#endif
+
+// Each handler must end in its own indirect jump, so that the branch
+// predictor can learn which handler tends to follow which. GCC otherwise
+// merges the tails of handlers that end alike (since the overflow checks,
+// most of them), funnelling them through one shared jump.
+#if defined(RT_THREADED_DISPATCH) && !defined(__clang__)
+#define RT_DISPATCH_FN __attribute__((optimize("no-crossjumping")))
+#else
+#define RT_DISPATCH_FN
+#endif
+
+// Build with -DRT_COUNT_INSTRUCTIONS to count dispatched instructions in
+// rt_vm_instructions (an OP_EXT prefix and the instruction it extends
+// count once).
+#ifdef RT_COUNT_INSTRUCTIONS
+long rt_vm_instructions = 0;
+#define COUNT_INSTRUCTION() instructions++
+#else
+#define COUNT_INSTRUCTION()
+#endif
+
+#define DECODE_N(op)
+#define DECODE_X(op)
+#define DECODE_C(op)    c = INST_C(op)
+#define DECODE_AC(op)   a = INST_A(op); c = INST_C(op)
+#define DECODE_ABC(op)  a = INST_A(op); b = INST_B(op); c = INST_C(op)
+#define DECODE_AK(op)   a = INST_A(op); k = INST_K(op)
+#define DECODE_J(op)    k = INST_SJ(op)
+#define DECODE_AJ(op)   a = INST_A(op); k = INST_SK(op)
+
+#define WIDE(hi, lo)    (((hi) << 8) | (lo))
+
+#define WIDE_N(name)    goto body_##name;
+#define WIDE_X(name)    break;
+#define WIDE_C(name)    c = WIDE(INST_C(ext), INST_C(op)); goto body_##name;
+#define WIDE_AC(name)   a = WIDE(INST_A(ext), INST_A(op)); c = WIDE(INST_C(ext), INST_C(op)); goto body_##name;
+#define WIDE_ABC(name)  a = WIDE(INST_A(ext), INST_A(op)); b = WIDE(INST_B(ext), INST_B(op)); c = WIDE(INST_C(ext), INST_C(op)); goto body_##name;
+#define WIDE_AK(name)   a = WIDE(INST_A(ext), INST_A(op)); k = (int)((INST_K(ext) << 16) | INST_K(op)); goto body_##name;
+#define WIDE_J(name)    k = (int32_t)((INST_A(ext) << 24) | (op & 0x00FFFFFF)); goto body_##name;
+#define WIDE_AJ(name)   a = WIDE(INST_A(ext), INST_A(op)); k = (int32_t)((INST_K(ext) << 16) | INST_K(op)); goto body_##name;
+
+#ifdef RT_THREADED_DISPATCH
+    #define DISPATCH() \
+        COUNT_INSTRUCTION(); \
+        op = code[ip++]; \
+        PROFILE_INSTRUCTION(op); \
+        goto *dispatch_table[op >> OP_SHIFT];
+    #define CASE(name) op_##name:
+    #define NEXT_OP() DISPATCH()
+#else
+    #define DISPATCH() \
+        COUNT_INSTRUCTION(); \
+        op = code[ip++]; \
+        PROFILE_INSTRUCTION(op); \
+        switch (op & 0xfc000000)
+    #define CASE(name) case OP_##name:
+    #define NEXT_OP() continue
+#endif
+
+#define HANDLER(name, fmt) \
+    CASE(name) \
+        DECODE_##fmt(op); \
+    body_##name:
+
+// Integer arithmetic stays inline while the operands are inline integers
+// and the result fits; anything else, overflow included, goes through
+// rt_arith(), which promotes to a bigint or hands off to the vector
+// kernels. The operands are shifted
+// (see int_shifted) so that the overflow check is a single flag test.
+// Build with -DRT_UNCHECKED_INT to leave the checks out, letting results
+// wrap at 47 bits, in order to measure what they cost.
+#ifdef RT_UNCHECKED_INT
+#define ADD_OVERFLOW(x, y, r)   (*(r) = (int64_t)((uint64_t)(x) + (uint64_t)(y)), 0)
+#define SUB_OVERFLOW(x, y, r)   (*(r) = (int64_t)((uint64_t)(x) - (uint64_t)(y)), 0)
+#define MUL_OVERFLOW(x, y, r)   (*(r) = (int64_t)((uint64_t)(x) * (uint64_t)(y)), 0)
+#else
+#define ADD_OVERFLOW(x, y, r)   __builtin_add_overflow(x, y, r)
+#define SUB_OVERFLOW(x, y, r)   __builtin_sub_overflow(x, y, r)
+#define MUL_OVERFLOW(x, y, r)   __builtin_mul_overflow(x, y, r)
+#endif
+
+// The right operand is shifted, except for multiplication.
+#define ARITH_OP(name, overflow, rhs) \
+    HANDLER(name, ABC) \
+        { \
+            int64_t r; \
+            if (__builtin_expect(ints_p(reg[b], reg[c]) && !overflow(int_shifted(reg[b]), rhs(reg[c]), &r), 1)) { \
+                reg[a] = mk_int_shifted(r); \
+            } else { \
+                reg[a] = rt_arith(OP_##name, &reg[b], &reg[c]); \
+            } \
+        } \
+        NEXT_OP();
+
+// K operands are inline integers, so a copy of one serves as a slot.
+#define ARITH_K_OP(name, overflow, rhs, opcode) \
+    HANDLER(name, ABC) \
+        { \
+            int64_t r; \
+            if (__builtin_expect(int_p(reg[b]) && !overflow(int_shifted(reg[b]), rhs(constants[c]), &r), 1)) { \
+                reg[a] = mk_int_shifted(r); \
+            } else { \
+                val_t kslot = constants[c]; \
+                reg[a] = rt_arith(opcode, &reg[b], &kslot); \
+            } \
+        } \
+        NEXT_OP();
+
+// Orders numbers, inline integers first.
+#define INT_COMPARE(x, y, operator) \
+    (__builtin_expect(ints_p(x, y), 1) ? int_val(x) operator int_val(y) : rt_compare(x, y) operator 0)
+
+#define COMPARE_OP(name, operator) \
+    HANDLER(name, ABC) \
+        reg[a] = mk_bool(INT_COMPARE(reg[b], reg[c], operator)); \
+        NEXT_OP();
+
+// Equality is by representation, except that strings are equal if their
+// contents are, bigints and vectors if their values are, and maps, sets
+// and lists if their elements are. Operands must be slots, as comparing
+// ropes may allocate.
+#define EQUAL(x, y) \
+    ((x).bits == (y).bits \
+        || (string_p(x) && string_p(y) && rt_string_equal(&(x), &(y))) \
+        || (bigint_p(x) && bigint_p(y) && rt_bigint_equal(x, y)) \
+        || (vector_p(x) && vector_p(y) && rt_vector_equal(x, y)) \
+        || (map_p(x) && map_p(y) && rt_map_equal(&(x), &(y))) \
+        || (list_p(x) && list_p(y) && rt_list_equal(&(x), &(y))))
+
+// Suspends the task if its budget has run out and another task (or the
+// collector) is waiting.
+#define PREEMPT() \
+    do { \
+        if (--budget == 0) { \
+            budget = RT_TASK_BUDGET; \
+            if (rt_sched_contended()) { \
+                status = TASK_YIELDED; \
+                goto suspend; \
+            } \
+        } \
+    } while (0)
+
+// Fused compare-and-branch instructions are followed by the JMP that holds
+// their target. Falling through skips it; taking it applies its offset
+// directly, unless it has a prefix, in which case it's left to execute.
+// Jump threading can make that JMP a loop's back edge.
+#define SKIP_JUMP() \
+    ip += (INST_OP(code[ip]) == OP_EXT) ? 2 : 1
+#define TAKE_JUMP() \
+    if (INST_OP(code[ip]) == OP_JMP) { \
+        k = INST_SJ(code[ip]); \
+        ip += 1 + k; \
+        if (k < 0) PREEMPT(); \
+    }
+
+// Suspends the task, to retry the current instruction when it's woken.
+#define BLOCK() \
+    do { \
+        ip -= (ip >= 2 && INST_OP(code[ip - 2]) == OP_EXT) ? 2 : 1; \
+        status = TASK_BLOCKED; \
+        goto suspend; \
+    } while (0)
+
+#define COMPARE_JUMP(name, operator) \
+    HANDLER(name, ABC) \
+        if (INT_COMPARE(reg[a], reg[b], operator)) { SKIP_JUMP(); } else { TAKE_JUMP(); } \
+        NEXT_OP();
+
+#define EQUAL_JUMP(name, test) \
+    HANDLER(name, ABC) \
+        if (test EQUAL(reg[a], reg[b])) { SKIP_JUMP(); } else { TAKE_JUMP(); } \
+        NEXT_OP();
+
+#define COMPARE_K_JUMP(name, operator) \
+    HANDLER(name, ABC) \
+        if (INT_COMPARE(reg[a], constants[b], operator)) { SKIP_JUMP(); } else { TAKE_JUMP(); } \
+        NEXT_OP();
+
+// Grows `stack` so that it holds at least `need` values.
+val_t *run_grow_stack(val_t *stack, int *cap, int need) {
+    int new_cap = *cap;
+    while (new_cap < need) new_cap *= 2;
+    stack = (val_t*)realloc(stack, sizeof(val_t) * new_cap);
+    if (!stack) {
+        fprintf(stderr, "failed to allocate value stack\n");
+        exit(1);
+    }
+    *cap = new_cap;
+    return stack;
+}
+
+// Creates a task that calls `co` with `nargs` arguments.
+rt_task_t *rt_task_new(code_t *co, const val_t *args, int nargs) {
+    rt_task_t *task = (rt_task_t*)malloc(sizeof(rt_task_t));
+    if (!task) {
+        fprintf(stderr, "failed to allocate task\n");
+        exit(1);
+    }
+    int need = co->nregs > nargs ? co->nregs : nargs;
+    task->co = co;
+    task->ip = 0;
+    task->base = 0;
+    task->stack_cap = 64;
+    task->stack = run_grow_stack(NULL, &task->stack_cap, need);
+    for (int i = 0; i < nargs; ++i) {
+        task->stack[i] = args[i];
+    }
+    for (int i = nargs < co->nparams ? nargs : co->nparams; i < co->nregs; ++i) {
+        task->stack[i] = mk_nil();
+    }
+    task->top = need;
+    task->frames = NULL;
+    task->frames_cap = 0;
+    task->depth = 0;
+    task->state = TASK_RUNNING;
+    task->wait_claimed = 0;
+    task->wait_done = 0;
+    task->wait_value = mk_nil();
+    task->wait.task = task;
+    task->wait.chan = mk_nil();
+    task->wait.value = mk_nil();
+    task->wait.queued = 0;
+    task->wait.sending = 0;
+    task->waits = NULL;
+    task->nwaits = 0;
+    task->messages = 0;
+    return task;
+}
+
+void rt_task_free(rt_task_t *task) {
+    free(task->stack);
+    free(task->frames);
+    free(task);
+}
+
+void rt_task_visit(rt_task_t *task) {
+    for (int i = 0; i < task->top; ++i) {
+        rt_gc_visit(&task->stack[i]);
+    }
+    rt_gc_visit(&task->wait_value);
+    for (int i = 0; i < task->nwaits; ++i) {
+        rt_gc_visit(&task->waits[i].chan);
+        rt_gc_visit(&task->waits[i].value);
+    }
+}
+
+// Runs `task` until it finishes (TASK_DONE) or is suspended (TASK_YIELDED,
+// or TASK_BLOCKED on a channel), in which case running it again resumes
+// it.
+RT_DISPATCH_FN int run_task(rt_task_t *task) {
+    code_t *co = task->co;
+    const inst_t *code = co->code;
+    const val_t *constants = co->constants;
+    const val_t *globals = co->module->globals;
+    const rt_native_t *natives = co->module->natives->natives;
+    int ip = task->ip;
+    inst_t op;
+    int a, b, c, k;
+    int status;
+    int budget = RT_TASK_BUDGET;
+#ifdef RT_COUNT_INSTRUCTIONS
+    long instructions = 0;
+#endif
+
+    int stack_cap = task->stack_cap, base = task->base;
+    val_t *stack = task->stack;
+    val_t *reg = stack + base;
+
+    int frames_cap = task->frames_cap, depth = task->depth;
+    rt_frame_t *frames = task->frames;
+
+#ifdef RT_THREADED_DISPATCH
+    // every one of the 64 values an opcode field can hold needs an entry,
+    // and the table is shared by every worker thread, so it's padded in
+    // its initializer rather than filled in at run time
+    #define ILLEGAL_8 \
+        &&op_ILLEGAL, &&op_ILLEGAL, &&op_ILLEGAL, &&op_ILLEGAL, \
+        &&op_ILLEGAL, &&op_ILLEGAL, &&op_ILLEGAL, &&op_ILLEGAL,
+    static void *const dispatch_table[OPI_MAX + 64] = {
+        &&op_ILLEGAL,
+        #define OPCODE(name, _, __) &&op_##name,
+        #include "opcodes.x"
+        #undef OPCODE
+        ILLEGAL_8 ILLEGAL_8 ILLEGAL_8 ILLEGAL_8
+        ILLEGAL_8 ILLEGAL_8 ILLEGAL_8 ILLEGAL_8
+    };
+    #undef ILLEGAL_8
+#endif
+
+    while (1) {
+        DISPATCH() {
+            CASE(EXT)
+                {
+                    inst_t ext = op;
+                    op = code[ip++];
+                    switch (op >> OP_SHIFT) {
+                        #define OPCODE(name, fmt, _) case OPI_##name: WIDE_##fmt(name)
+                        #include "opcodes.x"
+                        #undef OPCODE
+                    }
+                }
+                goto illegal;
+            HANDLER(PRINT, C)
+                rt_builtin_print(&reg[c], 1);
+                NEXT_OP();
+            HANDLER(ADD, ABC)
+                {
+                    int64_t r;
+                    if (__builtin_expect(ints_p(reg[b], reg[c]) && !ADD_OVERFLOW(int_shifted(reg[b]), int_shifted(reg[c]), &r), 1)) {
+                        reg[a] = mk_int_shifted(r);
+                    } else if (string_p(reg[b]) && string_p(reg[c])) {
+                        reg[a] = rt_string_concat(&reg[b], &reg[c]);
+                    } else {
+                        reg[a] = rt_arith(OP_ADD, &reg[b], &reg[c]);
+                    }
+                }
+                NEXT_OP();
+            ARITH_OP(SUB, SUB_OVERFLOW, int_shifted)
+            ARITH_OP(MUL, MUL_OVERFLOW, int_val)
+            HANDLER(DIV, ABC)
+                // only VAL_INT_MIN / -1 overflows
+                if (int_p(reg[b]) && int_p(reg[c]) && int_val(reg[c]) != 0 && int_val(reg[b]) != VAL_INT_MIN) {
+                    reg[a] = mk_int(int_val(reg[b]) / int_val(reg[c]));
+                } else {
+                    reg[a] = rt_arith(OP_DIV, &reg[b], &reg[c]);
+                }
+                NEXT_OP();
+            HANDLER(POW, ABC)
+                if (int_p(reg[b]) && int_p(reg[c])) {
+                    int64_t x = int_val(reg[b]), exp = int_val(reg[c]), acc = 1;
+                    if (exp < 1 || x == 0 || x == 1 || x == -1) {
+                        // as bigint_pow(): these never overflow, however big the exponent
+                        reg[a] = mk_int(exp < 1 || (x == -1 && (exp & 1) == 0) ? 1 : x);
+                        NEXT_OP();
+                    }
+                    // square and multiply, one step per bit of the exponent
+                    for (;;) {
+                        if ((exp & 1) && MUL_OVERFLOW(acc, x, &acc)) goto pow_slow;
+                        if ((exp >>= 1) == 0) break;
+                        if (MUL_OVERFLOW(x, x, &x)) goto pow_slow;
+                    }
+                    if (MUL_OVERFLOW(acc, 1LL << VAL_INT_SHIFT, &acc)) goto pow_slow;
+                    reg[a] = mk_int_shifted(acc);
+                    NEXT_OP();
+                }
+            pow_slow:
+                reg[a] = rt_arith(OP_POW, &reg[b], &reg[c]);
+                NEXT_OP();
+            HANDLER(LOADK, AK)
+                reg[a] = constants[k];
+                NEXT_OP();
+            HANDLER(COPY, AC)
+                reg[a] = reg[c];
+                NEXT_OP();
+            HANDLER(CALL, ABC)
+                if (proto_p(reg[a])) {
+                    code_t *fn = proto_val(reg[a]);
+                    if (depth == frames_cap) {
+                        if (frames_cap >= RT_MAX_FRAMES) {
+                            fprintf(stderr, "stack overflow\n");
+                            exit(1);
+                        }
+                        frames = (rt_frame_t*)code_grow(frames, &frames_cap, sizeof(rt_frame_t));
+                    }
+                    frames[depth].co = co;
+                    frames[depth].ip = ip;
+                    frames[depth].base = base;
+                    frames[depth].result = c;
+                    depth++;
+                    base += a + 1;
+                    if (base + fn->nregs > stack_cap) {
+                        stack = run_grow_stack(stack, &stack_cap, base + fn->nregs);
+                        task->stack = stack;
+                    }
+                    reg = stack + base;
+                    // missing arguments, locals and temporaries start out nil
+                    for (int i = b < fn->nparams ? b : fn->nparams; i < fn->nregs; ++i) {
+                        reg[i] = mk_nil();
+                    }
+                    if (base + fn->nregs > task->top) {
+                        task->top = base + fn->nregs;
+                    }
+                    co = fn;
+                    code = fn->code;
+                    constants = fn->constants;
+                    ip = 0;
+                    PREEMPT();
+                } else if (foreign_fn_p(reg[a])) {
+                    reg[c] = fn_val(reg[a])(&reg[a+1], b);
+                } else {
+                    fprintf(stderr, "attempt to call a non-function\n");
+                    exit(1);
+                }
+                NEXT_OP();
+            HANDLER(RET, C)
+                if (depth == 0) {
+                    status = TASK_DONE;
+                    goto suspend;
+                }
+                {
+                    val_t ret = reg[c];
+                    rt_frame_t *caller = &frames[--depth];
+                    co = caller->co;
+                    code = co->code;
+                    constants = co->constants;
+                    ip = caller->ip;
+                    base = caller->base;
+                    reg = stack + base;
+                    reg[caller->result] = ret;
+                }
+                NEXT_OP();
+            HANDLER(GETG, AK)
+                reg[a] = globals[k];
+                NEXT_OP();
+            HANDLER(CALLN, ABC)
+                reg[a] = natives[c].fn(&reg[a], b);
+                NEXT_OP();
+            HANDLER(IABS, AC)
+                if (int_p(reg[c]) && int_val(reg[c]) != VAL_INT_MIN) {
+                    int64_t v = int_val(reg[c]);
+                    reg[a] = mk_int(v < 0 ? -v : v);
+                } else {
+                    reg[a] = rt_int_abs(reg[c]);
+                }
+                NEXT_OP();
+            HANDLER(IMIN, ABC)
+                reg[a] = INT_COMPARE(reg[b], reg[c], <=) ? reg[b] : reg[c];
+                NEXT_OP();
+            HANDLER(IMAX, ABC)
+                reg[a] = INT_COMPARE(reg[b], reg[c], >=) ? reg[b] : reg[c];
+                NEXT_OP();
+            COMPARE_OP(LT, <)
+            COMPARE_OP(LE, <=)
+            COMPARE_OP(GT, >)
+            COMPARE_OP(GE, >=)
+            HANDLER(EQ, ABC)
+                reg[a] = mk_bool(EQUAL(reg[b], reg[c]));
+                NEXT_OP();
+            HANDLER(NEQ, ABC)
+                reg[a] = mk_bool(!EQUAL(reg[b], reg[c]));
+                NEXT_OP();
+            HANDLER(JMP, J)
+                ip += k;
+                if (k < 0) PREEMPT();
+                NEXT_OP();
+            HANDLER(JMPF, AJ)
+                if (!truthy_p(reg[a])) {
+                    ip += k;
+                    if (k < 0) PREEMPT();
+                }
+                NEXT_OP();
+            COMPARE_JUMP(LT_JMPF, <)
+            COMPARE_JUMP(LE_JMPF, <=)
+            EQUAL_JUMP(EQ_JMPF, )
+            EQUAL_JUMP(NEQ_JMPF, !)
+            COMPARE_K_JUMP(LTK_JMPF, <)
+            COMPARE_K_JUMP(LEK_JMPF, <=)
+            COMPARE_K_JUMP(GTK_JMPF, >)
+            COMPARE_K_JUMP(GEK_JMPF, >=)
+            // K operands are inline integers, so equality is by representation
+            HANDLER(EQK_JMPF, ABC)
+                if (reg[a].bits == constants[b].bits) { SKIP_JUMP(); } else { TAKE_JUMP(); }
+                NEXT_OP();
+            HANDLER(NEQK_JMPF, ABC)
+                if (reg[a].bits != constants[b].bits) { SKIP_JUMP(); } else { TAKE_JUMP(); }
+                NEXT_OP();
+            ARITH_K_OP(ADDK, ADD_OVERFLOW, int_shifted, OP_ADD)
+            ARITH_K_OP(SUBK, SUB_OVERFLOW, int_shifted, OP_SUB)
+            ARITH_K_OP(MULK, MUL_OVERFLOW, int_val, OP_MUL)
+            HANDLER(YIELD, N)
+                status = TASK_YIELDED;
+                goto suspend;
+            HANDLER(SEND, AC)
+                if (!rt_chan_send(task, reg[a], reg[c])) BLOCK();
+                NEXT_OP();
+            HANDLER(RECV, AC)
+                if (!rt_chan_recv(task, reg[c], &reg[a])) BLOCK();
+                NEXT_OP();
+            HANDLER(SELECT, ABC)
+                if (!rt_chan_select(task, &reg[a], b, &reg[a])) BLOCK();
+                NEXT_OP();
+            HANDLER(HALT, N)
+                status = TASK_DONE;
+                goto suspend;
+#ifdef RT_THREADED_DISPATCH
+            op_ILLEGAL:
+#else
+            default:
+#endif
+            illegal:
+                fprintf(stderr, "illegal opcode: 0x%x at %d\n", op, ip - 1);
+                exit(1);
+        }
+    }
+
+suspend:
+    task->co = co;
+    task->ip = ip;
+    task->base = base;
+    task->stack = stack;
+    task->stack_cap = stack_cap;
+    task->frames = frames;
+    task->frames_cap = frames_cap;
+    task->depth = depth;
+#ifdef RT_COUNT_INSTRUCTIONS
+    __atomic_add_fetch(&rt_vm_instructions, instructions, __ATOMIC_RELAXED);
+#endif
+    return status;
+}
+
+#undef DECODE_N
+#undef DECODE_X
+#undef DECODE_C
+#undef DECODE_AC
+#undef DECODE_ABC
+#undef DECODE_AK
+#undef DECODE_J
+#undef DECODE_AJ
+#undef WIDE
+#undef WIDE_N
+#undef WIDE_X
+#undef WIDE_C
+#undef WIDE_AC
+#undef WIDE_ABC
+#undef WIDE_AK
+#undef WIDE_J
+#undef WIDE_AJ
+#undef COUNT_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+#undef NEXT_OP
+#undef HANDLER
+#undef ARITH_OP
+#undef COMPARE_OP
+#undef ARITH_K_OP
+#undef PREEMPT
+#undef BLOCK
+#undef SKIP_JUMP
+#undef TAKE_JUMP
+#undef COMPARE_JUMP
+#undef COMPARE_K_JUMP
+#undef EQUAL
+#undef EQUAL_JUMP
+#undef INT_COMPARE
+#undef ADD_OVERFLOW
+#undef SUB_OVERFLOW
+#undef MUL_OVERFLOW
+#undef RT_MAX_FRAMES
+#undef RT_DISPATCH_FN